@@ -0,0 +1,281 @@
+#include "async_test.h"
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <utility>
+
+namespace speedtest {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Ping until the mean's 95% interval is within +/- 5%, within these
+// bounds, as SpeedTest does
+const int kMinPings = 10;
+const int kMaxPings = 30;
+const double kPingPrecision = 0.05;
+
+// However long a test waits for I/O, it looks at cancel() this often
+const auto kCancelCheck = std::chrono::milliseconds(50);
+
+// "server busy, try again in 5 s", or the phase's own error
+std::string phase_error(const PhaseResult& phase) {
+    if (!phase.error.empty()) return phase.error;
+    if (phase.retry_after_s > 0) return "server busy, try again in " + std::to_string(phase.retry_after_s) + " s";
+    return "";
+}
+
+// The loop sleeps in one ppoll() on every test's sockets. An epoll fd
+// polls readable as soon as a socket does; an io_uring ring only once its
+// completions have been reaped, which needs the ring entered, so a loop
+// would sleep through them.
+EngineConfig on_loop(EngineConfig config) {
+    config.io_backend = IoBackendKind::kEpoll;
+    return config;
+}
+
+} // namespace
+
+const char* test_phase_name(TestPhase phase) {
+    switch (phase) {
+        case TestPhase::kDownload: return "download";
+        case TestPhase::kUpload: return "upload";
+        default: return "ping";
+    }
+}
+
+AsyncTest::AsyncTest(const EngineConfig& config) : engine_(on_loop(config)) {}
+
+void AsyncTest::ping(PingHandler done) {
+    Op op;
+    op.phase = TestPhase::kPing;
+    op.ping_done = std::move(done);
+    ops_.push_back(std::move(op));
+}
+
+void AsyncTest::download(PhaseHandler done, ProgressCallback progress) {
+    Op op;
+    op.phase = TestPhase::kDownload;
+    op.phase_done = std::move(done);
+    op.progress = std::move(progress);
+    ops_.push_back(std::move(op));
+}
+
+void AsyncTest::upload(PhaseHandler done, ProgressCallback progress) {
+    Op op;
+    op.phase = TestPhase::kUpload;
+    op.phase_done = std::move(done);
+    op.progress = std::move(progress);
+    ops_.push_back(std::move(op));
+}
+
+void AsyncTest::run(ResultHandler done, TestProgress progress) {
+    struct State {
+        SpeedResult result = SpeedResult();
+        std::string error;
+    };
+    auto state = std::make_shared<State>();
+    auto note = [state](TestPhase phase, const std::string& error) {
+        if (!error.empty() && state->error.empty()) state->error = std::string(test_phase_name(phase)) + ": " + error;
+    };
+    auto report = [progress](TestPhase phase) -> ProgressCallback {
+        if (!progress) return nullptr;
+        return [progress, phase](double fraction, double mbps) { progress(phase, fraction, mbps); };
+    };
+
+    ping([state, note](const PingResult& ping) {
+        state->result.ping_ms = ping.stats.mean;
+        state->result.jitter_ms = ping.jitter_ms;
+        state->result.ping_stats = ping.stats;
+        note(TestPhase::kPing, ping.error);
+    });
+    ops_.back().begins_test = true;
+    download([state, note](const PhaseResult& phase) {
+        SpeedResult& r = state->result;
+        r.download_mbps = phase.mbps;
+        r.download_stats = phase.rate;
+        r.download_tcp = phase.sender_tcp;
+        r.download_datagrams = phase.datagrams;
+        r.download_integrity = phase.integrity;
+        r.tuning_rejected = phase.tuning_rejected;
+        note(TestPhase::kDownload, phase_error(phase));
+    }, report(TestPhase::kDownload));
+    upload([this, state, note, done](const PhaseResult& phase) {
+        SpeedResult& r = state->result;
+        r.upload_mbps = phase.mbps;
+        r.upload_stats = phase.rate;
+        r.upload_sent_mbps = phase.sent_mbps;
+        r.upload_sent_stats = phase.sent_rate;
+        r.upload_tcp = phase.sender_tcp;
+        r.upload_datagrams = phase.datagrams;
+        r.upload_integrity = phase.integrity;
+        note(TestPhase::kUpload, phase_error(phase));
+
+        const EngineConfig& config = engine_.config();
+        r.tuning = config.tuning;
+        r.transport = transport_name(config.transport);
+        r.source = config.source.describe();
+        r.placement = config.placement;
+        r.server_placement = engine_.server_placement();
+        if (done) done(r, state->error);
+    }, report(TestPhase::kUpload));
+}
+
+void AsyncTest::poll_fds(std::vector<pollfd>* fds, Clock::time_point* wake) {
+    if (ops_.empty()) return;
+    auto now = Clock::now();
+    if (!running_ || cancelling_ > 0 || cancel_) {
+        *wake = now;
+        return;
+    }
+    if (ops_.front().phase != TestPhase::kPing) {
+        phase_->poll_fds(fds, wake);
+        return;
+    }
+    if (ping_waiting_ && engine_.ping_fd() >= 0) fds->push_back({engine_.ping_fd(), POLLIN, 0});
+    else *wake = now;
+    if (ping_waiting_) *wake = std::min(*wake, engine_.ping_deadline());
+    *wake = std::min(*wake, now + kCancelCheck);
+}
+
+void AsyncTest::step() {
+    if (cancel_.exchange(false)) cancelling_ = ops_.size();
+    while (!ops_.empty()) {
+        TestPhase phase = ops_.front().phase;
+        // Pings and phases not yet started end at once
+        if (cancelling_ > 0 && (phase == TestPhase::kPing || !running_)) {
+            if (phase == TestPhase::kPing) {
+                engine_.cancel_ping();
+                finish_ping("cancelled");
+            } else {
+                PhaseResult result;
+                result.error = "cancelled";
+                finish_phase(std::move(result));
+            }
+            continue;
+        }
+
+        if (!running_) {
+            running_ = true;
+            TraceRecorder* recorder = engine_.config().recorder;
+            if (ops_.front().begins_test && recorder) recorder->test_begin(engine_.config().tuning.to_query());
+            if (phase != TestPhase::kPing) {
+                phase_ = engine_.start_phase(phase == TestPhase::kDownload, ops_.front().progress);
+            }
+        }
+
+        if (phase == TestPhase::kPing) {
+            if (!step_ping()) return;
+        } else {
+            if (cancelling_ > 0) phase_->cancel();
+            if (phase_->step(0)) return;
+            finish_phase(phase_->finish());
+        }
+    }
+}
+
+bool AsyncTest::step_ping() {
+    for (;;) {
+        if (ping_waiting_) {
+            double rtt_ms;
+            if (!engine_.poll_ping(&rtt_ms)) return false;
+            ping_waiting_ = false;
+            if (rtt_ms >= 0) {
+                // Jitter: mean difference between consecutive samples
+                if (!pings_.samples_ms.empty()) jitter_.add(std::fabs(rtt_ms - pings_.samples_ms.back()));
+                pings_.samples_ms.push_back(rtt_ms);
+                ping_stats_.add(rtt_ms);
+            }
+        }
+        if (ping_attempts_ >= kMaxPings || ping_stats_.precise_enough(kPingPrecision, kMinPings)) {
+            finish_ping(pings_.samples_ms.empty() ? "no answer to any ping" : "");
+            return true;
+        }
+        ++ping_attempts_;
+        ping_waiting_ = engine_.start_ping();
+    }
+}
+
+void AsyncTest::finish_ping(const std::string& error) {
+    PingResult result = std::move(pings_);
+    result.stats = ping_stats_.summarize();
+    result.jitter_ms = jitter_.mean();
+    result.error = error;
+    pings_ = PingResult();
+    ping_stats_ = SampleStats();
+    jitter_ = RunningStats();
+    ping_attempts_ = 0;
+    ping_waiting_ = false;
+
+    PingHandler done = std::move(ops_.front().ping_done);
+    ops_.pop_front();
+    running_ = false;
+    if (cancelling_ > 0) --cancelling_;
+    if (done) done(result);
+}
+
+void AsyncTest::finish_phase(PhaseResult result) {
+    PhaseHandler done = std::move(ops_.front().phase_done);
+    ops_.pop_front();
+    running_ = false;
+    phase_.reset();
+    if (cancelling_ > 0) --cancelling_;
+    if (done) done(result);
+}
+
+std::shared_ptr<AsyncTest> TestLoop::add(const EngineConfig& config) {
+    std::shared_ptr<AsyncTest> test(new AsyncTest(config));
+    tests_.push_back(test);
+    return test;
+}
+
+bool TestLoop::prepare_until(std::vector<pollfd>* fds, Clock::time_point* wake) {
+    // Nobody else can queue anything on these
+    tests_.erase(std::remove_if(tests_.begin(), tests_.end(),
+                                [](const std::shared_ptr<AsyncTest>& test) {
+                                    return !test->busy() && test.use_count() == 1;
+                                }),
+                 tests_.end());
+    fds->clear();
+    bool busy = false;
+    for (const std::shared_ptr<AsyncTest>& test : tests_) {
+        if (!test->busy()) continue;
+        busy = true;
+        test->poll_fds(fds, wake);
+    }
+    return busy;
+}
+
+int TestLoop::prepare(std::vector<pollfd>* fds) {
+    auto wake = Clock::time_point::max();
+    if (!prepare_until(fds, &wake)) return -1;
+    auto wait = std::chrono::ceil<std::chrono::milliseconds>(wake - Clock::now());
+    return static_cast<int>(std::max<int64_t>(0, wait.count()));
+}
+
+bool TestLoop::run_once(int timeout_ms) {
+    auto now = Clock::now();
+    auto wake = timeout_ms < 0 ? Clock::time_point::max() : now + std::chrono::milliseconds(timeout_ms);
+    if (!prepare_until(&fds_, &wake)) return false;
+    int64_t wait_ns = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(wake - now).count());
+    timespec timeout{static_cast<time_t>(wait_ns / 1000000000), static_cast<long>(wait_ns % 1000000000)};
+    ppoll(fds_.data(), fds_.size(), wake == Clock::time_point::max() ? nullptr : &timeout, nullptr);
+    dispatch();
+    return true;
+}
+
+void TestLoop::run() {
+    while (run_once()) {}
+}
+
+void TestLoop::dispatch() {
+    // By index: a handler may add tests
+    for (size_t i = 0; i < tests_.size(); ++i) {
+        std::shared_ptr<AsyncTest> test = tests_[i];
+        test->step();
+    }
+}
+
+} // namespace speedtest
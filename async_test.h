@@ -0,0 +1,158 @@
+#ifndef ASYNC_TEST_H_
+#define ASYNC_TEST_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+
+#include "benchmark.h"
+#include "client_engine.h"
+#include "stats.h"
+
+namespace speedtest {
+
+// Live tests for embedding in another service: no threads of their own,
+// nothing printed, and any number of them on one event loop thread.
+//
+//   TestLoop loop;
+//   auto test = loop.add(config);
+//   test->ping([&](const PingResult& ping) {
+//       test->download([&](const PhaseResult& down) { ... }, on_progress);
+//   });
+//   loop.run();
+//
+// Each phase is a call whose handler runs on the loop thread once the
+// phase is over, the way `co_await` would resume; a handler may queue the
+// next phase. Pings and the transfer itself are interleaved with every
+// other test on the loop, which always uses epoll (see on_loop()).
+// Connecting a phase's streams, TLS handshakes and fetching the server's
+// samples when a phase ends still block the loop for a round trip or two
+// each.
+
+// The pings of one test, stopped on SpeedTest's rule: once the mean's
+// 95% interval is within +/- 5%, after at least 10 and at most 30
+struct PingResult {
+    std::vector<double> samples_ms;
+    SampleSummary stats;
+    double jitter_ms = 0;  // Mean difference between consecutive pings
+    std::string error;
+};
+
+enum class TestPhase { kPing, kDownload, kUpload };
+const char* test_phase_name(TestPhase phase);
+
+using PingHandler = std::function<void(const PingResult& result)>;
+using PhaseHandler = std::function<void(const PhaseResult& result)>;
+// A whole test, with the first phase error ("download: cancelled") if any
+using ResultHandler = std::function<void(const SpeedResult& result, const std::string& error)>;
+// Progress of the download and upload phases of run()
+using TestProgress = std::function<void(TestPhase phase, double progress, double mbps)>;
+
+class TestLoop;
+
+// One live test against a speed_test_gui server, run by a TestLoop.
+// Phases queue up and run one after another; every handler runs exactly
+// once, cancelled or not. Only cancel() may be called from another thread.
+class AsyncTest {
+public:
+    AsyncTest(const AsyncTest&) = delete;
+    AsyncTest& operator=(const AsyncTest&) = delete;
+
+    const EngineConfig& config() const { return engine_.config(); }
+    void set_tuning(const TuningProfile& tuning) { engine_.set_tuning(tuning); }
+    void set_transport(TransportKind transport) { engine_.set_transport(transport); }
+
+    void ping(PingHandler done);
+    void download(PhaseHandler done, ProgressCallback progress = nullptr);
+    void upload(PhaseHandler done, ProgressCallback progress = nullptr);
+    // Ping, download and upload, then the result SpeedTest::run_full_test()
+    // would have given
+    void run(ResultHandler done, TestProgress progress = nullptr);
+
+    // Ends the running phase at the loop's next round, its handler getting
+    // what was measured so far, and the queued phases without running
+    // them; every such result says "cancelled"
+    void cancel() { cancel_ = true; }
+    // Phases queued or running
+    bool busy() const { return !ops_.empty(); }
+
+private:
+    friend class TestLoop;
+
+    struct Op {
+        TestPhase phase;
+        PingHandler ping_done;
+        PhaseHandler phase_done;
+        ProgressCallback progress;
+        bool begins_test = false;  // Marks the start of a test in a recording
+    };
+
+    explicit AsyncTest(const EngineConfig& config);
+
+    // What step() is waiting for, as PhaseRun::poll_fds
+    void poll_fds(std::vector<pollfd>* fds, std::chrono::steady_clock::time_point* wake);
+    // Move the front phase on as far as it goes without waiting
+    void step();
+    // True once the ping phase is over
+    bool step_ping();
+    void finish_ping(const std::string& error);
+    void finish_phase(PhaseResult result);
+
+    ClientEngine engine_;
+    std::deque<Op> ops_;
+    bool running_ = false;       // ops_.front() has started
+    std::atomic<bool> cancel_{false};
+    size_t cancelling_ = 0;      // Phases at the front still to cancel
+    std::unique_ptr<PhaseRun> phase_;
+
+    // The ping phase under way
+    PingResult pings_;
+    SampleStats ping_stats_;
+    RunningStats jitter_;
+    int ping_attempts_ = 0;
+    bool ping_waiting_ = false;  // A ping is in flight
+};
+
+// Runs AsyncTests on whichever thread calls it
+class TestLoop {
+public:
+    TestLoop() = default;
+    TestLoop(const TestLoop&) = delete;
+    TestLoop& operator=(const TestLoop&) = delete;
+
+    // A test on this loop. It stays on the loop while it has phases
+    // queued or the caller still holds it.
+    std::shared_ptr<AsyncTest> add(const EngineConfig& config);
+
+    // One round: wait up to timeout_ms (-1 = as long as it takes) for any
+    // test's I/O or deadline, then move every test on. False, without
+    // waiting, when no test has anything queued.
+    bool run_once(int timeout_ms = -1);
+    // Rounds until no test has anything queued
+    void run();
+
+    // For a host with its own poller: the sockets to watch for readable
+    // and how long to wait at most, in ms (-1 = nothing queued). Call
+    // dispatch() when one is readable or the time is up.
+    int prepare(std::vector<pollfd>* fds);
+    void dispatch();
+
+    size_t size() const { return tests_.size(); }
+
+private:
+    bool prepare_until(std::vector<pollfd>* fds, std::chrono::steady_clock::time_point* wake);
+
+    std::vector<std::shared_ptr<AsyncTest>> tests_;
+    std::vector<pollfd> fds_;
+};
+
+} // namespace speedtest
+
+#endif // ASYNC_TEST_H_
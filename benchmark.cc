@@ -3,9 +3,34 @@
 #include <random>
 #include <unistd.h>
 #include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include "json_writer.h"
 
 namespace speedtest {
 
+namespace {
+
+// Ping until the mean's 95% interval is within +/- 5%, within these bounds
+const int kMinPings = 10;
+const int kMaxPings = 30;
+const double kPingPrecision = 0.05;
+
+// Simulated phases run on a virtual clock and stop on the same rule as
+// live ones: 50 steps of 200 ms, sampled after a 1 s warm-up
+const double kPhasePrecision = 0.02;
+const uint64_t kMinPhaseSamples = 8;
+const int kPhaseSteps = 50;
+const double kStepS = 0.2;
+const double kWarmupS = 1.0;
+
+// The live progress bar redraws this often, from the newest sample
+const auto kRedrawInterval = std::chrono::milliseconds(50);
+const size_t kProgressSamples = 256;
+
+} // namespace
+
 const char* Spinner::frames_[] = {"⠋", "⠙", "⠹", "⠸", "⠼", "⠴", "⠦", "⠧", "⠇", "⠏"};
 
 Spinner::Spinner() : frame_(0) {}
@@ -43,19 +68,69 @@ void ProgressBar::complete(const std::string& label, double final_value, const s
     std::cout << std::string(30, ' ') << "\n";
 }
 
-SpeedTest::SpeedTest() {
+SpeedTest::SpeedTest()
+    : SpeedTest(std::shared_ptr<const LinkModel>(make_link_model("default", nullptr)),
+                std::random_device{}()) {}
+
+SpeedTest::SpeedTest(std::shared_ptr<const LinkModel> link, uint64_t seed, bool realtime)
+    : sim_(new LinkSimulator(std::move(link), seed)), realtime_(realtime) {
+    if (realtime_) {
+        server_info_ = detect_server();
+    } else {
+        server_info_.server_name = "Simulator";
+        server_info_.location = sim_->model().name();
+        server_info_.isp = "Simulated";
+        server_info_.ip_address = "127.0.0.1";
+    }
+}
+
+SpeedTest::SpeedTest(const EngineConfig& config, bool realtime)
+    : engine_(new ClientEngine(config)), realtime_(realtime) {
     server_info_ = detect_server();
+    server_info_.server_name = config.host + ":" + std::to_string(config.port);
+    if (TraceRecorder* recorder = config.recorder) {
+        recorder->meta("server", server_info_.server_name);
+        recorder->meta("location", server_info_.location);
+        recorder->meta("isp", server_info_.isp);
+        recorder->meta("ip", server_info_.ip_address);
+        recorder->meta("streams", std::to_string(config.streams));
+        recorder->meta("duration_s", std::to_string(config.duration_s));
+        recorder->meta("started", std::to_string(std::time(nullptr)));
+        if (!config.placement.empty()) recorder->meta("placement", config.placement);
+    }
 }
 
+SpeedTest::SpeedTest(std::shared_ptr<const TestTrace> trace, double speed)
+    : trace_(std::move(trace)), replay_speed_(speed) {
+    auto meta = [this](const char* key, const char* fallback) {
+        auto it = trace_->meta.find(key);
+        return it == trace_->meta.end() ? std::string(fallback) : it->second;
+    };
+    server_info_.server_name = meta("server", "Recorded");
+    server_info_.location = meta("location", "");
+    server_info_.isp = meta("isp", "");
+    server_info_.ip_address = meta("ip", "");
+}
+
+SpeedTest::~SpeedTest() = default;
+
 ServerInfo SpeedTest::detect_server() {
     Spinner spinner;
-    spinner.spin("Detecting location...");
-    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    if (realtime_) {
+        spinner.spin("Detecting location...");
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
     
     ServerInfo info;
     
-    // Try to get real IP info using curl
-    FILE* pipe = popen("curl -s ifconfig.me 2>/dev/null", "r");
+    // Try to get real IP info using curl, leaving the way the test will;
+    // bindings were validated by parse_binding, so they are safe to quote
+    std::string command = "curl -s ";
+    if (engine_ && !engine_->config().source.empty()) {
+        const SourceBinding& source = engine_->config().source;
+        command += "--interface '" + (source.address.empty() ? source.device : source.address) + "' ";
+    }
+    FILE* pipe = popen((command + "ifconfig.me 2>/dev/null").c_str(), "r");
     if (pipe) {
         char buffer[128];
         if (fgets(buffer, sizeof(buffer), pipe)) {
@@ -67,8 +142,10 @@ ServerInfo SpeedTest::detect_server() {
         pclose(pipe);
     }
     
-    spinner.spin("Finding best server...");
-    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    if (realtime_) {
+        spinner.spin("Finding best server...");
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
     
     // Get hostname
     char hostname[256];
@@ -86,10 +163,32 @@ ServerInfo SpeedTest::detect_server() {
         info.ip_address = "127.0.0.1";
     }
     
-    spinner.stop();
+    if (realtime_) spinner.stop();
     return info;
 }
 
+ProgressReporter::ProgressReporter(const std::string& label)
+    : label_(label), samples_(kProgressSamples), thread_([this] { loop(); }) {}
+
+ProgressReporter::~ProgressReporter() {
+    done_ = true;
+    thread_.join();
+}
+
+void ProgressReporter::post(double progress, double mbps) {
+    samples_.try_push({progress, mbps});
+}
+
+void ProgressReporter::loop() {
+    while (!done_) {
+        std::this_thread::sleep_for(kRedrawInterval);
+        Sample newest;
+        if (samples_.drain([&](Sample&& sample) { newest = sample; }) > 0 && !done_) {
+            ProgressBar::show(label_, newest.progress, newest.mbps);
+        }
+    }
+}
+
 void SpeedTest::clear_line() {
     std::cout << "\r" << std::string(70, ' ') << "\r" << std::flush;
 }
@@ -104,84 +203,175 @@ void SpeedTest::print_header() {
 )" << std::endl;
 }
 
-double SpeedTest::simulate_network_operation(double base_speed, double variance) {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    std::normal_distribution<> dist(base_speed, variance);
-    return std::max(1.0, dist(gen));
+void SpeedTest::pause_ms(int ms) const {
+    if (realtime_) std::this_thread::sleep_for(std::chrono::milliseconds(ms));
 }
 
 double SpeedTest::test_ping() {
     Spinner spinner;
-    std::vector<double> pings;
+    SampleStats stats;
+    RunningStats jitter;
+    double previous = -1;
+    // A replay takes exactly the pings that were recorded
+    size_t recorded = replaying_ ? replaying_->pings_ms.size() : 0;
+    int max_pings = replaying_ ? static_cast<int>(recorded) : kMaxPings;
     
-    for (int i = 0; i < 10; ++i) {
-        spinner.spin("Testing ping...");
+    for (int i = 0; i < max_pings && (replaying_ || !stats.precise_enough(kPingPrecision, kMinPings)); ++i) {
+        if (realtime_) spinner.spin("Testing ping...");
         
-        // Simulate ping measurement
-        auto start = std::chrono::high_resolution_clock::now();
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
-        auto end = std::chrono::high_resolution_clock::now();
-        
-        double ping = simulate_network_operation(15.0, 5.0);
-        pings.push_back(ping);
+        double ping;
+        if (replaying_) {
+            ping = replaying_->pings_ms[i];
+            if (replay_speed_ > 0) {
+                std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(ping / replay_speed_));
+            }
+        } else if (engine_) {
+            std::vector<double> sample = engine_->ping(1);
+            if (sample.empty()) continue;
+            ping = sample[0];
+        } else {
+            // One probe every 150 ms, on the virtual clock too
+            pause_ms(50);
+            ping = sim_->ping_ms(i * 0.15);
+            pause_ms(100);
+        }
         
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        // Jitter: mean difference between consecutive samples
+        if (previous >= 0) jitter.add(std::fabs(ping - previous));
+        previous = ping;
+        stats.add(ping);
     }
     
-    spinner.stop();
-    
-    double sum = 0;
-    for (double p : pings) sum += p;
-    return sum / pings.size();
+    if (realtime_) spinner.stop();
+    ping_stats_ = stats.summarize();
+    jitter_ms_ = jitter.mean();
+    return ping_stats_.mean;
 }
 
 double SpeedTest::test_download() {
-    double current_speed = 0;
-    double max_speed = 0;
+    if (engine_) {
+        std::unique_ptr<ProgressReporter> reporter;
+        if (realtime_) reporter.reset(new ProgressReporter("Download"));
+        PhaseResult phase = engine_->download([&reporter](double progress, double mbps) {
+            if (reporter) reporter->post(progress, mbps);
+        });
+        reporter.reset();
+        download_tcp_ = phase.sender_tcp;
+        download_stats_ = phase.rate;
+        download_datagrams_ = phase.datagrams;
+        download_integrity_ = phase.integrity;
+        tuning_rejected_ = phase.tuning_rejected;
+        if (realtime_) clear_line();
+        if (phase.retry_after_s > 0) {
+            std::cout << "  Server busy, try again in " << phase.retry_after_s << " s\n";
+        }
+        if (!phase.error.empty()) std::cout << "  Download failed: " << phase.error << "\n";
+        return phase.mbps;
+    }
+    if (replaying_) return replay_phase("Download", true);
     
-    for (int i = 0; i <= 100; i += 2) {
-        double progress = i / 100.0;
-        
-        // Simulate speed ramping up then stabilizing
-        if (progress < 0.3) {
-            current_speed = simulate_network_operation(50 + progress * 200, 10);
-        } else {
-            current_speed = simulate_network_operation(95, 8);
+    return simulate_phase("Download", true);
+}
+
+double SpeedTest::test_upload() {
+    upload_sent_mbps_ = 0;
+    upload_sent_stats_ = SampleSummary();
+    if (engine_) {
+        std::unique_ptr<ProgressReporter> reporter;
+        if (realtime_) reporter.reset(new ProgressReporter("Upload"));
+        PhaseResult phase = engine_->upload([&reporter](double progress, double mbps) {
+            if (reporter) reporter->post(progress, mbps);
+        });
+        reporter.reset();
+        upload_tcp_ = phase.sender_tcp;
+        upload_stats_ = phase.rate;
+        upload_datagrams_ = phase.datagrams;
+        upload_integrity_ = phase.integrity;
+        upload_sent_mbps_ = phase.sent_mbps;
+        upload_sent_stats_ = phase.sent_rate;
+        if (realtime_) clear_line();
+        if (phase.retry_after_s > 0) {
+            std::cout << "  Server busy, try again in " << phase.retry_after_s << " s\n";
         }
+        if (!phase.error.empty()) std::cout << "  Upload failed: " << phase.error << "\n";
+        return phase.mbps;
+    }
+    if (replaying_) return replay_phase("Upload", false);
+    
+    return simulate_phase("Upload", false);
+}
+
+double SpeedTest::simulate_phase(const char* label, bool download) {
+    SampleStats stats;
+    
+    for (int i = 0; i <= kPhaseSteps; ++i) {
+        double t = i * kStepS;
+        double current_speed = sim_->rate_mbps(download, t);
+        if (t >= kWarmupS) stats.add(current_speed);
         
-        max_speed = std::max(max_speed, current_speed);
-        
-        ProgressBar::show("Download", progress, current_speed);
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        if (realtime_) ProgressBar::show(label, static_cast<double>(i) / kPhaseSteps, current_speed);
+        pause_ms(50);
+        if (stats.precise_enough(kPhasePrecision, kMinPhaseSamples)) break;
     }
     
-    clear_line();
-    return simulate_network_operation(92, 5);
+    if (realtime_) clear_line();
+    SampleSummary& summary = download ? download_stats_ : upload_stats_;
+    summary = stats.summarize();
+    return summary.mean;
 }
 
-double SpeedTest::test_upload() {
-    double current_speed = 0;
-    double max_speed = 0;
+double SpeedTest::replay_phase(const char* label, bool download) {
+    const RecordedPhase* phase = nullptr;
+    while (!phase && next_phase_ < replaying_->phases.size()) {
+        const RecordedPhase& p = replaying_->phases[next_phase_++];
+        if (p.download == download) phase = &p;
+    }
+    SampleSummary& summary = download ? download_stats_ : upload_stats_;
+    TcpInfoSummary& tcp = download ? download_tcp_ : upload_tcp_;
+    summary = SampleSummary();
+    tcp = TcpInfoSummary();
+    if (!phase) return 0;
     
-    for (int i = 0; i <= 100; i += 2) {
-        double progress = i / 100.0;
+    // Bytes move at the recorded phase times, and the progress display and
+    // rate sampler see them exactly as the live test did
+    auto duration = trace_->meta.find("duration_s");
+    double duration_s = duration == trace_->meta.end() ? 10 : std::max(1.0, atof(duration->second.c_str()));
+    auto start = std::chrono::steady_clock::now();
+    RateSampler rate;
+    uint64_t bytes = 0;
+    uint64_t last_bytes = 0;
+    double last_report = 0;
+    for (size_t i = 0; i < phase->bytes.size();) {
+        double t = phase->bytes[i].t_s;
+        for (; i < phase->bytes.size() && phase->bytes[i].t_s == t; ++i) bytes += phase->bytes[i].n;
+        rate.update(t, bytes);
         
-        // Simulate speed ramping up then stabilizing (upload typically slower)
-        if (progress < 0.3) {
-            current_speed = simulate_network_operation(20 + progress * 80, 8);
-        } else {
-            current_speed = simulate_network_operation(45, 6);
+        if (t - last_report >= 0.1) {
+            if (replay_speed_ > 0) {
+                std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                          std::chrono::duration<double>(t / replay_speed_)));
+            }
+            double mbps = (bytes - last_bytes) * 8.0 / (t - last_report) / 1e6;
+            ProgressBar::show(label, std::min(1.0, t / duration_s), mbps);
+            last_report = t;
+            last_bytes = bytes;
         }
-        
-        max_speed = std::max(max_speed, current_speed);
-        
-        ProgressBar::show("Upload", progress, current_speed);
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
     }
-    
     clear_line();
-    return simulate_network_operation(42, 4);
+    if (phase->retry_after_s > 0) {
+        std::cout << "  Server busy, try again in " << phase->retry_after_s << " s\n";
+    }
+    
+    summary = rate.stats().summarize();
+    tcp = summarize_tcp_info(download ? phase->remote_tcp : phase->local_tcp);
+    double mbps = summary.count > 0 ? summary.mean : phase->seconds > 0 ? bytes * 8.0 / phase->seconds / 1e6 : 0;
+    if (phase->received_mbps <= 0) return mbps;
+    // The live test quoted what the server received; the recorded samples
+    // are ours, so their spread goes with what we sent
+    upload_sent_mbps_ = mbps;
+    upload_sent_stats_ = summary;
+    summary = SampleSummary();
+    return phase->received_mbps;
 }
 
 void SpeedTest::print_server_info(const ServerInfo& info) {
@@ -198,28 +388,77 @@ void SpeedTest::print_server_info(const ServerInfo& info) {
 SpeedResult SpeedTest::run_full_test() {
     SpeedResult result;
     result.server = server_info_;
+    if (trace_) {
+        replaying_ = next_replay_ < trace_->tests.size() ? &trace_->tests[next_replay_++] : nullptr;
+        next_phase_ = 0;
+        if (!replaying_) return result;
+        result.tuning = tuning_from_query(replaying_->tuning);
+        auto placement = trace_->meta.find("placement");
+        if (placement != trace_->meta.end()) result.placement = placement->second;
+    }
+    if (engine_ && engine_->config().recorder) {
+        engine_->config().recorder->test_begin(engine_->config().tuning.to_query());
+    }
+    if (sim_) {
+        result.link = sim_->model().name();
+        result.seed = sim_->seed();
+    }
     
-    print_server_info(server_info_);
-    
-    std::cout << "  Testing latency...\n";
+    if (realtime_) {
+        print_server_info(server_info_);
+        std::cout << "  Testing latency...\n";
+    }
     result.ping_ms = test_ping();
-    result.jitter_ms = simulate_network_operation(3.0, 1.5);
-    ProgressBar::complete("Ping", result.ping_ms, "ms");
-    ProgressBar::complete("Jitter", result.jitter_ms, "ms");
-    
-    std::cout << "\n";
+    result.jitter_ms = jitter_ms_;
+    if (realtime_) {
+        ProgressBar::complete("Ping", result.ping_ms, "ms");
+        ProgressBar::complete("Jitter", result.jitter_ms, "ms");
+        std::cout << "\n";
+    }
     
     result.download_mbps = test_download();
-    ProgressBar::complete("Download", result.download_mbps, "Mbps");
-    
-    std::cout << "\n";
+    if (realtime_) {
+        ProgressBar::complete("Download", result.download_mbps, "Mbps");
+        std::cout << "\n";
+    }
     
     result.upload_mbps = test_upload();
-    ProgressBar::complete("Upload", result.upload_mbps, "Mbps");
+    if (realtime_) ProgressBar::complete("Upload", result.upload_mbps, "Mbps");
     
+    result.ping_stats = ping_stats_;
+    result.download_stats = download_stats_;
+    result.upload_stats = upload_stats_;
+    result.upload_sent_mbps = upload_sent_mbps_;
+    result.upload_sent_stats = upload_sent_stats_;
+    result.download_tcp = download_tcp_;
+    result.upload_tcp = upload_tcp_;
+    if (engine_) {
+        result.tuning = engine_->config().tuning;
+        result.tuning_rejected = tuning_rejected_;
+        result.transport = transport_name(engine_->config().transport);
+        result.download_datagrams = download_datagrams_;
+        result.upload_datagrams = upload_datagrams_;
+        result.download_integrity = download_integrity_;
+        result.upload_integrity = upload_integrity_;
+        result.source = engine_->config().source.describe();
+        result.placement = engine_->config().placement;
+        result.server_placement = engine_->server_placement();
+    }
     return result;
 }
 
+void SpeedTest::set_tuning(const TuningProfile& tuning) {
+    if (engine_) engine_->set_tuning(tuning);
+}
+
+void SpeedTest::set_transport(TransportKind transport) {
+    if (engine_) engine_->set_transport(transport);
+}
+
+size_t SpeedTest::replays_left() const {
+    return trace_ ? trace_->tests.size() - next_replay_ : 0;
+}
+
 void SpeedTest::print_result(const SpeedResult& result) {
     std::cout << R"(
    ┌─────────────────────────────────────────────────────┐
@@ -229,7 +468,7 @@ void SpeedTest::print_result(const SpeedResult& result) {
     
     std::cout << "   │  PING      " << std::fixed << std::setprecision(2) 
               << std::setw(8) << result.ping_ms << " ms"
-              << "                              │\n";
+              << error_bar(result.ping_stats, 30) << "│\n";
     
     std::cout << "   │  JITTER    " << std::fixed << std::setprecision(2) 
               << std::setw(8) << result.jitter_ms << " ms"
@@ -239,13 +478,249 @@ void SpeedTest::print_result(const SpeedResult& result) {
     
     std::cout << "   │  ↓ DOWNLOAD " << std::fixed << std::setprecision(2) 
               << std::setw(7) << result.download_mbps << " Mbps"
-              << "                           │\n";
+              << error_bar(result.download_stats, 27) << "│\n";
     
     std::cout << "   │  ↑ UPLOAD   " << std::fixed << std::setprecision(2) 
               << std::setw(7) << result.upload_mbps << " Mbps"
-              << "                           │\n";
+              << error_bar(result.upload_stats, 27) << "│\n";
+    if (result.upload_sent_mbps > 0) {
+        // Upload is what the server received; this is what left our end
+        std::cout << "   │    SENT     " << std::fixed << std::setprecision(2)
+                  << std::setw(7) << result.upload_sent_mbps << " Mbps";
+        if (result.upload_sent_stats.count >= 2) {
+            std::cout << error_bar(result.upload_sent_stats, 27) << "│\n";
+        } else {
+            std::cout << std::left << std::setw(27) << "  (our kernel's count)" << std::right << "│\n";
+        }
+    }
+    
+    if (!result.link.empty()) {
+        std::ostringstream link;
+        link << result.link << ", seed " << result.seed;
+        std::cout << "   ├─────────────────────────────────────────────────────┤\n";
+        std::cout << "   │  SIMULATED " << std::left << std::setw(41) << link.str() << "│\n";
+    }
+    
+    if (!result.source.empty()) {
+        std::cout << "   ├─────────────────────────────────────────────────────┤\n";
+        std::cout << "   │  SOURCE    " << std::left << std::setw(41) << result.source << "│\n";
+    }
+    
+    if (!result.placement.empty() || !result.server_placement.empty()) {
+        std::cout << "   ├─────────────────────────────────────────────────────┤\n";
+        if (!result.placement.empty()) {
+            std::cout << "   │  CLIENT    " << std::left << std::setw(41) << result.placement << "│\n";
+        }
+        if (!result.server_placement.empty()) {
+            std::cout << "   │  SERVER    " << std::left << std::setw(41) << result.server_placement << "│\n";
+        }
+    }
+    
+    if (!result.tuning.empty()) {
+        std::string tuning = result.tuning.describe();
+        for (const std::string& key : result.tuning_rejected) tuning += " !" + key;
+        std::cout << "   ├─────────────────────────────────────────────────────┤\n";
+        std::cout << "   │  TUNING    " << std::left << std::setw(41) << tuning << "│\n";
+    }
+    
+    if (result.download_tcp.samples > 0 || result.upload_tcp.samples > 0) {
+        std::cout << "   ├─────────────────────────────────────────────────────┤\n";
+        print_tcp_info("↓ TCP   ", result.download_tcp);
+        print_tcp_info("↑ TCP   ", result.upload_tcp);
+    }
+    
+    if (result.download_datagrams.sent > 0 || result.upload_datagrams.sent > 0) {
+        std::cout << "   ├─────────────────────────────────────────────────────┤\n";
+        print_datagrams("↓ UDP   ", result.download_datagrams);
+        print_datagrams("↑ UDP   ", result.upload_datagrams);
+    }
+    
+    if (result.download_integrity.bytes > 0 || result.upload_integrity.bytes > 0) {
+        std::cout << "   ├─────────────────────────────────────────────────────┤\n";
+        print_integrity("↓ CRC   ", result.download_integrity);
+        print_integrity("↑ CRC   ", result.upload_integrity);
+    }
     
     std::cout << "   └─────────────────────────────────────────────────────┘\n\n";
 }
 
+std::string SpeedTest::error_bar(const SampleSummary& stats, int width) {
+    std::ostringstream out;
+    int columns = 0;
+    if (stats.count >= 2) {
+        out << std::fixed << std::setprecision(2) << "  ± " << (stats.ci_high - stats.ci_low) / 2
+            << "  n=" << stats.count;
+        if (stats.outliers > 0) out << " -" << stats.outliers;
+        columns = static_cast<int>(out.str().size()) - 1;  // ± is two bytes
+    }
+    out << std::string(std::max(0, width - columns), ' ');
+    return out.str();
+}
+
+void SpeedTest::print_tcp_info(const std::string& label, const TcpInfoSummary& tcp) {
+    if (tcp.samples == 0) return;
+    
+    std::ostringstream line1, line2;
+    line1 << std::fixed << std::setprecision(2) << "rtt " << tcp.rtt_ms << " ms  var " << tcp.rttvar_ms
+          << " ms  cwnd " << std::setprecision(0) << tcp.cwnd;
+    line2 << std::fixed << std::setprecision(3) << "retrans " << tcp.retransmit_rate * 100 << "%  "
+          << std::setprecision(0) << "rwnd " << tcp.rwnd_limited * 100 << "%  sndbuf "
+          << tcp.sndbuf_limited * 100 << "%";
+    
+    // label is pre-padded to 8 columns; the arrows are multi-byte
+    std::cout << "   │  " << label << std::left << std::setw(43) << line1.str() << "│\n";
+    std::cout << "   │          " << std::left << std::setw(43) << line2.str() << "│\n";
+}
+
+void SpeedTest::print_datagrams(const std::string& label, const DatagramSummary& datagrams) {
+    if (datagrams.sent == 0) return;
+    
+    std::ostringstream line1, line2, line3, line4;
+    line1 << std::fixed << std::setprecision(3) << "loss " << datagrams.loss_rate * 100 << "%  ("
+          << datagrams.lost << " of " << datagrams.sent << ")";
+    line2 << "reordered " << datagrams.reordered << "  max depth " << datagrams.max_reorder_depth;
+    line3 << std::fixed << std::setprecision(3) << "jitter " << datagrams.jitter_ms << " ms  delay var " << datagrams.delay_var_ms
+          << " ms";
+    line4 << std::fixed << std::setprecision(0) << "target " << datagrams.target_mbps << " Mbps";
+    
+    std::cout << "   │  " << label << std::left << std::setw(43) << line1.str() << "│\n";
+    std::cout << "   │          " << std::left << std::setw(43) << line2.str() << "│\n";
+    std::cout << "   │          " << std::left << std::setw(43) << line3.str() << "│\n";
+    if (datagrams.target_mbps > 0) std::cout << "   │          " << std::left << std::setw(43) << line4.str() << "│\n";
+}
+
+void SpeedTest::print_integrity(const std::string& label, const IntegrityCounts& integrity) {
+    if (integrity.bytes == 0) return;
+    
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1) << integrity.bytes / 1e6 << " MB checked, ";
+    if (integrity.bad_blocks == 0) line << "all intact";
+    else line << integrity.bad_blocks << " corrupt block(s)";
+    std::cout << "   │  " << label << std::left << std::setw(43) << line.str() << "│\n";
+}
+
+void SpeedTest::print_sweep(const std::vector<SpeedResult>& results) {
+    // Runs over several transports are labelled with theirs, and UDP ones
+    // report loss where TCP ones report retransmits
+    bool transports = false;
+    for (const SpeedResult& r : results) transports |= r.transport != results.front().transport;
+    // ... and runs from several interfaces with theirs
+    bool sources = false;
+    for (const SpeedResult& r : results) sources |= r.source != results.front().source;
+    std::cout << "\n  " << (transports || sources ? "COMPARISON" : "TUNING SWEEP") << "\n";
+    std::cout << "  " << std::left << std::setw(36) << "profile"
+              << std::right << std::setw(12) << "down Mbps" << std::setw(12) << "up Mbps"
+              << std::setw(10) << "rtt ms" << std::setw(10) << (transports ? "retr/loss" : "retr %") << "\n";
+    std::cout << "  " << std::string(80, '-') << "\n";
+    for (const SpeedResult& r : results) {
+        std::string profile = r.tuning.describe();
+        if (transports) profile = r.transport + "  " + profile;
+        if (sources) profile = r.source + "  " + profile;
+        for (const std::string& key : r.tuning_rejected) profile += " !" + key;
+        double lost = r.download_datagrams.sent > 0 ? r.download_datagrams.loss_rate : r.download_tcp.retransmit_rate;
+        std::cout << "  " << std::left << std::setw(36) << profile << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(12) << r.download_mbps
+                  << std::setw(12) << r.upload_mbps
+                  << std::setw(10) << r.download_tcp.rtt_ms
+                  << std::setprecision(3) << std::setw(10) << lost * 100
+                  << "\n";
+    }
+    std::cout << "  (! marks options the kernel refused";
+    if (transports) std::cout << "; udp rows show datagram loss %";
+    std::cout << ")\n\n";
+}
+
+namespace {
+
+void write_summary(const SampleSummary& stats, JsonWriter* json) {
+    json->begin_object()
+        .field("count", stats.count)
+        .field("outliers", stats.outliers)
+        .field("mean", stats.mean)
+        .field("stddev", stats.stddev)
+        .field("ci_low", stats.ci_low)
+        .field("ci_high", stats.ci_high)
+        .field("p50", stats.p50)
+        .field("p90", stats.p90)
+        .field("p99", stats.p99)
+        .end_object();
+}
+
+void write_tcp_summary(const TcpInfoSummary& tcp, JsonWriter* json) {
+    json->begin_object()
+        .field("samples", tcp.samples)
+        .field("rtt_ms", tcp.rtt_ms)
+        .field("rttvar_ms", tcp.rttvar_ms)
+        .field("max_rtt_ms", tcp.max_rtt_ms)
+        .field("cwnd", tcp.cwnd)
+        .field("retransmits", tcp.retransmits)
+        .field("retransmit_rate", tcp.retransmit_rate)
+        .field("pacing_mbps", tcp.pacing_mbps)
+        .field("delivery_mbps", tcp.delivery_mbps)
+        .field("rwnd_limited", tcp.rwnd_limited)
+        .field("sndbuf_limited", tcp.sndbuf_limited)
+        .field("sending", tcp.sending)
+        .end_object();
+}
+
+void write_datagrams(const DatagramSummary& datagrams, JsonWriter* json) {
+    json->begin_object()
+        .field("sent", datagrams.sent)
+        .field("received", datagrams.received)
+        .field("lost", datagrams.lost)
+        .field("reordered", datagrams.reordered)
+        .field("max_reorder_depth", datagrams.max_reorder_depth)
+        .field("loss_rate", datagrams.loss_rate)
+        .field("jitter_ms", datagrams.jitter_ms)
+        .field("delay_var_ms", datagrams.delay_var_ms)
+        .field("target_mbps", datagrams.target_mbps)
+        .end_object();
+}
+
+void write_integrity(const IntegrityCounts& integrity, JsonWriter* json) {
+    json->begin_object().field("bytes", integrity.bytes).field("bad_blocks", integrity.bad_blocks).end_object();
+}
+
+} // namespace
+
+std::string speed_result_to_json(const SpeedResult& result) {
+    JsonWriter json(2048);
+    json.begin_object()
+        .field("download_mbps", result.download_mbps)
+        .field("upload_mbps", result.upload_mbps)
+        .field("ping_ms", result.ping_ms)
+        .field("jitter_ms", result.jitter_ms);
+    json.key("server").begin_object()
+        .field("name", result.server.server_name)
+        .field("location", result.server.location)
+        .field("isp", result.server.isp)
+        .field("ip", result.server.ip_address)
+        .end_object();
+    if (!result.link.empty()) json.field("link", result.link).field("seed", result.seed);
+    if (!result.transport.empty()) json.field("transport", result.transport);
+    if (!result.source.empty()) json.field("source", result.source);
+    if (!result.placement.empty()) json.field("placement", result.placement);
+    if (!result.server_placement.empty()) json.field("server_placement", result.server_placement);
+    json.field("tuning", result.tuning.describe());
+    json.key("tuning_rejected").begin_array();
+    for (const std::string& key : result.tuning_rejected) json.value(key);
+    json.end_array();
+
+    write_summary(result.ping_stats, &json.key("ping_stats"));
+    write_summary(result.download_stats, &json.key("download_stats"));
+    write_summary(result.upload_stats, &json.key("upload_stats"));
+    if (result.upload_sent_mbps > 0) {
+        json.field("upload_sent_mbps", result.upload_sent_mbps);
+        write_summary(result.upload_sent_stats, &json.key("upload_sent_stats"));
+    }
+    if (result.download_tcp.samples > 0) write_tcp_summary(result.download_tcp, &json.key("download_tcp"));
+    if (result.upload_tcp.samples > 0) write_tcp_summary(result.upload_tcp, &json.key("upload_tcp"));
+    if (result.download_datagrams.sent > 0) write_datagrams(result.download_datagrams, &json.key("download_udp"));
+    if (result.upload_datagrams.sent > 0) write_datagrams(result.upload_datagrams, &json.key("upload_udp"));
+    if (result.download_integrity.bytes > 0) write_integrity(result.download_integrity, &json.key("download_integrity"));
+    if (result.upload_integrity.bytes > 0) write_integrity(result.upload_integrity, &json.key("upload_integrity"));
+    json.end_object();
+    return json.take();
+}
+
 } // namespace speedtest
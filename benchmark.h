@@ -1,16 +1,23 @@
 #ifndef BENCHMARK_H_
 #define BENCHMARK_H_
 
+#include <atomic>
 #include <chrono>
 #include <cmath>
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "client_engine.h"
+#include "link_model.h"
+#include "sample_queue.h"
+#include "stats.h"
+
 namespace speedtest {
 
 // Server/Location info
@@ -28,8 +35,42 @@ struct SpeedResult {
     double ping_ms;
     double jitter_ms;
     ServerInfo server;
+    // Simulated runs: the link model and the seed that reproduces them
+    std::string link;
+    uint64_t seed = 0;
+    // Spread of the samples behind ping, download and upload
+    SampleSummary ping_stats;
+    SampleSummary download_stats;
+    SampleSummary upload_stats;
+    // Live uploads the server timed: upload_mbps and upload_stats are what
+    // it received, and these what our kernel took, which a deep send
+    // buffer inflates
+    double upload_sent_mbps = 0;
+    SampleSummary upload_sent_stats;
+    // Kernel TCP_INFO of the sending side, live tests only
+    TcpInfoSummary download_tcp;
+    TcpInfoSummary upload_tcp;
+    // Socket tuning in effect, and options the local kernel refused
+    TuningProfile tuning;
+    std::vector<std::string> tuning_rejected;
+    // Live tests: how the bytes moved (http, tcp or udp), and for UDP
+    // what was lost or reordered on the way
+    std::string transport;
+    DatagramSummary download_datagrams;
+    DatagramSummary upload_datagrams;
+    // --verify: payload checked by the receiving end of each phase
+    IntegrityCounts download_integrity;
+    IntegrityCounts upload_integrity;
+    // --bind: the interface and/or address the test left from
+    std::string source;
+    // --affinity: CPUs and NUMA node of our thread and the server's
+    std::string placement;
+    std::string server_placement;
 };
 
+// One result as a JSON object, for --json
+std::string speed_result_to_json(const SpeedResult& result);
+
 // Progress bar with animation
 class ProgressBar {
 public:
@@ -37,6 +78,33 @@ public:
     static void complete(const std::string& label, double final_value, const std::string& unit);
 };
 
+// Draws a live phase's progress bar from its own thread. The engine's
+// event loop only posts samples, so a terminal that stops reading (a
+// paused pager, a stalled ssh session) can't stall the transfer; the
+// newest sample is drawn every 50 ms and older ones are skipped.
+class ProgressReporter {
+public:
+    explicit ProgressReporter(const std::string& label);
+    ~ProgressReporter();  // Stops drawing
+    ProgressReporter(const ProgressReporter&) = delete;
+    ProgressReporter& operator=(const ProgressReporter&) = delete;
+
+    // Never blocks; a sample that finds the ring full is dropped
+    void post(double progress, double mbps);
+
+private:
+    struct Sample {
+        double progress = 0;
+        double mbps = 0;
+    };
+    void loop();
+
+    std::string label_;
+    SpscRing<Sample> samples_;
+    std::atomic<bool> done_{false};
+    std::thread thread_;
+};
+
 // Spinner animation
 class Spinner {
 public:
@@ -51,7 +119,21 @@ private:
 // Main speed test class
 class SpeedTest {
 public:
+    // Simulated tests on the default link with a random seed
     SpeedTest();
+    // Simulated tests on `link`, reproducible from `seed`. With realtime
+    // off, nothing is printed and nothing sleeps: a whole test takes
+    // microseconds, for exercising the statistics and reporting code.
+    SpeedTest(std::shared_ptr<const LinkModel> link, uint64_t seed, bool realtime = true);
+    // Live tests against a speed_test_gui server instead of simulation.
+    // With realtime off nothing is drawn while it runs, so several can
+    // run at once and print their results afterwards.
+    explicit SpeedTest(const EngineConfig& config, bool realtime = true);
+    // Replays a recording through the same statistics and display as a
+    // live test. `speed` is the multiple of real time; 0 doesn't wait at
+    // all. Each run_full_test() replays the next recorded test.
+    SpeedTest(std::shared_ptr<const TestTrace> trace, double speed);
+    ~SpeedTest();
     
     // Get server/location info
     ServerInfo detect_server();
@@ -64,15 +146,52 @@ public:
     // Run full test with UI
     SpeedResult run_full_test();
     
+    // Socket tuning and transport for the following live tests
+    void set_tuning(const TuningProfile& tuning);
+    void set_transport(TransportKind transport);
+    
+    // Recorded tests not yet replayed
+    size_t replays_left() const;
+    
     // UI helpers
     static void print_header();
     static void print_server_info(const ServerInfo& info);
     static void print_result(const SpeedResult& result);
+    static void print_tcp_info(const std::string& label, const TcpInfoSummary& tcp);
+    static void print_datagrams(const std::string& label, const DatagramSummary& datagrams);
+    static void print_integrity(const std::string& label, const IntegrityCounts& integrity);
+    // "  ± 1.23  n=40 -2" (95% CI half-width, samples, outliers dropped),
+    // padded to `width` columns
+    static std::string error_bar(const SampleSummary& stats, int width);
+    static void print_sweep(const std::vector<SpeedResult>& results);
     static void clear_line();
 
 private:
-    double simulate_network_operation(double base_speed, double variance);
+    double simulate_phase(const char* label, bool download);
+    double replay_phase(const char* label, bool download);
+    void pause_ms(int ms) const;
     ServerInfo server_info_;
+    std::unique_ptr<ClientEngine> engine_;
+    std::unique_ptr<LinkSimulator> sim_;
+    std::shared_ptr<const TestTrace> trace_;
+    const RecordedTest* replaying_ = nullptr;
+    size_t next_replay_ = 0;
+    size_t next_phase_ = 0;
+    double replay_speed_ = 0;
+    bool realtime_ = true;
+    double jitter_ms_ = 0;
+    SampleSummary ping_stats_;
+    SampleSummary download_stats_;
+    SampleSummary upload_stats_;
+    double upload_sent_mbps_ = 0;
+    SampleSummary upload_sent_stats_;
+    TcpInfoSummary download_tcp_;
+    TcpInfoSummary upload_tcp_;
+    DatagramSummary download_datagrams_;
+    DatagramSummary upload_datagrams_;
+    IntegrityCounts download_integrity_;
+    IntegrityCounts upload_integrity_;
+    std::vector<std::string> tuning_rejected_;
 };
 
 } // namespace speedtest
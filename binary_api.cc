@@ -0,0 +1,420 @@
+#include "binary_api.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "json_writer.h"
+
+namespace speedtest {
+
+namespace {
+
+const uint32_t kMagic = 0x53544231;  // "STB1"
+
+void put_be(char* out, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; --i, v >>= 8) out[i] = static_cast<char>(v & 0xff);
+}
+
+uint64_t get_be(const char* in, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i) v = v << 8 | static_cast<uint8_t>(in[i]);
+    return v;
+}
+
+uint64_t double_bits(double v) {
+    uint64_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+// Just enough JSON for a server list: strings, numbers, and anything else
+// skipped over without interpreting it
+class JsonScanner {
+public:
+    explicit JsonScanner(const std::string& text) : text_(text) {}
+
+    bool at_end() {
+        skip_space();
+        return pos_ >= text_.size();
+    }
+
+    bool consume(char c) {
+        skip_space();
+        if (pos_ >= text_.size() || text_[pos_] != c) return false;
+        ++pos_;
+        return true;
+    }
+
+    bool peek(char c) {
+        skip_space();
+        return pos_ < text_.size() && text_[pos_] == c;
+    }
+
+    bool string(std::string* out) {
+        if (!consume('"')) return false;
+        out->clear();
+        while (pos_ < text_.size() && text_[pos_] != '"') {
+            char c = text_[pos_++];
+            if (c != '\\') {
+                out->push_back(c);
+                continue;
+            }
+            if (pos_ >= text_.size()) return false;
+            char e = text_[pos_++];
+            switch (e) {
+                case 'n': out->push_back('\n'); break;
+                case 't': out->push_back('\t'); break;
+                case 'r': out->push_back('\r'); break;
+                case 'b': out->push_back('\b'); break;
+                case 'f': out->push_back('\f'); break;
+                case 'u': {
+                    if (pos_ + 4 > text_.size()) return false;
+                    unsigned code = std::strtoul(text_.substr(pos_, 4).c_str(), nullptr, 16);
+                    pos_ += 4;
+                    // Basic plane only; surrogate pairs come out as two characters
+                    if (code < 0x80) {
+                        out->push_back(static_cast<char>(code));
+                    } else if (code < 0x800) {
+                        out->push_back(static_cast<char>(0xc0 | code >> 6));
+                        out->push_back(static_cast<char>(0x80 | (code & 0x3f)));
+                    } else {
+                        out->push_back(static_cast<char>(0xe0 | code >> 12));
+                        out->push_back(static_cast<char>(0x80 | (code >> 6 & 0x3f)));
+                        out->push_back(static_cast<char>(0x80 | (code & 0x3f)));
+                    }
+                    break;
+                }
+                default: out->push_back(e);
+            }
+        }
+        return consume('"');
+    }
+
+    bool number(double* out) {
+        skip_space();
+        const char* start = text_.c_str() + pos_;
+        char* end;
+        *out = std::strtod(start, &end);
+        if (end == start) return false;
+        pos_ += end - start;
+        return true;
+    }
+
+    bool skip_value(int depth = 0) {
+        if (depth > 32) return false;
+        std::string ignored;
+        double n;
+        if (peek('"')) return string(&ignored);
+        if (consume('{')) {
+            if (consume('}')) return true;
+            do {
+                if (!string(&ignored) || !consume(':') || !skip_value(depth + 1)) return false;
+            } while (consume(','));
+            return consume('}');
+        }
+        if (consume('[')) {
+            if (consume(']')) return true;
+            do {
+                if (!skip_value(depth + 1)) return false;
+            } while (consume(','));
+            return consume(']');
+        }
+        for (const char* word : {"true", "false", "null"}) {
+            if (text_.compare(pos_, strlen(word), word) == 0) {
+                pos_ += strlen(word);
+                return true;
+            }
+        }
+        return number(&n);
+    }
+
+    size_t position() const { return pos_; }
+
+private:
+    void skip_space() {
+        while (pos_ < text_.size() && std::strchr(" \t\r\n", text_[pos_])) ++pos_;
+    }
+
+    const std::string& text_;
+    size_t pos_ = 0;
+};
+
+} // namespace
+
+uint32_t BinaryFields::u32(size_t offset) const {
+    return offset + 4 <= size_ ? static_cast<uint32_t>(get_be(data_ + offset, 4)) : 0;
+}
+
+uint64_t BinaryFields::u64(size_t offset) const {
+    return offset + 8 <= size_ ? get_be(data_ + offset, 8) : 0;
+}
+
+double BinaryFields::f64(size_t offset) const {
+    uint64_t bits = u64(offset);
+    double v;
+    std::memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+std::string_view BinaryFields::str(size_t offset) const {
+    if (offset + 8 > size_) return std::string_view();
+    uint64_t start = get_be(data_ + offset, 4);
+    uint64_t len = get_be(data_ + offset + 4, 4);
+    if (start + len > strings_.size()) return std::string_view();
+    return strings_.substr(start, len);
+}
+
+bool BinaryMessage::parse(const char* data, size_t len, std::string* error) {
+    if (len < kBinaryHeaderSize || get_be(data, 4) != kMagic) {
+        *error = "not a binary API message";
+        return false;
+    }
+    version_ = static_cast<uint16_t>(get_be(data + 4, 2));
+    if (version_ != kBinaryVersion) {
+        *error = "binary API version " + std::to_string(version_) + ", expected " + std::to_string(kBinaryVersion);
+        return false;
+    }
+    type_ = static_cast<BinaryType>(get_be(data + 6, 2));
+    body_size_ = get_be(data + 8, 4);
+    record_size_ = get_be(data + 12, 4);
+    records_ = get_be(data + 16, 4);
+    uint64_t strings_size = get_be(data + 20, 4);
+    // Each part against what is left of the buffer, so no sum can wrap
+    uint64_t left = len - kBinaryHeaderSize;
+    bool fits = body_size_ <= left;
+    if (fits) left -= body_size_;
+    fits = fits && !(records_ > 0 && (record_size_ == 0 || records_ > left / record_size_));
+    if (fits) left -= uint64_t(record_size_) * records_;
+    if (!fits || strings_size > left) {
+        *error = "truncated binary API message";
+        return false;
+    }
+    uint64_t total = len - left + strings_size;
+    data_ = data;
+    strings_ = std::string_view(data + total - strings_size, strings_size);
+    return true;
+}
+
+BinaryFields BinaryMessage::record(size_t i) const {
+    const char* start = data_ + kBinaryHeaderSize + body_size_ + i * record_size_;
+    return BinaryFields(start, record_size_, strings_);
+}
+
+BinaryWriter::BinaryWriter(BinaryType type, size_t body_size, size_t record_size)
+    : fixed_(kBinaryHeaderSize + body_size, '\0'), current_(kBinaryHeaderSize), record_size_(record_size) {
+    put_be(&fixed_[0], kMagic, 4);
+    put_be(&fixed_[4], kBinaryVersion, 2);
+    put_be(&fixed_[6], static_cast<uint16_t>(type), 2);
+    put_be(&fixed_[8], body_size, 4);
+    put_be(&fixed_[12], record_size, 4);
+}
+
+void BinaryWriter::begin_record() {
+    current_ = fixed_.size();
+    fixed_.resize(fixed_.size() + record_size_, '\0');
+    ++records_;
+}
+
+void BinaryWriter::put_u32(size_t offset, uint32_t v) {
+    put_be(&fixed_[current_ + offset], v, 4);
+}
+
+void BinaryWriter::put_u64(size_t offset, uint64_t v) {
+    put_be(&fixed_[current_ + offset], v, 8);
+}
+
+void BinaryWriter::put_f64(size_t offset, double v) {
+    put_u64(offset, double_bits(v));
+}
+
+void BinaryWriter::put_str(size_t offset, std::string_view s) {
+    put_u32(offset, static_cast<uint32_t>(strings_.size()));
+    put_u32(offset + 4, static_cast<uint32_t>(s.size()));
+    strings_.append(s.data(), s.size());
+}
+
+std::string BinaryWriter::finish() {
+    put_be(&fixed_[16], records_, 4);
+    put_be(&fixed_[20], strings_.size(), 4);
+    return fixed_ + strings_;
+}
+
+std::string encode_info(const ApiInfo& info) {
+    BinaryWriter out(BinaryType::kInfo, info_field::kSize);
+    out.put_str(info_field::kIp, info.ip);
+    out.put_str(info_field::kServer, info.server);
+    out.put_str(info_field::kLocation, info.location);
+    out.put_str(info_field::kIsp, info.isp);
+    out.put_u32(info_field::kTcpPort, info.tcp_port);
+    out.put_u32(info_field::kUdpPort, info.udp_port);
+    out.put_u64(info_field::kPayloadSeed, info.payload_seed);
+    out.put_u64(info_field::kPayloadSize, info.payload_size);
+    out.put_str(info_field::kPlacement, info.placement);
+    return out.finish();
+}
+
+std::string encode_ping(double ping_ms, double jitter_ms) {
+    BinaryWriter out(BinaryType::kPing, ping_field::kSize);
+    out.put_f64(ping_field::kPingMs, ping_ms);
+    out.put_f64(ping_field::kJitterMs, jitter_ms);
+    return out.finish();
+}
+
+std::string encode_servers(const std::vector<ServerEntry>& servers) {
+    BinaryWriter out(BinaryType::kServers, 0, server_field::kSize);
+    for (const ServerEntry& s : servers) {
+        out.begin_record();
+        out.put_u32(server_field::kId, static_cast<uint32_t>(s.id));
+        out.put_u32(server_field::kDistanceKm, static_cast<uint32_t>(s.distance_km));
+        out.put_u32(server_field::kPingMs, static_cast<uint32_t>(s.ping_ms));
+        out.put_f64(server_field::kLat, s.lat);
+        out.put_f64(server_field::kLng, s.lng);
+        out.put_str(server_field::kName, s.name);
+        out.put_str(server_field::kLocation, s.location);
+        out.put_str(server_field::kCountry, s.country);
+    }
+    return out.finish();
+}
+
+std::string encode_samples(const std::string& test, uint64_t next, const std::vector<TcpInfoSample>& samples,
+                           const IntegrityCounts* integrity, const ReceivedSummary* received) {
+    BinaryWriter out(BinaryType::kSamples, samples_field::kSize, tcp_sample_field::kSize);
+    out.put_str(samples_field::kTest, test);
+    out.put_u64(samples_field::kNext, next);
+    if (integrity) {
+        out.put_u64(samples_field::kIntegrityBytes, integrity->bytes);
+        out.put_u64(samples_field::kBadBlocks, integrity->bad_blocks);
+        out.put_u32(samples_field::kVerified, 1);
+    }
+    if (received) {
+        out.put_u64(samples_field::kReceivedBytes, received->bytes);
+        out.put_f64(samples_field::kReceivedSeconds, received->seconds);
+        out.put_f64(samples_field::kReceivedMbps, received->mbps);
+        const SampleSummary& rate = received->rate;
+        out.put_u64(samples_field::kRateCount, rate.count);
+        out.put_u64(samples_field::kRateOutliers, rate.outliers);
+        out.put_f64(samples_field::kRateMean, rate.mean);
+        out.put_f64(samples_field::kRateStddev, rate.stddev);
+        out.put_f64(samples_field::kRateCiLow, rate.ci_low);
+        out.put_f64(samples_field::kRateCiHigh, rate.ci_high);
+        out.put_f64(samples_field::kRateP50, rate.p50);
+        out.put_f64(samples_field::kRateP90, rate.p90);
+        out.put_f64(samples_field::kRateP99, rate.p99);
+    }
+    for (const TcpInfoSample& s : samples) {
+        out.begin_record();
+        out.put_f64(tcp_sample_field::kTime, s.t_s);
+        out.put_u32(tcp_sample_field::kStream, static_cast<uint32_t>(s.stream));
+        out.put_u32(tcp_sample_field::kCwnd, s.cwnd);
+        out.put_f64(tcp_sample_field::kRtt, s.rtt_ms);
+        out.put_f64(tcp_sample_field::kRttVar, s.rttvar_ms);
+        out.put_u32(tcp_sample_field::kMss, s.mss);
+        out.put_u32(tcp_sample_field::kTotalRetrans, s.total_retrans);
+        out.put_u32(tcp_sample_field::kSegsOut, s.segs_out);
+        out.put_u64(tcp_sample_field::kPacingRate, s.pacing_rate_bps);
+        out.put_u64(tcp_sample_field::kDeliveryRate, s.delivery_rate_bps);
+        out.put_u64(tcp_sample_field::kBusy, s.busy_us);
+        out.put_u64(tcp_sample_field::kRwndLimited, s.rwnd_limited_us);
+        out.put_u64(tcp_sample_field::kSndbufLimited, s.sndbuf_limited_us);
+    }
+    return out.finish();
+}
+
+TcpInfoSample read_tcp_sample(const BinaryFields& record) {
+    TcpInfoSample s;
+    s.t_s = record.f64(tcp_sample_field::kTime);
+    s.stream = static_cast<int>(record.u32(tcp_sample_field::kStream));
+    s.cwnd = record.u32(tcp_sample_field::kCwnd);
+    s.rtt_ms = record.f64(tcp_sample_field::kRtt);
+    s.rttvar_ms = record.f64(tcp_sample_field::kRttVar);
+    s.mss = record.u32(tcp_sample_field::kMss);
+    s.total_retrans = record.u32(tcp_sample_field::kTotalRetrans);
+    s.segs_out = record.u32(tcp_sample_field::kSegsOut);
+    s.pacing_rate_bps = record.u64(tcp_sample_field::kPacingRate);
+    s.delivery_rate_bps = record.u64(tcp_sample_field::kDeliveryRate);
+    s.busy_us = record.u64(tcp_sample_field::kBusy);
+    s.rwnd_limited_us = record.u64(tcp_sample_field::kRwndLimited);
+    s.sndbuf_limited_us = record.u64(tcp_sample_field::kSndbufLimited);
+    return s;
+}
+
+ReceivedSummary read_received(const BinaryFields& body) {
+    ReceivedSummary received;
+    received.bytes = body.u64(samples_field::kReceivedBytes);
+    received.seconds = body.f64(samples_field::kReceivedSeconds);
+    received.mbps = body.f64(samples_field::kReceivedMbps);
+    SampleSummary& rate = received.rate;
+    rate.count = body.u64(samples_field::kRateCount);
+    rate.outliers = body.u64(samples_field::kRateOutliers);
+    rate.mean = body.f64(samples_field::kRateMean);
+    rate.stddev = body.f64(samples_field::kRateStddev);
+    rate.ci_low = body.f64(samples_field::kRateCiLow);
+    rate.ci_high = body.f64(samples_field::kRateCiHigh);
+    rate.p50 = body.f64(samples_field::kRateP50);
+    rate.p90 = body.f64(samples_field::kRateP90);
+    rate.p99 = body.f64(samples_field::kRateP99);
+    return received;
+}
+
+std::string servers_to_json(const std::vector<ServerEntry>& servers) {
+    JsonWriter json(servers.size() * 160 + 2);
+    json.begin_array();
+    for (const ServerEntry& s : servers) {
+        json.begin_object()
+            .field("id", s.id)
+            .field("name", s.name)
+            .field("location", s.location)
+            .field("country", s.country)
+            .field("lat", s.lat)
+            .field("lng", s.lng)
+            .field("distance", s.distance_km)
+            .field("ping", s.ping_ms)
+            .end_object();
+    }
+    json.end_array();
+    return json.take();
+}
+
+bool parse_servers_json(const std::string& json, std::vector<ServerEntry>* servers, std::string* error) {
+    servers->clear();
+    JsonScanner in(json);
+    bool ok = in.consume('[');
+    if (ok && !in.consume(']')) {
+        do {
+            ServerEntry entry;
+            ok = in.consume('{');
+            if (ok && !in.consume('}')) {
+                do {
+                    std::string key;
+                    std::string text;
+                    double n;
+                    ok = in.string(&key) && in.consume(':');
+                    if (!ok) break;
+                    if (key == "name" || key == "location" || key == "country") {
+                        ok = in.string(&text);
+                        (key == "name" ? entry.name : key == "location" ? entry.location : entry.country) = text;
+                    } else if (key == "id" || key == "lat" || key == "lng" || key == "distance" || key == "ping") {
+                        ok = in.number(&n);
+                        if (key == "id") entry.id = static_cast<int>(n);
+                        else if (key == "lat") entry.lat = n;
+                        else if (key == "lng") entry.lng = n;
+                        else if (key == "distance") entry.distance_km = static_cast<int>(n);
+                        else entry.ping_ms = static_cast<int>(n);
+                    } else {
+                        ok = in.skip_value();
+                    }
+                } while (ok && in.consume(','));
+                ok = ok && in.consume('}');
+            }
+            if (ok) servers->push_back(entry);
+        } while (ok && in.consume(','));
+        ok = ok && in.consume(']');
+    }
+    if (!ok || !in.at_end()) {
+        *error = "expected a JSON array of server objects (at byte " + std::to_string(in.position()) + ")";
+        return false;
+    }
+    return true;
+}
+
+} // namespace speedtest
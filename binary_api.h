@@ -0,0 +1,190 @@
+#ifndef BINARY_API_H_
+#define BINARY_API_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "payload.h"
+#include "stats.h"
+#include "tcp_info.h"
+
+namespace speedtest {
+
+// Binary form of /api/info, /api/ping, /api/servers and /api/samples, for
+// clients that poll them often. A request with
+// "Accept: application/x-speedtest-binary" on the usual route gets it back
+// with that Content-Type; anything else still gets JSON.
+//
+// A message is a 24-byte header, a fixed-layout body, fixed-layout records
+// and a string area:
+//
+//   u32 magic "STB1"  u16 version  u16 type
+//   u32 body size  u32 record size  u32 records  u32 string area size
+//
+// Integers are big-endian, as in the datagram header; doubles travel as
+// the u64 of their IEEE 754 bits, so nothing is lost to decimal
+// formatting. A string field is a u32 offset into the string area and a
+// u32 length. Fields are only ever appended: readers take the sizes from
+// the header, and a field past the end of what the sender wrote reads as
+// zero, so either end may be the newer one. The version changes only
+// for layouts older readers can't use.
+constexpr char kBinaryContentType[] = "application/x-speedtest-binary";
+constexpr uint16_t kBinaryVersion = 1;
+constexpr size_t kBinaryHeaderSize = 24;
+
+enum class BinaryType : uint16_t { kInfo = 1, kPing = 2, kServers = 3, kSamples = 4 };
+
+// Field offsets, and the size of the struct as this version writes it
+namespace info_field {
+enum : size_t {
+    kIp = 0, kServer = 8, kLocation = 16, kIsp = 24, kTcpPort = 32, kUdpPort = 36,
+    kPayloadSeed = 40, kPayloadSize = 48, kPlacement = 56, kSize = 64,
+};
+}
+namespace ping_field {
+enum : size_t { kPingMs = 0, kJitterMs = 8, kSize = 16 };
+}
+namespace server_field {
+enum : size_t {
+    kId = 0, kDistanceKm = 4, kPingMs = 8, kLat = 16, kLng = 24, kName = 32, kLocation = 40, kCountry = 48,
+    kSize = 56,
+};
+}
+namespace samples_field {
+// Body; each record is a tcp_sample_field struct
+enum : size_t {
+    kTest = 0, kNext = 8, kIntegrityBytes = 16, kBadBlocks = 24, kVerified = 32, kReceivedBytes = 40,
+    kReceivedSeconds = 48, kReceivedMbps = 56, kRateCount = 64, kRateOutliers = 72, kRateMean = 80,
+    kRateStddev = 88, kRateCiLow = 96, kRateCiHigh = 104, kRateP50 = 112, kRateP90 = 120, kRateP99 = 128,
+    kSize = 136,
+};
+}
+namespace tcp_sample_field {
+enum : size_t {
+    kTime = 0, kStream = 8, kCwnd = 12, kRtt = 16, kRttVar = 24, kMss = 32, kTotalRetrans = 36,
+    kSegsOut = 40, kPacingRate = 48, kDeliveryRate = 56, kBusy = 64, kRwndLimited = 72,
+    kSndbufLimited = 80, kSize = 88,
+};
+}
+
+// One fixed-layout struct of a received message, read in place
+class BinaryFields {
+public:
+    BinaryFields() = default;
+    BinaryFields(const char* data, size_t size, std::string_view strings)
+        : data_(data), size_(size), strings_(strings) {}
+
+    uint32_t u32(size_t offset) const;
+    uint64_t u64(size_t offset) const;
+    double f64(size_t offset) const;
+    // Points into the message; empty if out of range
+    std::string_view str(size_t offset) const;
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    std::string_view strings_;
+};
+
+// A received message, checked once. Nothing is copied: fields are read
+// from the buffer it was parsed from, which must outlive it.
+class BinaryMessage {
+public:
+    // False with *error if it is truncated, not ours or another version
+    bool parse(const char* data, size_t len, std::string* error);
+
+    BinaryType type() const { return type_; }
+    uint16_t version() const { return version_; }
+    BinaryFields body() const { return BinaryFields(data_ + kBinaryHeaderSize, body_size_, strings_); }
+    size_t records() const { return records_; }
+    BinaryFields record(size_t i) const;
+
+private:
+    const char* data_ = nullptr;
+    BinaryType type_ = BinaryType::kInfo;
+    uint16_t version_ = 0;
+    size_t body_size_ = 0;
+    size_t record_size_ = 0;
+    size_t records_ = 0;
+    std::string_view strings_;
+};
+
+// Builds one message: set the body's fields, then begin_record() and set
+// each record's
+class BinaryWriter {
+public:
+    BinaryWriter(BinaryType type, size_t body_size, size_t record_size = 0);
+
+    void begin_record();
+    void put_u32(size_t offset, uint32_t v);
+    void put_u64(size_t offset, uint64_t v);
+    void put_f64(size_t offset, double v);
+    void put_str(size_t offset, std::string_view s);
+    std::string finish();
+
+private:
+    std::string fixed_;    // Header, body and records
+    std::string strings_;
+    size_t current_;       // Where the struct being written starts
+    size_t record_size_;
+    uint32_t records_ = 0;
+};
+
+// What /api/info reports
+struct ApiInfo {
+    std::string ip;
+    std::string server;
+    std::string location;
+    std::string isp;
+    uint32_t tcp_port = 0;
+    uint32_t udp_port = 0;
+    uint64_t payload_seed = 0;
+    uint64_t payload_size = 0;
+    std::string placement;
+};
+
+// One entry of /api/servers
+struct ServerEntry {
+    int id = 0;
+    std::string name;
+    std::string location;
+    std::string country;
+    double lat = 0;
+    double lng = 0;
+    int distance_km = 0;
+    int ping_ms = 0;
+};
+
+// Upload bytes of a test as the server's sink received them, timed as
+// they arrived rather than as the client handed them to its kernel
+struct ReceivedSummary {
+    uint64_t bytes = 0;
+    double seconds = 0;  // First byte to last
+    double mbps = 0;     // Steady-state mean, sampled as RateSampler does
+    SampleSummary rate;  // Of those samples; none for short uploads
+};
+
+std::string encode_info(const ApiInfo& info);
+std::string encode_ping(double ping_ms, double jitter_ms);
+std::string encode_servers(const std::vector<ServerEntry>& servers);
+// `integrity` is set for tests whose uploads the server verifies,
+// `received` for tests that uploaded anything
+std::string encode_samples(const std::string& test, uint64_t next, const std::vector<TcpInfoSample>& samples,
+                           const IntegrityCounts* integrity, const ReceivedSummary* received);
+
+TcpInfoSample read_tcp_sample(const BinaryFields& record);
+// The received summary of a samples body; zero if the server sent none
+ReceivedSummary read_received(const BinaryFields& body);
+
+// The JSON array of /api/servers. Parsing takes the fields above from each
+// object and skips any others; false with *error if it isn't an array of
+// objects.
+std::string servers_to_json(const std::vector<ServerEntry>& servers);
+bool parse_servers_json(const std::string& json, std::vector<ServerEntry>* servers, std::string* error);
+
+} // namespace speedtest
+
+#endif // BINARY_API_H_
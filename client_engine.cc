@@ -0,0 +1,578 @@
+#include "client_engine.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+
+#include "binary_api.h"
+#include "http_routes.h"
+#include "transport.h"
+
+namespace speedtest {
+
+namespace {
+
+// Rate samples needed before a phase may stop early
+const uint64_t kMinRateSamples = 8;
+
+// A ping with no answer by then has failed
+const auto kPingTimeout = std::chrono::seconds(5);
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+double to_mbps(uint64_t bytes, double seconds) {
+    return seconds > 0 ? bytes * 8.0 / seconds / 1e6 : 0;
+}
+
+// Blocking write, encrypted first on TLS connections without kTLS
+bool send_blocking(int fd, TlsStream* tls, const std::string& data) {
+    std::string sealed;
+    const std::string& out = tls && tls->seal(data.data(), data.size(), &sealed) ? sealed : data;
+    size_t sent = 0;
+    while (sent < out.size()) {
+        ssize_t n = ::send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Blocking read of the next bytes to arrive, decrypted; false on EOF or error
+bool recv_blocking(int fd, TlsStream* tls, std::string* plain) {
+    char buffer[16384];
+    for (;;) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) return false;
+        if (!tls) {
+            plain->append(buffer, n);
+            return true;
+        }
+        size_t before = plain->size();
+        bool ok = tls->receive(buffer, n, plain);
+        if (plain->size() > before) return true;
+        if (!ok) return false;
+    }
+}
+
+// Whatever has arrived without waiting, decrypted: 1 if anything did,
+// 0 if nothing yet, -1 on EOF or error
+int recv_available(int fd, TlsStream* tls, std::string* plain) {
+    char buffer[16384];
+    ssize_t n = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if (n <= 0) return -1;
+    if (!tls) {
+        plain->append(buffer, n);
+        return 1;
+    }
+    return tls->receive(buffer, n, plain) ? 1 : -1;
+}
+
+// A whole response with a Content-Length body is in; one whose length
+// can't be read is as complete as it will get
+bool response_complete(const std::string& response) {
+    size_t header_end = response.find("\r\n\r\n");
+    if (header_end == std::string::npos) return false;
+    uint64_t length = 0;
+    std::string_view value;
+    std::string_view head(response.data(), header_end + 2);
+    if (find_header(head, "Content-Length", &value) && !parse_u64(value, &length)) return true;
+    return response.size() - (header_end + 4) >= length;
+}
+
+// The server will close the connection after this response
+bool closes_connection(const std::string& response) {
+    std::string_view value;
+    size_t header_end = response.find("\r\n\r\n");
+    std::string_view head(response.data(), header_end == std::string::npos ? response.size() : header_end + 2);
+    return find_header(head, "Connection", &value) && equals_ignore_case(value, "close");
+}
+
+} // namespace
+
+std::unique_ptr<TlsStream> start_tls(int fd, const std::shared_ptr<TlsContext>& context, const std::string& host) {
+    std::unique_ptr<TlsStream> tls(new TlsStream(context, fd, host));
+    std::string error;
+    if (!tls->handshake_blocking(5000, &error)) return nullptr;
+    // Everything the handshake sent is on the socket by now
+    tls->enable_ktls_tx();
+    return tls;
+}
+
+bool parse_transport(const std::string& name, TransportKind* kind) {
+    if (name == "http") *kind = TransportKind::kHttp;
+    else if (name == "tcp") *kind = TransportKind::kTcp;
+    else if (name == "udp") *kind = TransportKind::kUdp;
+    else return false;
+    return true;
+}
+
+const char* transport_name(TransportKind kind) {
+    switch (kind) {
+        case TransportKind::kTcp: return "tcp";
+        case TransportKind::kUdp: return "udp";
+        default: return "http";
+    }
+}
+
+bool RateSampler::update(double t_s, uint64_t bytes) {
+    double interval = t_s - last_t_s_;
+    if (interval < kIntervalS) return false;
+    if (t_s > kWarmupS) stats_.add(to_mbps(bytes - last_bytes_, interval));
+    last_t_s_ = t_s;
+    last_bytes_ = bytes;
+    return true;
+}
+
+bool resolve_tcp(const std::string& host, int port, sockaddr_storage* addr, socklen_t* len) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0) return false;
+    std::memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+int connect_tcp(const std::string& host, int port, const TuningProfile* tuning,
+                std::vector<std::string>* rejected, const SourceBinding* source) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0) return -1;
+
+    int fd = -1;
+    for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        std::string error;
+        if (source && !apply_binding(fd, *source, &error)) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        if (tuning) {
+            std::vector<std::string> refused = apply_tuning(fd, *tuning);
+            if (rejected) rejected->insert(rejected->end(), refused.begin(), refused.end());
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+namespace {
+
+// One request with no body on its own connection; the body of a 200
+bool http_request(const char* method, const std::string& host, int port, const std::string& path,
+                  std::string* body, const std::shared_ptr<TlsContext>& tls, const SourceBinding* source,
+                  const std::string& accept, const std::string& token) {
+    int fd = connect_tcp(host, port, nullptr, nullptr, source);
+    if (fd < 0) return false;
+    std::unique_ptr<TlsStream> stream;
+    if (tls && !(stream = start_tls(fd, tls, host))) {
+        close(fd);
+        return false;
+    }
+
+    std::string request = std::string(method) + " " + path + " HTTP/1.1\r\nHost: " + host +
+                          "\r\nConnection: close\r\n";
+    if (strcmp(method, "POST") == 0) request += "Content-Length: 0\r\n";
+    if (!accept.empty()) request += "Accept: " + accept + "\r\n";
+    if (!token.empty()) request += "Authorization: Bearer " + token + "\r\n";
+    request += "\r\n";
+    std::string response;
+    if (send_blocking(fd, stream.get(), request)) {
+        while (recv_blocking(fd, stream.get(), &response)) {}
+    }
+    close(fd);
+
+    size_t header_end = response.find("\r\n\r\n");
+    if (response.compare(0, 12, "HTTP/1.1 200") != 0 || header_end == std::string::npos) return false;
+    *body = response.substr(header_end + 4);
+    return true;
+}
+
+} // namespace
+
+bool http_get(const std::string& host, int port, const std::string& path, std::string* body,
+              const std::shared_ptr<TlsContext>& tls, const SourceBinding* source, const std::string& accept,
+              const std::string& token) {
+    return http_request("GET", host, port, path, body, tls, source, accept, token);
+}
+
+bool http_post(const std::string& host, int port, const std::string& path, std::string* body,
+               const std::shared_ptr<TlsContext>& tls, const SourceBinding* source, const std::string& token) {
+    return http_request("POST", host, port, path, body, tls, source, "", token);
+}
+
+ClientEngine::ClientEngine(const EngineConfig& config)
+    : config_(config), backend_(make_io_backend(config.io_backend)) {
+    std::ostringstream id;
+    id << std::hex << std::mt19937_64(std::random_device{}())();
+    test_id_ = id.str();
+}
+
+ClientEngine::~ClientEngine() {
+    if (ping_fd_ >= 0) close(ping_fd_);
+}
+
+std::vector<double> ClientEngine::ping(int count) {
+    std::vector<double> samples;
+    for (int i = 0; i < count; ++i) {
+        if (!start_ping()) continue;
+        double rtt_ms;
+        while (!poll_ping(&rtt_ms)) {
+            pollfd fd{ping_fd_, POLLIN, 0};
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(ping_deadline() - Clock::now());
+            poll(&fd, 1, static_cast<int>(std::max<int64_t>(0, wait.count())));
+        }
+        if (rtt_ms >= 0) samples.push_back(rtt_ms);
+    }
+    return samples;
+}
+
+bool ClientEngine::connect_ping() {
+    ping_fd_ = connect_tcp(config_.host, config_.port, nullptr, nullptr, &config_.source);
+    if (ping_fd_ < 0) return false;
+    int one = 1;
+    setsockopt(ping_fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // The handshake happens here, outside the timed request
+    if (config_.tls && !(ping_tls_ = start_tls(ping_fd_, config_.tls, config_.host))) {
+        close_ping();
+        return false;
+    }
+    return true;
+}
+
+void ClientEngine::close_ping() {
+    if (ping_fd_ >= 0) close(ping_fd_);
+    ping_fd_ = -1;
+    ping_tls_.reset();
+    ping_in_flight_ = false;
+}
+
+bool ClientEngine::send_ping() {
+    // The binary reply is a few fixed-size fields, so the server spends
+    // next to nothing formatting it inside the timed round trip
+    std::string request = "GET /api/ping HTTP/1.1\r\nHost: " + config_.host + "\r\nAccept: " +
+                          kBinaryContentType + "\r\n\r\n";
+    for (;;) {
+        if (ping_fd_ < 0 && !connect_ping()) return false;
+        ping_response_.clear();
+        ping_sent_ = Clock::now();
+        if (send_blocking(ping_fd_, ping_tls_.get(), request)) {
+            ping_in_flight_ = true;
+            return true;
+        }
+        close_ping();
+        if (ping_retried_) return false;
+        ping_retried_ = true;
+    }
+}
+
+// Pings share one kept-alive connection, so they time a request and its
+// response rather than a TCP handshake. When the server has closed it in
+// the meantime, reconnect once and try again.
+bool ClientEngine::start_ping() {
+    cancel_ping();
+    ping_retried_ = false;
+    return send_ping();
+}
+
+bool ClientEngine::poll_ping(double* rtt_ms) {
+    *rtt_ms = -1;
+    if (!ping_in_flight_) return true;
+    for (;;) {
+        int got = recv_available(ping_fd_, ping_tls_.get(), &ping_response_);
+        if (got == 0 && Clock::now() < ping_deadline()) return false;
+        if (got == 0) {
+            // The server took the request and never answered; the
+            // connection may be stuck behind it, so it goes too
+            close_ping();
+            return true;
+        }
+        if (got > 0 && !response_complete(ping_response_)) continue;
+        double rtt = seconds_since(ping_sent_) * 1000.0;
+        bool ok = got > 0 && ping_response_.compare(0, 12, "HTTP/1.1 200") == 0;
+        ping_in_flight_ = false;
+        if (!ok || closes_connection(ping_response_)) close_ping();
+        if (ok) {
+            *rtt_ms = rtt;
+            if (config_.recorder) config_.recorder->ping(rtt);
+            return true;
+        }
+        if (ping_retried_) return true;
+        ping_retried_ = true;
+        return !send_ping();
+    }
+}
+
+Clock::time_point ClientEngine::ping_deadline() const {
+    return ping_sent_ + kPingTimeout;
+}
+
+void ClientEngine::cancel_ping() {
+    if (ping_in_flight_) close_ping();
+}
+
+namespace {
+
+// How long a phase waits for I/O before checking its clock
+const int kStepMs = 50;
+
+// The phase loop every transport shares: timing, early stopping, rate
+// samples, TCP_INFO, progress and recording
+template <typename Transport>
+class PhaseDriver : public PhaseRun {
+public:
+    template <typename... Args>
+    PhaseDriver(const EngineConfig& config, bool download, const ProgressCallback& progress, Args&&... args);
+
+    bool step(int timeout_ms) override;
+    void poll_fds(std::vector<pollfd>* fds, Clock::time_point* wake) override;
+    PhaseResult finish() override;
+
+private:
+    const EngineConfig& config_;
+    bool download_;
+    ProgressCallback progress_;
+    Transport transport_;
+    TraceRecorder* recorder_;
+    PhaseResult result_;
+    // The clock starts when the server lets the first stream go, so time
+    // spent queued for a session slot doesn't count
+    bool started_ = false;
+    Clock::time_point start_;
+    Clock::time_point last_report_;
+    Clock::time_point last_sample_;
+    uint64_t last_bytes_ = 0;
+    RateSampler rate_;
+    std::vector<uint64_t> recorded_;  // Bytes already passed to the recorder
+};
+
+template <typename Transport>
+template <typename... Args>
+PhaseDriver<Transport>::PhaseDriver(const EngineConfig& config, bool download, const ProgressCallback& progress,
+                                    Args&&... args)
+    : config_(config), download_(download), progress_(progress), transport_(std::forward<Args>(args)...),
+      recorder_(config.recorder) {
+    if (recorder_) recorder_->phase_begin(download, config.streams);
+    transport_.open(&result_);
+    start_ = last_report_ = last_sample_ = Clock::now();
+    recorded_.resize(transport_.streams());
+}
+
+template <typename Transport>
+bool PhaseDriver<Transport>::step(int timeout_ms) {
+    if (cancelled_) {
+        if (result_.error.empty()) result_.error = "cancelled";
+        return false;
+    }
+    if (transport_.open_streams() == 0 ||
+        seconds_since(start_) >= (started_ ? config_.duration_s : transport_.give_up_s())) {
+        return false;
+    }
+    if (config_.precision > 0 && seconds_since(start_) >= config_.min_duration_s &&
+        rate_.stats().precise_enough(config_.precision, kMinRateSamples)) {
+        return false;
+    }
+    transport_.pump(timeout_ms);
+    if (!started_ && transport_.started()) {
+        started_ = true;
+        start_ = last_report_ = last_sample_ = Clock::now();
+    }
+
+    auto now = Clock::now();
+    double t = std::chrono::duration<double>(now - start_).count();
+    // One recorded event per stream that moved data this round, all at
+    // the time the sampler sees, so a replay samples identically
+    bool moved = false;
+    result_.bytes = 0;
+    for (size_t i = 0; i < transport_.streams(); ++i) {
+        uint64_t bytes = transport_.stream_bytes(i);
+        result_.bytes += bytes;
+        if (recorder_ && started_ && bytes != recorded_[i]) {
+            recorder_->bytes(t, static_cast<int>(i), bytes - recorded_[i]);
+            recorded_[i] = bytes;
+            moved = true;
+        }
+    }
+
+    if (std::chrono::duration<double>(now - last_sample_).count() >= config_.tcp_info_interval_s) {
+        last_sample_ = now;
+        for (size_t i = 0; i < transport_.streams(); ++i) {
+            TcpInfoSample sample;
+            int fd = transport_.stream_fd(i);
+            if (fd < 0 || !read_tcp_info(fd, &sample)) continue;
+            sample.t_s = seconds_since(start_);
+            sample.stream = static_cast<int>(i);
+            result_.local_tcp.push_back(sample);
+            if (recorder_) recorder_->tcp_info(false, sample);
+        }
+    }
+
+    // A stalled round that still closes an interval is recorded too,
+    // or the replay's intervals would drift from ours
+    if (started_ && rate_.update(t, result_.bytes) && recorder_ && !moved) recorder_->bytes(t, 0, 0);
+
+    double interval = std::chrono::duration<double>(now - last_report_).count();
+    if (progress_ && interval >= 0.1) {
+        double mbps = to_mbps(result_.bytes - last_bytes_, interval);
+        progress_(std::min(1.0, seconds_since(start_) / config_.duration_s), mbps);
+        last_report_ = now;
+        last_bytes_ = result_.bytes;
+    }
+    return true;
+}
+
+template <typename Transport>
+void PhaseDriver<Transport>::poll_fds(std::vector<pollfd>* fds, Clock::time_point* wake) {
+    transport_.poll_fds(fds, wake);
+    *wake = std::min(*wake, Clock::now() + std::chrono::milliseconds(kStepMs));
+}
+
+template <typename Transport>
+PhaseResult PhaseDriver<Transport>::finish() {
+    result_.seconds = started_ ? seconds_since(start_) : 0;
+    result_.rate = rate_.stats().summarize();
+    // Steady-state rate when there is one; short phases fall back to the average
+    result_.mbps = result_.rate.count > 0 ? result_.rate.mean : to_mbps(result_.bytes, result_.seconds);
+
+    transport_.close();
+    transport_.finish(&result_);
+    if (recorder_) {
+        if (result_.sent_mbps > 0) recorder_->received(result_.seconds, result_.mbps);
+        recorder_->phase_end(result_.seconds, result_.retry_after_s);
+        for (const TcpInfoSample& sample : result_.remote_tcp) recorder_->tcp_info(true, sample);
+    }
+    result_.sender_tcp = summarize_tcp_info(download_ ? result_.remote_tcp : result_.local_tcp);
+    return std::move(result_);
+}
+
+// A phase that couldn't start
+class FailedPhase : public PhaseRun {
+public:
+    explicit FailedPhase(const std::string& error) { result_.error = error; }
+
+    bool step(int) override { return false; }
+    void poll_fds(std::vector<pollfd>*, Clock::time_point* wake) override { *wake = Clock::now(); }
+    PhaseResult finish() override { return result_; }
+
+private:
+    PhaseResult result_;
+};
+
+PhaseResult run_to_end(PhaseRun* run) {
+    while (run->step(kStepMs)) {}
+    return run->finish();
+}
+
+} // namespace
+
+PhaseResult ClientEngine::download(const ProgressCallback& progress) {
+    return run_to_end(start_phase(true, progress).get());
+}
+
+PhaseResult ClientEngine::upload(const ProgressCallback& progress) {
+    return run_to_end(start_phase(false, progress).get());
+}
+
+std::unique_ptr<PhaseRun> ClientEngine::start_phase(bool download, const ProgressCallback& progress) {
+    PhaseSetup setup;
+    setup.config = &config_;
+    setup.backend = backend_.get();
+    setup.payload = &payload();
+    setup.verify = payload_shared_;
+    setup.download = download;
+    setup.test = test_id_ + "-" + std::to_string(++phases_) + (download ? "d" : "u");
+    setup.session = test_id_;
+
+    switch (config_.transport) {
+        case TransportKind::kTcp: {
+            fetch_server_info();
+            int port = raw_tcp_port_;
+            if (port <= 0) return std::unique_ptr<PhaseRun>(new FailedPhase("server has no raw TCP port (--tcp-port)"));
+            return std::unique_ptr<PhaseRun>(
+                new PhaseDriver<RawTcpTransport>(config_, download, progress, setup, port));
+        }
+        case TransportKind::kUdp:
+            return std::unique_ptr<PhaseRun>(new PhaseDriver<UdpTransport>(config_, download, progress, setup));
+        default:
+            return std::unique_ptr<PhaseRun>(
+                new PhaseDriver<HttpTransport>(config_, download, progress, setup, config_.port));
+    }
+}
+
+void ClientEngine::fetch_server_info() {
+    if (info_fetched_) return;
+    info_fetched_ = true;
+    std::string json;
+    if (!http_get(config_.host, config_.port, "/api/info", &json, config_.tls, &config_.source, kBinaryContentType)) {
+        return;
+    }
+    BinaryMessage message;
+    std::string error;
+    if (message.parse(json.data(), json.size(), &error) && message.type() == BinaryType::kInfo) {
+        BinaryFields info = message.body();
+        raw_tcp_port_ = static_cast<int>(info.u32(info_field::kTcpPort));
+        server_payload_seed_ = info.u64(info_field::kPayloadSeed);
+        server_payload_size_ = info.u64(info_field::kPayloadSize);
+        server_placement_ = std::string(info.str(info_field::kPlacement));
+        return;
+    }
+    // Servers from before the binary API answer in JSON
+    size_t pos = json.find("\"tcp_port\":");
+    if (pos != std::string::npos) raw_tcp_port_ = std::max(0, atoi(json.c_str() + pos + 11));
+    pos = json.find("\"payload_seed\":\"");
+    if (pos != std::string::npos) server_payload_seed_ = std::strtoull(json.c_str() + pos + 16, nullptr, 16);
+    pos = json.find("\"payload_size\":");
+    if (pos != std::string::npos) server_payload_size_ = std::strtoull(json.c_str() + pos + 15, nullptr, 10);
+    pos = json.find("\"placement\":\"");
+    if (pos != std::string::npos) {
+        pos += 13;
+        server_placement_ = json.substr(pos, json.find('"', pos) - pos);
+    }
+}
+
+const std::string& ClientEngine::server_placement() {
+    fetch_server_info();
+    return server_placement_;
+}
+
+const PayloadPool& ClientEngine::payload() {
+    if (payload_) return *payload_;
+    if (config_.verify_payload) fetch_server_info();
+    payload_shared_ = config_.verify_payload && server_payload_size_ > 0;
+    if (payload_shared_) {
+        payload_.reset(new PayloadPool(server_payload_seed_, server_payload_size_, config_.numa_node));
+    } else {
+        uint64_t seed = std::random_device{}() | uint64_t(std::random_device{}()) << 32;
+        payload_.reset(new PayloadPool(seed, PayloadPool::kDefaultSize, config_.numa_node));
+    }
+    backend_->register_send_buffer(payload_->data(), payload_->size());
+    payload_->seal();
+    return *payload_;
+}
+
+} // namespace speedtest
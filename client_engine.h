@@ -0,0 +1,214 @@
+#ifndef CLIENT_ENGINE_H_
+#define CLIENT_ENGINE_H_
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+
+#include "binary_api.h"
+#include "interfaces.h"
+#include "io_backend.h"
+#include "payload.h"
+#include "socket_tuning.h"
+#include "stats.h"
+#include "tcp_info.h"
+#include "test_trace.h"
+#include "tls.h"
+#include "udp_flow.h"
+
+namespace speedtest {
+
+// How phases move their bytes: HTTP /stream requests, raw TCP streams on
+// the server's --tcp-port, or paced UDP datagrams on its --udp-port
+enum class TransportKind { kHttp, kTcp, kUdp };
+
+bool parse_transport(const std::string& name, TransportKind* kind);
+const char* transport_name(TransportKind kind);
+
+// Where and how to run live tests against a speed_test_gui server
+struct EngineConfig {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    int streams = 4;
+    double duration_s = 10.0;          // Upper bound per phase
+    double min_duration_s = 3.0;       // Lower bound before stopping early
+    double precision = 0.02;           // Stop once the rate's 95% CI is within +/- this; 0 = never
+    IoBackendKind io_backend = IoBackendKind::kAuto;
+    double tcp_info_interval_s = 0.1;  // TCP_INFO sampling period per stream
+    TuningProfile tuning;              // Applied to both ends of every stream
+    TraceRecorder* recorder = nullptr; // Records pings, bytes and TCP_INFO when set
+    std::shared_ptr<TlsContext> tls;   // Speak HTTPS (the server's --tls-port) when set
+    TransportKind transport = TransportKind::kHttp;
+    uint64_t udp_rate_bps = 100000000; // UDP: target rate, split across streams
+    size_t udp_datagram_size = 1200;   // UDP: bytes per datagram
+    bool verify_payload = false;       // CRC32C-check TCP payload against the server's pool, both ways
+    SourceBinding source;              // Interface and/or address every socket leaves from
+    std::string placement;             // Where the calling thread is pinned, for the result
+    int numa_node = -1;                // Allocate the payload here; -1 = first touch
+};
+
+// Outcome of one download or upload phase
+struct PhaseResult {
+    uint64_t bytes = 0;
+    double seconds = 0;
+    double mbps = 0;                        // Steady-state mean of rate; uploads, what the server received
+    double sent_mbps = 0;                   // Uploads: our own rate, when mbps is the server's
+    SampleSummary rate;                     // Mbps per interval after warmup, behind mbps
+    SampleSummary sent_rate;                // The same behind sent_mbps
+    std::vector<TcpInfoSample> local_tcp;   // Our end of each stream
+    std::vector<TcpInfoSample> remote_tcp;  // The server's end, from /api/samples
+    TcpInfoSummary sender_tcp;              // Summary of whichever end was sending
+    std::vector<std::string> tuning_rejected;  // Options our kernel refused
+    int retry_after_s = 0;                  // Server was full; try again after this
+    DatagramSummary datagrams;              // UDP: loss and reordering
+    IntegrityCounts integrity;              // verify_payload: checked by the receiving end
+    ReceivedSummary received;               // TCP uploads: timed by the server as they arrived
+    std::string error;                      // Why the phase couldn't run
+};
+
+// Turns a phase's running byte count into per-interval rates once slow
+// start is over. Live phases and replayed recordings share it, so a replay
+// reproduces the original samples.
+class RateSampler {
+public:
+    static constexpr double kWarmupS = 1.0;
+    static constexpr double kIntervalS = 0.25;
+
+    // t_s on the phase clock; true when this call closed an interval
+    bool update(double t_s, uint64_t bytes);
+
+    const SampleStats& stats() const { return stats_; }
+
+private:
+    double last_t_s_ = 0;
+    uint64_t last_bytes_ = 0;
+    SampleStats stats_;
+};
+
+// Called periodically with phase progress (0..1) and the current rate
+using ProgressCallback = std::function<void(double progress, double mbps)>;
+
+// Resolve host:port to the first TCP address; false if lookup fails
+bool resolve_tcp(const std::string& host, int port, sockaddr_storage* addr, socklen_t* len);
+
+// Blocking TCP connect; returns the socket or -1. Tuning is applied before
+// connecting and refused options are appended to *rejected. A source
+// binding skips addresses it can't reach.
+int connect_tcp(const std::string& host, int port, const TuningProfile* tuning = nullptr,
+                std::vector<std::string>* rejected = nullptr, const SourceBinding* source = nullptr);
+
+// TLS handshake on a freshly connected blocking socket, then kTLS
+// transmit if it is on; nullptr if the handshake fails
+std::unique_ptr<TlsStream> start_tls(int fd, const std::shared_ptr<TlsContext>& context, const std::string& host);
+
+// Blocking one-shot GET, over TLS when `tls` is set; fills the response
+// body on a 200. `accept` asks for a content type, e.g. kBinaryContentType;
+// `token`, if any, goes as Authorization: Bearer.
+bool http_get(const std::string& host, int port, const std::string& path, std::string* body,
+              const std::shared_ptr<TlsContext>& tls = nullptr, const SourceBinding* source = nullptr,
+              const std::string& accept = "", const std::string& token = "");
+// The same for a POST without a body, e.g. a result in the query string
+bool http_post(const std::string& host, int port, const std::string& path, std::string* body,
+               const std::shared_ptr<TlsContext>& tls = nullptr, const SourceBinding* source = nullptr,
+               const std::string& token = "");
+
+// A download or upload phase driven a round at a time by the caller's
+// own loop, rather than start to finish by ClientEngine::download(). The
+// engine that started it must outlive it.
+class PhaseRun {
+public:
+    virtual ~PhaseRun() = default;
+
+    // One round of the phase: wait up to timeout_ms for I/O, handle it,
+    // sample and report progress. False once the phase is over.
+    virtual bool step(int timeout_ms) = 0;
+    // What step(0) is waiting for: sockets to poll readable, and a time
+    // to step by regardless (only ever moved earlier)
+    virtual void poll_fds(std::vector<pollfd>* fds, std::chrono::steady_clock::time_point* wake) = 0;
+    // Ends the phase at the next step; the result keeps what was measured
+    // and says "cancelled"
+    void cancel() { cancelled_ = true; }
+    // Once step() has returned false: hang up and gather the result
+    virtual PhaseResult finish() = 0;
+
+protected:
+    bool cancelled_ = false;
+};
+
+// Drives parallel streams against a speed_test_gui server, over the
+// configured transport
+class ClientEngine {
+public:
+    explicit ClientEngine(const EngineConfig& config);
+    ~ClientEngine();
+
+    const EngineConfig& config() const { return config_; }
+    IoBackendKind backend_kind() const { return backend_->kind(); }
+    void set_tuning(const TuningProfile& tuning) { config_.tuning = tuning; }
+    void set_transport(TransportKind transport) { config_.transport = transport; }
+
+    // Round-trip times of `count` requests to /api/ping over one kept-alive
+    // connection, in ms
+    std::vector<double> ping(int count);
+
+    // One ping without waiting for the answer. start_ping() connects if
+    // need be and sends the request (false if it can't); poll_ping() reads
+    // what has arrived and returns true once the round trip is over, with
+    // *rtt_ms set, or negative if it failed. Meanwhile ping_fd() polls
+    // readable when there is something to read. A ping the server hung up
+    // on is retried once on a new connection, as ping() does; one still
+    // unanswered at ping_deadline() fails, and its connection is closed.
+    bool start_ping();
+    bool poll_ping(double* rtt_ms);
+    int ping_fd() const { return ping_fd_; }
+    std::chrono::steady_clock::time_point ping_deadline() const;
+    // Abandons a ping in flight, and its connection with it
+    void cancel_ping();
+
+    PhaseResult download(const ProgressCallback& progress);
+    PhaseResult upload(const ProgressCallback& progress);
+    // The same phases, for a loop that runs several things at once.
+    // Connecting the streams and fetching the server's samples afterwards
+    // still block for a round trip or two.
+    std::unique_ptr<PhaseRun> start_phase(bool download, const ProgressCallback& progress);
+
+    // Where the server's threads run, as its /api/info says; empty if unpinned
+    const std::string& server_placement();
+
+private:
+    bool connect_ping();
+    bool send_ping();
+    void close_ping();
+    // What the phases need from /api/info, fetched once
+    void fetch_server_info();
+    // Built on first use: from the server's seed with verify_payload, so
+    // both ends hold the same bytes, else from a random one
+    const PayloadPool& payload();
+
+    EngineConfig config_;
+    std::unique_ptr<IoBackend> backend_;
+    std::unique_ptr<PayloadPool> payload_;
+    bool payload_shared_ = false;  // payload_ is the server's
+    std::string test_id_;  // Tags our streams so the server can report on them
+    int phases_ = 0;
+    int ping_fd_ = -1;     // Kept-alive connection for pings
+    std::unique_ptr<TlsStream> ping_tls_;
+    bool ping_in_flight_ = false;
+    bool ping_retried_ = false;   // This ping is on its second connection
+    std::chrono::steady_clock::time_point ping_sent_;
+    std::string ping_response_;
+    bool info_fetched_ = false;
+    int raw_tcp_port_ = 0;           // 0 if the server has none
+    uint64_t server_payload_seed_ = 0;
+    size_t server_payload_size_ = 0; // 0 if the server doesn't share its pool
+    std::string server_placement_;
+};
+
+} // namespace speedtest
+
+#endif // CLIENT_ENGINE_H_
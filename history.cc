@@ -0,0 +1,1051 @@
+#include "history.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <unistd.h>
+
+#include "json_writer.h"
+#include "stats.h"
+
+namespace speedtest {
+
+namespace {
+
+const char kMagic[8] = {'S', 'P', 'D', 'H', 'I', 'S', '1', '\n'};
+const char kJournalMagic[8] = {'S', 'P', 'D', 'H', 'E', 'A', 'D', '\n'};
+// A journaled point: t_ms and the four values, in host byte order since
+// the journal never leaves the machine that wrote it
+const size_t kRecordBytes = 40;
+const int kColumns = 1 + kHistoryFields;
+const auto kFoldInterval = std::chrono::seconds(1);
+const int64_t kMinuteMs = 60 * 1000;
+
+// What /api/history hands out at once
+const size_t kDefaultPoints = 100;
+const size_t kMaxPoints = 10000;
+const int64_t kMaxBuckets = 10000;
+const size_t kMaxQuantiles = 16;
+
+// Delta-of-delta timestamp buckets after a '0' for "same interval as
+// before": a control prefix, then the difference in that many bits.
+// Gorilla's are sized for second-resolution samples at a fixed period;
+// results land at irregular millisecond times, so these are wider.
+struct TimeBucket {
+    uint64_t prefix;
+    int prefix_bits;
+    int value_bits;
+};
+const TimeBucket kTimeBuckets[] = {{0b10, 2, 14}, {0b110, 3, 20}, {0b1110, 4, 32}, {0b1111, 4, 64}};
+
+int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+int64_t floor_to(int64_t t, int64_t step) {
+    int64_t q = t / step;
+    if (t % step != 0 && t < 0) --q;
+    return q * step;
+}
+
+int64_t ceil_to(int64_t t, int64_t step) {
+    int64_t floor = floor_to(t, step);
+    return floor == t ? t : floor + step;
+}
+
+double field_value(const HistoryPoint& point, int field) {
+    switch (field) {
+    case 0: return point.download_mbps;
+    case 1: return point.upload_mbps;
+    case 2: return point.ping_ms;
+    default: return point.jitter_ms;
+    }
+}
+
+void set_field_value(HistoryPoint* point, int field, double v) {
+    switch (field) {
+    case 0: point->download_mbps = v; break;
+    case 1: point->upload_mbps = v; break;
+    case 2: point->ping_ms = v; break;
+    default: point->jitter_ms = v; break;
+    }
+}
+
+uint64_t double_bits(double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+double bits_double(uint64_t bits) {
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+// Appends the low `n` bits of a value, most significant first
+class BitWriter {
+public:
+    explicit BitWriter(std::string* out) : out_(out) {}
+
+    void write(uint64_t bits, int n) {
+        while (n > 0) {
+            if (used_ == 8) {
+                out_->push_back(0);
+                used_ = 0;
+            }
+            int take = std::min(8 - used_, n);
+            uint64_t part = (bits >> (n - take)) & ((1u << take) - 1);
+            out_->back() = static_cast<char>(static_cast<uint8_t>(out_->back()) | (part << (8 - used_ - take)));
+            used_ += take;
+            n -= take;
+        }
+    }
+
+private:
+    std::string* out_;
+    int used_ = 8;  // Bits used in the last byte
+};
+
+class BitReader {
+public:
+    BitReader(const char* data, size_t size) : data_(reinterpret_cast<const uint8_t*>(data)), bits_(size * 8) {}
+
+    bool read(int n, uint64_t* v) {
+        if (static_cast<size_t>(n) > bits_ - pos_) return false;
+        uint64_t out = 0;
+        while (n > 0) {
+            int offset = static_cast<int>(pos_ % 8);
+            int take = std::min(8 - offset, n);
+            out = (out << take) | ((data_[pos_ / 8] >> (8 - offset - take)) & ((1u << take) - 1));
+            pos_ += take;
+            n -= take;
+        }
+        *v = out;
+        return true;
+    }
+
+    bool read_signed(int n, int64_t* v) {
+        uint64_t u;
+        if (!read(n, &u)) return false;
+        *v = n == 64 ? static_cast<int64_t>(u) : static_cast<int64_t>(u << (64 - n)) >> (64 - n);
+        return true;
+    }
+
+private:
+    const uint8_t* data_;
+    size_t bits_;
+    size_t pos_ = 0;
+};
+
+void put_times(const HistoryPoint* points, size_t n, std::string* out) {
+    BitWriter bits(out);
+    bits.write(static_cast<uint64_t>(points[0].t_ms), 64);
+    int64_t last_delta = 0;
+    for (size_t i = 1; i < n; ++i) {
+        int64_t delta = points[i].t_ms - points[i - 1].t_ms;
+        int64_t dod = delta - last_delta;
+        last_delta = delta;
+        if (dod == 0) {
+            bits.write(0, 1);
+            continue;
+        }
+        for (const TimeBucket& bucket : kTimeBuckets) {
+            int64_t limit = bucket.value_bits == 64 ? 0 : int64_t(1) << (bucket.value_bits - 1);
+            if (bucket.value_bits == 64 || (dod >= -limit && dod < limit)) {
+                bits.write(bucket.prefix, bucket.prefix_bits);
+                bits.write(static_cast<uint64_t>(dod), bucket.value_bits);
+                break;
+            }
+        }
+    }
+}
+
+bool get_times(const char* data, size_t size, size_t n, std::vector<int64_t>* times) {
+    BitReader bits(data, size);
+    times->clear();
+    uint64_t first;
+    if (!bits.read(64, &first)) return false;
+    times->push_back(static_cast<int64_t>(first));
+    int64_t delta = 0;
+    while (times->size() < n) {
+        uint64_t bit;
+        if (!bits.read(1, &bit)) return false;
+        int64_t dod = 0;
+        if (bit) {
+            int ones = 1;
+            while (ones < 4) {
+                if (!bits.read(1, &bit)) return false;
+                if (!bit) break;
+                ++ones;
+            }
+            if (!bits.read_signed(kTimeBuckets[ones - 1].value_bits, &dod)) return false;
+        }
+        delta += dod;
+        times->push_back(times->back() + delta);
+    }
+    return true;
+}
+
+// XOR with the previous value: '0' when equal, else '1' and either '0'
+// plus the bits inside the previous window of leading and trailing zeros,
+// or '1', a new window (5 bits of leading zeros, 6 of length) and the
+// bits inside it
+void put_values(const HistoryPoint* points, size_t n, int field, std::string* out) {
+    BitWriter bits(out);
+    uint64_t last = double_bits(field_value(points[0], field));
+    bits.write(last, 64);
+    int lead = -1;
+    int trail = 0;
+    for (size_t i = 1; i < n; ++i) {
+        uint64_t v = double_bits(field_value(points[i], field));
+        uint64_t x = v ^ last;
+        last = v;
+        if (x == 0) {
+            bits.write(0, 1);
+            continue;
+        }
+        int l = std::min(__builtin_clzll(x), 31);
+        int t = __builtin_ctzll(x);
+        if (lead >= 0 && l >= lead && t >= trail) {
+            bits.write(0b10, 2);
+            bits.write(x >> trail, 64 - lead - trail);
+        } else {
+            lead = l;
+            trail = t;
+            int meaningful = 64 - l - t;
+            bits.write(0b11, 2);
+            bits.write(l, 5);
+            bits.write(meaningful - 1, 6);
+            bits.write(x >> t, meaningful);
+        }
+    }
+}
+
+bool get_values(const char* data, size_t size, size_t n, std::vector<double>* values) {
+    BitReader bits(data, size);
+    values->clear();
+    uint64_t last;
+    if (!bits.read(64, &last)) return false;
+    values->push_back(bits_double(last));
+    uint64_t lead = 0, meaningful = 0;
+    while (values->size() < n) {
+        uint64_t bit, x = 0;
+        if (!bits.read(1, &bit)) return false;
+        if (bit) {
+            if (!bits.read(1, &bit)) return false;
+            if (bit) {
+                if (!bits.read(5, &lead) || !bits.read(6, &meaningful)) return false;
+                ++meaningful;
+            } else if (meaningful == 0) {
+                return false;
+            }
+            if (!bits.read(static_cast<int>(meaningful), &x)) return false;
+            x <<= 64 - lead - meaningful;
+        }
+        last ^= x;
+        values->push_back(bits_double(last));
+    }
+    return true;
+}
+
+void put_varint(std::string* out, uint64_t v) {
+    while (v >= 0x80) {
+        out->push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    out->push_back(static_cast<char>(v));
+}
+
+void put_signed(std::string* out, int64_t v) {
+    put_varint(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+}
+
+void put_record(std::string* out, const HistoryPoint& point) {
+    char record[kRecordBytes];
+    memcpy(record, &point.t_ms, 8);
+    for (int field = 0; field < kHistoryFields; ++field) {
+        double v = field_value(point, field);
+        memcpy(record + 8 + field * 8, &v, 8);
+    }
+    out->append(record, sizeof(record));
+}
+
+HistoryPoint get_record(const char* record) {
+    HistoryPoint point;
+    memcpy(&point.t_ms, record, 8);
+    for (int field = 0; field < kHistoryFields; ++field) {
+        double v;
+        memcpy(&v, record + 8 + field * 8, 8);
+        set_field_value(&point, field, v);
+    }
+    return point;
+}
+
+// Bounds-checked reads; every getter fails once the data runs out
+class Reader {
+public:
+    Reader(const std::string& data, size_t pos) : data_(data), pos_(pos) {}
+
+    bool done() const { return pos_ >= data_.size(); }
+    size_t pos() const { return pos_; }
+
+    bool varint(uint64_t* v) {
+        *v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (pos_ >= data_.size()) return false;
+            uint8_t b = static_cast<uint8_t>(data_[pos_++]);
+            *v |= static_cast<uint64_t>(b & 0x7f) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+
+    bool signed_varint(int64_t* v) {
+        uint64_t u;
+        if (!varint(&u)) return false;
+        *v = static_cast<int64_t>(u >> 1) ^ -static_cast<int64_t>(u & 1);
+        return true;
+    }
+
+    bool bytes(uint64_t n, std::string* out) {
+        if (n > data_.size() - pos_) return false;
+        out->assign(data_, pos_, n);
+        pos_ += n;
+        return true;
+    }
+
+private:
+    const std::string& data_;
+    size_t pos_;
+};
+
+// False if the file can't be read, e.g. because it doesn't exist yet
+bool read_file(const std::string& path, std::string* data) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) data->append(buffer, n);
+    fclose(file);
+    return true;
+}
+
+// Start and length of each column of a chunk
+bool find_columns(const std::string& data, size_t offsets[kColumns], size_t sizes[kColumns]) {
+    Reader in(data, 0);
+    for (int column = 0; column < kColumns; ++column) {
+        uint64_t size;
+        if (!in.varint(&size) || size > data.size() - in.pos()) return false;
+        offsets[column] = in.pos();
+        sizes[column] = size;
+        std::string skip;
+        in.bytes(size, &skip);
+    }
+    return true;
+}
+
+std::vector<std::string> split(const std::string& text, char separator) {
+    std::vector<std::string> parts;
+    std::istringstream in(text);
+    std::string part;
+    while (std::getline(in, part, separator)) {
+        if (!part.empty()) parts.push_back(part);
+    }
+    return parts;
+}
+
+bool parse_int(const std::string& text, int64_t* v) {
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), *v);
+    return ec == std::errc() && end == text.data() + text.size();
+}
+
+bool parse_number(const std::string& text, double* v) {
+    char* end;
+    *v = std::strtod(text.c_str(), &end);
+    return !text.empty() && *end == '\0' && std::isfinite(*v);
+}
+
+std::string number_text(double v) {
+    char text[32];
+    return std::string(text, std::to_chars(text, text + sizeof(text), v).ptr);
+}
+
+// "p50", "p99.9"
+std::string quantile_key(double q) {
+    return "p" + number_text(std::llround(q * 1e4) / 100.0);
+}
+
+void write_summary(const HistorySummary& summary, const std::vector<double>& quantiles, JsonWriter* json) {
+    json->field("count", summary.count)
+        .field("mean", summary.mean)
+        .field("min", summary.min)
+        .field("max", summary.max);
+    for (size_t i = 0; i < quantiles.size(); ++i) json->field(quantile_key(quantiles[i]), summary.quantiles[i]);
+}
+
+} // namespace
+
+const char* history_field_name(HistoryField field) {
+    switch (field) {
+    case HistoryField::kDownload: return "download_mbps";
+    case HistoryField::kUpload: return "upload_mbps";
+    case HistoryField::kPing: return "ping_ms";
+    case HistoryField::kJitter: return "jitter_ms";
+    }
+    return "";
+}
+
+bool parse_history_field(const std::string& text, HistoryField* field) {
+    for (int i = 0; i < kHistoryFields; ++i) {
+        std::string name = history_field_name(static_cast<HistoryField>(i));
+        if (text == name || text == name.substr(0, name.find('_'))) {
+            *field = static_cast<HistoryField>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+int64_t history_step_ms(HistoryStep step) {
+    switch (step) {
+    case HistoryStep::kMinute: return kMinuteMs;
+    case HistoryStep::kHour: return 60 * kMinuteMs;
+    case HistoryStep::kDay: return 24 * 60 * kMinuteMs;
+    }
+    return kMinuteMs;
+}
+
+bool parse_history_step(const std::string& text, HistoryStep* step) {
+    if (text == "1m") *step = HistoryStep::kMinute;
+    else if (text == "1h") *step = HistoryStep::kHour;
+    else if (text == "1d") *step = HistoryStep::kDay;
+    else return false;
+    return true;
+}
+
+// Moments and quantiles over rollups and raw points alike
+class HistoryStore::Accumulator {
+public:
+    void add(double v) {
+        note(v, v);
+        ++count_;
+        sum_ += v;
+        sketch_.add(v);
+    }
+
+    void add(const FieldRollup& rollup) {
+        if (rollup.count == 0) return;
+        note(rollup.min, rollup.max);
+        count_ += rollup.count;
+        sum_ += rollup.sum;
+        for (const auto& bucket : rollup.sketch) sketch_.add_bucket(bucket.first, bucket.second);
+    }
+
+    uint64_t count() const { return count_; }
+
+    HistorySummary summary(int64_t start_ms, const std::vector<double>& quantiles) const {
+        HistorySummary s;
+        s.start_ms = start_ms;
+        s.count = count_;
+        if (count_) {
+            s.mean = sum_ / count_;
+            s.min = min_;
+            s.max = max_;
+        }
+        // A bucket's midpoint can fall outside what was actually seen
+        for (double q : quantiles) s.quantiles.push_back(count_ ? std::clamp(sketch_.quantile(q), min_, max_) : 0);
+        return s;
+    }
+
+private:
+    void note(double low, double high) {
+        min_ = count_ ? std::min(min_, low) : low;
+        max_ = count_ ? std::max(max_, high) : high;
+    }
+
+    uint64_t count_ = 0;
+    double sum_ = 0;
+    double min_ = 0;
+    double max_ = 0;
+    QuantileSketch sketch_;
+};
+
+HistoryStore::HistoryStore() = default;
+
+HistoryStore::~HistoryStore() {
+    stop();
+    if (chunks_file_) fclose(chunks_file_);
+    if (journal_) fclose(journal_);
+}
+
+bool HistoryStore::open(const std::string& path, std::string* error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    path_ = path;
+
+    std::string data;
+    bool exists = read_file(path, &data) && !data.empty();
+    if (exists) {
+        if (data.size() < sizeof(kMagic) || data.compare(0, sizeof(kMagic), kMagic, sizeof(kMagic)) != 0) {
+            if (error) *error = path + ": not a speed test history";
+            return false;
+        }
+        // chunk count, first timestamp, span, data size, data
+        Reader in(data, sizeof(kMagic));
+        size_t good = in.pos();
+        while (!in.done()) {
+            Chunk chunk;
+            uint64_t count, span, size;
+            int64_t first;
+            if (!in.varint(&count) || !in.signed_varint(&first) || !in.varint(&span) || !in.varint(&size) ||
+                !in.bytes(size, &chunk.data)) {
+                break;
+            }
+            chunk.count = static_cast<uint32_t>(count);
+            chunk.first_ms = first;
+            chunk.last_ms = first + static_cast<int64_t>(span);
+            sealed_points_ += chunk.count;
+            sealed_bytes_ += chunk.data.size();
+            chunks_.push_back(std::move(chunk));
+            good = in.pos();
+        }
+        // A chunk cut short by a crash is dropped, and so is its tail in
+        // the file so the next one lands after the last good one; its
+        // points are still in the journal
+        if (good < data.size() && truncate(path.c_str(), static_cast<off_t>(good)) != 0) {
+            if (error) *error = path + ": " + strerror(errno);
+            return false;
+        }
+    } else {
+        FILE* file = fopen(path.c_str(), "wb");
+        if (!file || fwrite(kMagic, 1, sizeof(kMagic), file) != sizeof(kMagic) || fclose(file) != 0) {
+            if (error) *error = path + ": " + strerror(errno);
+            return false;
+        }
+    }
+    chunks_file_ = fopen(path.c_str(), "ab");
+    if (!chunks_file_) {
+        if (error) *error = path + ": " + strerror(errno);
+        return false;
+    }
+
+    // The journal names how many chunks were sealed when it was written;
+    // points sealed since then are skipped rather than loaded twice
+    std::string journal;
+    if (read_file(path + ".head", &journal) && journal.size() >= sizeof(kJournalMagic) &&
+        journal.compare(0, sizeof(kJournalMagic), kJournalMagic, sizeof(kJournalMagic)) == 0) {
+        Reader in(journal, sizeof(kJournalMagic));
+        uint64_t sealed;
+        if (in.varint(&sealed) && sealed <= chunks_.size()) {
+            size_t skip = 0;
+            for (size_t i = sealed; i < chunks_.size(); ++i) skip += chunks_[i].count;
+            for (size_t pos = in.pos() + skip * kRecordBytes; pos + kRecordBytes <= journal.size();
+                 pos += kRecordBytes) {
+                head_.push_back(get_record(journal.data() + pos));
+            }
+        }
+    }
+
+    for (const Chunk& chunk : chunks_) {
+        std::vector<HistoryPoint> points = decode_all(chunk);
+        unfolded_.insert(unfolded_.end(), points.begin(), points.end());
+    }
+    unfolded_.insert(unfolded_.end(), head_.begin(), head_.end());
+    if (!write_journal()) {
+        if (error) *error = path + ".head: " + strerror(errno);
+        return false;
+    }
+    // Up to what was loaded; the background pass takes it from there
+    if (!unfolded_.empty()) fold_locked(unfolded_.back().t_ms);
+    return true;
+}
+
+void HistoryStore::start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (thread_.joinable()) return;
+    stopping_ = false;
+    thread_ = std::thread(&HistoryStore::loop, this);
+}
+
+void HistoryStore::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!thread_.joinable()) return;
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
+}
+
+void HistoryStore::loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        wake_.wait_for(lock, kFoldInterval, [this] { return stopping_; });
+        fold_locked(now_ms());
+    }
+}
+
+void HistoryStore::add(HistoryPoint point) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t newest = head_.empty() ? (chunks_.empty() ? point.t_ms : chunks_.back().last_ms) : head_.back().t_ms;
+    point.t_ms = std::max({point.t_ms, newest, folded_until_ms_});
+    head_.push_back(point);
+    unfolded_.push_back(point);
+    journal_point(point);
+}
+
+void HistoryStore::fold(int64_t cutoff_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    fold_locked(cutoff_ms);
+}
+
+void HistoryStore::fold_locked(int64_t cutoff_ms) {
+    size_t sealed = 0;
+    while (head_.size() - sealed >= kChunkPoints) {
+        Chunk chunk = seal(&head_[sealed], kChunkPoints);
+        write_chunk(chunk);
+        sealed_points_ += chunk.count;
+        sealed_bytes_ += chunk.data.size();
+        chunks_.push_back(std::move(chunk));
+        sealed += kChunkPoints;
+    }
+    if (sealed) {
+        head_.erase(head_.begin(), head_.begin() + sealed);
+        write_journal();
+    }
+
+    cutoff_ms = floor_to(cutoff_ms, kMinuteMs);
+    if (cutoff_ms <= folded_until_ms_) return;
+    size_t folded = 0;
+    while (folded < unfolded_.size() && unfolded_[folded].t_ms < cutoff_ms) fold_point(unfolded_[folded++]);
+    unfolded_.erase(unfolded_.begin(), unfolded_.begin() + folded);
+    folded_until_ms_ = cutoff_ms;
+}
+
+void HistoryStore::fold_point(const HistoryPoint& point) {
+    for (int level = 0; level < 3; ++level) {
+        std::vector<Rollup>& rollups = rollups_[level];
+        int64_t start = floor_to(point.t_ms, history_step_ms(static_cast<HistoryStep>(level)));
+        if (rollups.empty() || rollups.back().start_ms != start) {
+            rollups.emplace_back();
+            rollups.back().start_ms = start;
+        }
+        for (int field = 0; field < kHistoryFields; ++field) {
+            FieldRollup& r = rollups.back().fields[field];
+            double v = field_value(point, field);
+            r.min = r.count ? std::min(r.min, v) : v;
+            r.max = r.count ? std::max(r.max, v) : v;
+            ++r.count;
+            r.sum += v;
+            uint16_t bucket = static_cast<uint16_t>(QuantileSketch::bucket(v));
+            auto it = std::lower_bound(r.sketch.begin(), r.sketch.end(), bucket,
+                                       [](const std::pair<uint16_t, uint32_t>& e, uint16_t b) { return e.first < b; });
+            if (it != r.sketch.end() && it->first == bucket) ++it->second;
+            else r.sketch.insert(it, {bucket, 1});
+        }
+    }
+}
+
+HistoryStore::Chunk HistoryStore::seal(const HistoryPoint* points, size_t n) {
+    Chunk chunk;
+    chunk.first_ms = points[0].t_ms;
+    chunk.last_ms = points[n - 1].t_ms;
+    chunk.count = static_cast<uint32_t>(n);
+    std::string column;
+    put_times(points, n, &column);
+    put_varint(&chunk.data, column.size());
+    chunk.data += column;
+    for (int field = 0; field < kHistoryFields; ++field) {
+        column.clear();
+        put_values(points, n, field, &column);
+        put_varint(&chunk.data, column.size());
+        chunk.data += column;
+    }
+    return chunk;
+}
+
+void HistoryStore::decode(const Chunk& chunk, int field, std::vector<int64_t>* t_ms, std::vector<double>* values) {
+    size_t offsets[kColumns], sizes[kColumns];
+    bool ok = find_columns(chunk.data, offsets, sizes) &&
+              get_times(chunk.data.data() + offsets[0], sizes[0], chunk.count, t_ms) &&
+              get_values(chunk.data.data() + offsets[1 + field], sizes[1 + field], chunk.count, values);
+    // A damaged chunk yields what decoded before the damage
+    if (!ok) {
+        size_t n = std::min(t_ms->size(), values->size());
+        t_ms->resize(n);
+        values->resize(n);
+    }
+}
+
+std::vector<HistoryPoint> HistoryStore::decode_all(const Chunk& chunk) {
+    std::vector<HistoryPoint> points;
+    std::vector<int64_t> times;
+    std::vector<double> values;
+    for (int field = 0; field < kHistoryFields; ++field) {
+        decode(chunk, field, &times, &values);
+        if (field == 0) points.resize(times.size());
+        points.resize(std::min(points.size(), values.size()));
+        for (size_t i = 0; i < points.size(); ++i) {
+            points[i].t_ms = times[i];
+            set_field_value(&points[i], field, values[i]);
+        }
+    }
+    return points;
+}
+
+bool HistoryStore::write_chunk(const Chunk& chunk) {
+    if (!chunks_file_) return true;
+    std::string record;
+    put_varint(&record, chunk.count);
+    put_signed(&record, chunk.first_ms);
+    put_varint(&record, static_cast<uint64_t>(chunk.last_ms - chunk.first_ms));
+    put_varint(&record, chunk.data.size());
+    record += chunk.data;
+    if (fwrite(record.data(), 1, record.size(), chunks_file_) != record.size() || fflush(chunks_file_) != 0) {
+        std::cerr << "history: " << path_ << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Rewritten whole after each seal, through a rename so a crash leaves
+// either the old journal or the new one
+bool HistoryStore::write_journal() {
+    if (path_.empty()) return true;
+    std::string data(kJournalMagic, sizeof(kJournalMagic));
+    put_varint(&data, chunks_.size());
+    for (const HistoryPoint& point : head_) put_record(&data, point);
+
+    std::string journal = path_ + ".head";
+    std::string temporary = journal + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    bool ok = file && fwrite(data.data(), 1, data.size(), file) == data.size();
+    if (file && fclose(file) != 0) ok = false;
+    if (ok) ok = rename(temporary.c_str(), journal.c_str()) == 0;
+    if (journal_) fclose(journal_);
+    journal_ = ok ? fopen(journal.c_str(), "ab") : nullptr;
+    if (!journal_) std::cerr << "history: " << journal << ": " << strerror(errno) << "\n";
+    return journal_ != nullptr;
+}
+
+// Flushed to the kernel with each point, so a crash of the server loses
+// nothing; a crash of the machine can lose what the page cache held
+void HistoryStore::journal_point(const HistoryPoint& point) {
+    if (!journal_) return;
+    std::string record;
+    put_record(&record, point);
+    fwrite(record.data(), 1, record.size(), journal_);
+    fflush(journal_);
+}
+
+size_t HistoryStore::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sealed_points_ + head_.size();
+}
+
+size_t HistoryStore::sealed_points() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sealed_points_;
+}
+
+size_t HistoryStore::compressed_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sealed_bytes_;
+}
+
+bool HistoryStore::time_span(int64_t* first_ms, int64_t* last_ms) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return span_locked(first_ms, last_ms);
+}
+
+bool HistoryStore::span_locked(int64_t* first_ms, int64_t* last_ms) const {
+    if (chunks_.empty() && head_.empty()) return false;
+    *first_ms = chunks_.empty() ? head_.front().t_ms : chunks_.front().first_ms;
+    *last_ms = head_.empty() ? chunks_.back().last_ms : head_.back().t_ms;
+    return true;
+}
+
+bool HistoryStore::clip_locked(int64_t* from_ms, int64_t* to_ms) const {
+    int64_t first, last;
+    if (!span_locked(&first, &last)) return false;
+    *from_ms = std::max(*from_ms, first);
+    *to_ms = std::min(*to_ms, last + 1);
+    return *from_ms < *to_ms;
+}
+
+template <typename Visit>
+void HistoryStore::scan(int field, int64_t from_ms, int64_t to_ms, Visit&& visit) const {
+    if (from_ms >= to_ms) return;
+    auto chunk = std::partition_point(chunks_.begin(), chunks_.end(),
+                                      [&](const Chunk& c) { return c.last_ms < from_ms; });
+    std::vector<int64_t> times;
+    std::vector<double> values;
+    for (; chunk != chunks_.end() && chunk->first_ms < to_ms; ++chunk) {
+        decode(*chunk, field, &times, &values);
+        for (size_t i = 0; i < times.size(); ++i) {
+            if (times[i] >= from_ms && times[i] < to_ms) visit(times[i], values[i]);
+        }
+    }
+    auto point = std::partition_point(head_.begin(), head_.end(),
+                                      [&](const HistoryPoint& p) { return p.t_ms < from_ms; });
+    for (; point != head_.end() && point->t_ms < to_ms; ++point) visit(point->t_ms, field_value(*point, field));
+}
+
+void HistoryStore::collect(int field, int level, int64_t from_ms, int64_t to_ms, Accumulator* acc) const {
+    if (from_ms >= to_ms) return;
+    if (level < 0) {
+        scan(field, from_ms, to_ms, [acc](int64_t, double v) { acc->add(v); });
+        return;
+    }
+    int64_t step = history_step_ms(static_cast<HistoryStep>(level));
+    int64_t first = ceil_to(from_ms, step);
+    int64_t last = floor_to(to_ms, step);
+    if (first >= last) {
+        collect(field, level - 1, from_ms, to_ms, acc);
+        return;
+    }
+    collect(field, level - 1, from_ms, first, acc);
+    const std::vector<Rollup>& rollups = rollups_[level];
+    auto it = std::partition_point(rollups.begin(), rollups.end(),
+                                   [first](const Rollup& r) { return r.start_ms < first; });
+    for (; it != rollups.end() && it->start_ms < last; ++it) acc->add(it->fields[field]);
+    collect(field, level - 1, last, to_ms, acc);
+}
+
+std::vector<HistoryPoint> HistoryStore::points(int64_t from_ms, int64_t to_ms, size_t limit, uint64_t* total) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<HistoryPoint> newest;  // Newest first
+    uint64_t count = 0;
+    auto take = [&](const HistoryPoint& point) {
+        if (point.t_ms < from_ms || point.t_ms >= to_ms) return;
+        ++count;
+        if (newest.size() < limit) newest.push_back(point);
+    };
+    for (auto point = head_.rbegin(); point != head_.rend() && point->t_ms >= from_ms; ++point) take(*point);
+    for (auto chunk = chunks_.rbegin(); chunk != chunks_.rend() && chunk->last_ms >= from_ms; ++chunk) {
+        if (chunk->first_ms >= to_ms) continue;
+        // Chunks wholly inside the range past the limit only need counting
+        if (newest.size() >= limit && chunk->first_ms >= from_ms && chunk->last_ms < to_ms) {
+            count += chunk->count;
+            continue;
+        }
+        std::vector<HistoryPoint> points = decode_all(*chunk);
+        for (auto point = points.rbegin(); point != points.rend(); ++point) take(*point);
+    }
+    if (total) *total = count;
+    std::reverse(newest.begin(), newest.end());
+    return newest;
+}
+
+HistorySummary HistoryStore::summarize(HistoryField field, int64_t from_ms, int64_t to_ms,
+                                       const std::vector<double>& quantiles) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Accumulator acc;
+    int64_t start = from_ms;
+    if (clip_locked(&from_ms, &to_ms)) {
+        int f = static_cast<int>(field);
+        int64_t split = std::clamp(folded_until_ms_, from_ms, to_ms);
+        collect(f, 2, from_ms, split, &acc);
+        scan(f, split, to_ms, [&acc](int64_t, double v) { acc.add(v); });
+    }
+    return acc.summary(start, quantiles);
+}
+
+std::vector<HistorySummary> HistoryStore::series(HistoryField field, HistoryStep step, int64_t from_ms,
+                                                 int64_t to_ms, const std::vector<double>& quantiles) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<HistorySummary> out;
+    if (!clip_locked(&from_ms, &to_ms)) return out;
+    int f = static_cast<int>(field);
+    int level = static_cast<int>(step);
+    int64_t length = history_step_ms(step);
+    int64_t split = std::clamp(folded_until_ms_, from_ms, to_ms);
+
+    // Buckets with folded points: whole ones straight from the rollup,
+    // ones cut by the range or by the fold from finer data
+    int64_t tail = split;
+    const std::vector<Rollup>& rollups = rollups_[level];
+    int64_t first = floor_to(from_ms, length);
+    auto it = std::partition_point(rollups.begin(), rollups.end(),
+                                   [first](const Rollup& r) { return r.start_ms < first; });
+    for (; it != rollups.end() && it->start_ms < split; ++it) {
+        int64_t begin = std::max(from_ms, it->start_ms);
+        int64_t end = std::min(to_ms, it->start_ms + length);
+        Accumulator acc;
+        if (begin == it->start_ms && end == it->start_ms + length && end <= split) {
+            acc.add(it->fields[f]);
+        } else {
+            collect(f, level - 1, begin, std::min(end, split), &acc);
+            scan(f, std::max(begin, split), end, [&acc](int64_t, double v) { acc.add(v); });
+            tail = std::max(tail, end);
+        }
+        if (acc.count()) out.push_back(acc.summary(it->start_ms, quantiles));
+    }
+
+    // Then the points not folded yet
+    Accumulator acc;
+    int64_t bucket = 0;
+    scan(f, tail, to_ms, [&](int64_t t, double v) {
+        int64_t start = floor_to(t, length);
+        if (acc.count() && start != bucket) {
+            out.push_back(acc.summary(bucket, quantiles));
+            acc = Accumulator();
+        }
+        bucket = start;
+        acc.add(v);
+    });
+    if (acc.count()) out.push_back(acc.summary(bucket, quantiles));
+    return out;
+}
+
+std::string history_results_path(const HistoryPoint& point) {
+    return "/api/results?download_mbps=" + number_text(point.download_mbps) +
+           "&upload_mbps=" + number_text(point.upload_mbps) + "&ping_ms=" + number_text(point.ping_ms) +
+           "&jitter_ms=" + number_text(point.jitter_ms);
+}
+
+bool history_point_from_query(const std::string& query, HistoryPoint* point, std::string* error) {
+    *point = HistoryPoint();
+    bool download = false, upload = false;
+    for (const std::string& pair : split(query, '&')) {
+        size_t eq = pair.find('=');
+        if (eq == std::string::npos) continue;
+        std::string key = pair.substr(0, eq);
+        HistoryField field;
+        if (!parse_history_field(key, &field) || key != history_field_name(field)) continue;
+        double v;
+        if (!parse_number(pair.substr(eq + 1), &v) || v < 0 || v >= QuantileSketch::kMaxValue) {
+            *error = "bad " + key;
+            return false;
+        }
+        set_field_value(point, static_cast<int>(field), v);
+        download |= field == HistoryField::kDownload;
+        upload |= field == HistoryField::kUpload;
+    }
+    if (!download || !upload) {
+        *error = "expected download_mbps and upload_mbps";
+        return false;
+    }
+    return true;
+}
+
+bool history_query_json(const HistoryStore& store, const std::string& query, std::string* json, std::string* error) {
+    int64_t from = std::numeric_limits<int64_t>::min();
+    int64_t to = std::numeric_limits<int64_t>::max();
+    size_t limit = kDefaultPoints;
+    bool summary = false, stepped = false;
+    std::string step_text;
+    HistoryStep step = HistoryStep::kMinute;
+    HistoryField field = HistoryField::kDownload;
+    std::vector<double> quantiles = {0.5, 0.9, 0.99};
+    for (const std::string& pair : split(query, '&')) {
+        size_t eq = pair.find('=');
+        if (eq == std::string::npos) continue;
+        std::string key = pair.substr(0, eq);
+        std::string value = pair.substr(eq + 1);
+        int64_t n;
+        if (key == "from" || key == "to") {
+            if (!parse_int(value, &n)) {
+                *error = "expected " + key + "=Unix ms";
+                return false;
+            }
+            (key == "from" ? from : to) = n;
+        } else if (key == "limit") {
+            if (!parse_int(value, &n) || n < 1) {
+                *error = "expected limit=N";
+                return false;
+            }
+            limit = std::min(kMaxPoints, static_cast<size_t>(n));
+        } else if (key == "summary") {
+            summary = value != "0";
+        } else if (key == "step") {
+            if (!parse_history_step(value, &step)) {
+                *error = "expected step=1m|1h|1d";
+                return false;
+            }
+            stepped = true;
+            step_text = value;
+        } else if (key == "field") {
+            if (!parse_history_field(value, &field)) {
+                *error = "expected field=download|upload|ping|jitter";
+                return false;
+            }
+        } else if (key == "q") {
+            quantiles.clear();
+            for (const std::string& text : split(value, ',')) {
+                double q;
+                if (!parse_number(text, &q) || q < 0 || q > 1 || quantiles.size() == kMaxQuantiles) {
+                    *error = "expected q=Q1,Q2,... within [0, 1]";
+                    return false;
+                }
+                quantiles.push_back(q);
+            }
+        }
+    }
+    if (from >= to) {
+        *error = "expected from < to";
+        return false;
+    }
+
+    JsonWriter out;
+    if (stepped) {
+        // Bounded by the span actually stored, not the one asked for
+        int64_t first, last;
+        if (store.time_span(&first, &last)) {
+            int64_t begin = std::max(from, first);
+            int64_t end = std::min(to, last + 1);
+            if (end > begin && (end - begin) / history_step_ms(step) > kMaxBuckets) {
+                *error = "over " + std::to_string(kMaxBuckets) + " buckets; narrow from/to or use a coarser step";
+                return false;
+            }
+        }
+        out.begin_object().field("field", history_field_name(field)).field("step", step_text).key("buckets");
+        out.begin_array();
+        for (const HistorySummary& bucket : store.series(field, step, from, to, quantiles)) {
+            out.begin_object().field("t", bucket.start_ms);
+            write_summary(bucket, quantiles, &out);
+            out.end_object();
+        }
+        out.end_array().end_object();
+    } else if (summary) {
+        out.begin_object();
+        for (int i = 0; i < kHistoryFields; ++i) {
+            HistoryField f = static_cast<HistoryField>(i);
+            out.key(history_field_name(f)).begin_object();
+            write_summary(store.summarize(f, from, to, quantiles), quantiles, &out);
+            out.end_object();
+        }
+        out.end_object();
+    } else {
+        uint64_t total = 0;
+        std::vector<HistoryPoint> points = store.points(from, to, limit, &total);
+        out.begin_object()
+            .field("stored", store.size())
+            .field("sealed", store.sealed_points())
+            .field("compressed_bytes", store.compressed_bytes())
+            .field("total", total)
+            .key("points")
+            .begin_array();
+        for (const HistoryPoint& point : points) {
+            out.begin_object().field("t", point.t_ms);
+            for (int i = 0; i < kHistoryFields; ++i) {
+                out.field(history_field_name(static_cast<HistoryField>(i)), field_value(point, i));
+            }
+            out.end_object();
+        }
+        out.end_array().end_object();
+    }
+    *json = out.take();
+    return true;
+}
+
+} // namespace speedtest
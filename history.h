@@ -0,0 +1,175 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace speedtest {
+
+// Every completed test a server has seen, kept as a columnar time series.
+//
+// Points arrive in time order. The newest sit uncompressed in the head;
+// a background pass seals them in chunks of kChunkPoints, each column
+// compressed on its own as in Gorilla (Pelkonen et al., VLDB 2015):
+// timestamps as delta-of-delta, values XORed with their predecessor.
+// Noisy results at irregular times still take about 30 bytes against 40
+// raw (history_bench); repeated values and steady intervals cost a bit.
+//
+// The same pass folds points older than the current minute into 1m, 1h
+// and 1d rollups of count, sum, min, max and a quantile sketch per
+// field. A range query reads whole days, hours and minutes from the
+// rollups and decodes raw points only for the partial minutes at its
+// edges and for the minute still being filled, so it costs about the
+// same over a day or over years of results.
+struct HistoryPoint {
+    int64_t t_ms = 0;          // Unix time the result was stored
+    double download_mbps = 0;
+    double upload_mbps = 0;
+    double ping_ms = 0;
+    double jitter_ms = 0;
+};
+
+enum class HistoryField { kDownload, kUpload, kPing, kJitter };
+constexpr int kHistoryFields = 4;
+
+// "download_mbps", ...; parsing also takes "download", ...
+const char* history_field_name(HistoryField field);
+bool parse_history_field(const std::string& text, HistoryField* field);
+
+// Rollup resolutions, coarsest last
+enum class HistoryStep { kMinute, kHour, kDay };
+int64_t history_step_ms(HistoryStep step);
+bool parse_history_step(const std::string& text, HistoryStep* step);  // "1m", "1h", "1d"
+
+// One field over some span. Quantiles are within 1% of the true value
+// (QuantileSketch) and in the order they were asked for.
+struct HistorySummary {
+    int64_t start_ms = 0;
+    uint64_t count = 0;
+    double mean = 0;
+    double min = 0;
+    double max = 0;
+    std::vector<double> quantiles;
+};
+
+class HistoryStore {
+public:
+    static constexpr size_t kChunkPoints = 1024;
+
+    HistoryStore();
+    ~HistoryStore();  // Stops the background pass
+    HistoryStore(const HistoryStore&) = delete;
+    HistoryStore& operator=(const HistoryStore&) = delete;
+
+    // Persist to `path`: sealed chunks are appended to it, the head is
+    // journaled to path + ".head" as each point arrives. Whatever the two
+    // hold is loaded first. Without open() the store lives in memory.
+    bool open(const std::string& path, std::string* error);
+    // Seal and fold every second from a background thread
+    void start();
+    void stop();
+
+    // Timestamps earlier than the newest point's are moved up to it
+    void add(HistoryPoint point);
+    // Seal full chunks and fold everything before cutoff_ms, which is
+    // rounded down to a minute
+    void fold(int64_t cutoff_ms);
+
+    size_t size() const;
+    size_t sealed_points() const;
+    size_t compressed_bytes() const;  // Of the sealed chunks
+    // Times of the oldest and newest points; false when empty
+    bool time_span(int64_t* first_ms, int64_t* last_ms) const;
+
+    // The newest `limit` points in [from_ms, to_ms), oldest first, and
+    // how many the range holds
+    std::vector<HistoryPoint> points(int64_t from_ms, int64_t to_ms, size_t limit, uint64_t* total = nullptr) const;
+    // One field over [from_ms, to_ms)
+    HistorySummary summarize(HistoryField field, int64_t from_ms, int64_t to_ms,
+                             const std::vector<double>& quantiles) const;
+    // One summary per step-long bucket holding any points
+    std::vector<HistorySummary> series(HistoryField field, HistoryStep step, int64_t from_ms, int64_t to_ms,
+                                       const std::vector<double>& quantiles) const;
+
+private:
+    struct Chunk {
+        int64_t first_ms = 0;
+        int64_t last_ms = 0;
+        uint32_t count = 0;
+        std::string data;  // One bit stream per column, each prefixed with its byte length
+    };
+    // Per field: moments and sparse sketch buckets (bucket, count)
+    struct FieldRollup {
+        uint64_t count = 0;
+        double sum = 0;
+        double min = 0;
+        double max = 0;
+        std::vector<std::pair<uint16_t, uint32_t>> sketch;
+    };
+    struct Rollup {
+        int64_t start_ms = 0;
+        FieldRollup fields[kHistoryFields];
+    };
+    class Accumulator;
+
+    static Chunk seal(const HistoryPoint* points, size_t n);
+    static void decode(const Chunk& chunk, int field, std::vector<int64_t>* t_ms, std::vector<double>* values);
+    static std::vector<HistoryPoint> decode_all(const Chunk& chunk);
+
+    bool span_locked(int64_t* first_ms, int64_t* last_ms) const;
+    // Narrow a range to the points stored, so bucket arithmetic on it
+    // can't overflow; false if nothing is left
+    bool clip_locked(int64_t* from_ms, int64_t* to_ms) const;
+    void fold_locked(int64_t cutoff_ms);
+    void fold_point(const HistoryPoint& point);
+    // Calls visit(t_ms, value) for the raw points of one field in [from_ms, to_ms)
+    template <typename Visit>
+    void scan(int field, int64_t from_ms, int64_t to_ms, Visit&& visit) const;
+    // Rollups where whole buckets fit, raw points elsewhere
+    void collect(int field, int level, int64_t from_ms, int64_t to_ms, Accumulator* acc) const;
+
+    bool write_chunk(const Chunk& chunk);
+    bool write_journal();
+    void journal_point(const HistoryPoint& point);
+    void loop();
+
+    mutable std::mutex mutex_;
+    std::vector<Chunk> chunks_;
+    size_t sealed_points_ = 0;
+    size_t sealed_bytes_ = 0;
+    std::vector<HistoryPoint> head_;         // Not yet sealed
+    std::vector<HistoryPoint> unfolded_;     // Not yet in the rollups
+    int64_t folded_until_ms_ = 0;            // Every point before this is in the rollups
+    std::vector<Rollup> rollups_[3];         // By HistoryStep, oldest first
+
+    std::string path_;
+    FILE* chunks_file_ = nullptr;
+    FILE* journal_ = nullptr;
+
+    std::thread thread_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+};
+
+// POST /api/results?download_mbps=..&upload_mbps=..&ping_ms=..&jitter_ms=..
+// submits a result; the server stamps it with its own clock
+std::string history_results_path(const HistoryPoint& point);
+bool history_point_from_query(const std::string& query, HistoryPoint* point, std::string* error);
+
+// GET /api/history: the query string in, a JSON body out.
+//   (no step)         the newest `limit` points of [from, to), all fields
+//   summary=1         every field over [from, to), with quantiles `q`
+//   step=1m|1h|1d     one field (`field`, default download) per bucket
+// from and to are Unix ms (default: all of it); q is a comma list
+// (default 0.5,0.9,0.99). False with *error for bad values.
+bool history_query_json(const HistoryStore& store, const std::string& query, std::string* json, std::string* error);
+
+} // namespace speedtest
+
+#endif // HISTORY_H_
@@ -0,0 +1,257 @@
+// Fills a HistoryStore with a synthetic year of results and reports how
+// well it compresses, how fast it ingests, and how long /api/history
+// style queries take, checking every summary against a brute-force pass
+// over the raw points.
+//
+// Results arrive at random intervals averaging --every seconds, with
+// rates that drift over the day the way a shared access link does.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "history.h"
+
+using namespace speedtest;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const int64_t kDayMs = 24 * 3600 * 1000ll;
+
+struct Options {
+    size_t points = 1000000;
+    double every_s = 30;
+    int queries = 200;
+    uint64_t seed = 1;
+    std::string path;
+};
+
+double elapsed_ms(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+std::vector<HistoryPoint> make_points(const Options& options) {
+    std::mt19937_64 rng(options.seed);
+    std::exponential_distribution<double> gap(1 / (options.every_s * 1000));
+    std::normal_distribution<double> noise(0, 1);
+    std::vector<HistoryPoint> points;
+    points.reserve(options.points);
+    // Start on a day boundary, a year or so back
+    int64_t t = 1700000000000ll / kDayMs * kDayMs;
+    for (size_t i = 0; i < options.points; ++i) {
+        t += 1 + static_cast<int64_t>(gap(rng));
+        double busy = 0.5 + 0.5 * std::sin(2 * M_PI * (t % kDayMs) / kDayMs);
+        HistoryPoint p;
+        p.t_ms = t;
+        // Rates to 0.01 Mbps and times to 1 us, as clients report them
+        p.download_mbps = std::round(std::max(1.0, 900 - 400 * busy + 60 * noise(rng)) * 100) / 100;
+        p.upload_mbps = std::round(std::max(1.0, 400 - 150 * busy + 30 * noise(rng)) * 100) / 100;
+        p.ping_ms = std::round(std::max(0.1, 8 + 6 * busy + std::abs(2 * noise(rng))) * 1000) / 1000;
+        p.jitter_ms = std::round(std::abs(0.5 + busy * noise(rng)) * 1000) / 1000;
+        points.push_back(p);
+    }
+    return points;
+}
+
+double value_of(const HistoryPoint& p, HistoryField field) {
+    switch (field) {
+    case HistoryField::kDownload: return p.download_mbps;
+    case HistoryField::kUpload: return p.upload_mbps;
+    case HistoryField::kPing: return p.ping_ms;
+    default: return p.jitter_ms;
+    }
+}
+
+// What summarize() should say, from the raw points
+HistorySummary brute_force(const std::vector<HistoryPoint>& points, HistoryField field, int64_t from, int64_t to,
+                           const std::vector<double>& quantiles) {
+    std::vector<double> values;
+    for (const HistoryPoint& p : points) {
+        if (p.t_ms >= from && p.t_ms < to) values.push_back(value_of(p, field));
+    }
+    HistorySummary s;
+    s.count = values.size();
+    if (values.empty()) return s;
+    std::sort(values.begin(), values.end());
+    double sum = 0;
+    for (double v : values) sum += v;
+    s.mean = sum / values.size();
+    s.min = values.front();
+    s.max = values.back();
+    for (double q : quantiles) s.quantiles.push_back(values[static_cast<size_t>(q * (values.size() - 1))]);
+    return s;
+}
+
+bool matches(const HistorySummary& got, const HistorySummary& want) {
+    if (got.count != want.count) return false;
+    if (want.count == 0) return true;
+    if (got.min != want.min || got.max != want.max) return false;
+    if (std::abs(got.mean - want.mean) > 1e-9 * std::max(1.0, std::abs(want.mean))) return false;
+    for (size_t i = 0; i < want.quantiles.size(); ++i) {
+        // The sketch promises 1%, plus the value itself for ranks that
+        // fall between two equal neighbours
+        if (std::abs(got.quantiles[i] - want.quantiles[i]) > 0.0101 * std::abs(want.quantiles[i]) + 1e-3) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void print_usage() {
+    std::cout << "Usage: history_bench [options]\n"
+              << "  --points=N             Results stored (default 1000000)\n"
+              << "  --every=S              Mean seconds between results (default 30)\n"
+              << "  --queries=N            Random range queries timed (default 200)\n"
+              << "  --seed=N               Data and range seed (default 1)\n"
+              << "  --path=FILE            Persist to FILE, then time reopening it\n";
+}
+
+const char* flag_value(const char* arg, const char* name) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) == 0 && arg[len] == '=') return arg + len + 1;
+    return nullptr;
+}
+
+void print_row(const std::string& what, double ms, const std::string& note = "") {
+    std::cout << "  " << std::left << std::setw(40) << what << std::right << std::fixed << std::setprecision(3)
+              << std::setw(12) << ms << " ms  " << note << "\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value;
+        if ((value = flag_value(arg, "--points"))) {
+            options.points = std::max(2ull, std::strtoull(value, nullptr, 10));
+        } else if ((value = flag_value(arg, "--every"))) {
+            options.every_s = std::max(0.001, atof(value));
+        } else if ((value = flag_value(arg, "--queries"))) {
+            options.queries = std::max(1, atoi(value));
+        } else if ((value = flag_value(arg, "--seed"))) {
+            options.seed = std::strtoull(value, nullptr, 10);
+        } else if ((value = flag_value(arg, "--path"))) {
+            options.path = value;
+        } else {
+            print_usage();
+            return strcmp(arg, "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    std::vector<HistoryPoint> points = make_points(options);
+    int64_t first = points.front().t_ms;
+    int64_t last = points.back().t_ms;
+    std::cout << "  " << points.size() << " results over " << std::fixed << std::setprecision(1)
+              << (last - first) / double(kDayMs) << " days\n\n";
+
+    HistoryStore store;
+    std::string error;
+    if (!options.path.empty()) {
+        std::remove(options.path.c_str());
+        std::remove((options.path + ".head").c_str());
+        if (!store.open(options.path, &error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+    }
+
+    // The server folds once a second; here once per simulated minute
+    auto start = Clock::now();
+    int64_t next_fold = first;
+    for (const HistoryPoint& p : points) {
+        if (p.t_ms >= next_fold) {
+            store.fold(p.t_ms);
+            next_fold = p.t_ms + 60000;
+        }
+        store.add(p);
+    }
+    store.fold(last);
+    double ingest_ms = elapsed_ms(start);
+    double bytes_per_point = double(store.compressed_bytes()) / store.sealed_points();
+    print_row("ingest", ingest_ms,
+              std::to_string(static_cast<uint64_t>(points.size() / (ingest_ms / 1000))) + " results/s");
+    std::cout << "  " << std::left << std::setw(40) << "sealed" << std::right << std::setw(12)
+              << store.sealed_points() << " pts   " << std::setprecision(2) << bytes_per_point
+              << " bytes/result (raw: 40)\n\n";
+
+    const std::vector<double> quantiles = {0.5, 0.9, 0.99};
+    std::mt19937_64 rng(options.seed + 1);
+    std::uniform_int_distribution<int64_t> when(first, last + 1);
+    int wrong = 0;
+    auto check = [&](HistoryField field, int64_t from, int64_t to, const HistorySummary& got) {
+        if (!matches(got, brute_force(points, field, from, to, quantiles))) ++wrong;
+    };
+
+    start = Clock::now();
+    HistorySummary all = store.summarize(HistoryField::kDownload, first, last + 1, quantiles);
+    print_row("summary, everything", elapsed_ms(start), std::to_string(all.count) + " results");
+    check(HistoryField::kDownload, first, last + 1, all);
+
+    // Arbitrary ms bounds, so every level of rollup and raw edges play a part
+    std::vector<std::pair<int64_t, int64_t>> ranges;
+    for (int i = 0; i < options.queries; ++i) {
+        int64_t a = when(rng), b = when(rng);
+        ranges.emplace_back(std::min(a, b), std::max(a, b) + 1);
+    }
+    std::vector<HistorySummary> got;
+    start = Clock::now();
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        got.push_back(store.summarize(static_cast<HistoryField>(i % 4), ranges[i].first, ranges[i].second, quantiles));
+    }
+    print_row("summary, random range (mean)", elapsed_ms(start) / ranges.size());
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        check(static_cast<HistoryField>(i % 4), ranges[i].first, ranges[i].second, got[i]);
+    }
+
+    start = Clock::now();
+    std::vector<HistorySummary> days = store.series(HistoryField::kPing, HistoryStep::kDay, first, last + 1, quantiles);
+    print_row("series 1d, everything", elapsed_ms(start), std::to_string(days.size()) + " buckets");
+    for (const HistorySummary& day : days) check(HistoryField::kPing, day.start_ms, day.start_ms + kDayMs, day);
+
+    int64_t week_from = last - 7 * kDayMs + 12345;
+    start = Clock::now();
+    std::vector<HistorySummary> hours =
+        store.series(HistoryField::kUpload, HistoryStep::kHour, week_from, last + 1, quantiles);
+    print_row("series 1h, last week", elapsed_ms(start), std::to_string(hours.size()) + " buckets");
+    for (const HistorySummary& hour : hours) {
+        int64_t from = std::max(week_from, hour.start_ms);
+        check(HistoryField::kUpload, from, hour.start_ms + 3600000, hour);
+    }
+
+    start = Clock::now();
+    uint64_t total = 0;
+    std::vector<HistoryPoint> newest = store.points(first, last + 1, 100, &total);
+    print_row("raw, newest 100", elapsed_ms(start), std::to_string(total) + " in range");
+    for (size_t i = 0; i < newest.size(); ++i) {
+        const HistoryPoint& want = points[points.size() - newest.size() + i];
+        if (memcmp(&newest[i], &want, sizeof(want)) != 0) ++wrong;
+    }
+
+    if (!options.path.empty()) {
+        start = Clock::now();
+        HistoryStore reopened;
+        if (!reopened.open(options.path, &error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+        print_row("reopen and refold", elapsed_ms(start), std::to_string(reopened.size()) + " results");
+        HistorySummary again = reopened.summarize(HistoryField::kDownload, first, last + 1, quantiles);
+        if (!matches(again, all)) ++wrong;
+    }
+
+    std::cout << "\n  " << (wrong ? std::to_string(wrong) + " answers differ from brute force"
+                                  : "every answer matches brute force") << "\n\n";
+    return wrong ? 1 : 0;
+}
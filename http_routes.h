@@ -0,0 +1,227 @@
+#ifndef HTTP_ROUTES_H_
+#define HTTP_ROUTES_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace speedtest {
+
+// The server's HTTP routes and response headers, fixed at compile time.
+//
+// A request is routed on its method and path ("GET /api/ping" of
+// "GET /api/ping?x=1 HTTP/1.1\r\n..."): one pass to find where the path
+// ends, one hash of those bytes, one table slot and one compare. The hash
+// seed is searched for at compile time so that no two routes share a slot;
+// anything that isn't a route lands on a slot holding another key, or none,
+// and gets the table's fallback.
+//
+// Response headers are assembled the same way up to the Content-Length
+// value, so a response is that prefix, the length, and the body.
+
+// The method and path of a request, without the query; up to the first
+// line's end if it has no target
+constexpr std::string_view route_key(std::string_view request) {
+    size_t i = 0;
+    while (i < request.size() && request[i] != ' ' && request[i] != '\r') ++i;
+    if (i < request.size() && request[i] == ' ') ++i;
+    while (i < request.size() && request[i] != ' ' && request[i] != '?' && request[i] != '\r') ++i;
+    return request.substr(0, i);
+}
+
+// FNV-1a from a seeded basis, folded so the low bits see the high ones
+constexpr uint32_t route_hash(std::string_view key, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (char c : key) {
+        h ^= static_cast<uint8_t>(c);
+        h *= 16777619u;
+    }
+    return h ^ (h >> 16);
+}
+
+template <typename Id>
+struct Route {
+    std::string_view key;  // "GET /api/ping"
+    Id id;
+};
+
+// N routes in the smallest power-of-two table, at least twice their
+// number, that some seed below kMaxSeeds fills without collisions
+template <typename Id, size_t N>
+class RouteTable {
+public:
+    static constexpr size_t kSlots = [] {
+        size_t slots = 1;
+        while (slots < 2 * N) slots <<= 1;
+        return slots;
+    }();
+    static constexpr uint32_t kMaxSeeds = 1 << 16;
+
+    constexpr RouteTable(const Route<Id> (&routes)[N], Id fallback) : slots_(), fallback_(fallback) {
+        for (uint32_t seed = 0; seed < kMaxSeeds; ++seed) {
+            if (fill(routes, seed)) {
+                seed_ = seed;
+                perfect_ = true;
+                return;
+            }
+        }
+    }
+
+    // False if no seed separated the routes; callers static_assert it
+    constexpr bool perfect() const { return perfect_; }
+    constexpr uint32_t seed() const { return seed_; }
+
+    constexpr Id find(std::string_view request) const {
+        std::string_view key = route_key(request);
+        const Slot& slot = slots_[route_hash(key, seed_) & (kSlots - 1)];
+        return slot.used && slot.key == key ? slot.id : fallback_;
+    }
+
+private:
+    struct Slot {
+        std::string_view key;
+        Id id{};
+        bool used = false;
+    };
+
+    constexpr bool fill(const Route<Id> (&routes)[N], uint32_t seed) {
+        for (Slot& slot : slots_) slot = Slot();
+        for (const Route<Id>& route : routes) {
+            Slot& slot = slots_[route_hash(route.key, seed) & (kSlots - 1)];
+            if (slot.used) return false;
+            slot.key = route.key;
+            slot.id = route.id;
+            slot.used = true;
+        }
+        return true;
+    }
+
+    Slot slots_[kSlots];
+    Id fallback_;
+    uint32_t seed_ = 0;
+    bool perfect_ = false;
+};
+
+template <typename Id, size_t N>
+constexpr RouteTable<Id, N> make_route_table(const Route<Id> (&routes)[N], Id fallback) {
+    return RouteTable<Id, N>(routes, fallback);
+}
+
+// Header text up to where the per-response part starts
+template <size_t N>
+struct ResponseHead {
+    char text[N] = {};
+    size_t size = 0;
+
+    constexpr std::string_view view() const { return std::string_view(text, size); }
+};
+
+// String literals joined at compile time:
+//   constexpr auto kHead = response_head("HTTP/1.1 200 OK\r\n", "Content-Length: ");
+template <size_t... Ns>
+constexpr ResponseHead<(Ns + ... + 0)> response_head(const char (&... parts)[Ns]) {
+    ResponseHead<(Ns + ... + 0)> head;
+    auto append = [&head](const char* part, size_t n) {
+        // Less the terminating NUL
+        for (size_t i = 0; i + 1 < n; ++i) head.text[head.size++] = part[i];
+    };
+    (append(parts, Ns), ...);
+    return head;
+}
+
+// ASCII case-insensitive compare, as header names and tokens want
+constexpr bool equals_ignore_case(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        char x = a[i] >= 'A' && a[i] <= 'Z' ? a[i] - 'A' + 'a' : a[i];
+        char y = b[i] >= 'A' && b[i] <= 'Z' ? b[i] - 'A' + 'a' : b[i];
+        if (x != y) return false;
+    }
+    return true;
+}
+
+// The value of the first NAME: header of a request or response head,
+// with the name matched regardless of case and the value trimmed of
+// spaces and tabs; false if there is none before the blank line
+constexpr bool find_header(std::string_view head, std::string_view name, std::string_view* value) {
+    size_t pos = head.find("\r\n");
+    while (pos != std::string_view::npos && pos + 2 < head.size()) {
+        size_t start = pos + 2;
+        size_t end = head.find("\r\n", start);
+        std::string_view line = head.substr(start, end == std::string_view::npos ? end : end - start);
+        if (line.empty()) return false;
+        if (line.size() > name.size() && line[name.size()] == ':' &&
+            equals_ignore_case(line.substr(0, name.size()), name)) {
+            line.remove_prefix(name.size() + 1);
+            while (!line.empty() && (line.front() == ' ' || line.front() == '\t')) line.remove_prefix(1);
+            while (!line.empty() && (line.back() == ' ' || line.back() == '\t')) line.remove_suffix(1);
+            *value = line;
+            return true;
+        }
+        pos = end;
+    }
+    return false;
+}
+
+// Decimal digits only, as Content-Length allows; false if empty, if
+// anything else is there or if the number doesn't fit
+constexpr bool parse_u64(std::string_view text, uint64_t* value) {
+    if (text.empty()) return false;
+    uint64_t n = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') return false;
+        uint64_t digit = static_cast<uint64_t>(c - '0');
+        if (n > (UINT64_MAX - digit) / 10) return false;
+        n = n * 10 + digit;
+    }
+    *value = n;
+    return true;
+}
+
+// What speed_test_gui answers, by route
+enum class ServerRoute : uint8_t {
+    kPage,  // Anything else gets the GUI
+    kServers,
+    kInfo,
+    kPing,
+    kSamples,
+    kScheduler,
+    kMemory,
+    kUdp,
+    kAgentRun,
+    kAgentResult,
+    kResults,
+    kHistory,
+    kSimulatedDownload,
+    kSimulatedUpload,
+    kStreamDownload,
+    kStreamUpload,
+};
+
+constexpr auto kServerRoutes = make_route_table<ServerRoute>({
+    {"GET /api/servers", ServerRoute::kServers},
+    {"GET /api/info", ServerRoute::kInfo},
+    {"GET /api/ping", ServerRoute::kPing},
+    {"GET /api/samples", ServerRoute::kSamples},
+    {"GET /api/scheduler", ServerRoute::kScheduler},
+    {"GET /api/memory", ServerRoute::kMemory},
+    {"GET /api/udp", ServerRoute::kUdp},
+    {"POST /api/agent/run", ServerRoute::kAgentRun},
+    {"GET /api/agent/result", ServerRoute::kAgentResult},
+    {"POST /api/results", ServerRoute::kResults},
+    {"GET /api/history", ServerRoute::kHistory},
+    {"GET /api/download", ServerRoute::kSimulatedDownload},
+    {"GET /api/upload", ServerRoute::kSimulatedUpload},
+    {"GET /stream/download", ServerRoute::kStreamDownload},
+    {"POST /stream/upload", ServerRoute::kStreamUpload},
+}, ServerRoute::kPage);
+static_assert(kServerRoutes.perfect(), "no seed gives the server's routes a slot each");
+
+// Scheduled bulk streams rather than API calls
+constexpr bool is_stream_route(ServerRoute route) {
+    return route == ServerRoute::kStreamDownload || route == ServerRoute::kStreamUpload;
+}
+
+} // namespace speedtest
+
+#endif // HTTP_ROUTES_H_
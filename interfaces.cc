@@ -0,0 +1,178 @@
+#include "interfaces.h"
+
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+
+namespace speedtest {
+
+namespace {
+
+// First integer in a sysfs file, or `fallback`
+int read_sysfs_int(const std::string& path, int fallback) {
+    std::ifstream in(path);
+    int value;
+    return in >> value ? value : fallback;
+}
+
+std::string address_string(const sockaddr* addr) {
+    char text[INET6_ADDRSTRLEN] = {};
+    if (addr->sa_family == AF_INET) {
+        inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in*>(addr)->sin_addr, text, sizeof(text));
+    } else {
+        inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6*>(addr)->sin6_addr, text, sizeof(text));
+    }
+    return text;
+}
+
+} // namespace
+
+std::vector<NetInterface> list_interfaces() {
+    std::vector<NetInterface> interfaces;
+    ifaddrs* list = nullptr;
+    if (getifaddrs(&list) != 0) return interfaces;
+    for (ifaddrs* ifa = list; ifa; ifa = ifa->ifa_next) {
+        NetInterface* found = nullptr;
+        for (NetInterface& i : interfaces) {
+            if (i.name == ifa->ifa_name) found = &i;
+        }
+        if (!found) {
+            interfaces.emplace_back();
+            found = &interfaces.back();
+            found->name = ifa->ifa_name;
+            found->up = ifa->ifa_flags & IFF_UP;
+            found->loopback = ifa->ifa_flags & IFF_LOOPBACK;
+            std::string sys = "/sys/class/net/" + found->name;
+            found->numa_node = read_sysfs_int(sys + "/device/numa_node", -1);
+            found->speed_mbps = std::max(0, read_sysfs_int(sys + "/speed", 0));
+        }
+        if (ifa->ifa_addr && (ifa->ifa_addr->sa_family == AF_INET || ifa->ifa_addr->sa_family == AF_INET6)) {
+            found->addresses.push_back(address_string(ifa->ifa_addr));
+        }
+    }
+    freeifaddrs(list);
+    return interfaces;
+}
+
+std::string SourceBinding::describe() const {
+    if (device.empty() || address.empty()) return device + address;
+    return device + "/" + address;
+}
+
+bool parse_binding(const std::string& spec, SourceBinding* binding, std::string* error) {
+    *binding = SourceBinding();
+    std::string device = spec;
+    std::string address;
+    size_t slash = spec.find('/');
+    if (slash != std::string::npos) {
+        device = spec.substr(0, slash);
+        address = spec.substr(slash + 1);
+    } else {
+        in6_addr probe;
+        if (inet_pton(AF_INET, spec.c_str(), &probe) == 1 || inet_pton(AF_INET6, spec.c_str(), &probe) == 1) {
+            device.clear();
+            address = spec;
+        }
+    }
+    if (!device.empty() && if_nametoindex(device.c_str()) == 0) {
+        *error = "no interface named " + device;
+        return false;
+    }
+    in6_addr probe;
+    if (!address.empty() && inet_pton(AF_INET, address.c_str(), &probe) != 1 &&
+        inet_pton(AF_INET6, address.c_str(), &probe) != 1) {
+        *error = address + " is not a numeric address";
+        return false;
+    }
+    binding->device = device;
+    binding->address = address;
+    return true;
+}
+
+bool apply_binding(int fd, const SourceBinding& binding, std::string* error) {
+    if (!binding.device.empty() &&
+        setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, binding.device.c_str(), binding.device.size()) != 0) {
+        *error = "SO_BINDTODEVICE " + binding.device + ": " + strerror(errno);
+        return false;
+    }
+    if (binding.address.empty()) return true;
+
+    int family = 0;
+    socklen_t len = sizeof(family);
+    getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &family, &len);
+    sockaddr_storage addr{};
+    if (family == AF_INET) {
+        sockaddr_in* in = reinterpret_cast<sockaddr_in*>(&addr);
+        in->sin_family = AF_INET;
+        len = sizeof(sockaddr_in);
+        if (inet_pton(AF_INET, binding.address.c_str(), &in->sin_addr) != 1) family = 0;
+    } else if (family == AF_INET6) {
+        sockaddr_in6* in6 = reinterpret_cast<sockaddr_in6*>(&addr);
+        in6->sin6_family = AF_INET6;
+        len = sizeof(sockaddr_in6);
+        if (inet_pton(AF_INET6, binding.address.c_str(), &in6->sin6_addr) != 1) family = 0;
+    }
+    if (family == 0) {
+        *error = binding.address + " can't reach this address family";
+        return false;
+    }
+    // Pick the port at connect time, so many streams from one address
+    // don't run out of ephemeral ports
+    int one = 1;
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), len) != 0) {
+        *error = "bind " + binding.address + ": " + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+namespace {
+
+// The interface holding a local address
+std::string address_interface(const std::string& address) {
+    for (const NetInterface& i : list_interfaces()) {
+        for (const std::string& a : i.addresses) {
+            if (a == address) return i.name;
+        }
+    }
+    return "";
+}
+
+} // namespace
+
+std::string binding_interface(const SourceBinding& binding) {
+    return binding.device.empty() ? address_interface(binding.address) : binding.device;
+}
+
+std::string route_interface(const std::string& host, int port) {
+    // Connecting a UDP socket picks the route, and the source address it
+    // would use, without sending anything
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* res = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0) return "";
+    std::string address;
+    int fd = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    sockaddr_storage local{};
+    socklen_t len = sizeof(local);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) == 0 &&
+        getsockname(fd, reinterpret_cast<sockaddr*>(&local), &len) == 0) {
+        address = address_string(reinterpret_cast<sockaddr*>(&local));
+    }
+    if (fd >= 0) close(fd);
+    freeaddrinfo(res);
+    return address.empty() ? "" : address_interface(address);
+}
+
+} // namespace speedtest
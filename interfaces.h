@@ -0,0 +1,50 @@
+#ifndef INTERFACES_H_
+#define INTERFACES_H_
+
+#include <string>
+#include <vector>
+
+namespace speedtest {
+
+// A local network interface, as getifaddrs and sysfs describe it
+struct NetInterface {
+    std::string name;
+    std::vector<std::string> addresses;  // Numeric IPv4 and IPv6
+    bool up = false;
+    bool loopback = false;
+    int numa_node = -1;  // Of the NIC's device; -1 if unknown or virtual
+    int speed_mbps = 0;  // As the driver reports it; 0 if it doesn't
+};
+
+std::vector<NetInterface> list_interfaces();
+
+// Where a test's sockets leave from: a device (SO_BINDTODEVICE), a source
+// address (bound before connecting), both, or wherever the kernel routes
+struct SourceBinding {
+    std::string device;
+    std::string address;
+
+    bool empty() const { return device.empty() && address.empty(); }
+    std::string describe() const;
+};
+
+// "eth0", "10.0.0.2" or "eth0/10.0.0.2"; false with *error if the device
+// doesn't exist or the address isn't numeric
+bool parse_binding(const std::string& spec, SourceBinding* binding, std::string* error);
+
+// Binds a socket that hasn't connected yet; false with *error. A socket
+// of the other address family than binding.address can't use it, which
+// is an error too, so callers move on to the next resolved address.
+bool apply_binding(int fd, const SourceBinding& binding, std::string* error);
+
+// The interface a binding leaves through: its device, or the one holding
+// its address; empty if neither says
+std::string binding_interface(const SourceBinding& binding);
+
+// The interface the kernel routes to `host` through; empty if it can't
+// tell
+std::string route_interface(const std::string& host, int port);
+
+} // namespace speedtest
+
+#endif // INTERFACES_H_
@@ -0,0 +1,860 @@
+#include "io_backend.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <unordered_map>
+
+namespace speedtest {
+
+const char* io_backend_name(IoBackendKind kind) {
+    switch (kind) {
+        case IoBackendKind::kAuto: return "auto";
+        case IoBackendKind::kEpoll: return "epoll";
+        case IoBackendKind::kIoUring: return "io_uring";
+    }
+    return "unknown";
+}
+
+bool parse_io_backend(const std::string& name, IoBackendKind* kind) {
+    if (name == "auto") *kind = IoBackendKind::kAuto;
+    else if (name == "epoll") *kind = IoBackendKind::kEpoll;
+    else if (name == "io_uring" || name == "uring") *kind = IoBackendKind::kIoUring;
+    else return false;
+    return true;
+}
+
+namespace {
+
+void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0 && !(flags & O_NONBLOCK)) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// ---------------------------------------------------------------------------
+// epoll: readiness notifications turned into completions
+// ---------------------------------------------------------------------------
+
+class EpollBackend : public IoBackend {
+public:
+    EpollBackend() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)), arena_(kArenaSize) {}
+    ~EpollBackend() override { if (epoll_fd_ >= 0) close(epoll_fd_); }
+
+    IoBackendKind kind() const override { return IoBackendKind::kEpoll; }
+
+    bool watch_accept(int listen_fd, uint64_t tag) override {
+        FdState& state = fds_[listen_fd];
+        state.listening = true;
+        state.accept_tag = tag;
+        set_nonblocking(listen_fd);
+        return update_interest(listen_fd, state);
+    }
+
+    bool connect(int fd, const sockaddr* addr, socklen_t len, uint64_t tag) override {
+        set_nonblocking(fd);
+        int rc = ::connect(fd, addr, len);
+        if (rc == 0 || errno != EINPROGRESS) {
+            deferred_.push_back({IoCompletion::kConnect, tag, fd, rc == 0 ? 0 : -errno, nullptr});
+            return true;
+        }
+        FdState& state = fds_[fd];
+        state.connecting = true;
+        state.connect_tag = tag;
+        return update_interest(fd, state);
+    }
+
+    bool watch_recv(int fd, uint64_t tag) override {
+        FdState& state = fds_[fd];
+        state.receiving = true;
+        state.recv_tag = tag;
+        set_nonblocking(fd);
+        return update_interest(fd, state);
+    }
+
+    bool send(int fd, const void* data, size_t len, uint64_t tag) override {
+        FdState& state = fds_[fd];
+        set_nonblocking(fd);
+        state.sends.push_back({static_cast<const char*>(data), len, 0, tag});
+        // Try to write straight away; only wait for EPOLLOUT when the
+        // socket buffer is full
+        if (state.sends.size() == 1 && !state.connecting) flush(fd, state);
+        return update_interest(fd, state);
+    }
+
+    void forget(int fd) override {
+        auto it = fds_.find(fd);
+        if (it == fds_.end()) return;
+        for (const PendingSend& s : it->second.sends) {
+            deferred_.push_back({IoCompletion::kSend, s.tag, fd, -ECANCELED, nullptr});
+        }
+        if (it->second.registered) epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        fds_.erase(it);
+    }
+
+    int wait(std::vector<IoCompletion>* out, int timeout_ms) override {
+        out->clear();
+        out->swap(deferred_);
+        arena_used_ = 0;
+
+        epoll_event events[256];
+        int n = epoll_wait(epoll_fd_, events, 256, out->empty() ? timeout_ms : 0);
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            auto it = fds_.find(fd);
+            if (it == fds_.end()) continue;
+            FdState& state = it->second;
+            bool failed = events[i].events & (EPOLLERR | EPOLLHUP);
+
+            if (state.connecting && (events[i].events & EPOLLOUT || failed)) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                state.connecting = false;
+                out->push_back({IoCompletion::kConnect, state.connect_tag, fd, -err, nullptr});
+            }
+            if (state.listening && (events[i].events & EPOLLIN)) {
+                accept_ready(fd, state, out);
+            } else if (state.receiving && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                recv_ready(fd, state, out);
+            }
+            if (!state.connecting && !state.sends.empty() && (events[i].events & EPOLLOUT || failed)) {
+                flush(fd, state);
+            }
+            update_interest(fd, state);
+        }
+        out->insert(out->end(), deferred_.begin(), deferred_.end());
+        deferred_.clear();
+        return static_cast<int>(out->size());
+    }
+
+    int poll_fd() override {
+        return deferred_.empty() ? epoll_fd_ : -1;
+    }
+
+private:
+    static constexpr size_t kArenaSize = 4 << 20;
+    static constexpr size_t kMaxRead = 64 << 10;
+
+    struct PendingSend {
+        const char* data;
+        size_t len;
+        size_t done;
+        uint64_t tag;
+    };
+
+    struct FdState {
+        bool listening = false;
+        bool connecting = false;
+        bool receiving = false;
+        bool registered = false;
+        uint32_t events = 0;
+        uint64_t accept_tag = 0;
+        uint64_t connect_tag = 0;
+        uint64_t recv_tag = 0;
+        std::deque<PendingSend> sends;
+    };
+
+    bool update_interest(int fd, FdState& state) {
+        uint32_t want = 0;
+        if (state.listening || state.receiving) want |= EPOLLIN;
+        if (!state.sends.empty() || state.connecting) want |= EPOLLOUT;
+        if (want == state.events && state.registered) return true;
+
+        epoll_event ev{};
+        ev.events = want;
+        ev.data.fd = fd;
+        int rc = epoll_ctl(epoll_fd_, state.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+        if (rc == 0) {
+            state.registered = true;
+            state.events = want;
+        }
+        return rc == 0;
+    }
+
+    void accept_ready(int fd, FdState& state, std::vector<IoCompletion>* out) {
+        for (int i = 0; i < 64; ++i) {
+            int client = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client < 0) {
+                if (errno != EAGAIN && errno != EINTR) {
+                    out->push_back({IoCompletion::kAccept, state.accept_tag, fd, -errno, nullptr});
+                }
+                break;
+            }
+            out->push_back({IoCompletion::kAccept, state.accept_tag, fd, client, nullptr});
+        }
+    }
+
+    void recv_ready(int fd, FdState& state, std::vector<IoCompletion>* out) {
+        // Every read this round lands in one arena so the data stays valid
+        // until the next wait(). When it is full, level-triggered epoll will
+        // report the socket again.
+        size_t room = std::min(kMaxRead, arena_.size() - arena_used_);
+        if (room == 0) return;
+        char* dst = arena_.data() + arena_used_;
+        ssize_t n = recv(fd, dst, room, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+
+        int result = n < 0 ? -errno : static_cast<int>(n);
+        if (n > 0) arena_used_ += n;
+        else state.receiving = false;
+        out->push_back({IoCompletion::kRecv, state.recv_tag, fd, result, n > 0 ? dst : nullptr});
+    }
+
+    void flush(int fd, FdState& state) {
+        while (!state.sends.empty()) {
+            PendingSend& s = state.sends.front();
+            ssize_t n = ::send(fd, s.data + s.done, s.len - s.done, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EINTR) return;
+                int err = -errno;
+                for (const PendingSend& p : state.sends) {
+                    deferred_.push_back({IoCompletion::kSend, p.tag, fd, err, nullptr});
+                }
+                state.sends.clear();
+                return;
+            }
+            s.done += n;
+            if (s.done < s.len) continue;
+            deferred_.push_back({IoCompletion::kSend, s.tag, fd, static_cast<int>(s.len), nullptr});
+            state.sends.pop_front();
+        }
+    }
+
+    int epoll_fd_;
+    std::unordered_map<int, FdState> fds_;
+    std::vector<IoCompletion> deferred_;
+    std::vector<char> arena_;
+    size_t arena_used_ = 0;
+};
+
+// ---------------------------------------------------------------------------
+// io_uring: multishot accept/recv into a provided buffer ring, registered
+// files for connected sockets, SEND_ZC from registered buffers
+// ---------------------------------------------------------------------------
+
+int uring_setup(unsigned entries, io_uring_params* p) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                const void* arg, size_t argsz) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                                    flags, arg, argsz));
+}
+
+int uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+class UringBackend : public IoBackend {
+public:
+    static std::unique_ptr<IoBackend> create() {
+        std::unique_ptr<UringBackend> backend(new UringBackend());
+        if (!backend->init()) return nullptr;
+        return backend;
+    }
+
+    ~UringBackend() override {
+        if (buffers_) munmap(buffers_, kBufCount * kBufSize);
+        if (buf_ring_) munmap(buf_ring_, buf_ring_size_);
+        if (sqes_) munmap(sqes_, sqes_size_);
+        if (ring_) munmap(ring_, ring_size_);
+        if (ring_fd_ >= 0) close(ring_fd_);
+        for (auto& entry : fds_) {
+            for (Op* op : entry.second.ops) delete op;
+        }
+        for (Op* op : forgotten_) delete op;
+    }
+
+    IoBackendKind kind() const override { return IoBackendKind::kIoUring; }
+
+    bool watch_accept(int listen_fd, uint64_t tag) override {
+        Op* op = new_op(IoCompletion::kAccept, listen_fd, tag);
+        submit_accept(op);
+        return true;
+    }
+
+    bool connect(int fd, const sockaddr* addr, socklen_t len, uint64_t tag) override {
+        Op* op = new_op(IoCompletion::kConnect, fd, tag);
+        std::memcpy(&op->addr, addr, std::min<size_t>(len, sizeof(op->addr)));
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&op->addr);
+        sqe->off = len;
+        sqe->user_data = reinterpret_cast<uint64_t>(op);
+        return true;
+    }
+
+    bool watch_recv(int fd, uint64_t tag) override {
+        Op* op = new_op(IoCompletion::kRecv, fd, tag);
+        submit_recv(op);
+        return true;
+    }
+
+    bool send(int fd, const void* data, size_t len, uint64_t tag) override {
+        Op* op = new_op(IoCompletion::kSend, fd, tag);
+        op->data = static_cast<const char*>(data);
+        op->len = len;
+        if (len == 0) {
+            finish(op, 0, &deferred_);
+            return true;
+        }
+        submit_send(op);
+        return true;
+    }
+
+    void forget(int fd) override {
+        auto it = fds_.find(fd);
+        if (it == fds_.end()) return;
+        FdInfo& info = it->second;
+        for (Op* op : info.ops) {
+            if (op->forgotten) continue;
+            op->forgotten = true;
+            io_uring_sqe* sqe = get_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = reinterpret_cast<uint64_t>(op);
+            sqe->user_data = 0;
+        }
+        // The cancellations must reach the kernel before the caller closes
+        // the descriptor
+        submit();
+        if (info.slot >= 0) {
+            int minus_one = -1;
+            io_uring_files_update update{};
+            update.offset = info.slot;
+            update.fds = reinterpret_cast<uint64_t>(&minus_one);
+            uring_register(ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1);
+            free_slots_.push_back(info.slot);
+            info.slot = -1;
+        }
+        // The ops live on until their last completion, but no longer under
+        // the descriptor, whose number the caller may soon reuse
+        forgotten_.insert(forgotten_.end(), info.ops.begin(), info.ops.end());
+        fds_.erase(it);
+    }
+
+    void register_send_buffer(const void* data, size_t len) override {
+        iovec iov{const_cast<void*>(data), len};
+        std::vector<iovec> next = registered_;
+        next.push_back(iov);
+        if (!registered_.empty()) uring_register(ring_fd_, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+        if (uring_register(ring_fd_, IORING_REGISTER_BUFFERS, next.data(), next.size()) == 0) {
+            registered_ = next;
+        } else if (!registered_.empty()) {
+            // Usually RLIMIT_MEMLOCK; keep the previous table
+            uring_register(ring_fd_, IORING_REGISTER_BUFFERS, registered_.data(), registered_.size());
+        }
+    }
+
+    int wait(std::vector<IoCompletion>* out, int timeout_ms) override {
+        out->clear();
+        out->swap(deferred_);
+        recycle_buffers();
+
+        __kernel_timespec ts{};
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        io_uring_getevents_arg arg{};
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = timeout_ms >= 0 ? reinterpret_cast<uint64_t>(&ts) : 0;
+
+        unsigned to_submit = sq_tail_ - sq_submitted_;
+        unsigned min_complete = out->empty() && stashed_.empty() ? 1 : 0;
+        int rc = uring_enter(ring_fd_, to_submit, min_complete,
+                             IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        // Entries the kernel didn't take go with the next enter
+        if (rc > 0) sq_submitted_ += rc;
+        if (rc < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) return -errno;
+
+        reap(out);
+        out->insert(out->end(), deferred_.begin(), deferred_.end());
+        deferred_.clear();
+        return static_cast<int>(out->size());
+    }
+
+    int poll_fd() override {
+        // With COOP_TASKRUN, finished receives only reach the CQ when we
+        // enter the kernel, so collect those along with submitting. The
+        // ring fd won't wake a poller for ones that finish later: bound
+        // the wait (TestLoop uses epoll instead).
+        unsigned to_submit = sq_tail_ - sq_submitted_;
+        int rc = uring_enter(ring_fd_, to_submit, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (rc > 0) sq_submitted_ += rc;
+        bool ready = !deferred_.empty() || !stashed_.empty() ||
+                     *cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        return ready ? -1 : ring_fd_;
+    }
+
+private:
+    static constexpr unsigned kEntries = 1024;
+    static constexpr unsigned kBufCount = 256;
+    static constexpr unsigned kBufSize = 64 << 10;
+    static constexpr unsigned kFileSlots = 4096;
+    static constexpr uint16_t kBufGroup = 0;
+    static constexpr size_t kZeroCopyMin = 64 << 10;
+
+    struct Op {
+        IoCompletion::Type type;
+        int fd;
+        uint64_t tag;
+        const char* data = nullptr;
+        size_t len = 0;
+        size_t done = 0;
+        int error = 0;
+        bool forgotten = false;
+        bool awaiting_notif = false;
+        bool single_shot = false;
+        sockaddr_storage addr;  // Connect target; the kernel may read it late
+    };
+
+    struct FdInfo {
+        int slot = -1;
+        bool slot_tried = false;
+        bool zero_copy = true;
+        std::vector<Op*> ops;
+    };
+
+    UringBackend() = default;
+
+    bool init() {
+        io_uring_params p{};
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        p.cq_entries = kEntries * 8;
+        ring_fd_ = uring_setup(kEntries, &p);
+        if (ring_fd_ < 0 && errno == EINVAL) {
+            p = io_uring_params{};
+            p.flags = IORING_SETUP_CQSIZE;
+            p.cq_entries = kEntries * 8;
+            ring_fd_ = uring_setup(kEntries, &p);
+        }
+        if (ring_fd_ < 0) return false;
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+            !(p.features & IORING_FEAT_NODROP)) {
+            return false;
+        }
+
+        size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        ring_size_ = std::max(sq_size, cq_size);
+        void* ring = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd_, IORING_OFF_SQ_RING);
+        if (ring == MAP_FAILED) return false;
+        ring_ = static_cast<char*>(ring);
+
+        sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+        sq_head_ = reinterpret_cast<unsigned*>(ring_ + p.sq_off.head);
+        sq_ktail_ = reinterpret_cast<unsigned*>(ring_ + p.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(ring_ + p.sq_off.ring_mask);
+        sq_entries_ = p.sq_entries;
+        unsigned* array = reinterpret_cast<unsigned*>(ring_ + p.sq_off.array);
+        for (unsigned i = 0; i < p.sq_entries; ++i) array[i] = i;
+        sq_tail_ = sq_submitted_ = *sq_ktail_;
+
+        cq_head_ = reinterpret_cast<unsigned*>(ring_ + p.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(ring_ + p.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(ring_ + p.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(ring_ + p.cq_off.cqes);
+
+        if (!probe_ops()) return false;
+        if (!setup_buffer_ring()) return false;
+        setup_file_table();
+        return true;
+    }
+
+    bool probe_ops() {
+        size_t size = sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op);
+        std::vector<char> storage(size, 0);
+        auto* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+        if (uring_register(ring_fd_, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) return false;
+        auto supported = [&](int op) {
+            return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+        };
+        zero_copy_ = supported(IORING_OP_SEND_ZC);
+        return supported(IORING_OP_ACCEPT) && supported(IORING_OP_RECV) &&
+               supported(IORING_OP_SEND) && supported(IORING_OP_ASYNC_CANCEL);
+    }
+
+    bool setup_buffer_ring() {
+        buf_ring_size_ = kBufCount * sizeof(io_uring_buf);
+        void* ring = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) {
+            buf_ring_ = nullptr;
+            return false;
+        }
+        buf_ring_ = static_cast<io_uring_buf_ring*>(ring);
+
+        void* buffers = mmap(nullptr, kBufCount * kBufSize, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffers == MAP_FAILED) return false;
+        buffers_ = static_cast<char*>(buffers);
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+        reg.ring_entries = kBufCount;
+        reg.bgid = kBufGroup;
+        if (uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+
+        for (uint16_t bid = 0; bid < kBufCount; ++bid) recycled_.push_back(bid);
+        recycle_buffers();
+        return true;
+    }
+
+    void setup_file_table() {
+        io_uring_rsrc_register reg{};
+        reg.nr = kFileSlots;
+        reg.flags = IORING_RSRC_REGISTER_SPARSE;
+        if (uring_register(ring_fd_, IORING_REGISTER_FILES2, &reg, sizeof(reg)) < 0) return;
+        for (int slot = kFileSlots - 1; slot >= 0; --slot) free_slots_.push_back(slot);
+    }
+
+    FdInfo& fd_info(int fd) { return fds_[fd]; }
+
+    // Connected sockets get a slot in the registered file table so each op
+    // skips the fd lookup and reference counting
+    void use_fixed_file(io_uring_sqe* sqe, int fd) {
+        FdInfo& info = fd_info(fd);
+        if (!info.slot_tried) {
+            info.slot_tried = true;
+            if (!free_slots_.empty()) {
+                int slot = free_slots_.back();
+                io_uring_files_update update{};
+                update.offset = slot;
+                update.fds = reinterpret_cast<uint64_t>(&fd);
+                if (uring_register(ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1) {
+                    free_slots_.pop_back();
+                    info.slot = slot;
+                }
+            }
+        }
+        if (info.slot >= 0) {
+            sqe->fd = info.slot;
+            sqe->flags |= IOSQE_FIXED_FILE;
+        } else {
+            sqe->fd = fd;
+        }
+    }
+
+    Op* new_op(IoCompletion::Type type, int fd, uint64_t tag) {
+        Op* op = new Op();
+        op->type = type;
+        op->fd = fd;
+        op->tag = tag;
+        fd_info(fd).ops.push_back(op);
+        return op;
+    }
+
+    void release(Op* op) {
+        std::vector<Op*>* ops = &forgotten_;
+        if (!op->forgotten) {
+            auto it = fds_.find(op->fd);
+            ops = it != fds_.end() ? &it->second.ops : nullptr;
+        }
+        if (ops) ops->erase(std::remove(ops->begin(), ops->end(), op), ops->end());
+        delete op;
+    }
+
+    void finish(Op* op, int result, std::vector<IoCompletion>* out) {
+        // Forgotten receives and accepts vanish silently; sends always report
+        // so the owner knows the kernel is done with the buffer
+        if (!op->forgotten || op->type == IoCompletion::kSend) {
+            out->push_back({op->type, op->tag, op->fd, result, nullptr});
+        }
+        release(op);
+    }
+
+    // The next free SQE. A full SQ is submitted first, until the kernel
+    // has consumed a slot: one it still has to read can't be reused.
+    io_uring_sqe* get_sqe() {
+        while (sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+            int rc = submit();
+            if (rc > 0 || rc == -EINTR) continue;
+            // The kernel takes no more until completions make room: set
+            // them aside for the next wait(), waiting briefly for one if
+            // there are none yet
+            if (!stash_completions()) {
+                __kernel_timespec ts{0, 1000000};
+                io_uring_getevents_arg arg{};
+                arg.sigmask_sz = _NSIG / 8;
+                arg.ts = reinterpret_cast<uint64_t>(&ts);
+                uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+                stash_completions();
+            }
+        }
+        io_uring_sqe* sqe = &sqes_[sq_tail_ & sq_mask_];
+        std::memset(sqe, 0, sizeof(*sqe));
+        ++sq_tail_;
+        __atomic_store_n(sq_ktail_, sq_tail_, __ATOMIC_RELEASE);
+        return sqe;
+    }
+
+    // What the enter returned: SQEs taken, or -errno
+    int submit() {
+        unsigned to_submit = sq_tail_ - sq_submitted_;
+        if (to_submit == 0) return 0;
+        int rc = uring_enter(ring_fd_, to_submit, 0, 0, nullptr, 0);
+        if (rc > 0) sq_submitted_ += rc;
+        return rc < 0 ? -errno : rc;
+    }
+
+    // Moves the CQ's completions to stashed_, unhandled: handling them may
+    // need SQEs, and their receive buffers must last until wait() hands
+    // them out. False if there were none.
+    bool stash_completions() {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        if (head == tail) return false;
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+            stashed_.push_back({cqe.user_data, cqe.res, cqe.flags});
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    void submit_accept(Op* op) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = op->fd;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        if (!op->single_shot) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = reinterpret_cast<uint64_t>(op);
+    }
+
+    void submit_recv(Op* op) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        use_fixed_file(sqe, op->fd);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kBufGroup;
+        if (!op->single_shot) sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->user_data = reinterpret_cast<uint64_t>(op);
+    }
+
+    int registered_index(const char* data, size_t len) const {
+        for (size_t i = 0; i < registered_.size(); ++i) {
+            const char* base = static_cast<const char*>(registered_[i].iov_base);
+            if (data >= base && data + len <= base + registered_[i].iov_len) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    void submit_send(Op* op) {
+        const char* data = op->data + op->done;
+        size_t len = op->len - op->done;
+        FdInfo& info = fd_info(op->fd);
+
+        io_uring_sqe* sqe = get_sqe();
+        use_fixed_file(sqe, op->fd);
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->len = static_cast<unsigned>(std::min<size_t>(len, 1u << 30));
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = reinterpret_cast<uint64_t>(op);
+
+        if (zero_copy_ && info.zero_copy && len >= kZeroCopyMin) {
+            sqe->opcode = IORING_OP_SEND_ZC;
+            sqe->ioprio = IORING_SEND_ZC_REPORT_USAGE;
+            int index = registered_index(data, len);
+            if (index >= 0) {
+                sqe->ioprio |= IORING_RECVSEND_FIXED_BUF;
+                sqe->buf_index = static_cast<uint16_t>(index);
+            }
+        } else {
+            sqe->opcode = IORING_OP_SEND;
+        }
+    }
+
+    void recycle_buffers() {
+        if (recycled_.empty()) return;
+        // Index the entries directly: under C++ the header's flexible array
+        // member does not start at offset 0
+        io_uring_buf* bufs = reinterpret_cast<io_uring_buf*>(buf_ring_);
+        unsigned short mask = kBufCount - 1;
+        for (uint16_t bid : recycled_) {
+            io_uring_buf* buf = &bufs[buf_tail_ & mask];
+            buf->addr = reinterpret_cast<uint64_t>(buffers_ + static_cast<size_t>(bid) * kBufSize);
+            buf->len = kBufSize;
+            buf->bid = bid;
+            ++buf_tail_;
+        }
+        recycled_.clear();
+        __atomic_store_n(&buf_ring_->tail, buf_tail_, __ATOMIC_RELEASE);
+    }
+
+    void reap(std::vector<IoCompletion>* out) {
+        // Those get_sqe() set aside came first. Handling them may stash
+        // more, which wait the next round.
+        std::vector<StashedCqe> stashed;
+        stashed.swap(stashed_);
+        for (const StashedCqe& cqe : stashed) {
+            Op* op = reinterpret_cast<Op*>(cqe.user_data);
+            if (op) handle_cqe(op, cqe.res, cqe.flags, out);
+        }
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+            Op* op = reinterpret_cast<Op*>(cqe.user_data);
+            if (op) handle_cqe(op, cqe.res, cqe.flags, out);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+    void handle_cqe(Op* op, int res, unsigned flags, std::vector<IoCompletion>* out) {
+        bool more = flags & IORING_CQE_F_MORE;
+        switch (op->type) {
+            case IoCompletion::kConnect:
+                finish(op, res, out);
+                return;
+
+            case IoCompletion::kAccept:
+                if (res == -EINVAL && !op->single_shot && !more && !op->forgotten) {
+                    // Kernel without multishot accept
+                    op->single_shot = true;
+                    submit_accept(op);
+                    return;
+                }
+                if (!op->forgotten) out->push_back({IoCompletion::kAccept, op->tag, op->fd, res, nullptr});
+                if (!more) {
+                    if (op->forgotten || (res < 0 && res != -ENOBUFS && res != -EINTR)) release(op);
+                    else submit_accept(op);
+                }
+                return;
+
+            case IoCompletion::kRecv: {
+                const char* data = nullptr;
+                if (flags & IORING_CQE_F_BUFFER) {
+                    uint16_t bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+                    data = buffers_ + static_cast<size_t>(bid) * kBufSize;
+                    recycled_.push_back(bid);
+                }
+                if (res == -EINVAL && !op->single_shot && !more && !op->forgotten) {
+                    // Kernel without multishot recv
+                    op->single_shot = true;
+                    submit_recv(op);
+                    return;
+                }
+                if (res == -ENOBUFS && !op->forgotten) {
+                    // Ring ran dry; buffers come back at the next wait()
+                    if (!more) submit_recv(op);
+                    return;
+                }
+                if (!op->forgotten) out->push_back({IoCompletion::kRecv, op->tag, op->fd, res, data});
+                if (!more) {
+                    if (op->forgotten || res <= 0) release(op);
+                    else submit_recv(op);
+                }
+                return;
+            }
+
+            case IoCompletion::kSend:
+                if (flags & IORING_CQE_F_NOTIF) {
+                    // Zero-copy buffer released. Stop using SEND_ZC on sockets
+                    // where the kernel copies anyway (e.g. loopback).
+                    if ((res & IORING_NOTIF_USAGE_ZC_COPIED) && !op->forgotten) fd_info(op->fd).zero_copy = false;
+                    op->awaiting_notif = false;
+                    continue_send(op, out);
+                    return;
+                }
+                if (res == -EINVAL && zero_copy_ && op->done == 0 && !more && !op->forgotten) {
+                    // SEND_ZC flags not supported here; fall back to copying
+                    zero_copy_ = false;
+                    submit_send(op);
+                    return;
+                }
+                if (res == -EOPNOTSUPP && op->done == 0 && !op->forgotten) {
+                    // This socket refuses SEND_ZC (kTLS does); copy from now on
+                    fd_info(op->fd).zero_copy = false;
+                    op->awaiting_notif = more;
+                    if (!more) submit_send(op);
+                    return;
+                }
+                if (res < 0) op->error = res;
+                else op->done += res;
+                op->awaiting_notif = more;
+                if (!more) continue_send(op, out);
+                return;
+        }
+    }
+
+    void continue_send(Op* op, std::vector<IoCompletion>* out) {
+        if (op->error == 0 && op->done < op->len && !op->forgotten) {
+            submit_send(op);
+            return;
+        }
+        int result = op->error ? op->error : static_cast<int>(op->done);
+        if (op->forgotten && op->error == 0 && op->done < op->len) result = -ECANCELED;
+        finish(op, result, out);
+    }
+
+    int ring_fd_ = -1;
+    char* ring_ = nullptr;
+    size_t ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_ktail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned sq_tail_ = 0;
+    unsigned sq_submitted_ = 0;
+
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    // Taken off the CQ by get_sqe(); see stash_completions
+    struct StashedCqe {
+        uint64_t user_data;
+        int res;
+        unsigned flags;
+    };
+    std::vector<StashedCqe> stashed_;
+
+    io_uring_buf_ring* buf_ring_ = nullptr;
+    size_t buf_ring_size_ = 0;
+    char* buffers_ = nullptr;
+    unsigned short buf_tail_ = 0;
+    std::vector<uint16_t> recycled_;
+
+    bool zero_copy_ = false;
+    std::vector<iovec> registered_;
+    std::vector<int> free_slots_;
+    std::unordered_map<int, FdInfo> fds_;
+    std::vector<Op*> forgotten_;  // Cancelled, waiting for their last completion
+    std::vector<IoCompletion> deferred_;
+};
+
+} // namespace
+
+std::unique_ptr<IoBackend> make_io_backend(IoBackendKind kind) {
+    if (kind != IoBackendKind::kEpoll) {
+        std::unique_ptr<IoBackend> uring = UringBackend::create();
+        if (uring) return uring;
+    }
+    return std::unique_ptr<IoBackend>(new EpollBackend());
+}
+
+} // namespace speedtest
@@ -0,0 +1,84 @@
+#ifndef IO_BACKEND_H_
+#define IO_BACKEND_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+
+namespace speedtest {
+
+// Socket I/O backend, chosen at runtime
+enum class IoBackendKind {
+    kAuto,     // io_uring when the kernel supports it, else epoll
+    kEpoll,
+    kIoUring,
+};
+
+const char* io_backend_name(IoBackendKind kind);
+bool parse_io_backend(const std::string& name, IoBackendKind* kind);
+
+// A finished operation, as reported by IoBackend::wait()
+struct IoCompletion {
+    enum Type { kAccept, kRecv, kSend, kConnect };
+
+    Type type;
+    uint64_t tag;        // Caller cookie passed when the op was queued
+    int fd;              // Socket the op ran on
+    int result;          // New fd (accept), bytes (recv/send), 0 on EOF or connect, or -errno
+    const char* data;    // Received bytes for kRecv, valid until the next wait()
+};
+
+// Completion-based socket I/O shared by the server and the client engine.
+//
+// Accepts and receives are persistent: once armed they keep producing
+// completions until the socket fails or is forgotten. Sends complete once
+// the whole buffer is written (short writes are retried internally); the
+// buffer must stay alive until then. Keep at most one send outstanding per
+// socket: io_uring does not order concurrent sends on the same stream.
+class IoBackend {
+public:
+    virtual ~IoBackend() = default;
+
+    virtual IoBackendKind kind() const = 0;
+
+    // Keep accepting connections on a listening socket
+    virtual bool watch_accept(int listen_fd, uint64_t tag) = 0;
+
+    // Non-blocking connect; completes once the handshake finishes or fails.
+    // Queue sends and receives only after that completion.
+    virtual bool connect(int fd, const sockaddr* addr, socklen_t len, uint64_t tag) = 0;
+
+    // Keep receiving on a connected socket until EOF, error or forget()
+    virtual bool watch_recv(int fd, uint64_t tag) = 0;
+
+    // Write all of [data, data + len); one completion when done
+    virtual bool send(int fd, const void* data, size_t len, uint64_t tag) = 0;
+
+    // Cancel everything queued on fd. Outstanding sends still complete
+    // (with -ECANCELED) so their buffers can be released safely. The
+    // caller closes fd afterwards.
+    virtual void forget(int fd) = 0;
+
+    // Long-lived buffer that sends may reference for zero-copy transmit
+    virtual void register_send_buffer(const void* /*data*/, size_t /*len*/) {}
+
+    // Block for up to timeout_ms (-1 = forever) and collect completions
+    virtual int wait(std::vector<IoCompletion>* out, int timeout_ms) = 0;
+
+    // For callers that wait on several backends (or other sockets) at
+    // once: push queued operations to the kernel and return an fd that
+    // polls readable once wait() has something, or -1 if it already does.
+    // Only epoll's wakes a poller promptly; io_uring's lags its sockets.
+    virtual int poll_fd() = 0;
+};
+
+// Build a backend. kAuto and kIoUring fall back to epoll when io_uring
+// cannot be set up on this kernel.
+std::unique_ptr<IoBackend> make_io_backend(IoBackendKind kind);
+
+} // namespace speedtest
+
+#endif // IO_BACKEND_H_
@@ -0,0 +1,217 @@
+// Formats /api/samples bodies the way the server did before JsonWriter
+// (std::ostringstream and operator<<) and the way it does now, and reports
+// the time per body, throughput and how many values survive the round
+// trip through the JSON text unchanged.
+//
+// The payload is what a verified 8-stream test leaves behind: one
+// TCP_INFO sample per stream every 100 ms, with microsecond RTTs and
+// clock-derived timestamps, polled either every 500 ms by the GUI or all
+// at once at the end of a phase.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "json_writer.h"
+#include "payload.h"
+#include "tcp_info.h"
+
+using namespace speedtest;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    int streams = 8;
+    double seconds = 10;     // Of test time covered by the full body
+    double run_s = 1;        // Per measurement
+    uint64_t seed = 1;
+};
+
+std::vector<TcpInfoSample> make_samples(const Options& options) {
+    std::mt19937_64 rng(options.seed);
+    std::uniform_real_distribution<double> unit(0, 1);
+    std::vector<TcpInfoSample> samples;
+    int ticks = static_cast<int>(options.seconds * 10);
+    for (int tick = 1; tick <= ticks; ++tick) {
+        for (int stream = 0; stream < options.streams; ++stream) {
+            TcpInfoSample s;
+            // steady_clock differences, never round
+            s.t_s = tick * 0.1 + unit(rng) * 2e-4;
+            s.stream = stream;
+            s.rtt_ms = static_cast<uint32_t>(8000 + unit(rng) * 4000) / 1000.0;
+            s.rttvar_ms = static_cast<uint32_t>(200 + unit(rng) * 1800) / 1000.0;
+            s.cwnd = 10 + static_cast<uint32_t>(unit(rng) * 400);
+            s.mss = 1448;
+            s.total_retrans = static_cast<uint32_t>(tick * unit(rng) * 3);
+            s.segs_out = tick * 9000 + static_cast<uint32_t>(unit(rng) * 500);
+            s.pacing_rate_bps = static_cast<uint64_t>(2e9 + unit(rng) * 1e9);
+            s.delivery_rate_bps = static_cast<uint64_t>(1e9 + unit(rng) * 5e8);
+            s.busy_us = tick * 100000ull;
+            s.rwnd_limited_us = static_cast<uint64_t>(tick * unit(rng) * 2000);
+            s.sndbuf_limited_us = static_cast<uint64_t>(tick * unit(rng) * 5000);
+            samples.push_back(s);
+        }
+    }
+    return samples;
+}
+
+// The server's samples_json() and tcp_samples_to_json() before JsonWriter
+std::string ostream_json(const std::string& test, uint64_t next, const std::vector<TcpInfoSample>& samples,
+                         const IntegrityCounts& integrity) {
+    std::ostringstream json;
+    json << "{\"test\":\"" << test << "\",\"next\":" << next << ",\"samples\":[";
+    for (size_t i = 0; i < samples.size(); ++i) {
+        const TcpInfoSample& s = samples[i];
+        if (i) json << ",";
+        json << "{\"t\":" << s.t_s
+             << ",\"stream\":" << s.stream
+             << ",\"rtt_ms\":" << s.rtt_ms
+             << ",\"rttvar_ms\":" << s.rttvar_ms
+             << ",\"cwnd\":" << s.cwnd
+             << ",\"mss\":" << s.mss
+             << ",\"retrans\":" << s.total_retrans
+             << ",\"segs_out\":" << s.segs_out
+             << ",\"pacing_bps\":" << s.pacing_rate_bps
+             << ",\"delivery_bps\":" << s.delivery_rate_bps
+             << ",\"busy_us\":" << s.busy_us
+             << ",\"rwnd_limited_us\":" << s.rwnd_limited_us
+             << ",\"sndbuf_limited_us\":" << s.sndbuf_limited_us << "}";
+    }
+    json << "],\"integrity\":{\"bytes\":" << integrity.bytes << ",\"bad_blocks\":" << integrity.bad_blocks << "}}";
+    return json.str();
+}
+
+// What the server does now
+std::string writer_json(const std::string& test, uint64_t next, const std::vector<TcpInfoSample>& samples,
+                        const IntegrityCounts& integrity) {
+    JsonWriter json(samples.size() * 256 + 128);
+    json.begin_object().field("test", test).field("next", next).key("samples");
+    write_tcp_samples(samples, &json);
+    json.key("integrity").begin_object()
+        .field("bytes", integrity.bytes)
+        .field("bad_blocks", integrity.bad_blocks)
+        .end_object();
+    json.end_object();
+    return json.take();
+}
+
+using Formatter = std::string (*)(const std::string&, uint64_t, const std::vector<TcpInfoSample>&,
+                                  const IntegrityCounts&);
+
+struct Measurement {
+    double us_per_body = 0;
+    double mb_per_s = 0;
+    size_t bytes = 0;
+};
+
+Measurement measure(Formatter format, const std::vector<TcpInfoSample>& samples, double run_s) {
+    IntegrityCounts integrity{2650300000ull, 0};
+    Measurement m;
+    m.bytes = format("1d", samples.size(), samples, integrity).size();
+    // Repeat in batches until run_s has passed; the size check keeps the
+    // work from being optimized away
+    uint64_t bodies = 0;
+    size_t total = 0;
+    auto start = Clock::now();
+    double elapsed = 0;
+    while (elapsed < run_s) {
+        for (int i = 0; i < 16; ++i) total += format("1d", bodies + i, samples, integrity).size();
+        bodies += 16;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    if (total == 0) std::abort();
+    m.us_per_body = elapsed * 1e6 / bodies;
+    m.mb_per_s = total / elapsed / 1e6;
+    return m;
+}
+
+// Timestamps and RTTs that read back exactly as they were sent
+size_t exact_values(Formatter format, const std::vector<TcpInfoSample>& samples) {
+    std::string json = format("1d", 0, samples, IntegrityCounts());
+    std::vector<TcpInfoSample> parsed;
+    tcp_samples_from_json(json.substr(json.find('[')), &parsed);
+    size_t exact = 0;
+    for (size_t i = 0; i < std::min(parsed.size(), samples.size()); ++i) {
+        exact += parsed[i].t_s == samples[i].t_s;
+        exact += parsed[i].rtt_ms == samples[i].rtt_ms;
+        exact += parsed[i].rttvar_ms == samples[i].rttvar_ms;
+    }
+    return exact;
+}
+
+void print_usage() {
+    std::cout << "Usage: json_bench [options]\n"
+              << "  --streams=N            Streams sampled (default 8)\n"
+              << "  --seconds=S            Test time in the full body, at 10 samples/s (default 10)\n"
+              << "  --run=S                Time spent on each measurement (default 1)\n"
+              << "  --seed=N               Sample values seed (default 1)\n";
+}
+
+const char* flag_value(const char* arg, const char* name) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) == 0 && arg[len] == '=') return arg + len + 1;
+    return nullptr;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value;
+        if ((value = flag_value(arg, "--streams"))) {
+            options.streams = std::max(1, atoi(value));
+        } else if ((value = flag_value(arg, "--seconds"))) {
+            options.seconds = std::max(0.5, atof(value));
+        } else if ((value = flag_value(arg, "--run"))) {
+            options.run_s = std::max(0.01, atof(value));
+        } else if ((value = flag_value(arg, "--seed"))) {
+            options.seed = std::strtoull(value, nullptr, 10);
+        } else {
+            print_usage();
+            return strcmp(arg, "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    std::vector<TcpInfoSample> all = make_samples(options);
+    // A GUI poll: the last 500 ms
+    size_t poll_size = std::min(all.size(), static_cast<size_t>(options.streams) * 5);
+    std::vector<TcpInfoSample> poll(all.end() - poll_size, all.end());
+
+    std::cout << "  /api/samples bodies, " << options.streams << " streams\n\n";
+    std::cout << "  " << std::left << std::setw(22) << "body" << std::setw(12) << "formatter" << std::right
+              << std::setw(10) << "bytes" << std::setw(12) << "us/body" << std::setw(10) << "MB/s"
+              << std::setw(10) << "speedup" << std::setw(12) << "exact" << "\n";
+    const std::pair<std::string, const std::vector<TcpInfoSample>*> bodies[] = {
+        {"poll (" + std::to_string(poll.size()) + " samples)", &poll},
+        {"full (" + std::to_string(all.size()) + " samples)", &all},
+    };
+    const std::pair<const char*, Formatter> formatters[] = {{"ostream", ostream_json}, {"JsonWriter", writer_json}};
+    for (const auto& body : bodies) {
+        double baseline = 0;
+        for (const auto& formatter : formatters) {
+            Measurement m = measure(formatter.second, *body.second, options.run_s);
+            if (baseline == 0) baseline = m.us_per_body;
+            std::string exact = std::to_string(exact_values(formatter.second, *body.second)) + "/" +
+                                std::to_string(body.second->size() * 3);
+            std::cout << "  " << std::left << std::setw(22) << body.first << std::setw(12) << formatter.first
+                      << std::right << std::fixed << std::setw(10) << m.bytes << std::setprecision(2)
+                      << std::setw(12) << m.us_per_body << std::setprecision(0) << std::setw(10) << m.mb_per_s
+                      << std::setprecision(2) << std::setw(9) << baseline / m.us_per_body << "x"
+                      << std::setw(12) << exact << "\n";
+        }
+    }
+    std::cout << "\n  exact: timestamps and RTTs that parse back to the value that was formatted\n\n";
+    return 0;
+}
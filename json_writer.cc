@@ -0,0 +1,69 @@
+#include "json_writer.h"
+
+#include <cmath>
+
+namespace speedtest {
+
+JsonWriter& JsonWriter::key(std::string_view name) {
+    separate();
+    append_string(name);
+    out_.push_back(':');
+    after_key_ = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(double v) {
+    if (!std::isfinite(v)) return null();
+    separate();
+    char text[32];
+    out_.append(text, std::to_chars(text, text + sizeof(text), v).ptr);
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(bool v) {
+    separate();
+    out_ += v ? "true" : "false";
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(std::string_view s) {
+    separate();
+    append_string(s);
+    return *this;
+}
+
+JsonWriter& JsonWriter::null() {
+    separate();
+    out_ += "null";
+    return *this;
+}
+
+JsonWriter& JsonWriter::raw(std::string_view json) {
+    separate();
+    out_ += json;
+    return *this;
+}
+
+void JsonWriter::append_string(std::string_view s) {
+    static const char kHex[] = "0123456789abcdef";
+    out_.push_back('"');
+    // Copy runs that need no escaping in one go
+    size_t run = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+        unsigned char c = static_cast<unsigned char>(s[i]);
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        out_.append(s.data() + run, i - run);
+        run = i + 1;
+        if (c == '"' || c == '\\') {
+            out_.push_back('\\');
+            out_.push_back(static_cast<char>(c));
+        } else {
+            const char escape[] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xf]};
+            out_.append(escape, sizeof(escape));
+        }
+    }
+    out_.append(s.data() + run, s.size() - run);
+    out_.push_back('"');
+}
+
+} // namespace speedtest
@@ -0,0 +1,83 @@
+#ifndef JSON_WRITER_H_
+#define JSON_WRITER_H_
+
+#include <charconv>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace speedtest {
+
+// Builds JSON by appending to one string: commas and quoting are taken
+// care of, and numbers go through std::to_chars, so doubles come out as
+// the shortest text that reads back as the same value, with no stream
+// state or locale involved. Calls chain:
+//
+//   JsonWriter json;
+//   json.begin_object().field("ping", 12.5).key("samples").begin_array() ...
+//
+// Nothing checks that the calls make a well-formed document.
+class JsonWriter {
+public:
+    explicit JsonWriter(size_t reserve = 256) { out_.reserve(reserve); }
+
+    JsonWriter& begin_object() { return open('{'); }
+    JsonWriter& end_object() { return close('}'); }
+    JsonWriter& begin_array() { return open('['); }
+    JsonWriter& end_array() { return close(']'); }
+    JsonWriter& key(std::string_view name);
+
+    // NaN and infinities, which JSON can't express, are written as null
+    JsonWriter& value(double v);
+    JsonWriter& value(bool v);
+    JsonWriter& value(std::string_view s);
+    JsonWriter& value(const char* s) { return value(std::string_view(s)); }
+    JsonWriter& value(const std::string& s) { return value(std::string_view(s)); }
+    template <typename T, typename = std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>>
+    JsonWriter& value(T v) {
+        separate();
+        char text[24];
+        out_.append(text, std::to_chars(text, text + sizeof(text), v).ptr);
+        return *this;
+    }
+    JsonWriter& null();
+    // Text that is already JSON, e.g. a stored document
+    JsonWriter& raw(std::string_view json);
+
+    template <typename T>
+    JsonWriter& field(std::string_view name, const T& v) { return key(name).value(v); }
+
+    const std::string& str() const { return out_; }
+    std::string take() { return std::move(out_); }
+
+private:
+    // A comma before anything but the first item of a container or the
+    // value after a key
+    void separate() {
+        if (after_key_) after_key_ = false;
+        else if (need_comma_) out_.push_back(',');
+        need_comma_ = true;
+    }
+    JsonWriter& open(char c) {
+        separate();
+        out_.push_back(c);
+        need_comma_ = false;
+        return *this;
+    }
+    JsonWriter& close(char c) {
+        out_.push_back(c);
+        need_comma_ = true;
+        return *this;
+    }
+    void append_string(std::string_view s);
+
+    std::string out_;
+    bool need_comma_ = false;
+    bool after_key_ = false;
+};
+
+} // namespace speedtest
+
+#endif // JSON_WRITER_H_
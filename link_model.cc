@@ -0,0 +1,151 @@
+#include "link_model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+namespace speedtest {
+
+namespace {
+
+const double kMss = 1460;                 // Bytes
+const double kInitialWindow = 10 * kMss;  // RFC 6928
+const double kRetransmitMs = 200;         // Minimum RTO
+
+const LinkProfile kProfiles[] = {
+    // name        down   up     rtt    loss       down_sd up_sd rtt_sd
+    {"default",   {95,    45,    15,    0},        8,      6,    5},
+    {"fiber",     {940,   880,   4,     0.0001},   8,      10,   1},
+    {"cable",     {300,   20,    18,    0.0001},   30,     3,    4},
+    {"dsl",       {40,    8,     25,    0.002},    2,      0.5,  5},
+    {"lte",       {50,    15,    45,    0.001},    20,     6,    15},
+    {"satellite", {100,   10,    600,   0.00001},  25,     3,    40},
+};
+
+// Normal noise that can't push a quantity below a small share of its mean
+double noisy(double mean, double sd, std::mt19937_64& rng) {
+    if (sd <= 0) return mean;
+    return std::max(mean * 0.05, std::normal_distribution<double>(mean, sd)(rng));
+}
+
+} // namespace
+
+LinkState ProfileLink::sample(double /*t_s*/, std::mt19937_64& rng) const {
+    LinkState state = profile_.mean;
+    state.down_mbps = noisy(profile_.mean.down_mbps, profile_.down_sd, rng);
+    state.up_mbps = noisy(profile_.mean.up_mbps, profile_.up_sd, rng);
+    state.rtt_ms = noisy(profile_.mean.rtt_ms, profile_.rtt_sd, rng);
+    return state;
+}
+
+TraceLink::TraceLink(std::string name, std::vector<TracePoint> points)
+    : name_(std::move(name)), points_(std::move(points)) {
+    std::sort(points_.begin(), points_.end(),
+              [](const TracePoint& a, const TracePoint& b) { return a.t_s < b.t_s; });
+}
+
+LinkState TraceLink::sample(double t_s, std::mt19937_64& rng) const {
+    if (points_.empty()) return LinkState();
+    double span = points_.back().t_s - points_.front().t_s;
+    double t = points_.front().t_s + (span > 0 ? std::fmod(std::max(0.0, t_s), span) : 0);
+
+    // Linear between the surrounding points; loss steps
+    auto next = std::upper_bound(points_.begin(), points_.end(), t,
+                                 [](double v, const TracePoint& p) { return v < p.t_s; });
+    if (next == points_.begin()) next = points_.begin() + 1;
+    if (next == points_.end() || points_.size() == 1) {
+        LinkState state = points_.back().state;
+        state.rtt_ms = noisy(state.rtt_ms, state.rtt_ms * 0.05, rng);
+        return state;
+    }
+    const TracePoint& a = *(next - 1);
+    const TracePoint& b = *next;
+    double f = b.t_s > a.t_s ? (t - a.t_s) / (b.t_s - a.t_s) : 0;
+    LinkState state;
+    state.down_mbps = a.state.down_mbps + f * (b.state.down_mbps - a.state.down_mbps);
+    state.up_mbps = a.state.up_mbps + f * (b.state.up_mbps - a.state.up_mbps);
+    state.rtt_ms = a.state.rtt_ms + f * (b.state.rtt_ms - a.state.rtt_ms);
+    state.rtt_ms = noisy(state.rtt_ms, state.rtt_ms * 0.05, rng);
+    state.loss = a.state.loss;
+    return state;
+}
+
+bool load_link_trace(const std::string& path, std::vector<TracePoint>* points, std::string* error) {
+    std::ifstream in(path);
+    if (!in) {
+        if (error) *error = "cannot open " + path;
+        return false;
+    }
+    std::string line;
+    int number = 0;
+    while (std::getline(in, line)) {
+        ++number;
+        line = line.substr(0, line.find('#'));
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        std::replace(line.begin(), line.end(), ',', ' ');
+        std::istringstream fields(line);
+        TracePoint p;
+        if (!(fields >> p.t_s >> p.state.down_mbps >> p.state.up_mbps >> p.state.rtt_ms >> p.state.loss)) {
+            if (error) *error = path + ":" + std::to_string(number) + ": expected t_s,down_mbps,up_mbps,rtt_ms,loss";
+            return false;
+        }
+        points->push_back(p);
+    }
+    if (points->empty()) {
+        if (error) *error = path + ": no trace points";
+        return false;
+    }
+    return true;
+}
+
+std::vector<std::string> link_profile_names() {
+    std::vector<std::string> names;
+    for (const LinkProfile& p : kProfiles) names.push_back(p.name);
+    return names;
+}
+
+std::unique_ptr<LinkModel> make_link_model(const std::string& spec, std::string* error) {
+    if (spec.compare(0, 6, "trace:") == 0) {
+        std::vector<TracePoint> points;
+        if (!load_link_trace(spec.substr(6), &points, error)) return nullptr;
+        return std::unique_ptr<LinkModel>(new TraceLink(spec, std::move(points)));
+    }
+    for (const LinkProfile& p : kProfiles) {
+        if (spec == p.name) return std::unique_ptr<LinkModel>(new ProfileLink(p));
+    }
+    if (error) *error = "unknown link profile '" + spec + "'";
+    return nullptr;
+}
+
+LinkSimulator::LinkSimulator(std::shared_ptr<const LinkModel> model, uint64_t seed, int streams)
+    : model_(std::move(model)), seed_(seed), streams_(std::max(1, streams)), rng_(seed) {}
+
+double LinkSimulator::ping_ms(double t_s) {
+    LinkState state = model_->sample(t_s, rng_);
+    double rtt = state.rtt_ms;
+    // Request or response lost: wait out the retransmit timer
+    if (state.loss > 0 && std::uniform_real_distribution<double>()(rng_) < 1 - std::pow(1 - state.loss, 2)) {
+        rtt += std::max(kRetransmitMs, 2 * state.rtt_ms);
+    }
+    return rtt;
+}
+
+double LinkSimulator::rate_mbps(bool download, double t_s) {
+    LinkState state = model_->sample(t_s, rng_);
+    double link = download ? state.down_mbps : state.up_mbps;
+    double rtt_s = std::max(state.rtt_ms, 0.01) / 1000;
+
+    // Slow start: every stream doubles its window each RTT
+    double ramp_mbps = streams_ * kInitialWindow * 8 / rtt_s / 1e6 * std::pow(2.0, std::min(t_s / rtt_s, 60.0));
+    double rate = std::min(link, ramp_mbps);
+
+    // Mathis et al.: loss-limited Reno throughput per stream
+    if (state.loss > 0) {
+        double mathis_mbps = streams_ * kMss * 8 / rtt_s * 1.22 / std::sqrt(state.loss) / 1e6;
+        rate = std::min(rate, mathis_mbps);
+    }
+    return rate;
+}
+
+} // namespace speedtest
@@ -0,0 +1,110 @@
+#ifndef LINK_MODEL_H_
+#define LINK_MODEL_H_
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace speedtest {
+
+// Link conditions at one instant
+struct LinkState {
+    double down_mbps = 0;   // Bottleneck bandwidth
+    double up_mbps = 0;
+    double rtt_ms = 0;
+    double loss = 0;        // Packet loss probability, 0..1
+};
+
+// A simulated network path. Models are immutable once built, so one model
+// can be shared by any number of threads; all randomness comes from the
+// caller's generator.
+class LinkModel {
+public:
+    virtual ~LinkModel() = default;
+
+    virtual std::string name() const = 0;
+
+    // Conditions t_s seconds into a test
+    virtual LinkState sample(double t_s, std::mt19937_64& rng) const = 0;
+};
+
+// Gaussian noise around fixed means
+struct LinkProfile {
+    std::string name;
+    LinkState mean;
+    double down_sd = 0;
+    double up_sd = 0;
+    double rtt_sd = 0;
+};
+
+class ProfileLink : public LinkModel {
+public:
+    explicit ProfileLink(const LinkProfile& profile) : profile_(profile) {}
+
+    std::string name() const override { return profile_.name; }
+    LinkState sample(double t_s, std::mt19937_64& rng) const override;
+
+private:
+    LinkProfile profile_;
+};
+
+// Replays a recorded trace, looping past its end. Small seeded noise is
+// added to the RTT between trace points so pings aren't all identical.
+//
+// Trace files are CSV, one point per line, '#' starts a comment:
+//   t_s,down_mbps,up_mbps,rtt_ms,loss
+//   0.0,92.1,11.3,24.0,0.001
+struct TracePoint {
+    double t_s = 0;
+    LinkState state;
+};
+
+class TraceLink : public LinkModel {
+public:
+    TraceLink(std::string name, std::vector<TracePoint> points);
+
+    std::string name() const override { return name_; }
+    LinkState sample(double t_s, std::mt19937_64& rng) const override;
+
+private:
+    std::string name_;
+    std::vector<TracePoint> points_;  // Sorted by t_s
+};
+
+bool load_link_trace(const std::string& path, std::vector<TracePoint>* points, std::string* error);
+
+// Built-in profile names, for help text
+std::vector<std::string> link_profile_names();
+
+// "default", "fiber", "cable", "dsl", "lte", "satellite" or "trace:FILE"
+std::unique_ptr<LinkModel> make_link_model(const std::string& spec, std::string* error);
+
+// One simulated client: a model plus its own seeded generator and a
+// virtual clock, so a run is reproducible from (model, seed) and costs no
+// real time. Not shared between threads; give each thread its own.
+class LinkSimulator {
+public:
+    LinkSimulator(std::shared_ptr<const LinkModel> model, uint64_t seed, int streams = 4);
+
+    const LinkModel& model() const { return *model_; }
+    uint64_t seed() const { return seed_; }
+
+    // Round trip of one ping; a lost probe costs a 200 ms retransmit
+    double ping_ms(double t_s = 0);
+
+    // Throughput t_s into a phase: the link rate, ramping up like slow start
+    // over the first few RTTs and capped by what TCP sustains under loss
+    double rate_mbps(bool download, double t_s);
+
+private:
+    std::shared_ptr<const LinkModel> model_;
+    uint64_t seed_;
+    int streams_;
+    std::mt19937_64 rng_;
+};
+
+} // namespace speedtest
+
+#endif // LINK_MODEL_H_
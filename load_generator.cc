@@ -0,0 +1,737 @@
+// Load generator for speed_test_gui: many simulated GUI users at once.
+//
+// Sessions arrive open-loop (Poisson, at a fixed offered rate that does not
+// slow down when the server does) and each follows the GUI flow:
+// /api/info, a burst of /api/ping, one download, one upload. Every request
+// has an intended start time and latency is measured from it, so time spent
+// queued behind an overloaded server or generator counts (no coordinated
+// omission).
+//
+// --slow-clients=N adds connections that never finish (half trickle a
+// request header, half stop reading a download) and polls the server's
+// /api/memory meanwhile, to check its memory stays flat under them.
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "client_engine.h"
+#include "http_routes.h"
+#include "io_backend.h"
+#include "payload.h"
+#include "topology.h"
+
+using namespace speedtest;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    int sessions = 1000;
+    double rate = 100;                 // Session arrivals per second
+    int pings = 10;
+    uint64_t download_bytes = 1 << 20;
+    uint64_t upload_bytes = 1 << 20;
+    int threads = 1;
+    double timeout_s = 30;
+    uint64_t seed = 1;
+    bool keep_alive = true;            // One connection per session, not per request
+    IoBackendKind io_backend = IoBackendKind::kAuto;
+    std::string affinity = "none";     // Worker k on its CPU; see parse_placement
+    int slow_clients = 0;              // Connections that never finish; see SlowClients
+    double trickle_s = 1;              // Between header bytes of a slow client
+};
+
+enum Step { kInfo, kPing, kDownload, kUpload, kStepCount };
+const char* const kStepNames[] = {"info", "ping", "download", "upload"};
+
+// Pauses between phases, as in the GUI's startTest()
+const double kThinkAfterPing = 0.3;
+const double kThinkAfterDownload = 0.5;
+
+const size_t kPayloadSize = 1 << 20;
+const size_t kChunkSize = 256 << 10;
+
+double seconds_between(Clock::time_point a, Clock::time_point b) {
+    return std::chrono::duration<double>(b - a).count();
+}
+
+Clock::time_point after(Clock::time_point t, double seconds) {
+    return t + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+}
+
+struct Stats {
+    std::vector<double> latency_ms[kStepCount];
+    std::vector<double> download_mbps;  // One entry per session
+    std::vector<double> upload_mbps;
+    uint64_t bytes_down = 0;
+    uint64_t bytes_up = 0;
+    int completed = 0;
+    int failed = 0;
+    int unavailable = 0;  // Of those failed, turned away with 503
+    int errors[kStepCount] = {};
+
+    void merge(const Stats& other) {
+        for (int i = 0; i < kStepCount; ++i) {
+            latency_ms[i].insert(latency_ms[i].end(), other.latency_ms[i].begin(), other.latency_ms[i].end());
+            errors[i] += other.errors[i];
+        }
+        download_mbps.insert(download_mbps.end(), other.download_mbps.begin(), other.download_mbps.end());
+        upload_mbps.insert(upload_mbps.end(), other.upload_mbps.begin(), other.upload_mbps.end());
+        bytes_down += other.bytes_down;
+        bytes_up += other.bytes_up;
+        completed += other.completed;
+        failed += other.failed;
+        unavailable += other.unavailable;
+    }
+};
+
+// One event loop driving a share of the sessions
+class Worker {
+public:
+    Worker(const Options& options, int index, int sessions, const sockaddr_storage& addr,
+           socklen_t addr_len, const PayloadPool& payload)
+        : options_(options), index_(index), sessions_(sessions), addr_(addr), addr_len_(addr_len),
+          payload_(payload), backend_(make_io_backend(options.io_backend)),
+          rng_(options.seed * 7919 + index) {
+        backend_->register_send_buffer(payload_.data(), payload_.size());
+    }
+
+    IoBackendKind backend_kind() const { return backend_->kind(); }
+    const Stats& stats() const { return stats_; }
+
+    void run(Clock::time_point start) {
+        // Open-loop arrivals: the whole schedule is fixed up front
+        double rate = options_.rate / options_.threads;
+        std::exponential_distribution<double> gap(rate);
+        double t = 0;
+        sessions_state_.resize(sessions_);
+        for (int i = 0; i < sessions_; ++i) {
+            t += gap(rng_);
+            schedule(i, after(start, t));
+        }
+
+        std::vector<IoCompletion> events;
+        auto last_timeout_check = start;
+        while (stats_.completed + stats_.failed < sessions_) {
+            auto now = Clock::now();
+            while (!due_.empty() && due_.top().first <= now) {
+                int index = due_.top().second;
+                Clock::time_point intended = due_.top().first;
+                due_.pop();
+                start_request(index, intended);
+            }
+
+            int timeout_ms = 10;
+            if (!due_.empty()) {
+                double wait = seconds_between(Clock::now(), due_.top().first);
+                timeout_ms = std::max(0, std::min(10, static_cast<int>(wait * 1000)));
+            }
+            backend_->wait(&events, timeout_ms);
+            for (const IoCompletion& ev : events) on_event(ev);
+
+            now = Clock::now();
+            if (seconds_between(last_timeout_check, now) >= 0.1) {
+                last_timeout_check = now;
+                for (int i = 0; i < sessions_; ++i) {
+                    Session& s = sessions_state_[i];
+                    if (s.busy && seconds_between(s.intended, now) > options_.timeout_s) fail(i);
+                }
+            }
+        }
+    }
+
+private:
+    struct Session {
+        Step step = kInfo;
+        int pings_left = 0;
+        Clock::time_point intended;      // When the current request should have started
+        Clock::time_point connected;     // Or, on a reused connection, when the request went out
+        bool busy = false;               // A request is outstanding
+        int fd = -1;
+        uint64_t conn_id = 0;
+        std::string request;
+        std::string header;
+        bool header_done = false;
+        bool closing = false;            // The server said Connection: close
+        uint64_t body_expected = 0;
+        uint64_t body_received = 0;
+        uint64_t upload_left = 0;
+        size_t payload_offset = 0;
+    };
+
+    using Due = std::pair<Clock::time_point, int>;
+
+    void schedule(int index, Clock::time_point when) { due_.push({when, index}); }
+
+    void start_request(int index, Clock::time_point intended) {
+        Session& s = sessions_state_[index];
+        s.intended = intended;
+        s.busy = true;
+        s.header.clear();
+        s.header_done = false;
+        s.body_expected = 0;
+        s.body_received = 0;
+
+        std::string host = "Host: " + options_.host + "\r\n";
+        if (!options_.keep_alive) host += "Connection: close\r\n";
+        // Each simulated user is its own session in the server's scheduler
+        std::string session = "session=lg" + std::to_string(index_) + "-" + std::to_string(index);
+        switch (s.step) {
+            case kInfo:
+                s.request = "GET /api/info HTTP/1.1\r\n" + host + "\r\n";
+                break;
+            case kPing:
+                s.request = "GET /api/ping HTTP/1.1\r\n" + host + "\r\n";
+                break;
+            case kDownload:
+                s.request = "GET /stream/download?bytes=" + std::to_string(options_.download_bytes) +
+                            "&" + session + " HTTP/1.1\r\n" + host + "\r\n";
+                break;
+            case kUpload:
+                s.request = "POST /stream/upload?" + session + " HTTP/1.1\r\n" + host +
+                            "Content-Type: application/octet-stream\r\nContent-Length: " +
+                            std::to_string(options_.upload_bytes) + "\r\n\r\n";
+                s.upload_left = options_.upload_bytes;
+                break;
+            default:
+                return;
+        }
+
+        if (s.fd >= 0) {
+            s.connected = Clock::now();
+            backend_->send(s.fd, s.request.data(), s.request.size(), s.conn_id);
+            return;
+        }
+        s.fd = socket(addr_.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (s.fd < 0) {
+            fail(index);
+            return;
+        }
+        s.conn_id = next_conn_id_++;
+        conn_to_session_[s.conn_id] = index;
+        backend_->connect(s.fd, reinterpret_cast<const sockaddr*>(&addr_), addr_len_, s.conn_id);
+    }
+
+    void on_event(const IoCompletion& ev) {
+        auto it = conn_to_session_.find(ev.tag);
+        if (it == conn_to_session_.end()) return;
+        int index = it->second;
+        Session& s = sessions_state_[index];
+        if (s.conn_id != ev.tag || s.fd < 0) return;
+
+        if (ev.result < 0) {
+            fail(index);
+            return;
+        }
+        switch (ev.type) {
+            case IoCompletion::kConnect:
+                s.connected = Clock::now();
+                backend_->watch_recv(s.fd, s.conn_id);
+                backend_->send(s.fd, s.request.data(), s.request.size(), s.conn_id);
+                break;
+            case IoCompletion::kSend:
+                if (s.step == kUpload && s.upload_left > 0) send_upload_chunk(s);
+                break;
+            case IoCompletion::kRecv:
+                // The server may drop a kept-alive connection between requests
+                if (ev.result == 0 && !s.busy) close_connection(s);
+                else if (ev.result == 0) fail(index);
+                else on_data(index, ev.data, ev.result);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void send_upload_chunk(Session& s) {
+        size_t len = std::min<uint64_t>(s.upload_left, kChunkSize);
+        s.upload_left -= len;
+        stats_.bytes_up += len;
+        backend_->send(s.fd, payload_.at(s.payload_offset), len, s.conn_id);
+        s.payload_offset = (s.payload_offset + kChunkSize) % payload_.size();
+    }
+
+    void on_data(int index, const char* data, size_t len) {
+        Session& s = sessions_state_[index];
+        if (!s.header_done) {
+            s.header.append(data, len);
+            size_t end = s.header.find("\r\n\r\n");
+            if (end == std::string::npos) return;
+            s.header_done = true;
+            // A full server answers 503, for memory or for a scheduler
+            // slot; either way that session is lost
+            int status = s.header.size() > 12 ? std::atoi(s.header.c_str() + 9) : 0;
+            if (status != 200) {
+                if (status == 503) stats_.unavailable++;
+                fail(index);
+                return;
+            }
+            std::string_view head(s.header.data(), end + 2);
+            std::string_view value;
+            s.body_expected = 0;
+            if (find_header(head, "Content-Length", &value) && !parse_u64(value, &s.body_expected)) {
+                fail(index);
+                return;
+            }
+            s.closing = find_header(head, "Connection", &value) && equals_ignore_case(value, "close");
+            len = s.header.size() - (end + 4);
+        }
+        s.body_received += len;
+        if (s.step == kDownload) stats_.bytes_down += len;
+        if (s.body_received >= s.body_expected) finish_step(index);
+    }
+
+    void finish_step(int index) {
+        Session& s = sessions_state_[index];
+        auto now = Clock::now();
+        stats_.latency_ms[s.step].push_back(seconds_between(s.intended, now) * 1000);
+        s.busy = false;
+        if (!options_.keep_alive || s.step == kUpload || s.closing) {
+            close_connection(s);
+        }
+
+        double transfer_s = seconds_between(s.connected, now);
+        switch (s.step) {
+            case kInfo:
+                s.step = kPing;
+                s.pings_left = options_.pings;
+                schedule(index, now);
+                break;
+            case kPing:
+                if (--s.pings_left > 0) {
+                    schedule(index, now);
+                } else {
+                    s.step = kDownload;
+                    schedule(index, after(now, kThinkAfterPing));
+                }
+                break;
+            case kDownload:
+                stats_.download_mbps.push_back(options_.download_bytes * 8.0 / transfer_s / 1e6);
+                s.step = kUpload;
+                schedule(index, after(now, kThinkAfterDownload));
+                break;
+            case kUpload:
+                stats_.upload_mbps.push_back(options_.upload_bytes * 8.0 / transfer_s / 1e6);
+                s.step = kStepCount;
+                stats_.completed++;
+                break;
+            default:
+                break;
+        }
+    }
+
+    void fail(int index) {
+        Session& s = sessions_state_[index];
+        if (s.step < kStepCount) stats_.errors[s.step]++;
+        s.step = kStepCount;
+        s.busy = false;
+        close_connection(s);
+        stats_.failed++;
+    }
+
+    void close_connection(Session& s) {
+        if (s.fd < 0) return;
+        conn_to_session_.erase(s.conn_id);
+        backend_->forget(s.fd);
+        close(s.fd);
+        s.fd = -1;
+    }
+
+    const Options& options_;
+    int index_;
+    int sessions_;
+    sockaddr_storage addr_;
+    socklen_t addr_len_;
+    const PayloadPool& payload_;
+    std::unique_ptr<IoBackend> backend_;
+    std::mt19937_64 rng_;
+    Stats stats_;
+    std::vector<Session> sessions_state_;
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> due_;
+    std::unordered_map<uint64_t, int> conn_to_session_;
+    uint64_t next_conn_id_ = 1;
+};
+
+// Connections that hold on to the server for as long as it lets them:
+// half send a request header a byte at a time, never ending it
+// (slowloris), half ask for an endless download with a tiny receive
+// buffer and never read it. Whichever the server hangs up on is opened
+// again, so the pressure stays on.
+class SlowClients {
+public:
+    SlowClients(const Options& options, const sockaddr_storage& addr, socklen_t addr_len)
+        : options_(options), addr_(addr), addr_len_(addr_len), clients_(options.slow_clients) {
+        for (size_t i = 0; i < clients_.size(); ++i) clients_[i].reader = i % 2 == 1;
+    }
+
+    uint64_t opened() const { return opened_; }
+    uint64_t hung_up() const { return hung_up_; }
+
+    void run(const std::atomic<bool>& stop) {
+        std::vector<pollfd> fds;
+        while (!stop) {
+            auto now = Clock::now();
+            fds.clear();
+            for (size_t i = 0; i < clients_.size(); ++i) {
+                Slow& c = clients_[i];
+                if (c.fd < 0) open(static_cast<int>(i), now);
+                else if (!c.reader && now >= c.next) trickle(c, now);
+                if (c.fd >= 0) fds.push_back({c.fd, POLLRDHUP, 0});
+            }
+            // Hung up on, even with a download still unread
+            poll(fds.data(), fds.size(), 100);
+            size_t k = 0;
+            for (Slow& c : clients_) {
+                if (c.fd < 0) continue;
+                if (fds[k++].revents & (POLLRDHUP | POLLHUP | POLLERR)) drop(c);
+            }
+        }
+        for (Slow& c : clients_) {
+            if (c.fd >= 0) close(c.fd);
+        }
+    }
+
+private:
+    struct Slow {
+        bool reader = false;
+        int fd = -1;
+        size_t sent = 0;              // Of the endless header
+        Clock::time_point next;       // Its next byte
+    };
+
+    void open(int index, Clock::time_point now) {
+        Slow& c = clients_[index];
+        c.fd = socket(addr_.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (c.fd < 0) return;
+        if (c.reader) {
+            int small = 4096;
+            setsockopt(c.fd, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+        }
+        if (connect(c.fd, reinterpret_cast<const sockaddr*>(&addr_), addr_len_) != 0) {
+            close(c.fd);
+            c.fd = -1;
+            return;
+        }
+        ++opened_;
+        c.sent = 0;
+        c.next = now;
+        if (c.reader) {
+            std::string request = "GET /stream/download?bytes=1000000000000&session=slow" + std::to_string(index) +
+                                  " HTTP/1.1\r\nHost: " + options_.host + "\r\n\r\n";
+            if (send(c.fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+                drop(c);
+            }
+        }
+    }
+
+    void trickle(Slow& c, Clock::time_point now) {
+        static const char kStart[] = "GET /api/info HTTP/1.1\r\n";
+        static const char kFiller[] = "X-a: b\r\n";
+        char byte = c.sent < sizeof(kStart) - 1 ? kStart[c.sent]
+                                                : kFiller[(c.sent - (sizeof(kStart) - 1)) % (sizeof(kFiller) - 1)];
+        if (send(c.fd, &byte, 1, MSG_NOSIGNAL) != 1) {
+            drop(c);
+            return;
+        }
+        ++c.sent;
+        c.next = after(now, options_.trickle_s);
+    }
+
+    void drop(Slow& c) {
+        close(c.fd);
+        c.fd = -1;
+        ++hung_up_;
+    }
+
+    const Options& options_;
+    sockaddr_storage addr_;
+    socklen_t addr_len_;
+    std::vector<Slow> clients_;
+    uint64_t opened_ = 0;
+    uint64_t hung_up_ = 0;
+};
+
+// What the server's /api/memory said over the run
+struct MemoryTrace {
+    std::vector<uint64_t> rss_bytes;
+    uint64_t max_buffered = 0;
+    uint64_t max_connections = 0;
+    uint64_t refused = 0;
+    uint64_t over_budget = 0;
+    uint64_t busy = 0;
+    uint64_t timed_out = 0;
+};
+
+uint64_t json_u64(const std::string& json, const char* key) {
+    std::string field = std::string("\"") + key + "\":";
+    size_t pos = json.find(field);
+    return pos == std::string::npos ? 0 : std::strtoull(json.c_str() + pos + field.size(), nullptr, 10);
+}
+
+bool poll_memory(const Options& options, MemoryTrace* trace) {
+    std::string body;
+    if (!http_get(options.host, options.port, "/api/memory", &body)) return false;
+    trace->rss_bytes.push_back(json_u64(body, "rss_bytes"));
+    trace->max_buffered = std::max(trace->max_buffered, json_u64(body, "buffered_bytes"));
+    trace->max_connections = std::max(trace->max_connections, json_u64(body, "connections"));
+    trace->refused = json_u64(body, "refused");
+    trace->over_budget = json_u64(body, "over_budget");
+    trace->busy = json_u64(body, "busy");
+    trace->timed_out = json_u64(body, "timed_out");
+    return true;
+}
+
+double percentile(std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+    return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+// Jain's fairness index: 1 when every client got the same rate, 1/n when
+// one client got everything
+double jain_index(const std::vector<double>& x) {
+    double sum = 0, sum_sq = 0;
+    for (double v : x) {
+        sum += v;
+        sum_sq += v * v;
+    }
+    return sum_sq > 0 ? sum * sum / (x.size() * sum_sq) : 0;
+}
+
+void print_report(Stats& stats, const Options& options, double wall_s) {
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "\n  LOAD TEST RESULTS\n";
+    std::cout << "  Sessions       " << options.sessions << " offered at " << options.rate << "/s, "
+              << stats.completed << " completed, " << stats.failed << " failed (" << stats.unavailable
+              << " on 503)\n";
+    std::cout << "  Wall time      " << wall_s << " s\n";
+    size_t requests = 0;
+    for (int i = 0; i < kStepCount; ++i) requests += stats.latency_ms[i].size();
+    std::cout << "  Requests       " << requests << " (" << requests / wall_s << "/s, "
+              << (options.keep_alive ? "keep-alive" : "new connection each") << ")\n";
+    std::cout << "  Throughput     " << stats.bytes_down * 8.0 / wall_s / 1e9 << " Gbit/s down, "
+              << stats.bytes_up * 8.0 / wall_s / 1e9 << " Gbit/s up (aggregate)\n";
+
+    std::cout << "\n  Latency from intended start (ms)\n";
+    std::cout << "  " << std::left << std::setw(10) << "request" << std::right
+              << std::setw(9) << "count" << std::setw(8) << "errors" << std::setw(10) << "p50"
+              << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "p99.9"
+              << std::setw(10) << "max" << "\n";
+    for (int i = 0; i < kStepCount; ++i) {
+        std::vector<double>& v = stats.latency_ms[i];
+        std::sort(v.begin(), v.end());
+        std::cout << "  " << std::left << std::setw(10) << kStepNames[i] << std::right
+                  << std::setw(9) << v.size() << std::setw(8) << stats.errors[i]
+                  << std::setw(10) << percentile(v, 50) << std::setw(10) << percentile(v, 90)
+                  << std::setw(10) << percentile(v, 99) << std::setw(10) << percentile(v, 99.9)
+                  << std::setw(10) << (v.empty() ? 0 : v.back()) << "\n";
+    }
+
+    std::cout << "\n  Per-client rate (Mbps)\n";
+    std::cout << "  " << std::left << std::setw(10) << "phase" << std::right << std::setw(10) << "min"
+              << std::setw(10) << "p50" << std::setw(10) << "max" << std::setw(10) << "Jain" << "\n";
+    std::vector<double>* rates[] = {&stats.download_mbps, &stats.upload_mbps};
+    const char* names[] = {"download", "upload"};
+    for (int i = 0; i < 2; ++i) {
+        std::vector<double>& v = *rates[i];
+        std::sort(v.begin(), v.end());
+        std::cout << "  " << std::left << std::setw(10) << names[i] << std::right
+                  << std::setw(10) << (v.empty() ? 0 : v.front()) << std::setw(10) << percentile(v, 50)
+                  << std::setw(10) << (v.empty() ? 0 : v.back()) << std::setw(10)
+                  << std::setprecision(3) << jain_index(v) << std::setprecision(2) << "\n";
+    }
+    std::cout << "\n";
+}
+
+void print_memory(const MemoryTrace& trace, const SlowClients* slow) {
+    if (trace.rss_bytes.empty()) return;
+    auto mib = [](uint64_t bytes) { return bytes / 1048576.0; };
+    const std::vector<uint64_t>& rss = trace.rss_bytes;
+    std::cout << "  Server memory (" << rss.size() << " polls of /api/memory)\n";
+    std::cout << "  RSS            " << mib(rss.front()) << " MiB at start, "
+              << mib(*std::max_element(rss.begin(), rss.end())) << " MiB peak, " << mib(rss.back())
+              << " MiB at end\n";
+    std::cout << "  Buffered       " << mib(trace.max_buffered) << " MiB peak over " << trace.max_connections
+              << " connections at most\n";
+    std::cout << "  Turned away    " << trace.refused << " connections refused, " << trace.over_budget
+              << " over the memory budget, " << trace.busy << " busy, " << trace.timed_out
+              << " connections timed out\n";
+    if (slow) {
+        std::cout << "  Slow clients   " << slow->opened() << " opened, " << slow->hung_up()
+                  << " hung up on by the server\n";
+    }
+    std::cout << "\n";
+}
+
+void print_usage() {
+    std::cout << "Usage: load_generator [options]\n"
+              << "  --server=HOST:PORT     speed_test_gui to load (default 127.0.0.1:8080)\n"
+              << "  --sessions=N           Simulated GUI users in total (default 1000)\n"
+              << "  --rate=N               Session arrivals per second (default 100)\n"
+              << "  --pings=N              Pings per session (default 10)\n"
+              << "  --download-bytes=N     Download size per session (default 1048576)\n"
+              << "  --upload-bytes=N       Upload size per session (default 1048576)\n"
+              << "  --threads=N            Generator event loops (default 1)\n"
+              << "  --timeout=SECONDS      Per-request timeout (default 30)\n"
+              << "  --seed=N               Arrival schedule seed (default 1)\n"
+              << "  --keep-alive=0|1       Reuse one connection per session (default 1)\n"
+              << "  --io-backend=KIND      auto, epoll or io_uring (default auto)\n"
+              << "  --affinity=SPEC        Pin event loops: none, node, node:N, auto (a core each\n"
+              << "                         near the NIC, away from its IRQs) or a CPU list\n"
+              << "  --slow-clients=N       Connections that trickle a header or never read (default 0)\n"
+              << "  --trickle=SECONDS      Between a slow client's header bytes (default 1)\n";
+}
+
+const char* flag_value(const char* arg, const char* name) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) == 0 && arg[len] == '=') return arg + len + 1;
+    return nullptr;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value;
+        if ((value = flag_value(arg, "--server"))) {
+            std::string server = value;
+            size_t colon = server.rfind(':');
+            options.host = server.substr(0, colon);
+            if (colon != std::string::npos) options.port = atoi(server.c_str() + colon + 1);
+        } else if ((value = flag_value(arg, "--sessions"))) {
+            options.sessions = std::max(1, atoi(value));
+        } else if ((value = flag_value(arg, "--rate"))) {
+            options.rate = std::max(0.001, atof(value));
+        } else if ((value = flag_value(arg, "--pings"))) {
+            options.pings = std::max(1, atoi(value));
+        } else if ((value = flag_value(arg, "--download-bytes"))) {
+            options.download_bytes = std::strtoull(value, nullptr, 10);
+        } else if ((value = flag_value(arg, "--upload-bytes"))) {
+            options.upload_bytes = std::strtoull(value, nullptr, 10);
+        } else if ((value = flag_value(arg, "--threads"))) {
+            options.threads = std::max(1, atoi(value));
+        } else if ((value = flag_value(arg, "--timeout"))) {
+            options.timeout_s = std::max(0.1, atof(value));
+        } else if ((value = flag_value(arg, "--seed"))) {
+            options.seed = std::strtoull(value, nullptr, 10);
+        } else if ((value = flag_value(arg, "--keep-alive"))) {
+            options.keep_alive = atoi(value) != 0;
+        } else if ((value = flag_value(arg, "--io-backend"))) {
+            if (!parse_io_backend(value, &options.io_backend)) {
+                std::cerr << "Unknown I/O backend: " << value << "\n";
+                return 1;
+            }
+        } else if ((value = flag_value(arg, "--affinity"))) {
+            options.affinity = value;
+        } else if ((value = flag_value(arg, "--slow-clients"))) {
+            options.slow_clients = std::max(0, atoi(value));
+        } else if ((value = flag_value(arg, "--trickle"))) {
+            options.trickle_s = std::max(0.01, atof(value));
+        } else {
+            print_usage();
+            return strcmp(arg, "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    sockaddr_storage addr{};
+    socklen_t addr_len = 0;
+    if (!resolve_tcp(options.host, options.port, &addr, &addr_len)) {
+        std::cerr << "Cannot resolve " << options.host << "\n";
+        return 1;
+    }
+
+    Placement placement;
+    std::string error;
+    if (!parse_placement(options.affinity, route_interface(options.host, options.port), &placement, &error)) {
+        std::cerr << "--affinity: " << error << "\n";
+        return 1;
+    }
+
+    // Thousands of concurrent sessions need thousands of descriptors
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    PayloadPool payload(options.seed, kPayloadSize);
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < options.threads; ++i) {
+        int share = options.sessions / options.threads + (i < options.sessions % options.threads);
+        workers.emplace_back(new Worker(options, i, share, addr, addr_len, payload));
+    }
+    // Every worker's io_uring has pinned it by now
+    payload.seal();
+    std::cout << "  Loading " << options.host << ":" << options.port << " with " << options.sessions
+              << " sessions at " << options.rate << "/s (" << options.threads << " thread(s), "
+              << io_backend_name(workers[0]->backend_kind()) << ")\n";
+    if (!placement.empty()) {
+        std::cout << "  Event loops on cpus " << format_cpu_list(placement.cpus);
+        if (placement.numa_node >= 0) std::cout << ", node " << placement.numa_node;
+        std::cout << "\n";
+    }
+
+    // Slow clients get a head start, so the sessions run into them
+    std::atomic<bool> stop{false};
+    MemoryTrace memory;
+    poll_memory(options, &memory);
+    std::unique_ptr<SlowClients> slow;
+    std::thread slow_thread;
+    if (options.slow_clients > 0) {
+        slow.reset(new SlowClients(options, addr, addr_len));
+        slow_thread = std::thread([&] { slow->run(stop); });
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        std::cout << "  " << options.slow_clients << " slow clients holding on, a byte every " << options.trickle_s
+                  << " s or none read\n";
+    }
+    std::thread memory_thread([&] {
+        while (!stop) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            if (!stop) poll_memory(options, &memory);
+        }
+    });
+
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers.size(); ++i) {
+        threads.emplace_back([&placement, &worker = workers[i], i, start] {
+            pin_to_cpus(placement.thread_cpus(i));
+            worker->run(start);
+        });
+    }
+    for (std::thread& t : threads) t.join();
+    double wall_s = seconds_between(start, Clock::now());
+    stop = true;
+    memory_thread.join();
+    if (slow_thread.joinable()) slow_thread.join();
+    poll_memory(options, &memory);
+
+    Stats total;
+    for (auto& worker : workers) total.merge(worker->stats());
+    print_report(total, options, wall_s);
+    print_memory(memory, slow.get());
+    return total.failed > 0 ? 2 : 0;
+}
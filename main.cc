@@ -1,16 +1,588 @@
 #include "benchmark.h"
+#include "history.h"
+#include "mesh.h"
+#include "topology.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sys/socket.h>
+#include <unistd.h>
 
 using namespace speedtest;
 
-int main() {
-    SpeedTest::print_header();
-    
-    std::cout << "  Connecting to server...\n\n";
-    
-    SpeedTest test;
-    SpeedResult result = test.run_full_test();
-    
-    SpeedTest::print_result(result);
-    
+static void print_usage() {
+    std::cout << "Usage: speed_test [options]\n"
+              << "  --server=HOST:PORT     Run live tests against a speed_test_gui server\n"
+              << "                         (without it, results are simulated)\n"
+              << "  --streams=N            Parallel TCP streams (default 4)\n"
+              << "  --duration=SECONDS     Longest throughput phase (default 10)\n"
+              << "  --precision=FRACTION   End a phase early once its 95% interval is within\n"
+              << "                         +/- this of the mean (default 0.02; 0 = full duration)\n"
+              << "  --io-backend=KIND      auto, epoll or io_uring (default auto)\n"
+              << "  --record=FILE          Save pings, per-stream bytes and TCP_INFO for trace_replay\n"
+              << "  --tls                  Test over HTTPS (the server's --tls-port); also implied\n"
+              << "                         by --server=https://HOST:PORT\n"
+              << "  --tls-verify           Check the server's certificate (default: accept any)\n"
+              << "  --ktls=0|1             Let the kernel encrypt what we send (default 1)\n"
+              << "  --transport=LIST       http, tcp (the server's --tcp-port) or udp (its\n"
+              << "                         --udp-port); several, e.g. http,tcp,udp, are compared\n"
+              << "  --udp-rate=BITS        UDP target rate across all streams (default 100m)\n"
+              << "  --udp-size=BYTES       UDP datagram size (default 1200)\n"
+              << "  --verify               CRC32C-check the payload at the receiving end (http and tcp)\n"
+              << "  --bind=LIST            Leave from these interfaces and/or source addresses, e.g.\n"
+              << "                         eth0,wlan0 or eth0/10.0.0.2; each is tested and compared\n"
+              << "  --parallel             Test every --bind source at once instead of in turn\n"
+              << "  --interfaces           List local interfaces and exit\n"
+              << "  --affinity=SPEC        Pin each test's thread: none, node (the NIC's NUMA node;\n"
+              << "                         the default with --bind), node:N, auto (a core of its own\n"
+              << "                         on the NIC's node, away from its IRQs) or a CPU list\n"
+              << "  --json                 Print each result as one line of JSON, and nothing else\n"
+              << "  --submit               Add each result to the server's history (/api/history)\n"
+              << "\n"
+              << "Mesh (agents are speed_test_gui --agent=1 at each site):\n"
+              << "  --mesh=SITES           Test every pair of [NAME=]HOST:PORT sites, with the test\n"
+              << "                         options above, and print the matrix\n"
+              << "  --pairs=LIST           Only these pairs, e.g. a:b,a:c (default all)\n"
+              << "  --mesh-parallel=N      At most N tests at once (default: one per site)\n"
+              << "  --mesh-token=SECRET    The agents' --agent-token\n"
+              << "\n"
+              << "Simulation (without --server):\n"
+              << "  --simulate=LINK        Link model: default, fiber, cable, dsl, lte, satellite,\n"
+              << "                         or trace:FILE (CSV of t_s,down_mbps,up_mbps,rtt_ms,loss)\n"
+              << "  --seed=N               Reproduce a run (default: random, shown in the results)\n"
+              << "  --runs=N               Run N tests headless as fast as possible and summarize\n"
+              << "  --threads=N            Threads for --runs (default 1)\n"
+              << "\n"
+              << "Socket tuning (live tests; applied on both client and server):\n"
+              << "  --cc=NAME              TCP congestion control, e.g. bbr, cubic\n"
+              << "  --sndbuf=SIZE          SO_SNDBUF, e.g. 4m\n"
+              << "  --rcvbuf=SIZE          SO_RCVBUF\n"
+              << "  --nodelay=0|1          TCP_NODELAY\n"
+              << "  --notsent-lowat=SIZE   TCP_NOTSENT_LOWAT\n"
+              << "  --pacing-rate=BITS     SO_MAX_PACING_RATE in bit/s, e.g. 500m\n"
+              << "  --busy-poll=USEC       SO_BUSY_POLL\n"
+              << "  --tuning=SPEC          All of the above at once: cc=bbr,sndbuf=4m\n"
+              << "  --sweep=SPEC           Run every combination: \"cc=bbr,cubic;sndbuf=256k,4m\"\n";
+}
+
+// --runs: many simulated tests back to back, no output but the summary.
+// Run i uses seed + i whichever thread picks it up, so every run is
+// reproducible regardless of --threads (the summary's intervals come from
+// merged reservoirs and can wobble slightly).
+static void run_batch(std::shared_ptr<const LinkModel> link, uint64_t seed, int runs, int threads) {
+    struct Totals {
+        SampleStats ping, download, upload;
+    };
+    std::vector<Totals> totals(threads);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (int i = t; i < runs; i += threads) {
+                SpeedTest test(link, seed + i, false);
+                SpeedResult r = test.run_full_test();
+                totals[t].ping.add(r.ping_ms);
+                totals[t].download.add(r.download_mbps);
+                totals[t].upload.add(r.upload_mbps);
+            }
+        });
+    }
+    for (std::thread& w : workers) w.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    Totals all;
+    for (const Totals& t : totals) {
+        all.ping.merge(t.ping);
+        all.download.merge(t.download);
+        all.upload.merge(t.upload);
+    }
+    std::cout << "  " << runs << " simulated tests on " << link->name() << " (seeds " << seed << ".."
+              << seed + runs - 1 << ") in " << std::fixed << std::setprecision(2) << seconds << " s, "
+              << std::setprecision(0) << runs / seconds << " tests/s\n\n";
+    std::cout << "  " << std::left << std::setw(10) << "" << std::right << std::setw(10) << "mean"
+              << std::setw(10) << "±95%" << std::setw(10) << "p50" << std::setw(10) << "p90"
+              << std::setw(10) << "p99" << "\n";
+    const std::pair<const char*, const SampleStats*> rows[] = {
+        {"ping ms", &all.ping}, {"down Mbps", &all.download}, {"up Mbps", &all.upload}};
+    for (const auto& row : rows) {
+        SampleSummary s = row.second->summarize();
+        std::cout << "  " << std::left << std::setw(10) << row.first << std::right << std::setprecision(2)
+                  << std::setw(10) << s.mean << std::setw(9) << (s.ci_high - s.ci_low) / 2
+                  << std::setw(10) << s.p50 << std::setw(10) << s.p90 << std::setw(10) << s.p99 << "\n";
+    }
+    std::cout << "\n";
+}
+
+// --interfaces
+static void print_interfaces() {
+    std::cout << "  " << std::left << std::setw(16) << "interface" << std::setw(6) << "state"
+              << std::right << std::setw(10) << "Mbps" << std::setw(6) << "numa" << "  addresses\n";
+    for (const NetInterface& i : list_interfaces()) {
+        std::string addresses;
+        for (const std::string& a : i.addresses) addresses += (addresses.empty() ? "" : " ") + a;
+        std::cout << "  " << std::left << std::setw(16) << i.name << std::setw(6) << (i.up ? "up" : "down")
+                  << std::right << std::setw(10) << (i.speed_mbps > 0 ? std::to_string(i.speed_mbps) : "-")
+                  << std::setw(6) << (i.numa_node >= 0 ? std::to_string(i.numa_node) : "-")
+                  << "  " << addresses << (i.loopback ? " (loopback)" : "") << "\n";
+    }
+}
+
+// A binding that parses can still be refused: SO_BINDTODEVICE needs
+// CAP_NET_RAW on older kernels, and the address must be one of ours.
+// Try it on a throwaway socket before any test starts.
+static bool check_binding(const SourceBinding& binding, std::string* error) {
+    int family = binding.address.find(':') == std::string::npos ? AF_INET : AF_INET6;
+    int fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        *error = strerror(errno);
+        return false;
+    }
+    bool ok = apply_binding(fd, binding, error);
+    close(fd);
+    return ok;
+}
+
+// Every transport with every profile, on the same server back to back;
+// `announce` prints which one is starting
+static std::vector<SpeedResult> run_tests(SpeedTest* test, const std::vector<TransportKind>& transports,
+                                          const std::vector<TuningProfile>& sweep, bool announce) {
+    std::vector<SpeedResult> results;
+    size_t runs = transports.size() * sweep.size();
+    for (size_t i = 0; i < runs; ++i) {
+        TransportKind transport = transports[i / sweep.size()];
+        const TuningProfile& tuning = sweep[i % sweep.size()];
+        test->set_transport(transport);
+        test->set_tuning(tuning);
+        if (announce) {
+            std::cout << "\n  [" << i + 1 << "/" << runs << "] ";
+            if (transports.size() > 1) std::cout << transport_name(transport) << "  ";
+            std::cout << tuning.describe() << "\n";
+        }
+        results.push_back(test->run_full_test());
+    }
+    return results;
+}
+
+// --mesh: the schedule up front, each test as it finishes, then the
+// matrices (or with --json, a line per test)
+static int run_mesh_controller(const EngineConfig& test, const std::string& sites_spec, const std::string& pairs_spec,
+                               size_t max_parallel, const std::string& token, bool json) {
+    std::vector<MeshSite> sites;
+    std::vector<MeshPair> pairs;
+    std::string error;
+    if (!parse_mesh_sites(sites_spec, &sites, &error)) {
+        std::cerr << "--mesh: " << error << "\n";
+        return 1;
+    }
+    if (!parse_mesh_pairs(pairs_spec, sites, &pairs, &error)) {
+        std::cerr << "--pairs: " << error << "\n";
+        return 1;
+    }
+    std::vector<std::vector<MeshPair>> rounds = schedule_mesh(pairs, max_parallel);
+    if (!json) {
+        SpeedTest::print_header();
+        std::cout << "  Mesh of " << sites.size() << " sites: " << pairs.size() << " tests in " << rounds.size()
+                  << " rounds\n";
+        for (size_t r = 0; r < rounds.size(); ++r) {
+            std::cout << "    round " << r + 1 << ":";
+            for (const MeshPair& pair : rounds[r]) {
+                std::cout << "  " << sites[pair.first].name << " <-> " << sites[pair.second].name;
+            }
+            std::cout << "\n";
+        }
+        std::cout << "\n";
+    }
+
+    size_t finished = 0;
+    std::vector<MeshResult> results = run_mesh(sites, rounds, test, token, [&](const MeshResult& r) {
+        const std::string& from = sites[r.pair.first].name;
+        const std::string& to = sites[r.pair.second].name;
+        ++finished;
+        if (json) {
+            // "from" is the site that ran the test, as in its result
+            JsonWriter line;
+            line.begin_object().field("from", r.reversed ? to : from).field("to", r.reversed ? from : to);
+            if (r.error.empty()) line.key("result").raw(r.result_json);
+            else line.field("error", r.error);
+            line.end_object();
+            std::cout << line.str() << "\n" << std::flush;
+            return;
+        }
+        std::cout << "  [" << finished << "/" << pairs.size() << "] " << from << " <-> " << to << "  ";
+        if (r.error.empty()) {
+            std::cout << std::fixed << std::setprecision(2) << "up " << r.upload_mbps << "  down "
+                      << r.download_mbps << " Mbps  ping " << r.ping_ms << " ms\n" << std::flush;
+        } else {
+            std::cout << "failed: " << r.error << "\n" << std::flush;
+        }
+    });
+    if (!json) print_mesh_matrix(sites, results);
+    for (const MeshResult& r : results) {
+        if (!r.error.empty()) return 1;
+    }
+    return 0;
+}
+
+// Returns the value of --name=value, or nullptr
+static const char* flag_value(const char* arg, const char* name) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) == 0 && arg[len] == '=') return arg + len + 1;
+    return nullptr;
+}
+
+int main(int argc, char** argv) {
+    EngineConfig config;
+    bool live = false;
+    std::string link_spec = "default";
+    uint64_t seed = std::random_device{}();
+    int runs = 0;
+    int threads = 1;
+    std::string sweep_spec;
+    std::vector<TransportKind> transports;
+    std::string record_path;
+    bool tls = false;
+    bool tls_verify = false;
+    bool ktls = true;
+    std::vector<SourceBinding> bindings;
+    bool parallel = false;
+    std::string affinity;
+    bool json = false;
+    bool submit = false;
+    std::string mesh_spec;
+    std::string pairs_spec;
+    size_t mesh_parallel = 0;
+    std::string mesh_token;
+    std::string error;
+    const char* tuning_flags[][2] = {
+        {"--cc", "cc"}, {"--sndbuf", "sndbuf"}, {"--rcvbuf", "rcvbuf"}, {"--nodelay", "nodelay"},
+        {"--notsent-lowat", "notsent_lowat"}, {"--pacing-rate", "pacing"}, {"--busy-poll", "busy_poll"},
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value;
+        if ((value = flag_value(arg, "--server"))) {
+            std::string server = value;
+            if (server.compare(0, 8, "https://") == 0) {
+                server.erase(0, 8);
+                tls = true;
+            }
+            size_t colon = server.rfind(':');
+            config.host = server.substr(0, colon);
+            if (colon != std::string::npos) config.port = atoi(server.c_str() + colon + 1);
+            live = true;
+        } else if ((value = flag_value(arg, "--streams"))) {
+            config.streams = std::max(1, atoi(value));
+        } else if ((value = flag_value(arg, "--duration"))) {
+            config.duration_s = std::max(1.0, atof(value));
+        } else if ((value = flag_value(arg, "--precision"))) {
+            config.precision = std::max(0.0, atof(value));
+        } else if ((value = flag_value(arg, "--simulate"))) {
+            link_spec = value;
+        } else if ((value = flag_value(arg, "--seed"))) {
+            seed = std::strtoull(value, nullptr, 10);
+        } else if ((value = flag_value(arg, "--runs"))) {
+            runs = std::max(1, atoi(value));
+        } else if ((value = flag_value(arg, "--threads"))) {
+            threads = std::max(1, atoi(value));
+        } else if ((value = flag_value(arg, "--io-backend"))) {
+            if (!parse_io_backend(value, &config.io_backend)) {
+                std::cerr << "Unknown I/O backend: " << value << "\n";
+                return 1;
+            }
+        } else if ((value = flag_value(arg, "--tuning"))) {
+            if (!parse_tuning(value, &config.tuning, &error)) {
+                std::cerr << "--tuning: " << error << "\n";
+                return 1;
+            }
+        } else if ((value = flag_value(arg, "--transport"))) {
+            std::istringstream list(value);
+            std::string name;
+            while (std::getline(list, name, ',')) {
+                TransportKind kind;
+                if (!parse_transport(name, &kind)) {
+                    std::cerr << "Unknown transport: " << name << "\n";
+                    return 1;
+                }
+                transports.push_back(kind);
+            }
+        } else if ((value = flag_value(arg, "--udp-rate"))) {
+            if (!parse_rate(value, &config.udp_rate_bps) || config.udp_rate_bps == 0) {
+                std::cerr << "--udp-rate: bad rate " << value << "\n";
+                return 1;
+            }
+        } else if ((value = flag_value(arg, "--udp-size"))) {
+            config.udp_datagram_size = std::strtoull(value, nullptr, 10);
+        } else if ((value = flag_value(arg, "--sweep"))) {
+            sweep_spec = value;
+        } else if ((value = flag_value(arg, "--record"))) {
+            record_path = value;
+        } else if (strcmp(arg, "--tls") == 0) {
+            tls = true;
+        } else if (strcmp(arg, "--verify") == 0) {
+            config.verify_payload = true;
+        } else if (strcmp(arg, "--tls-verify") == 0) {
+            tls = tls_verify = true;
+        } else if ((value = flag_value(arg, "--ktls"))) {
+            ktls = atoi(value) != 0;
+        } else if ((value = flag_value(arg, "--bind"))) {
+            std::istringstream list(value);
+            std::string spec;
+            while (std::getline(list, spec, ',')) {
+                SourceBinding binding;
+                if (!parse_binding(spec, &binding, &error) || !check_binding(binding, &error)) {
+                    std::cerr << "--bind: " << error << "\n";
+                    return 1;
+                }
+                bindings.push_back(binding);
+            }
+        } else if ((value = flag_value(arg, "--affinity"))) {
+            affinity = value;
+        } else if (strcmp(arg, "--parallel") == 0) {
+            parallel = true;
+        } else if (strcmp(arg, "--json") == 0) {
+            json = true;
+        } else if (strcmp(arg, "--submit") == 0) {
+            submit = true;
+        } else if ((value = flag_value(arg, "--mesh"))) {
+            mesh_spec = value;
+        } else if ((value = flag_value(arg, "--pairs"))) {
+            pairs_spec = value;
+        } else if ((value = flag_value(arg, "--mesh-parallel"))) {
+            mesh_parallel = std::strtoull(value, nullptr, 10);
+        } else if ((value = flag_value(arg, "--mesh-token"))) {
+            mesh_token = value;
+        } else if (strcmp(arg, "--interfaces") == 0) {
+            print_interfaces();
+            return 0;
+        } else {
+            bool matched = false;
+            for (const auto& flag : tuning_flags) {
+                if (!(value = flag_value(arg, flag[0]))) continue;
+                if (!set_tuning_option(&config.tuning, flag[1], value, &error)) {
+                    std::cerr << flag[0] << ": " << error << "\n";
+                    return 1;
+                }
+                matched = true;
+            }
+            if (!matched) {
+                print_usage();
+                return strcmp(arg, "--help") == 0 ? 0 : 1;
+            }
+        }
+    }
+
+    // The sites' agents run the tests; this process only coordinates
+    if (!mesh_spec.empty()) {
+        if (live || !bindings.empty() || !record_path.empty() || !sweep_spec.empty() || tls || runs > 0 ||
+            transports.size() > 1 || submit) {
+            std::cerr << "--mesh runs one kind of test between its sites: no --server, --bind, --record,\n"
+                      << "--sweep, --tls, --runs, --submit (agents keep their own history) or more than\n"
+                      << "one --transport\n";
+            return 1;
+        }
+        if (!transports.empty()) config.transport = transports[0];
+        if (mesh_token.empty()) {
+            std::cerr << "--mesh needs --mesh-token, the agents' --agent-token\n";
+            return 1;
+        }
+        return run_mesh_controller(config, mesh_spec, pairs_spec, mesh_parallel, mesh_token, json);
+    }
+    if (!pairs_spec.empty() || mesh_parallel > 0 || !mesh_token.empty()) {
+        std::cerr << "--pairs, --mesh-parallel and --mesh-token need --mesh\n";
+        return 1;
+    }
+
+    if (transports.empty()) transports.push_back(TransportKind::kHttp);
+    if (!live && (transports.size() > 1 || transports[0] != TransportKind::kHttp)) {
+        std::cerr << "--transport needs --server\n";
+        return 1;
+    }
+    config.transport = transports[0];
+
+    if (!bindings.empty() && !live) {
+        std::cerr << "--bind needs --server\n";
+        return 1;
+    }
+    if (parallel && bindings.size() < 2) {
+        std::cerr << "--parallel needs two or more --bind sources\n";
+        return 1;
+    }
+    if (bindings.size() > 1 && !record_path.empty()) {
+        std::cerr << "--record takes one --bind source at a time\n";
+        return 1;
+    }
+    if (submit && !live) {
+        std::cerr << "--submit needs --server\n";
+        return 1;
+    }
+    if (!affinity.empty() && !live) {
+        std::cerr << "--affinity needs --server\n";
+        return 1;
+    }
+    if (affinity.empty()) affinity = bindings.empty() ? "none" : "node";
+    if (bindings.empty()) bindings.emplace_back();
+
+    // Placed near the NIC each source leaves through, or the one the
+    // route to the server takes
+    std::vector<Placement> placements(bindings.size());
+    for (size_t b = 0; b < bindings.size(); ++b) {
+        std::string device = bindings[b].empty() ? route_interface(config.host, config.port)
+                                                 : binding_interface(bindings[b]);
+        if (!parse_placement(affinity, device, &placements[b], &error)) {
+            std::cerr << "--affinity: " << error << "\n";
+            return 1;
+        }
+    }
+
+    // Sweep axes override the matching fixed options
+    std::vector<TuningProfile> sweep;
+    if (!sweep_spec.empty()) {
+        if (!live) {
+            std::cerr << "--sweep needs --server\n";
+            return 1;
+        }
+        if (!parse_sweep(sweep_spec, config.tuning, &sweep, &error)) {
+            std::cerr << "--sweep: " << error << "\n";
+            return 1;
+        }
+    }
+
+    std::shared_ptr<const LinkModel> link;
+    if (!live) {
+        link = make_link_model(link_spec, &error);
+        if (!link) {
+            std::cerr << "--simulate: " << error << "\n";
+            return 1;
+        }
+    }
+
+    if (runs > 0) {
+        if (live) {
+            std::cerr << "--runs is for simulated tests; drop --server\n";
+            return 1;
+        }
+        run_batch(link, seed, runs, threads);
+        return 0;
+    }
+
+    if (tls) {
+        if (!live) {
+            std::cerr << "--tls needs --server\n";
+            return 1;
+        }
+        config.tls = TlsContext::client(tls_verify, &error);
+        if (!config.tls) {
+            std::cerr << "--tls: " << error << "\n";
+            return 1;
+        }
+        config.tls->set_ktls(ktls);
+    }
+
+    std::unique_ptr<TraceRecorder> recorder;
+    if (!record_path.empty()) {
+        if (!live) {
+            std::cerr << "--record needs --server\n";
+            return 1;
+        }
+        recorder.reset(new TraceRecorder);
+        if (!recorder->open(record_path, &error)) {
+            std::cerr << "--record: " << error << "\n";
+            return 1;
+        }
+        config.recorder = recorder.get();
+    }
+
+    if (!json) {
+        SpeedTest::print_header();
+        std::cout << "  Connecting to server...\n\n";
+    }
+
+    if (sweep.empty()) sweep.push_back(config.tuning);
+    bool compare = !sweep_spec.empty() || transports.size() > 1;
+    auto print_results = [compare, json](const std::vector<SpeedResult>& results) {
+        if (json) {
+            for (const SpeedResult& r : results) std::cout << speed_result_to_json(r) << "\n" << std::flush;
+        } else if (compare) {
+            SpeedTest::print_sweep(results);
+        } else {
+            SpeedTest::print_result(results.front());
+        }
+    };
+
+    // Each source runs on a thread of its own, placed by --affinity; the
+    // payload pool it builds comes from that thread's node. In turn, the
+    // tests draw as they go; at once, they run quietly and print when all
+    // are done. --json draws nothing at all.
+    std::vector<std::vector<SpeedResult>> results(bindings.size());
+    auto run = [&](size_t b) {
+        EngineConfig source_config = config;
+        source_config.source = bindings[b];
+        if (pin_to_cpus(placements[b].thread_cpus(b))) {
+            source_config.placement = placements[b].describe(b);
+            source_config.numa_node = placements[b].numa_node;
+        }
+        bool draw = !parallel && !json;
+        std::unique_ptr<SpeedTest> test(live ? new SpeedTest(source_config, draw) : new SpeedTest(link, seed, !json));
+        results[b] = run_tests(test.get(), transports, sweep, compare && draw);
+    };
+    if (parallel) {
+        if (!json) std::cout << "  Testing from " << bindings.size() << " sources at once...\n";
+        std::vector<std::thread> workers;
+        for (size_t b = 0; b < bindings.size(); ++b) workers.emplace_back(run, b);
+        for (std::thread& w : workers) w.join();
+        // Comparisons all go in the side-by-side table below
+        if (!compare || json) {
+            for (const std::vector<SpeedResult>& r : results) print_results(r);
+        }
+    } else {
+        for (size_t b = 0; b < bindings.size(); ++b) {
+            if (!bindings[b].empty() && !json) std::cout << "  From " << bindings[b].describe() << "\n";
+            std::thread(run, b).join();
+            print_results(results[b]);
+        }
+    }
+
+    // Side by side when there were several sources
+    if (bindings.size() > 1 && !json) {
+        std::vector<SpeedResult> all;
+        for (const std::vector<SpeedResult>& r : results) all.insert(all.end(), r.begin(), r.end());
+        SpeedTest::print_sweep(all);
+    }
+
+    // Tests that moved no data are left out, as agents leave them out
+    if (submit) {
+        size_t tried = 0, stored = 0;
+        for (const std::vector<SpeedResult>& source : results) {
+            for (const SpeedResult& r : source) {
+                if (r.download_mbps <= 0 && r.upload_mbps <= 0) continue;
+                HistoryPoint point;
+                point.download_mbps = r.download_mbps;
+                point.upload_mbps = r.upload_mbps;
+                point.ping_ms = r.ping_ms;
+                point.jitter_ms = r.jitter_ms;
+                std::string body;
+                ++tried;
+                stored += http_post(config.host, config.port, history_results_path(point), &body, config.tls);
+            }
+        }
+        std::ostream& out = json ? std::cerr : std::cout;
+        out << "  Submitted " << stored << " of " << tried << " results to the server's history\n\n";
+    }
+
+    if (recorder) {
+        recorder->close();
+        // Not mixed into --json output
+        std::ostream& out = json ? std::cerr : std::cout;
+        out << "  Recorded to " << record_path << " (" << recorder->bytes_written() << " bytes)\n";
+        if (recorder->dropped()) {
+            out << "  ⚠️  " << recorder->dropped() << " events dropped: the disk fell behind, so a replay will differ\n";
+        }
+        out << "\n";
+    }
+
     return 0;
 }
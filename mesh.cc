@@ -0,0 +1,440 @@
+#include "mesh.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "benchmark.h"
+#include "json_writer.h"
+
+namespace speedtest {
+
+namespace {
+
+// Results the agent keeps for the controller to collect
+const size_t kKeptRuns = 16;
+// What an agent accepts from a run request
+const int kMaxStreams = 64;
+const double kMaxDurationS = 60;
+// How often the controller asks for a result
+const auto kPollInterval = std::chrono::milliseconds(500);
+
+std::vector<std::string> split(const std::string& text, char separator) {
+    std::vector<std::string> parts;
+    std::istringstream in(text);
+    std::string part;
+    while (std::getline(in, part, separator)) {
+        if (!part.empty()) parts.push_back(part);
+    }
+    return parts;
+}
+
+// HOST:PORT, the port required
+bool parse_address(const std::string& text, std::string* host, int* port) {
+    size_t colon = text.rfind(':');
+    if (colon == std::string::npos || colon == 0) return false;
+    char* end;
+    long number = std::strtol(text.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || number < 1 || number > 65535) return false;
+    *host = text.substr(0, colon);
+    *port = static_cast<int>(number);
+    return true;
+}
+
+std::string number_text(double v) {
+    char text[32];
+    return std::string(text, std::to_chars(text, text + sizeof(text), v).ptr);
+}
+
+// The value of the first "key": in a JsonWriter document: strings
+// unquoted, objects and arrays as their JSON text, numbers as written.
+// Top-level fields of a SpeedResult are written before any nested object,
+// so the first match is the top-level one.
+std::string json_value(const std::string& json, const std::string& key) {
+    size_t pos = json.find("\"" + key + "\":");
+    if (pos == std::string::npos) return "";
+    pos += key.size() + 3;
+    if (pos >= json.size()) return "";
+    if (json[pos] == '"') {
+        std::string text;
+        for (size_t i = pos + 1; i < json.size() && json[i] != '"'; ++i) {
+            if (json[i] == '\\' && i + 1 < json.size()) ++i;
+            text.push_back(json[i]);
+        }
+        return text;
+    }
+    if (json[pos] == '{' || json[pos] == '[') {
+        int depth = 0;
+        bool quoted = false;
+        for (size_t i = pos; i < json.size(); ++i) {
+            char c = json[i];
+            if (quoted) {
+                if (c == '\\') ++i;
+                else if (c == '"') quoted = false;
+            } else if (c == '"') {
+                quoted = true;
+            } else if (c == '{' || c == '[') {
+                ++depth;
+            } else if ((c == '}' || c == ']') && --depth == 0) {
+                return json.substr(pos, i + 1 - pos);
+            }
+        }
+        return "";
+    }
+    return json.substr(pos, json.find_first_of(",}]", pos) - pos);
+}
+
+// Every pair of n sites, ordered round by round as in a round-robin
+// tournament (the circle method), so that schedule_mesh() packs them
+// into n - 1 rounds, or n when n is odd
+std::vector<MeshPair> all_pairs(size_t n) {
+    std::vector<MeshPair> pairs;
+    size_t slots = n + n % 2;  // An odd site out sits a round out
+    std::vector<size_t> circle(slots);
+    for (size_t i = 0; i < slots; ++i) circle[i] = i;
+    for (size_t round = 0; round + 1 < slots; ++round) {
+        for (size_t i = 0; i < slots / 2; ++i) {
+            size_t a = circle[i], b = circle[slots - 1 - i];
+            if (a < n && b < n) pairs.emplace_back(std::min(a, b), std::max(a, b));
+        }
+        // Keep the first slot, turn the rest one step
+        std::rotate(circle.begin() + 1, circle.end() - 1, circle.end());
+    }
+    return pairs;
+}
+
+// Starts `pair` on its first site's agent, or its second's if the first
+// has none, and waits for the result
+MeshResult run_pair(const std::vector<MeshSite>& sites, const MeshPair& pair, const EngineConfig& test,
+                    const std::string& token) {
+    MeshResult result;
+    result.pair = pair;
+    const MeshSite* from = &sites[pair.first];
+    const MeshSite* to = &sites[pair.second];
+    std::string body;
+    if (!http_post(from->host, from->port, agent_run_path(*to, test), &body, nullptr, nullptr, token)) {
+        // One test measures both directions, so either end can run it
+        if (!http_post(to->host, to->port, agent_run_path(*from, test), &body, nullptr, nullptr, token)) {
+            result.error = "no agent at " + from->address() + " or " + to->address() +
+                           " (speed_test_gui --agent=1) taking this --mesh-token";
+            return result;
+        }
+        std::swap(from, to);
+        result.reversed = true;
+    }
+    result.error = json_value(body, "error");
+    if (!result.error.empty()) return result;
+    std::string path = "/api/agent/result?run=" + json_value(body, "run");
+
+    // Two phases, pings and server detection: well past this something
+    // is stuck
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(2 * test.duration_s + 60);
+    while (true) {
+        std::this_thread::sleep_for(kPollInterval);
+        if (!http_get(from->host, from->port, path, &body, nullptr, nullptr, "", token)) {
+            result.error = "lost contact with the agent at " + from->address();
+            return result;
+        }
+        std::string state = json_value(body, "state");
+        if (state == "done") break;
+        if (state != "running") {
+            result.error = json_value(body, "error");
+            if (result.error.empty()) result.error = "agent reported " + body;
+            return result;
+        }
+        if (std::chrono::steady_clock::now() > deadline) {
+            result.error = "no result from " + from->address() + " in time";
+            return result;
+        }
+    }
+    result.result_json = json_value(body, "result");
+    result.download_mbps = std::atof(json_value(result.result_json, "download_mbps").c_str());
+    result.upload_mbps = std::atof(json_value(result.result_json, "upload_mbps").c_str());
+    result.ping_ms = std::atof(json_value(result.result_json, "ping_ms").c_str());
+    result.jitter_ms = std::atof(json_value(result.result_json, "jitter_ms").c_str());
+    if (result.reversed) std::swap(result.download_mbps, result.upload_mbps);
+    return result;
+}
+
+} // namespace
+
+bool parse_mesh_sites(const std::string& spec, std::vector<MeshSite>* sites, std::string* error) {
+    sites->clear();
+    for (const std::string& item : split(spec, ',')) {
+        MeshSite site;
+        size_t eq = item.find('=');
+        std::string address = eq == std::string::npos ? item : item.substr(eq + 1);
+        if (!parse_address(address, &site.host, &site.port)) {
+            *error = "expected [NAME=]HOST:PORT, not " + item;
+            return false;
+        }
+        site.name = eq == std::string::npos ? address : item.substr(0, eq);
+        for (const MeshSite& other : *sites) {
+            if (other.name == site.name) {
+                *error = "two sites named " + site.name;
+                return false;
+            }
+        }
+        sites->push_back(site);
+    }
+    if (sites->size() < 2) {
+        *error = "a mesh needs two or more sites";
+        return false;
+    }
+    return true;
+}
+
+bool parse_mesh_pairs(const std::string& spec, const std::vector<MeshSite>& sites, std::vector<MeshPair>* pairs,
+                      std::string* error) {
+    if (spec.empty()) {
+        *pairs = all_pairs(sites.size());
+        return true;
+    }
+    pairs->clear();
+    for (const std::string& item : split(spec, ',')) {
+        // Names may hold colons themselves (an unnamed site is HOST:PORT),
+        // so try every way of splitting the item into two names
+        bool found = false;
+        for (size_t a = 0; a < sites.size() && !found; ++a) {
+            const std::string& first = sites[a].name;
+            if (item.compare(0, first.size(), first) != 0 || item.size() <= first.size() ||
+                item[first.size()] != ':') {
+                continue;
+            }
+            for (size_t b = 0; b < sites.size() && !found; ++b) {
+                if (b == a || item.compare(first.size() + 1, std::string::npos, sites[b].name) != 0) continue;
+                MeshPair pair(std::min(a, b), std::max(a, b));
+                if (std::find(pairs->begin(), pairs->end(), pair) == pairs->end()) pairs->push_back(pair);
+                found = true;
+            }
+        }
+        if (!found) {
+            *error = "expected SITE:SITE with two different site names, not " + item;
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<std::vector<MeshPair>> schedule_mesh(const std::vector<MeshPair>& pairs, size_t max_parallel) {
+    std::vector<std::vector<MeshPair>> rounds;
+    std::vector<MeshPair> left = pairs;
+    while (!left.empty()) {
+        std::vector<MeshPair> round;
+        std::vector<MeshPair> later;
+        std::vector<size_t> busy;
+        for (const MeshPair& pair : left) {
+            bool free = std::find(busy.begin(), busy.end(), pair.first) == busy.end() &&
+                        std::find(busy.begin(), busy.end(), pair.second) == busy.end();
+            if (free && (max_parallel == 0 || round.size() < max_parallel)) {
+                round.push_back(pair);
+                busy.push_back(pair.first);
+                busy.push_back(pair.second);
+            } else {
+                later.push_back(pair);
+            }
+        }
+        rounds.push_back(round);
+        left = later;
+    }
+    return rounds;
+}
+
+MeshAgent::~MeshAgent() {
+    for (const std::unique_ptr<Run>& run : runs_) {
+        if (run->thread.joinable()) run->thread.join();
+    }
+}
+
+std::string MeshAgent::start(const std::string& query) {
+    JsonWriter json;
+    EngineConfig config;
+    std::string error;
+    if (!agent_config_from_query(query, &config, &error)) {
+        json.begin_object().field("error", error).end_object();
+        return json.take();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const std::unique_ptr<Run>& run : runs_) {
+        if (!run->finished) {
+            json.begin_object().field("error", "busy with run " + std::to_string(run->id)).end_object();
+            return json.take();
+        }
+    }
+    // Nothing is running, so every thread here has ended
+    while (runs_.size() >= kKeptRuns) {
+        runs_.front()->thread.join();
+        runs_.erase(runs_.begin());
+    }
+    runs_.emplace_back(new Run);
+    Run* run = runs_.back().get();
+    run->id = next_id_++;
+    run->thread = std::thread(run_test, config, run, &mutex_, on_result_);
+    json.begin_object().field("run", run->id).end_object();
+    return json.take();
+}
+
+std::string MeshAgent::result(uint64_t id) {
+    JsonWriter json;
+    json.begin_object().field("run", id);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find_if(runs_.begin(), runs_.end(), [id](const std::unique_ptr<Run>& run) { return run->id == id; });
+    if (it == runs_.end()) {
+        json.field("state", "unknown").field("error", "no run " + std::to_string(id) + " here");
+    } else if (!(*it)->finished) {
+        json.field("state", "running");
+    } else if (!(*it)->error.empty()) {
+        json.field("state", "failed").field("error", (*it)->error);
+    } else {
+        json.field("state", "done").key("result").raw((*it)->result_json);
+    }
+    json.end_object();
+    return json.take();
+}
+
+void MeshAgent::run_test(EngineConfig config, Run* run, std::mutex* mutex,
+                         std::function<void(const SpeedResult&)> on_result) {
+    std::string error;
+    std::string result_json;
+    std::string body;
+    std::string target = config.host + ":" + std::to_string(config.port);
+    if (!http_get(config.host, config.port, "/api/info", &body)) {
+        error = "can't reach " + target;
+    } else {
+        SpeedTest test(config, false);
+        SpeedResult result = test.run_full_test();
+        if (result.download_mbps > 0 || result.upload_mbps > 0) {
+            result_json = speed_result_to_json(result);
+            if (on_result) on_result(result);
+        } else {
+            error = "no data moved to or from " + target;
+        }
+    }
+    std::lock_guard<std::mutex> lock(*mutex);
+    run->finished = true;
+    run->error = error;
+    run->result_json = result_json;
+}
+
+std::string agent_run_path(const MeshSite& target, const EngineConfig& test) {
+    std::string path = "/api/agent/run?target=" + target.address() + "&streams=" + std::to_string(test.streams) +
+                       "&duration=" + number_text(test.duration_s) + "&precision=" + number_text(test.precision) +
+                       "&transport=" + transport_name(test.transport);
+    if (test.transport == TransportKind::kUdp) path += "&udp_rate=" + std::to_string(test.udp_rate_bps);
+    if (test.verify_payload) path += "&verify=1";
+    std::string tuning = test.tuning.to_query();
+    if (!tuning.empty()) path += "&" + tuning;
+    return path;
+}
+
+bool agent_config_from_query(const std::string& query, EngineConfig* config, std::string* error) {
+    *config = EngineConfig();
+    bool target = false;
+    for (const std::string& pair : split(query, '&')) {
+        size_t eq = pair.find('=');
+        if (eq == std::string::npos) continue;
+        std::string key = pair.substr(0, eq);
+        std::string value = pair.substr(eq + 1);
+        if (key == "target") {
+            target = parse_address(value, &config->host, &config->port);
+        } else if (key == "streams") {
+            config->streams = std::min(kMaxStreams, std::max(1, std::atoi(value.c_str())));
+        } else if (key == "duration") {
+            config->duration_s = std::min(kMaxDurationS, std::max(1.0, std::atof(value.c_str())));
+        } else if (key == "precision") {
+            config->precision = std::max(0.0, std::atof(value.c_str()));
+        } else if (key == "transport") {
+            if (!parse_transport(value, &config->transport)) {
+                *error = "unknown transport " + value;
+                return false;
+            }
+        } else if (key == "udp_rate") {
+            parse_rate(value, &config->udp_rate_bps);
+        } else if (key == "verify") {
+            config->verify_payload = std::atoi(value.c_str()) != 0;
+        }
+    }
+    if (!target) {
+        *error = "expected target=HOST:PORT";
+        return false;
+    }
+    config->min_duration_s = std::min(config->min_duration_s, config->duration_s);
+    config->tuning = tuning_from_query(query);
+    return true;
+}
+
+std::vector<MeshResult> run_mesh(const std::vector<MeshSite>& sites, const std::vector<std::vector<MeshPair>>& rounds,
+                                 const EngineConfig& test, const std::string& token,
+                                 const std::function<void(const MeshResult&)>& done) {
+    std::vector<MeshResult> results;
+    std::mutex mutex;
+    for (const std::vector<MeshPair>& round : rounds) {
+        std::vector<std::thread> collectors;
+        for (const MeshPair& pair : round) {
+            collectors.emplace_back([&, pair] {
+                MeshResult result = run_pair(sites, pair, test, token);
+                std::lock_guard<std::mutex> lock(mutex);
+                results.push_back(result);
+                if (done) done(result);
+            });
+        }
+        for (std::thread& collector : collectors) collector.join();
+    }
+    return results;
+}
+
+void print_mesh_matrix(const std::vector<MeshSite>& sites, const std::vector<MeshResult>& results) {
+    const int kColumn = 12;
+    size_t n = sites.size();
+    // "" untested, "fail", or the value
+    std::vector<std::vector<std::string>> mbps(n, std::vector<std::string>(n));
+    std::vector<std::vector<std::string>> rtt(n, std::vector<std::string>(n));
+    auto format = [](double v) {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(2) << v;
+        return out.str();
+    };
+    for (const MeshResult& r : results) {
+        size_t a = r.pair.first, b = r.pair.second;
+        if (!r.error.empty()) {
+            mbps[a][b] = mbps[b][a] = rtt[a][b] = rtt[b][a] = "fail";
+            continue;
+        }
+        mbps[a][b] = format(r.upload_mbps);
+        mbps[b][a] = format(r.download_mbps);
+        rtt[a][b] = rtt[b][a] = format(r.ping_ms);
+    }
+    auto print = [&](const char* title, const std::vector<std::vector<std::string>>& cells) {
+        std::cout << "\n  " << title << "\n  " << std::left << std::setw(kColumn) << "from \\ to" << std::right;
+        for (const MeshSite& site : sites) std::cout << std::setw(kColumn) << site.name.substr(0, kColumn - 1);
+        std::cout << "\n  " << std::string(kColumn * (n + 1), '-') << "\n";
+        for (size_t a = 0; a < n; ++a) {
+            std::cout << "  " << std::left << std::setw(kColumn) << sites[a].name.substr(0, kColumn - 1) << std::right;
+            for (size_t b = 0; b < n; ++b) {
+                std::cout << std::setw(kColumn) << (a == b ? "-" : cells[a][b].empty() ? "." : cells[a][b]);
+            }
+            std::cout << "\n";
+        }
+    };
+    print("THROUGHPUT Mbps", mbps);
+    print("RTT ms", rtt);
+    bool untested = false;
+    for (size_t a = 0; a < n; ++a) {
+        for (size_t b = 0; b < n; ++b) untested |= a != b && mbps[a][b].empty();
+    }
+    if (untested) std::cout << "  (. not tested)\n";
+    bool failed = false;
+    for (const MeshResult& r : results) {
+        if (r.error.empty()) continue;
+        if (!failed) std::cout << "\n";
+        failed = true;
+        std::cout << "  " << sites[r.pair.first].name << " <-> " << sites[r.pair.second].name << ": " << r.error << "\n";
+    }
+    std::cout << "\n";
+}
+
+} // namespace speedtest
@@ -0,0 +1,115 @@
+#ifndef MESH_H_
+#define MESH_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "client_engine.h"
+
+namespace speedtest {
+
+struct SpeedResult;
+
+// Coordinated tests across many sites. Each site runs speed_test_gui with
+// --agent: it is the server other sites test against, and it runs tests
+// of its own against them when a controller (speed_test --mesh) asks.
+// One test between two sites measures both directions, so a full mesh of
+// n sites takes n(n-1)/2 tests.
+
+// One site as the controller and the other agents reach it
+struct MeshSite {
+    std::string name;
+    std::string host;
+    int port = 8080;
+
+    std::string address() const { return host + ":" + std::to_string(port); }
+};
+
+// "a=10.0.0.1:8080,b=10.0.0.2:8080"; a site without name= is named after
+// its address. False with *error for fewer than two sites or duplicates.
+bool parse_mesh_sites(const std::string& spec, std::vector<MeshSite>* sites, std::string* error);
+
+// Which sites test each other, as indices into the site list
+using MeshPair = std::pair<size_t, size_t>;
+
+// "a:b,a:c" by site name; empty spec = every pair
+bool parse_mesh_pairs(const std::string& spec, const std::vector<MeshSite>& sites, std::vector<MeshPair>* pairs,
+                      std::string* error);
+
+// Rounds of tests run at once. No site is in two tests of a round, so no
+// access link carries more than one test, and a round holds at most
+// `max_parallel` tests (0 = no limit) for links the sites share.
+std::vector<std::vector<MeshPair>> schedule_mesh(const std::vector<MeshPair>& pairs, size_t max_parallel);
+
+// Agent side: POST /api/agent/run?target=HOST:PORT&streams=N&duration=S&...
+// starts a test, GET /api/agent/result?run=N reports on it. One test runs
+// at a time; the last few results are kept for collection. The server
+// only passes on requests that carry its --agent-token.
+class MeshAgent {
+public:
+    MeshAgent() = default;
+    ~MeshAgent();  // Waits for a running test
+
+    // The query of a run request; the reply is {"run":N}, or {"error":...}
+    // if it is malformed or a test is already running
+    std::string start(const std::string& query);
+    // {"run":N,"state":"running"}, then "done" with "result" (the test's
+    // SpeedResult) or "failed" with "error"
+    std::string result(uint64_t run);
+    // Called from the test's thread with each test that moved data
+    void set_result_handler(std::function<void(const SpeedResult&)> handler) { on_result_ = std::move(handler); }
+
+private:
+    struct Run {
+        uint64_t id = 0;
+        std::thread thread;
+        bool finished = false;
+        std::string result_json;
+        std::string error;
+    };
+    static void run_test(EngineConfig config, Run* run, std::mutex* mutex,
+                         std::function<void(const SpeedResult&)> on_result);
+
+    std::function<void(const SpeedResult&)> on_result_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Run>> runs_;  // Oldest first
+    uint64_t next_id_ = 1;
+};
+
+// The run request asking an agent to test `target` as `test` describes
+// (streams, duration, precision, transport, payload checks and tuning)
+std::string agent_run_path(const MeshSite& target, const EngineConfig& test);
+bool agent_config_from_query(const std::string& query, EngineConfig* config, std::string* error);
+
+// Controller side: one finished test between two sites. Upload is from
+// the pair's first site to its second, download the other way.
+struct MeshResult {
+    MeshPair pair;
+    bool reversed = false;     // The second site ran the test, the first having no agent
+    std::string error;         // Empty if the test ran
+    double download_mbps = 0;
+    double upload_mbps = 0;
+    double ping_ms = 0;
+    double jitter_ms = 0;
+    std::string result_json;   // The agent's SpeedResult object, from its side
+};
+
+// Runs the rounds in order, each round's tests at once, collecting every
+// result concurrently from the agents, which must share `token`. `done`
+// is called as each test finishes, one call at a time.
+std::vector<MeshResult> run_mesh(const std::vector<MeshSite>& sites, const std::vector<std::vector<MeshPair>>& rounds,
+                                 const EngineConfig& test, const std::string& token,
+                                 const std::function<void(const MeshResult&)>& done);
+
+// Rate from each row's site to each column's, then RTT between them
+void print_mesh_matrix(const std::vector<MeshSite>& sites, const std::vector<MeshResult>& results);
+
+} // namespace speedtest
+
+#endif // MESH_H_
@@ -0,0 +1,150 @@
+#include "payload.h"
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace speedtest {
+
+namespace {
+
+// Reflected Castagnoli polynomial
+const uint32_t kCrc32cPoly = 0x82f63b78;
+// Keystream generated per EVP call
+const size_t kFillStep = 1 << 20;
+
+uint32_t crc32c_software(uint32_t crc, const uint8_t* p, size_t len) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? (c >> 1) ^ kCrc32cPoly : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    while (len--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t* p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = static_cast<uint32_t>(c);
+    while (len--) c32 = _mm_crc32_u8(c32, *p++);
+    return c32;
+}
+#endif
+
+uint64_t splitmix64(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+} // namespace
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) return ~crc32c_sse42(~crc, p, len);
+#endif
+    return ~crc32c_software(~crc, p, len);
+}
+
+PayloadPool::PayloadPool(uint64_t seed, size_t size, int numa_node)
+    : size_((std::max(size, kBlockSize) + kBlockSize - 1) / kBlockSize * kBlockSize), seed_(seed) {
+    void* memory = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) throw std::bad_alloc();
+    data_ = static_cast<char*>(memory);
+    // Before the fill touches any page. glibc has no mbind wrapper; a
+    // kernel without NUMA refuses it and first touch decides instead.
+    if (numa_node >= 0 && numa_node < 64) {
+        unsigned long nodes = 1UL << numa_node;
+        // maxnode counts one past the mask, as the kernel drops a bit
+        syscall(SYS_mbind, data_, size_, MPOL_PREFERRED, &nodes, sizeof(nodes) * 8 + 1, 0);
+    }
+
+    // Anonymous memory starts zeroed, so encrypting it in place leaves the keystream
+    uint8_t key[16];
+    uint8_t iv[16] = {};
+    uint64_t state = seed;
+    for (int i = 0; i < 2; ++i) {
+        uint64_t v = splitmix64(&state);
+        std::memcpy(key + 8 * i, &v, 8);
+    }
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, EVP_aes_128_ctr(), nullptr, key, iv);
+    uint8_t* out = reinterpret_cast<uint8_t*>(data_);
+    for (size_t offset = 0; offset < size_; offset += kFillStep) {
+        int len = static_cast<int>(std::min(kFillStep, size_ - offset));
+        EVP_EncryptUpdate(ctx, out + offset, &len, out + offset, len);
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    block_crcs_.resize(size_ / kBlockSize);
+    for (size_t i = 0; i < block_crcs_.size(); ++i) block_crcs_[i] = crc32c(0, data_ + i * kBlockSize, kBlockSize);
+}
+
+PayloadPool::~PayloadPool() {
+    munmap(data_, size_);
+}
+
+void PayloadPool::seal() {
+    mprotect(data_, size_, PROT_READ);
+}
+
+PayloadVerifier::PayloadVerifier(const PayloadPool& pool, uint64_t start)
+    : pool_(pool), position_(start % pool.size()), block_start_(position_) {}
+
+void PayloadVerifier::add(const char* data, size_t len) {
+    while (len > 0) {
+        uint64_t block_end = (position_ / PayloadPool::kBlockSize + 1) * PayloadPool::kBlockSize;
+        size_t n = static_cast<size_t>(std::min<uint64_t>(len, block_end - position_));
+        crc_ = crc32c(crc_, data, n);
+        position_ += n;
+        data += n;
+        len -= n;
+        if (position_ == block_end) check();
+    }
+}
+
+IntegrityCounts PayloadVerifier::finish() {
+    if (position_ > block_start_) check();
+    return counts_;
+}
+
+void PayloadVerifier::check() {
+    size_t len = static_cast<size_t>(position_ - block_start_);
+    uint32_t expected;
+    if (len == PayloadPool::kBlockSize) {
+        expected = pool_.block_crc((block_start_ / PayloadPool::kBlockSize) % (pool_.size() / PayloadPool::kBlockSize));
+    } else {
+        expected = crc32c(0, pool_.at(block_start_), len);
+    }
+    counts_.bytes += len;
+    if (crc_ != expected) counts_.bad_blocks++;
+    crc_ = 0;
+    block_start_ = position_;
+}
+
+} // namespace speedtest
@@ -0,0 +1,80 @@
+#ifndef PAYLOAD_H_
+#define PAYLOAD_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace speedtest {
+
+// Incompressible bytes for bulk streams, generated once. The pool is the
+// AES-128-CTR keystream of a key derived from `seed` (AES-NI does several
+// GB/s of it), so a peer that learns the seed can rebuild the same bytes
+// and check what arrived. Streams walk it from a start offset and wrap.
+//
+// The memory is page-aligned for zero-copy sends. Register it with
+// io_uring first, which pins it writable, then seal() it read-only.
+class PayloadPool {
+public:
+    static constexpr size_t kDefaultSize = 4 << 20;
+    // Verification checks a CRC32C per block of the pool
+    static constexpr size_t kBlockSize = 64 << 10;
+
+    // `size` is rounded up to a whole number of blocks. Pages come from
+    // `numa_node` when it is set, else from the node of the filling thread.
+    explicit PayloadPool(uint64_t seed, size_t size = kDefaultSize, int numa_node = -1);
+    ~PayloadPool();
+    PayloadPool(const PayloadPool&) = delete;
+    PayloadPool& operator=(const PayloadPool&) = delete;
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    uint64_t seed() const { return seed_; }
+    // Where stream byte `position` comes from
+    const char* at(uint64_t position) const { return data_ + position % size_; }
+    uint32_t block_crc(size_t block) const { return block_crcs_[block]; }
+    void seal();
+
+private:
+    char* data_ = nullptr;
+    size_t size_;
+    uint64_t seed_;
+    std::vector<uint32_t> block_crcs_;
+};
+
+// CRC32C (Castagnoli), with SSE4.2's crc32 instruction where the CPU has it
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+struct IntegrityCounts {
+    uint64_t bytes = 0;       // Checked against the pool
+    uint64_t bad_blocks = 0;  // Blocks whose CRC32C didn't match
+};
+
+// Checks a received stream against the pool it was cut from, starting at
+// pool offset `start`: a running CRC32C per block of the pool, compared
+// as each block completes. Costs one pass over the data; the pool itself
+// isn't read.
+class PayloadVerifier {
+public:
+    PayloadVerifier(const PayloadPool& pool, uint64_t start);
+
+    void add(const char* data, size_t len);
+    // Counts of whole blocks so far; a partial block at either end is
+    // checked against the pool directly
+    IntegrityCounts finish();
+    const IntegrityCounts& counts() const { return counts_; }
+
+private:
+    // Closes the running CRC over [block_start_, position_)
+    void check();
+
+    const PayloadPool& pool_;
+    uint64_t position_;        // Pool offset of the next byte, unwrapped
+    uint64_t block_start_;     // ... where the running CRC began
+    uint32_t crc_ = 0;
+    IntegrityCounts counts_;
+};
+
+} // namespace speedtest
+
+#endif // PAYLOAD_H_
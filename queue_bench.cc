@@ -0,0 +1,296 @@
+// Runs stream threads that hand samples to one reporter thread the way
+// a test does (a sample per read, reported in batches), and measures
+// how long each push keeps its stream thread away from the socket, for
+// each way of handing them over:
+//
+//   report under lock  the reporter works while holding the producers'
+//                      mutex, as drawing progress from the callback did
+//   mutex + vector     producers append under a mutex the reporter swaps
+//                      out, as TraceRecorder did before sample_queue.h
+//   mpsc queue         MpscQueue shared by every stream
+//   spsc per stream    one SpscRing per stream, drained in turn
+//
+// Every --stall-every ms the reporter stalls for --stall ms, like a
+// terminal write that blocks. Bounded queues drop what doesn't fit
+// rather than wait; drops are counted, and every sample that arrives is
+// checked for order within its stream.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sample_queue.h"
+
+using namespace speedtest;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    int streams = 4;
+    double rate = 100000;     // Pushes per second per stream
+    double seconds = 2;       // Per scheme
+    size_t capacity = 16384;  // Per stream
+    int stall_ms = 20;
+    int stall_every_ms = 100;
+};
+
+struct Sample {
+    uint32_t stream = 0;
+    uint32_t seq = 0;
+    double value = 0;
+};
+
+// How a scheme's streams push and its reporter drains
+class Channel {
+public:
+    virtual ~Channel() = default;
+    virtual bool push(int stream, const Sample& sample) = 0;
+    // Hands over what is queued; `report` runs once per batch and is
+    // where the reporter's own work (and stalls) happen
+    virtual void drain_batch(const std::function<void(const Sample&)>& consume,
+                             const std::function<void()>& report) = 0;
+};
+
+class ReportUnderLock : public Channel {
+public:
+    bool push(int, const Sample& sample) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.push_back(sample);
+        return true;
+    }
+    void drain_batch(const std::function<void(const Sample&)>& consume,
+                     const std::function<void()>& report) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const Sample& s : pending_) consume(s);
+        pending_.clear();
+        report();
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<Sample> pending_;
+};
+
+class MutexVector : public Channel {
+public:
+    bool push(int, const Sample& sample) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.push_back(sample);
+        return true;
+    }
+    void drain_batch(const std::function<void(const Sample&)>& consume,
+                     const std::function<void()>& report) override {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            batch_.swap(pending_);
+        }
+        for (const Sample& s : batch_) consume(s);
+        batch_.clear();
+        report();
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<Sample> pending_;
+    std::vector<Sample> batch_;
+};
+
+class Mpsc : public Channel {
+public:
+    explicit Mpsc(size_t capacity) : queue_(capacity) {}
+    bool push(int, const Sample& sample) override { return queue_.try_push(sample); }
+    void drain_batch(const std::function<void(const Sample&)>& consume,
+                     const std::function<void()>& report) override {
+        queue_.drain([&](Sample&& s) { consume(s); });
+        report();
+    }
+
+private:
+    MpscQueue<Sample> queue_;
+};
+
+class SpscPerStream : public Channel {
+public:
+    SpscPerStream(int streams, size_t capacity) {
+        for (int i = 0; i < streams; ++i) rings_.emplace_back(new SpscRing<Sample>(capacity));
+    }
+    bool push(int stream, const Sample& sample) override { return rings_[stream]->try_push(sample); }
+    void drain_batch(const std::function<void(const Sample&)>& consume,
+                     const std::function<void()>& report) override {
+        for (auto& ring : rings_) ring->drain([&](Sample&& s) { consume(s); });
+        report();
+    }
+
+private:
+    std::vector<std::unique_ptr<SpscRing<Sample>>> rings_;
+};
+
+struct Result {
+    std::vector<uint32_t> push_ns;  // Every push, every stream
+    uint64_t pushed = 0;
+    uint64_t dropped = 0;
+    uint64_t received = 0;
+    uint64_t out_of_order = 0;
+};
+
+Result run(Channel* channel, const Options& options) {
+    const auto burst_every = std::chrono::milliseconds(1);
+    const uint64_t per_burst = std::max<uint64_t>(1, static_cast<uint64_t>(options.rate / 1000));
+    const uint64_t bursts = static_cast<uint64_t>(options.seconds * 1000);
+
+    std::vector<std::vector<uint32_t>> push_ns(options.streams);
+    std::vector<uint64_t> dropped(options.streams, 0);
+    std::atomic<int> running{options.streams};
+    Result result;
+
+    auto start = Clock::now();
+    std::vector<std::thread> streams;
+    for (int stream = 0; stream < options.streams; ++stream) {
+        streams.emplace_back([&, stream] {
+            std::vector<uint32_t>& latencies = push_ns[stream];
+            latencies.reserve(per_burst * bursts);
+            Sample sample;
+            sample.stream = stream;
+            auto next = start;
+            for (uint64_t b = 0; b < bursts; ++b) {
+                for (uint64_t i = 0; i < per_burst; ++i) {
+                    sample.value = sample.seq * 0.5;
+                    auto before = Clock::now();
+                    if (!channel->push(stream, sample)) ++dropped[stream];
+                    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - before).count();
+                    latencies.push_back(static_cast<uint32_t>(std::min<int64_t>(ns, UINT32_MAX)));
+                    ++sample.seq;
+                }
+                next += burst_every;
+                std::this_thread::sleep_until(next);
+            }
+            --running;
+        });
+    }
+
+    // The reporter
+    std::vector<int64_t> last_seq(options.streams, -1);
+    auto last_stall = start;
+    auto consume = [&](const Sample& s) {
+        if (static_cast<int64_t>(s.seq) <= last_seq[s.stream]) ++result.out_of_order;
+        last_seq[s.stream] = s.seq;
+        ++result.received;
+    };
+    auto report = [&] {
+        auto now = Clock::now();
+        if (now - last_stall >= std::chrono::milliseconds(options.stall_every_ms)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(options.stall_ms));
+            last_stall = Clock::now();
+        }
+    };
+    while (running > 0) {
+        channel->drain_batch(consume, report);
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    channel->drain_batch(consume, [] {});
+    for (auto& t : streams) t.join();
+
+    for (int stream = 0; stream < options.streams; ++stream) {
+        result.pushed += push_ns[stream].size();
+        result.dropped += dropped[stream];
+        result.push_ns.insert(result.push_ns.end(), push_ns[stream].begin(), push_ns[stream].end());
+    }
+    std::sort(result.push_ns.begin(), result.push_ns.end());
+    return result;
+}
+
+uint32_t percentile(const std::vector<uint32_t>& sorted, double q) {
+    if (sorted.empty()) return 0;
+    return sorted[static_cast<size_t>(q * (sorted.size() - 1))];
+}
+
+void print_usage() {
+    std::cout << "Usage: queue_bench [options]\n"
+              << "  --streams=N            Stream threads (default 4)\n"
+              << "  --rate=N               Samples per second per stream (default 100000)\n"
+              << "  --seconds=S            Run time per scheme (default 2)\n"
+              << "  --capacity=N           Queue slots per stream (default 16384)\n"
+              << "  --stall=MS             Reporter stall (default 20)\n"
+              << "  --stall-every=MS       Time between stalls (default 100)\n";
+}
+
+const char* flag_value(const char* arg, const char* name) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) == 0 && arg[len] == '=') return arg + len + 1;
+    return nullptr;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value;
+        if ((value = flag_value(arg, "--streams"))) {
+            options.streams = std::max(1, atoi(value));
+        } else if ((value = flag_value(arg, "--rate"))) {
+            options.rate = std::max(1000.0, atof(value));
+        } else if ((value = flag_value(arg, "--seconds"))) {
+            options.seconds = std::max(0.1, atof(value));
+        } else if ((value = flag_value(arg, "--capacity"))) {
+            options.capacity = std::max(2ull, std::strtoull(value, nullptr, 10));
+        } else if ((value = flag_value(arg, "--stall"))) {
+            options.stall_ms = std::max(0, atoi(value));
+        } else if ((value = flag_value(arg, "--stall-every"))) {
+            options.stall_every_ms = std::max(1, atoi(value));
+        } else {
+            print_usage();
+            return strcmp(arg, "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    std::cout << "  " << options.streams << " streams x " << static_cast<uint64_t>(options.rate)
+              << " samples/s, reporter stalls " << options.stall_ms << " ms every " << options.stall_every_ms
+              << " ms\n\n";
+    std::cout << "  " << std::left << std::setw(20) << "scheme" << std::right << std::setw(10) << "p50 ns"
+              << std::setw(10) << "p99 ns" << std::setw(12) << "p99.99 ns" << std::setw(12) << "max us"
+              << std::setw(10) << ">10us" << std::setw(10) << "dropped" << "\n";
+
+    struct Scheme {
+        const char* name;
+        std::unique_ptr<Channel> channel;
+    };
+    std::vector<Scheme> schemes;
+    schemes.push_back({"report under lock", std::unique_ptr<Channel>(new ReportUnderLock)});
+    schemes.push_back({"mutex + vector", std::unique_ptr<Channel>(new MutexVector)});
+    schemes.push_back({"mpsc queue", std::unique_ptr<Channel>(new Mpsc(options.capacity * options.streams))});
+    schemes.push_back({"spsc per stream",
+                       std::unique_ptr<Channel>(new SpscPerStream(options.streams, options.capacity))});
+
+    bool lost = false;
+    for (Scheme& scheme : schemes) {
+        Result r = run(scheme.channel.get(), options);
+        size_t slow = r.push_ns.end() - std::upper_bound(r.push_ns.begin(), r.push_ns.end(), 10000u);
+        std::cout << "  " << std::left << std::setw(20) << scheme.name << std::right << std::setw(10)
+                  << percentile(r.push_ns, 0.5) << std::setw(10) << percentile(r.push_ns, 0.99) << std::setw(12)
+                  << percentile(r.push_ns, 0.9999) << std::setw(12) << std::fixed << std::setprecision(1)
+                  << (r.push_ns.empty() ? 0 : r.push_ns.back()) / 1000.0 << std::setw(10) << slow
+                  << std::setw(10) << r.dropped << "\n";
+        if (r.received + r.dropped != r.pushed || r.out_of_order) {
+            std::cout << "    " << r.pushed - r.dropped - r.received << " samples lost, " << r.out_of_order
+                      << " out of order\n";
+            lost = true;
+        }
+    }
+    std::cout << "\n";
+    return lost ? 1 : 0;
+}
@@ -0,0 +1,249 @@
+// Routes requests the way the server did before http_routes.h (a chain of
+// std::string::find and compare calls, each over the request) and the way
+// it does now (kServerRoutes), and builds response headers the way it did
+// (std::ostringstream, or appends naming every part) and from the compiled
+// heads. Reports ns per request and checks both routers agree.
+//
+// Requests carry the headers a browser sends, since find() scans them
+// too. The mix is one GUI test: /api/samples polls, pings, the streams
+// of both phases, the page and a few misses.
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "http_routes.h"
+
+using namespace speedtest;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    double run_s = 0.5;  // Per measurement
+};
+
+const char kBrowserHeaders[] =
+    "Host: speedtest.example.net:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://speedtest.example.net:8080/\r\n"
+    "Connection: keep-alive\r\n"
+    "Sec-Fetch-Dest: empty\r\n"
+    "Sec-Fetch-Mode: cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n\r\n";
+
+std::vector<std::string> make_requests() {
+    struct Target {
+        const char* line;
+        int count;
+    };
+    const Target targets[] = {
+        {"GET /api/samples?test=k2x9a1b3-d&since=40 HTTP/1.1", 40},
+        {"GET /api/ping HTTP/1.1", 20},
+        {"GET /stream/download?bytes=1000000000000&test=k2x9a1b3-d&session=k2x9a1b3&stream=3 HTTP/1.1", 8},
+        {"POST /stream/upload?test=k2x9a1b3-u&session=k2x9a1b3&stream=3 HTTP/1.1", 8},
+        {"GET /api/info HTTP/1.1", 2},
+        {"GET /api/servers HTTP/1.1", 2},
+        {"POST /api/results?download_mbps=912.4&upload_mbps=88.1&ping_ms=11&jitter_ms=1.2 HTTP/1.1", 1},
+        {"GET /api/history?limit=10 HTTP/1.1", 1},
+        {"GET / HTTP/1.1", 1},
+        {"GET /favicon.ico HTTP/1.1", 1},
+    };
+    std::vector<std::string> requests;
+    for (const Target& target : targets) {
+        for (int i = 0; i < target.count; ++i) requests.push_back(std::string(target.line) + "\r\n" + kBrowserHeaders);
+    }
+    return requests;
+}
+
+// start_response() then handle_request() and start_stream() as they were
+ServerRoute chain_route(const std::string& request) {
+    if (request.find(" /stream/") < request.find("\r\n")) {
+        if (request.compare(0, 21, "GET /stream/download?") == 0 ||
+            request.compare(0, 21, "GET /stream/download ") == 0) {
+            return ServerRoute::kStreamDownload;
+        }
+        if (request.compare(0, 19, "POST /stream/upload") == 0) return ServerRoute::kStreamUpload;
+        return ServerRoute::kPage;
+    }
+    if (request.compare(0, 13, "GET /api/udp?") == 0) return ServerRoute::kUdp;
+    if (request.find("GET /api/servers") != std::string::npos) return ServerRoute::kServers;
+    if (request.find("GET /api/info") != std::string::npos) return ServerRoute::kInfo;
+    if (request.find("GET /api/ping") != std::string::npos) return ServerRoute::kPing;
+    if (request.find("GET /api/samples") != std::string::npos) return ServerRoute::kSamples;
+    if (request.find("GET /api/scheduler") != std::string::npos) return ServerRoute::kScheduler;
+    if (request.compare(0, 20, "POST /api/agent/run?") == 0) return ServerRoute::kAgentRun;
+    if (request.compare(0, 21, "GET /api/agent/result") == 0) return ServerRoute::kAgentResult;
+    if (request.compare(0, 18, "POST /api/results?") == 0) return ServerRoute::kResults;
+    if (request.compare(0, 16, "GET /api/history") == 0) return ServerRoute::kHistory;
+    if (request.find("GET /api/download") != std::string::npos) return ServerRoute::kSimulatedDownload;
+    if (request.find("GET /api/upload") != std::string::npos) return ServerRoute::kSimulatedUpload;
+    return ServerRoute::kPage;
+}
+
+ServerRoute table_route(const std::string& request) {
+    return kServerRoutes.find(request);
+}
+
+constexpr auto kJsonHead = response_head(
+    "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nAccess-Control-Allow-Origin: *\r\nContent-Length: ");
+constexpr auto kDownloadHead = response_head(
+    "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nCache-Control: no-store\r\n"
+    "Access-Control-Allow-Origin: *\r\nContent-Length: ");
+
+// The download header, as start_stream() built it
+std::string ostream_download(uint64_t length, const std::string&) {
+    std::ostringstream header;
+    header << "HTTP/1.1 200 OK\r\n"
+           << "Content-Type: application/octet-stream\r\n"
+           << "Cache-Control: no-store\r\n"
+           << "Access-Control-Allow-Origin: *\r\n"
+           << "Content-Length: " << length << "\r\n"
+           << "\r\n";
+    return header.str();
+}
+
+// An API response, as make_response() built it
+std::string appended_json(uint64_t, const std::string& body) {
+    std::string response;
+    response.reserve(160 + body.size());
+    response += "HTTP/1.1 ";
+    response += "200 OK";
+    response += "\r\nContent-Type: ";
+    response += "application/json";
+    response += "\r\nAccess-Control-Allow-Origin: *";
+    response += "\r\nContent-Length: ";
+    response += std::to_string(body.size());
+    response += "\r\n\r\n";
+    response += body;
+    return response;
+}
+
+std::string compiled(std::string_view head, uint64_t length, const std::string& body) {
+    char digits[20];
+    char* end = std::to_chars(digits, digits + sizeof(digits), length).ptr;
+    std::string response;
+    response.reserve(head.size() + sizeof(digits) + 4 + body.size());
+    response.append(head);
+    response.append(digits, end);
+    response.append("\r\n\r\n", 4);
+    response.append(body);
+    return response;
+}
+
+std::string compiled_download(uint64_t length, const std::string&) {
+    return compiled(kDownloadHead.view(), length, "");
+}
+
+std::string compiled_json(uint64_t, const std::string& body) {
+    return compiled(kJsonHead.view(), body.size(), body);
+}
+
+// ns per call of fn over `inputs`, repeated for run_s
+template <typename Fn>
+double time_per_call(const Fn& fn, size_t inputs, double run_s, uint64_t* sink) {
+    uint64_t calls = 0;
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(run_s));
+    do {
+        for (size_t i = 0; i < inputs; ++i) *sink += fn(i);
+        calls += inputs;
+    } while (Clock::now() < deadline);
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / calls;
+}
+
+void print_row(const std::string& what, const char* how, double ns, double baseline) {
+    std::cout << "  " << std::left << std::setw(28) << what << std::setw(14) << how << std::right << std::fixed
+              << std::setprecision(1) << std::setw(10) << ns << std::setprecision(2) << std::setw(9)
+              << baseline / ns << "x\n";
+}
+
+void print_usage() {
+    std::cout << "Usage: route_bench [options]\n"
+              << "  --run=S                Time per measurement (default 0.5)\n";
+}
+
+const char* flag_value(const char* arg, const char* name) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) == 0 && arg[len] == '=') return arg + len + 1;
+    return nullptr;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value;
+        if ((value = flag_value(arg, "--run"))) {
+            options.run_s = std::max(0.01, atof(value));
+        } else {
+            print_usage();
+            return strcmp(arg, "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    std::vector<std::string> requests = make_requests();
+    size_t disagree = 0;
+    for (const std::string& request : requests) disagree += chain_route(request) != table_route(request);
+
+    uint64_t sink = 0;
+    std::cout << "  " << requests.size() << " requests of " << requests[0].size() << " bytes or more, table seed "
+              << kServerRoutes.seed() << ", " << kServerRoutes.kSlots << " slots\n\n";
+    std::cout << "  " << std::left << std::setw(28) << "work" << std::setw(14) << "how" << std::right
+              << std::setw(10) << "ns/call" << std::setw(10) << "speedup" << "\n";
+
+    double chain = time_per_call([&](size_t i) { return static_cast<uint64_t>(chain_route(requests[i])); },
+                                 requests.size(), options.run_s, &sink);
+    double table = time_per_call([&](size_t i) { return static_cast<uint64_t>(table_route(requests[i])); },
+                                 requests.size(), options.run_s, &sink);
+    print_row("route (test mix)", "find chain", chain, chain);
+    print_row("route (test mix)", "route table", table, chain);
+
+    // The fallback scans every find() to the end of the request
+    const std::string page = requests.back();
+    chain = time_per_call([&](size_t) { return static_cast<uint64_t>(chain_route(page)); }, 1, options.run_s, &sink);
+    table = time_per_call([&](size_t) { return static_cast<uint64_t>(table_route(page)); }, 1, options.run_s, &sink);
+    print_row("route (miss)", "find chain", chain, chain);
+    print_row("route (miss)", "route table", table, chain);
+
+    using Builder = std::string (*)(uint64_t, const std::string&);
+    const std::string body = "{\"ping\":11.071702822784781,\"jitter\":1.7898263402135601}";
+    const struct {
+        const char* what;
+        const char* old_how;
+        Builder old_build;
+        Builder new_build;
+        uint64_t length;
+    } heads[] = {
+        {"download header", "ostringstream", ostream_download, compiled_download, 1000000000000ull},
+        {"json response", "appends", appended_json, compiled_json, 0},
+    };
+    for (const auto& head : heads) {
+        if (head.old_build(head.length, body) != head.new_build(head.length, body)) ++disagree;
+        double before = time_per_call([&](size_t) { return head.old_build(head.length, body).size(); }, 1,
+                                      options.run_s, &sink);
+        double after = time_per_call([&](size_t) { return head.new_build(head.length, body).size(); }, 1,
+                                     options.run_s, &sink);
+        print_row(head.what, head.old_how, before, before);
+        print_row(head.what, "compiled head", after, before);
+    }
+
+    std::cout << "\n";
+    if (disagree) std::cout << "  " << disagree << " requests or responses differ between the two ways\n\n";
+    return sink == 0 || disagree ? 1 : 0;
+}
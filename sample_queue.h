@@ -0,0 +1,155 @@
+#ifndef SAMPLE_QUEUE_H_
+#define SAMPLE_QUEUE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace speedtest {
+
+// Bounded queues that carry samples from the threads measuring to the
+// threads reporting (statistics, progress display, trace writer). Pushing
+// never waits: a full queue fails the push and the producer decides what
+// a lost sample costs. The consumer drains whatever is there in one
+// batch. Indices the two sides write live on separate cache lines, so a
+// producer's stores don't keep invalidating the line the consumer polls.
+
+constexpr size_t kCacheLineSize = 64;
+
+// Smallest power of two >= n, so slots are found with a mask
+inline size_t queue_capacity(size_t n) {
+    size_t capacity = 1;
+    while (capacity < n) capacity <<= 1;
+    return capacity;
+}
+
+// One producer thread, one consumer thread. Each side keeps a private
+// copy of the other's index and rereads the shared one only when the copy
+// says full (or empty), so the steady state touches no shared line but
+// the slot itself.
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity)
+        : slots_(queue_capacity(capacity)), mask_(slots_.size() - 1) {}
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Producer; false when full
+    bool try_push(T value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cached_head_ == slots_.size()) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ == slots_.size()) return false;
+        }
+        slots_[tail & mask_] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer: hands up to `max` queued values to consume(T&&) in order,
+    // then frees their slots at once. Returns how many.
+    template <typename Consume>
+    size_t drain(Consume&& consume, size_t max = std::numeric_limits<size_t>::max()) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == cached_tail_) cached_tail_ = tail_.load(std::memory_order_acquire);
+        size_t n = std::min(cached_tail_ - head, max);
+        for (size_t i = 0; i < n; ++i) consume(std::move(slots_[(head + i) & mask_]));
+        head_.store(head + n, std::memory_order_release);
+        return n;
+    }
+
+    // Either side; exact only when the other is idle
+    size_t size() const {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+    size_t capacity() const { return slots_.size(); }
+
+private:
+    alignas(kCacheLineSize) std::atomic<size_t> head_{0};  // Written by the consumer
+    size_t cached_tail_ = 0;
+    alignas(kCacheLineSize) std::atomic<size_t> tail_{0};  // Written by the producer
+    size_t cached_head_ = 0;
+    alignas(kCacheLineSize) std::vector<T> slots_;
+    size_t mask_;
+};
+
+// Many producer threads, one consumer (Vyukov's bounded queue). Producers
+// claim a slot by advancing the tail with a CAS, so a push is lock-free
+// but can retry under contention; each slot's sequence number says
+// whether it is free, filled, or still being written. A producer stalled
+// between claiming and filling a slot holds up the consumer at that slot,
+// never another producer.
+template <typename T>
+class MpscQueue {
+public:
+    explicit MpscQueue(size_t capacity) : slots_(queue_capacity(capacity)), mask_(slots_.size() - 1) {
+        for (size_t i = 0; i < slots_.size(); ++i) slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    // Any thread; false when full
+    bool try_push(T value) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots_[pos & mask_];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            auto lag = static_cast<std::ptrdiff_t>(sequence - pos);
+            if (lag == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (lag < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        slot->value = std::move(value);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // The consumer thread only, as SpscRing::drain
+    template <typename Consume>
+    size_t drain(Consume&& consume, size_t max = std::numeric_limits<size_t>::max()) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t n = 0;
+        while (n < max) {
+            Slot& slot = slots_[head & mask_];
+            if (slot.sequence.load(std::memory_order_acquire) != head + 1) break;
+            consume(std::move(slot.value));
+            slot.sequence.store(head + slots_.size(), std::memory_order_release);
+            ++head;
+            ++n;
+        }
+        head_.store(head, std::memory_order_relaxed);
+        return n;
+    }
+
+    size_t size() const {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+    size_t capacity() const { return slots_.size(); }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence{0};
+        T value{};
+    };
+
+    alignas(kCacheLineSize) std::atomic<size_t> tail_{0};  // Claimed by producers
+    alignas(kCacheLineSize) std::atomic<size_t> head_{0};  // Consumer's; atomic only for size()
+    alignas(kCacheLineSize) std::vector<Slot> slots_;
+    size_t mask_;
+};
+
+} // namespace speedtest
+
+#endif // SAMPLE_QUEUE_H_
@@ -1,89 +1,1676 @@
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cctype>
+#include <charconv>
 #include <chrono>
+#include <csignal>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "benchmark.h"
+#include "binary_api.h"
+#include "history.h"
+#include "http_routes.h"
+#include "interfaces.h"
+#include "io_backend.h"
+#include "json_writer.h"
+#include "link_model.h"
+#include "mesh.h"
+#include "payload.h"
+#include "session_scheduler.h"
+#include "socket_tuning.h"
+#include "tcp_info.h"
+#include "tls.h"
+#include "topology.h"
+#include "udp_flow.h"
 
 // Advanced HTTP server for speed test GUI with maps and server selection
 
+// Set by signal handlers; the event loop acts on them within a tick
+static volatile sig_atomic_t g_stop_signals = 0;   // SIGTERM/SIGINT: drain; a second one quits
+static volatile sig_atomic_t g_reload_signal = 0;  // SIGHUP: reload the config
+
+// Every setting, from --key=value flags and the --config file (one
+// key=value per line with the same names, '#' starts a comment). A reload
+// reads the file again and puts the command line on top. Fields marked
+// (restart) keep their startup value until the next process.
+struct ServerOptions {
+    int port = 8080;                        // (restart)
+    int tls_port = 0;                       // (restart)
+    std::string tls_cert;                   // (restart)
+    std::string tls_key;                    // (restart)
+    bool ktls = true;                       // (restart)
+    speedtest::IoBackendKind io_backend = speedtest::IoBackendKind::kAuto;  // (restart)
+    std::string handoff_path;               // (restart) Unix socket for passing listeners on
+    int tcp_port = 0;                       // (restart) Raw TCP streams; 0 = off
+    int udp_port = 0;                       // (restart) UDP flows; 0 = off
+    std::string affinity = "none";          // (restart) Event loop, then UDP thread; see speedtest::parse_placement
+    uint64_t udp_max_rate_bps = 1000000000; // Per UDP flow; 0 = whatever the client asks
+    speedtest::SchedulerConfig scheduler;
+    std::string link_spec = "default";
+    uint64_t seed = 0;
+    int idle_timeout_s = 15;
+    int drain_timeout_s = 30;               // Longest wait for running tests when stopping
+    int header_timeout_s = 10;              // From a request's first byte to the end of its header
+    int send_timeout_s = 30;                // Longest one send may take to go out
+    int max_connections = 10000;            // 0 = unlimited
+    uint64_t memory_budget = 256ull << 20;  // Bytes held for all connections and test samples; 0 = unlimited
+    uint64_t connection_budget = 4ull << 20; // Bytes held for one connection; 0 = unlimited
+    std::string servers_path;               // JSON array for /api/servers; empty = built-in list
+    bool agent = false;                     // Run tests for a speed_test --mesh controller
+    std::string agent_token;                // The controller's Authorization: Bearer; required with agent
+    std::string history_path;               // (restart) Results store; empty = in memory only
+    speedtest::TuningProfile tuning;        // Server-side defaults under each client's profile
+};
+
+static bool set_server_option(ServerOptions* options, const std::string& key, const std::string& value,
+                              std::string* error) {
+    if (key == "port") {
+        options->port = std::atoi(value.c_str());
+    } else if (key == "tls-port") {
+        options->tls_port = std::atoi(value.c_str());
+    } else if (key == "tls-cert") {
+        options->tls_cert = value;
+    } else if (key == "tls-key") {
+        options->tls_key = value;
+    } else if (key == "ktls") {
+        options->ktls = std::atoi(value.c_str()) != 0;
+    } else if (key == "io-backend") {
+        if (!speedtest::parse_io_backend(value, &options->io_backend)) {
+            *error = "unknown I/O backend: " + value;
+            return false;
+        }
+    } else if (key == "handoff") {
+        options->handoff_path = value;
+    } else if (key == "tcp-port") {
+        options->tcp_port = std::atoi(value.c_str());
+    } else if (key == "udp-port") {
+        options->udp_port = std::atoi(value.c_str());
+    } else if (key == "affinity") {
+        options->affinity = value;
+    } else if (key == "udp-max-rate") {
+        if (!speedtest::parse_rate(value, &options->udp_max_rate_bps)) {
+            *error = "bad rate: " + value;
+            return false;
+        }
+    } else if (key == "capacity") {
+        if (!speedtest::parse_rate(value, &options->scheduler.capacity_bps)) {
+            *error = "bad capacity: " + value;
+            return false;
+        }
+    } else if (key == "max-sessions") {
+        options->scheduler.max_sessions = std::atoi(value.c_str());
+    } else if (key == "max-queue") {
+        options->scheduler.max_queue = std::atoi(value.c_str());
+    } else if (key == "simulate") {
+        options->link_spec = value;
+    } else if (key == "seed") {
+        options->seed = std::strtoull(value.c_str(), nullptr, 10);
+    } else if (key == "idle-timeout") {
+        options->idle_timeout_s = std::max(1, std::atoi(value.c_str()));
+    } else if (key == "drain-timeout") {
+        options->drain_timeout_s = std::max(0, std::atoi(value.c_str()));
+    } else if (key == "header-timeout") {
+        options->header_timeout_s = std::max(1, std::atoi(value.c_str()));
+    } else if (key == "send-timeout") {
+        options->send_timeout_s = std::max(1, std::atoi(value.c_str()));
+    } else if (key == "max-connections") {
+        options->max_connections = std::max(0, std::atoi(value.c_str()));
+    } else if (key == "memory-budget" || key == "connection-budget") {
+        uint64_t* bytes = key == "memory-budget" ? &options->memory_budget : &options->connection_budget;
+        if (!speedtest::parse_size(value, bytes)) {
+            *error = "bad size: " + value;
+            return false;
+        }
+    } else if (key == "servers") {
+        options->servers_path = value;
+    } else if (key == "agent") {
+        options->agent = std::atoi(value.c_str()) != 0;
+    } else if (key == "agent-token") {
+        options->agent_token = value;
+    } else if (key == "history") {
+        options->history_path = value;
+    } else if (key == "tuning") {
+        options->tuning = speedtest::TuningProfile();
+        return speedtest::parse_tuning(value, &options->tuning, error);
+    } else {
+        *error = "unknown option: " + key;
+        return false;
+    }
+    return true;
+}
+
+// Resident set size of this process, from /proc; 0 where there is none
+static uint64_t resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    uint64_t pages = 0, resident = 0;
+    if (!(statm >> pages >> resident)) return 0;
+    return resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+}
+
+static std::string trim(const std::string& text) {
+    size_t begin = text.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) return "";
+    return text.substr(begin, text.find_last_not_of(" \t\r\n") - begin + 1);
+}
+
+static bool load_config_file(const std::string& path, ServerOptions* options, std::string* error) {
+    std::ifstream in(path);
+    if (!in) {
+        *error = path + ": can't read";
+        return false;
+    }
+    std::string line;
+    for (int number = 1; std::getline(in, line); ++number) {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) continue;
+        size_t eq = line.find('=');
+        std::string why = "expected key=value";
+        if (eq == std::string::npos ||
+            !set_server_option(options, trim(line.substr(0, eq)), trim(line.substr(eq + 1)), &why)) {
+            *error = path + ":" + std::to_string(number) + ": " + why;
+            return false;
+        }
+    }
+    return true;
+}
+
+// The /api/servers list, passed through to JSON clients as it is
+static bool load_servers_json(const std::string& path, std::string* json, std::string* error) {
+    std::ifstream in(path);
+    std::stringstream text;
+    text << in.rdbuf();
+    std::string body = trim(text.str());
+    if (!in || body.empty() || body.front() != '[' || body.back() != ']') {
+        *error = path + ": expected a JSON array of servers";
+        return false;
+    }
+    // Binary clients get the same list, so its entries must parse
+    std::vector<speedtest::ServerEntry> entries;
+    if (!speedtest::parse_servers_json(body, &entries, error)) {
+        *error = path + ": " + *error;
+        return false;
+    }
+    *json = body;
+    return true;
+}
+
+// /api/servers without --servers
+static std::vector<speedtest::ServerEntry> default_servers() {
+    return {
+        {1, "New York, US", "New York", "United States", 40.7128, -74.0060, 0, 12},
+        {2, "London, UK", "London", "United Kingdom", 51.5074, -0.1278, 5571, 85},
+        {3, "Tokyo, JP", "Tokyo", "Japan", 35.6762, 139.6503, 10838, 165},
+        {4, "Sydney, AU", "Sydney", "Australia", -33.8688, 151.2093, 15989, 210},
+        {5, "Frankfurt, DE", "Frankfurt", "Germany", 50.1109, 8.6821, 6198, 95},
+        {6, "Singapore, SG", "Singapore", "Singapore", 1.3521, 103.8198, 15322, 180},
+        {7, "Mumbai, IN", "Mumbai", "India", 19.0760, 72.8777, 12568, 145},
+        {8, "São Paulo, BR", "São Paulo", "Brazil", -23.5505, -46.6333, 7688, 120},
+    };
+}
+
 class SpeedTestServer {
 public:
-    SpeedTestServer(int port) : port_(port), server_fd_(-1) {}
-    
+    // `link` drives the simulated /api/ping, /api/download and /api/upload;
+    // `servers_json` replaces the built-in /api/servers list when not empty
+    SpeedTestServer(const ServerOptions& options, std::shared_ptr<const speedtest::LinkModel> link,
+                    std::string servers_json)
+        : options_(options), server_fd_(-1), scheduler_(options.scheduler),
+          sim_(std::move(link), options.seed) {
+        set_servers(std::move(servers_json));
+        // Tests this server ran as an agent go into its history too
+        agent_.set_result_handler([this](const speedtest::SpeedResult& result) {
+            speedtest::HistoryPoint point;
+            point.download_mbps = result.download_mbps;
+            point.upload_mbps = result.upload_mbps;
+            point.ping_ms = result.ping_ms;
+            point.jitter_ms = result.jitter_ms;
+            record_result(point);
+        });
+    }
+
+    // Also serve HTTPS on options.tls_port; call before start()
+    void enable_tls(std::shared_ptr<speedtest::TlsContext> context) {
+        tls_ = std::move(context);
+    }
+
+    // Called from the event loop on SIGHUP
+    void set_reload_handler(std::function<void()> handler) {
+        reload_ = std::move(handler);
+    }
+
     bool start() {
-        server_fd_ = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_fd_ < 0) {
-            std::cerr << "Failed to create socket\n";
+        auto begin = Clock::now();
+        // Pinned first, so the payload and every buffer after it are
+        // allocated on our node
+        std::string error;
+        if (!speedtest::parse_placement(options_.affinity, nic_device(), &placement_, &error)) {
+            std::cerr << "--affinity: " << error << "\n";
             return false;
         }
-        
-        int opt = 1;
-        setsockopt(server_fd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        
-        sockaddr_in address{};
-        address.sin_family = AF_INET;
-        address.sin_addr.s_addr = INADDR_ANY;
-        address.sin_port = htons(port_);
-        
-        if (bind(server_fd_, (sockaddr*)&address, sizeof(address)) < 0) {
-            std::cerr << "Failed to bind to port " << port_ << "\n";
+        speedtest::pin_to_cpus(placement_.thread_cpus(0));
+        // Listening sockets come from the process we replace, from
+        // systemd, or are bound here
+        const char* listeners = "bound";
+        if (!options_.handoff_path.empty() && take_over_listeners()) listeners = "taken over from the previous process";
+        else if (inherit_systemd_listeners()) listeners = "from systemd";
+        if (server_fd_ < 0 && (server_fd_ = open_listener(options_.port)) < 0) return false;
+        if (tls_ && tls_fd_ < 0 && (tls_fd_ = open_listener(options_.tls_port)) < 0) return false;
+        if (!tls_ && tls_fd_ >= 0) {
+            close(tls_fd_);
+            tls_fd_ = -1;
+        }
+        if (options_.tcp_port && raw_fd_ < 0 && (raw_fd_ = open_listener(options_.tcp_port)) < 0) return false;
+        if (options_.udp_port && udp_fd_ < 0 && (udp_fd_ = open_udp_socket(options_.udp_port)) < 0) return false;
+        if (udp_fd_ >= 0) {
+            udp_.reset(new speedtest::UdpFlowServer(udp_fd_, options_.udp_max_rate_bps, placement_.thread_cpus(1)));
+            udp_fd_ = -1;
+        }
+        if (!options_.handoff_path.empty() && !open_handoff_socket()) return false;
+        if (!options_.history_path.empty() && !history_.open(options_.history_path, &error)) {
+            std::cerr << "--history: " << error << "\n";
             return false;
         }
-        
-        if (listen(server_fd_, 10) < 0) {
-            std::cerr << "Failed to listen\n";
-            return false;
-        }
-        
+        history_.start();
+
+        backend_ = speedtest::make_io_backend(options_.io_backend);
+        init_payload();
+        start_ip_lookup();
+        double ready_ms = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+
         std::cout << "\n";
         std::cout << "  ╔═══════════════════════════════════════════════════════╗\n";
         std::cout << "  ║              ⚡ SPEED TEST SERVER ⚡                   ║\n";
         std::cout << "  ╚═══════════════════════════════════════════════════════╝\n";
         std::cout << "\n";
-        std::cout << "  🌐 Server running at: http://localhost:" << port_ << "\n";
-        std::cout << "  📋 Press Ctrl+C to stop\n\n";
-        
+        std::cout << "  🌐 Server running at: http://localhost:" << options_.port << "\n";
+        if (tls_) std::cout << "  🔒 HTTPS at: https://localhost:" << options_.tls_port << "\n";
+        if (raw_fd_ >= 0) std::cout << "  🔌 Raw TCP streams on port " << options_.tcp_port << "\n";
+        if (udp_) {
+            std::cout << "  📦 UDP flows on port " << options_.udp_port;
+            if (options_.udp_max_rate_bps) std::cout << ", up to " << options_.udp_max_rate_bps / 1e6 << " Mbit/s each";
+            std::cout << "\n";
+        }
+        std::cout << "  ⚙️  I/O backend: " << speedtest::io_backend_name(backend_->kind()) << "\n";
+        if (!placement_.empty()) {
+            std::cout << "  📌 Event loop on " << placement_.describe(0);
+            if (udp_) std::cout << "; UDP on " << speedtest::format_cpu_list(placement_.thread_cpus(1));
+            std::cout << "\n";
+        }
+        std::cout << "  🚦 Sessions: " << describe_limits() << "\n";
+        if (options_.agent) std::cout << "  🛰️  Agent: runs tests for speed_test --mesh controllers\n";
+        std::cout << "  📈 History: " << history_.size() << " results";
+        if (options_.history_path.empty()) std::cout << ", in memory only\n";
+        else std::cout << " in " << options_.history_path << "\n";
+        std::cout << "  🔁 Keep-alive: " << options_.idle_timeout_s << " s idle timeout\n";
+        std::cout << "  🧮 Memory: " << describe_budgets() << "\n";
+        std::cout << "  ⏱️  Ready in " << std::fixed << std::setprecision(1) << ready_ms << " ms, listeners "
+                  << listeners << "\n" << std::defaultfloat;
+        std::cout << "  📋 Ctrl+C or SIGTERM drains running tests, SIGHUP reloads the config\n\n" << std::flush;
+
         return true;
     }
-    
+
+    // Serve until a stop signal, or a handoff, has drained every
+    // connection (or the drain timed out)
     void run() {
-        while (true) {
-            sockaddr_in client_addr{};
-            socklen_t client_len = sizeof(client_addr);
-            int client_fd = accept(server_fd_, (sockaddr*)&client_addr, &client_len);
-            
-            if (client_fd >= 0) {
-                handle_client(client_fd);
-                close(client_fd);
+        backend_->watch_accept(server_fd_, kListenTag);
+        if (tls_) backend_->watch_accept(tls_fd_, kTlsListenTag);
+        if (raw_fd_ >= 0) backend_->watch_accept(raw_fd_, kRawListenTag);
+        if (handoff_fd_ >= 0) backend_->watch_accept(handoff_fd_, kHandoffTag);
+        std::vector<speedtest::IoCompletion> events;
+        auto last_sample = Clock::now();
+        while (!drained()) {
+            backend_->wait(&events, kSampleIntervalMs);
+            for (const speedtest::IoCompletion& ev : events) {
+                if (ev.tag == kListenTag || ev.tag == kTlsListenTag || ev.tag == kRawListenTag) on_accept(ev);
+                else if (ev.tag == kHandoffTag) on_handoff(ev);
+                else on_connection_event(ev);
             }
+            if (g_stop_signals > 1) break;
+            if (g_stop_signals > 0) begin_drain("Stopping", false);
+            if (g_reload_signal) {
+                g_reload_signal = 0;
+                if (reload_) reload_();
+            }
+            bool tick = Clock::now() - last_sample >= std::chrono::milliseconds(kSampleIntervalMs);
+            if (tick) {
+                last_sample = Clock::now();
+                sample_streams();
+                schedule_sessions();
+                close_idle_connections();
+                resume_downloads();
+            }
+            // Receive windows follow the RTT, so they are refreshed every tick
+            if (tick || scheduler_.generation() != paced_generation_) pace_streams(tick);
         }
+        std::cout << "  👋 Stopped with " << connections_.size() << " connection"
+                  << (connections_.size() == 1 ? "" : "s") << " left\n" << std::flush;
     }
-    
+
+    // Apply a reloaded config. Limits, the link model, tuning, timeouts and
+    // the server list change on the spot; sessions already running keep
+    // their slots. Listener and TLS settings wait for a restart.
+    void reconfigure(const ServerOptions& options, std::shared_ptr<const speedtest::LinkModel> link,
+                     std::string servers_json) {
+        std::vector<std::string> need_restart;
+        if (options.port != options_.port) need_restart.push_back("port");
+        if (options.tls_port != options_.tls_port || options.tls_cert != options_.tls_cert ||
+            options.tls_key != options_.tls_key || options.ktls != options_.ktls) {
+            need_restart.push_back("tls");
+        }
+        if (options.io_backend != options_.io_backend) need_restart.push_back("io-backend");
+        if (options.handoff_path != options_.handoff_path) need_restart.push_back("handoff");
+        if (options.tcp_port != options_.tcp_port) need_restart.push_back("tcp-port");
+        if (options.udp_port != options_.udp_port) need_restart.push_back("udp-port");
+        if (options.affinity != options_.affinity) need_restart.push_back("affinity");
+        if (options.history_path != options_.history_path) need_restart.push_back("history");
+        if (options.link_spec != options_.link_spec || options.seed != options_.seed) {
+            sim_ = speedtest::LinkSimulator(std::move(link), options.seed);
+        }
+
+        ServerOptions running = options_;
+        options_ = options;
+        options_.port = running.port;
+        options_.tls_port = running.tls_port;
+        options_.tls_cert = running.tls_cert;
+        options_.tls_key = running.tls_key;
+        options_.ktls = running.ktls;
+        options_.io_backend = running.io_backend;
+        options_.handoff_path = running.handoff_path;
+        options_.tcp_port = running.tcp_port;
+        options_.udp_port = running.udp_port;
+        options_.affinity = running.affinity;
+        options_.history_path = running.history_path;
+        scheduler_.set_config(options_.scheduler);
+        if (udp_) udp_->set_max_rate(options_.udp_max_rate_bps);
+        set_servers(std::move(servers_json));
+
+        std::cout << "  🔄 Reloaded: sessions " << describe_limits() << "; memory " << describe_budgets()
+                  << "; link " << sim_.model().name() << "; tuning " << options_.tuning.describe() << "\n";
+        for (const std::string& key : need_restart) std::cout << "     " << key << " changes on restart\n";
+        std::cout << std::flush;
+    }
+
 private:
-    int port_;
+    static constexpr uint64_t kListenTag = 0;
+    static constexpr uint64_t kTlsListenTag = ~0ull;
+    static constexpr uint64_t kHandoffTag = ~1ull;
+    static constexpr uint64_t kRawListenTag = ~2ull;
+    // Raw TCP uploads run until the client hangs up
+    static constexpr uint64_t kUnboundedUpload = 1ull << 62;
+    static constexpr size_t kChunkSize = 256 << 10;
+    static constexpr size_t kMaxHeaderSize = 16 << 10;
+    // Pipelined requests buffered behind the one being answered
+    static constexpr size_t kMaxPipelined = 64 << 10;
+    static constexpr int kSampleIntervalMs = 100;
+    static constexpr size_t kMaxSamplesPerTest = 50000;
+    static constexpr int kSampleRetentionS = 600;
+    // Simulated rates are quoted past slow start
+    static constexpr double kSimulatedSteadyS = 5.0;
+
+    // Response headers up to the Content-Length value (see make_response)
+    static constexpr auto kJsonHead = speedtest::response_head(
+        "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nAccess-Control-Allow-Origin: *\r\nContent-Length: ");
+    static constexpr auto kBinaryHead = speedtest::response_head(
+        "HTTP/1.1 200 OK\r\nContent-Type: ", speedtest::kBinaryContentType,
+        "\r\nAccess-Control-Allow-Origin: *\r\nContent-Length: ");
+    static constexpr auto kHtmlHead = speedtest::response_head(
+        "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: ");
+    static constexpr auto kDownloadHead = speedtest::response_head(
+        "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nCache-Control: no-store\r\n"
+        "Access-Control-Allow-Origin: *\r\nContent-Length: ");
+    static constexpr auto kBadRequestHead = speedtest::response_head(
+        "HTTP/1.1 400 Bad Request\r\nContent-Type: application/json\r\nAccess-Control-Allow-Origin: *\r\n"
+        "Content-Length: ");
+    static constexpr auto kUnavailableHead = speedtest::response_head(
+        "HTTP/1.1 503 Service Unavailable\r\nContent-Type: application/json\r\n"
+        "Access-Control-Allow-Origin: *\r\nContent-Length: ");
+    // ... with the Retry-After value next
+    static constexpr auto kBusyHead = speedtest::response_head(
+        "HTTP/1.1 503 Service Unavailable\r\nContent-Type: application/json\r\n"
+        "Access-Control-Allow-Origin: *\r\nRetry-After: ");
+    // /api/agent/* answers only the controller, never a page in a browser
+    static constexpr auto kAgentHead = speedtest::response_head(
+        "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: ");
+    static constexpr auto kForbiddenHead = speedtest::response_head(
+        "HTTP/1.1 403 Forbidden\r\nContent-Type: application/json\r\nContent-Length: ");
+    static constexpr auto kUnauthorizedHead = speedtest::response_head(
+        "HTTP/1.1 401 Unauthorized\r\nContent-Type: application/json\r\nWWW-Authenticate: Bearer\r\n"
+        "Content-Length: ");
+    static constexpr size_t kConnectionHeaderRoom = 64;
+    // Roughly what OpenSSL keeps for a connection, past our own buffers
+    static constexpr size_t kTlsStreamBytes = 48 << 10;
+    // Answers this small go out over the memory budget too, so pings and
+    // the page's polls keep working while bulk ones wait
+    static constexpr size_t kSmallResponse = 16 << 10;
+
+    using Clock = std::chrono::steady_clock;
+
+    // One accepted socket. Requests are answered in order; bytes of
+    // pipelined ones wait in `in` until the current response is out.
+    struct Connection {
+        int fd = -1;
+        std::string in;                // Unprocessed request bytes
+        std::string out;               // Response being sent
+        bool responded = false;        // A request is being answered
+        bool keep_alive = false;       // ... and another may follow it
+        int sends_in_flight = 0;
+        bool closing = false;          // Closed, waiting for sends to drain
+        Clock::time_point last_active; // Idle connections are closed after a while
+        bool reading = false;          // Part of a request (or TLS handshake) has arrived ...
+        Clock::time_point request_start; // ... at this time, and must be complete within --header-timeout
+        Clock::time_point send_start;  // Of the send in flight, which must finish within --send-timeout
+        size_t buffered = 0;           // Bytes counted against the memory budget (see account)
+        bool late = false;             // Accepted after draining began
+        bool raw = false;              // From the raw TCP port: one-line requests, no HTTP
+        speedtest::ServerRoute route = speedtest::ServerRoute::kPage;  // Of the request being answered
+
+        // POST /stream/upload
+        bool uploading = false;
+        uint64_t upload_expected = 0;
+        uint64_t upload_received = 0;
+        Clock::time_point upload_start;
+        std::unique_ptr<speedtest::PayloadVerifier> verifier;  // ?verify=1
+
+        // GET /stream/download
+        uint64_t download_left = 0;
+        size_t payload_offset = 0;
+        bool paused = false;           // Over the memory budget; see resume_downloads
+
+        // Bulk streams tagged with ?test=ID&stream=N get TCP_INFO sampled
+        std::string test_id;
+        int stream = 0;
+        Clock::time_point started;
+
+        // /stream/* requests belong to a scheduler session
+        bool scheduled = false;
+        bool queued = false;           // Waiting for a session slot
+        size_t header_len = 0;         // Request header kept in `in` while queued
+        uint64_t rate_bps = 0;         // Pacing rate currently applied
+        uint64_t client_pacing_bps = 0;
+        std::string pending;           // Response to send once the current send completes
+
+        // HTTPS: handshake and decryption here, encryption here or in the kernel
+        std::unique_ptr<speedtest::TlsStream> tls;
+        std::string sealed;            // Encrypted send in flight, without kTLS
+    };
+
+    // TCP_INFO history of one client test, served by /api/samples
+    struct TestSamples {
+        std::vector<speedtest::TcpInfoSample> samples;
+        Clock::time_point updated;
+        bool verified = false;                // Uploads checked against our payload
+        speedtest::IntegrityCounts integrity; // ... of those already finished
+        // Upload bytes as they reached us, on a clock from the first of them
+        uint64_t received = 0;
+        Clock::time_point first_received;
+        Clock::time_point last_received;
+        std::unique_ptr<speedtest::RateSampler> arrivals;
+    };
+
+    ServerOptions options_;
     int server_fd_;
-    
-    std::string get_ip() {
-        FILE* pipe = popen("curl -s ifconfig.me 2>/dev/null", "r");
+    std::unique_ptr<speedtest::IoBackend> backend_;
+    std::unordered_map<uint64_t, Connection> connections_;
+    uint64_t next_id_ = 1;
+    std::unique_ptr<speedtest::PayloadPool> payload_;
+    std::unordered_map<std::string, TestSamples> samples_;
+    speedtest::SessionScheduler scheduler_;
+    uint64_t paced_generation_ = 0;
+    speedtest::LinkSimulator sim_;
+    std::string servers_json_;
+    std::vector<speedtest::ServerEntry> servers_;  // The same list, for binary clients
+    std::function<void()> reload_;
+    int tls_fd_ = -1;
+    std::shared_ptr<speedtest::TlsContext> tls_;
+    int raw_fd_ = -1;
+    int udp_fd_ = -1;  // Until udp_ takes it over
+    std::unique_ptr<speedtest::UdpFlowServer> udp_;
+    bool ktls_reported_ = false;
+    // Memory held for connections (see account) and test samples, and
+    // what the budgets and the scheduler turned away
+    uint64_t buffered_ = 0;
+    uint64_t samples_bytes_ = 0;
+    std::vector<uint64_t> paused_;  // Downloads waiting for the budget, oldest first
+    uint64_t refused_ = 0;          // Connections closed as soon as accepted
+    uint64_t over_budget_ = 0;      // Responses answered with 503 instead
+    uint64_t busy_ = 0;             // Requests the scheduler had no room for
+    uint64_t timed_out_ = 0;        // Connections closed by --header-timeout or --send-timeout
+    speedtest::Placement placement_;
+    speedtest::HistoryStore history_;  // Before agent_, whose tests write to it
+    speedtest::MeshAgent agent_;
+
+    // Written by the lookup thread, which may outlive us at exit
+    struct PublicIp {
+        std::mutex mutex;
         std::string ip = "127.0.0.1";
-        if (pipe) {
+    };
+    std::shared_ptr<PublicIp> public_ip_ = std::make_shared<PublicIp>();
+
+    // Draining: responses say Connection: close, tests already running
+    // finish (including their next phase, which the scheduler's linger
+    // keeps the session open for), new ones are turned away. Once nothing
+    // is running, or at the drain timeout, run() returns.
+    int handoff_fd_ = -1;
+    bool draining_ = false;
+    Clock::time_point drain_deadline_;
+
+    bool drained() const {
+        if (!draining_) return false;
+        if (Clock::now() >= drain_deadline_) return true;
+        if (scheduler_.active_sessions() > 0) return false;
+        for (const auto& entry : connections_) {
+            if (entry.second.responded && !entry.second.closing) return false;
+        }
+        return true;
+    }
+
+    // A handoff gives the listeners away; a plain stop keeps them so
+    // running tests can open their next connections
+    void begin_drain(const char* reason, bool stop_listening) {
+        if (stop_listening) close_listeners();
+        if (draining_) return;
+        draining_ = true;
+        drain_deadline_ = Clock::now() + std::chrono::seconds(options_.drain_timeout_s);
+        // Queued tests are better off retrying against the next process
+        std::vector<uint64_t> queued;
+        for (const auto& entry : connections_) {
+            if (entry.second.queued) queued.push_back(entry.first);
+        }
+        for (uint64_t id : queued) {
+            Connection& conn = connections_[id];
+            scheduler_.close_stream(id, Clock::now());
+            conn.scheduled = false;
+            send_busy(id, conn);
+            account(conn);
+        }
+        close_idle_connections();
+        std::cout << "  🛑 " << reason << ": draining " << connections_.size() << " connection"
+                  << (connections_.size() == 1 ? "" : "s") << " (up to " << options_.drain_timeout_s
+                  << " s)\n" << std::flush;
+    }
+
+    void close_listeners() {
+        // UDP flows in progress end here; the next process can't share them
+        udp_.reset();
+        for (int* fd : {&server_fd_, &tls_fd_, &raw_fd_, &handoff_fd_}) {
+            if (*fd < 0) continue;
+            backend_->forget(*fd);
+            close(*fd);
+            *fd = -1;
+        }
+        if (!options_.handoff_path.empty()) unlink(options_.handoff_path.c_str());
+    }
+
+    static int bound_port(int fd) {
+        sockaddr_storage addr{};
+        socklen_t len = sizeof(addr);
+        if (getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) return -1;
+        if (addr.ss_family == AF_INET6) return ntohs(reinterpret_cast<sockaddr_in6*>(&addr)->sin6_port);
+        return ntohs(reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+    }
+
+    // Keep an inherited listener if it is on the port we want, else drop it
+    void adopt_listener(const std::string& name, int fd) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (name == "http" && server_fd_ < 0 && bound_port(fd) == options_.port) server_fd_ = fd;
+        else if (name == "https" && tls_fd_ < 0 && bound_port(fd) == options_.tls_port) tls_fd_ = fd;
+        else if (name == "tcp" && raw_fd_ < 0 && bound_port(fd) == options_.tcp_port) raw_fd_ = fd;
+        else if (name == "udp" && udp_fd_ < 0 && bound_port(fd) == options_.udp_port) udp_fd_ = fd;
+        else close(fd);
+    }
+
+    // Ask the process currently serving for its listening sockets
+    // (SCM_RIGHTS over the handoff socket). Connections arriving meanwhile
+    // wait in the shared accept queue, so none are refused.
+    bool take_over_listeners() {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return false;
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, options_.handoff_path.c_str(), sizeof(addr.sun_path) - 1);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            // Nobody there: a fresh start
+            close(fd);
+            return false;
+        }
+        timeval timeout{5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        char names[64] = "";
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 4)];
+        iovec iov{names, sizeof(names) - 1};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        close(fd);
+        cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : nullptr;
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            std::cerr << "Handoff from " << options_.handoff_path << " failed; binding instead\n";
+            return false;
+        }
+        // "http,https,tcp,udp" (those we had), one name per descriptor
+        int count = static_cast<int>((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        std::istringstream list(std::string(names, n));
+        std::string name;
+        for (int i = 0; i < count; ++i) {
+            int received;
+            std::memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (!std::getline(list, name, ',')) name.clear();
+            adopt_listener(name, received);
+        }
+        return server_fd_ >= 0;
+    }
+
+    // systemd socket activation: LISTEN_FDS sockets from fd 3, named
+    // "http", "https", "tcp" or "udp" in LISTEN_FDNAMES; unnamed ones are
+    // taken as http, then https
+    bool inherit_systemd_listeners() {
+        const char* pid = getenv("LISTEN_PID");
+        const char* fds = getenv("LISTEN_FDS");
+        if (!pid || !fds || std::strtol(pid, nullptr, 10) != getpid()) return false;
+        const char* fd_names = getenv("LISTEN_FDNAMES");
+        std::istringstream names(fd_names ? fd_names : "");
+        std::string name;
+        int count = std::atoi(fds);
+        for (int i = 0; i < count; ++i) {
+            if (!std::getline(names, name, ':')) name = i == 0 ? "http" : "https";
+            adopt_listener(name, 3 + i);
+        }
+        unsetenv("LISTEN_PID");
+        unsetenv("LISTEN_FDS");
+        unsetenv("LISTEN_FDNAMES");
+        return server_fd_ >= 0;
+    }
+
+    bool open_handoff_socket() {
+        handoff_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, options_.handoff_path.c_str(), sizeof(addr.sun_path) - 1);
+        // A path left behind by a crash; a live owner handed off above
+        unlink(addr.sun_path);
+        if (handoff_fd_ < 0 || bind(handoff_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            listen(handoff_fd_, 1) != 0) {
+            std::cerr << "Failed to open handoff socket " << options_.handoff_path << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    // A new process wants our listeners: send them, then drain
+    void on_handoff(const speedtest::IoCompletion& ev) {
+        if (ev.result < 0 || server_fd_ < 0) {
+            if (ev.result >= 0) close(ev.result);
+            return;
+        }
+        int peer = ev.result;
+        std::string names = "http";
+        std::vector<int> fds = {server_fd_};
+        if (tls_fd_ >= 0) {
+            names += ",https";
+            fds.push_back(tls_fd_);
+        }
+        if (raw_fd_ >= 0) {
+            names += ",tcp";
+            fds.push_back(raw_fd_);
+        }
+        if (udp_) {
+            names += ",udp";
+            fds.push_back(udp_->fd());
+        }
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 4)] = {};
+        iovec iov{&names[0], names.size()};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+        // The path must be free before the new process binds its own
+        backend_->forget(handoff_fd_);
+        close(handoff_fd_);
+        handoff_fd_ = -1;
+        unlink(options_.handoff_path.c_str());
+        bool sent = sendmsg(peer, &msg, MSG_NOSIGNAL) > 0;
+        close(peer);
+        if (!sent) {
+            std::cerr << "Handoff failed: " << strerror(errno) << "\n";
+            if (open_handoff_socket()) backend_->watch_accept(handoff_fd_, kHandoffTag);
+            return;
+        }
+        begin_drain("Listeners handed to a new process", true);
+    }
+
+    // The server listens on every interface; place it near the first real NIC
+    static std::string nic_device() {
+        for (const speedtest::NetInterface& i : speedtest::list_interfaces()) {
+            if (i.up && !i.loopback) return i.name;
+        }
+        return "";
+    }
+
+    // curl can take seconds; start up without waiting for it
+    void start_ip_lookup() {
+        std::shared_ptr<PublicIp> result = public_ip_;
+        std::thread([result] {
+            FILE* pipe = popen("curl -s ifconfig.me 2>/dev/null", "r");
+            if (!pipe) return;
             char buffer[128];
+            std::string ip;
             if (fgets(buffer, sizeof(buffer), pipe)) {
                 ip = std::string(buffer);
                 if (!ip.empty() && ip.back() == '\n') ip.pop_back();
             }
             pclose(pipe);
+            if (ip.empty()) return;
+            std::lock_guard<std::mutex> lock(result->mutex);
+            result->ip = ip;
+        }).detach();
+    }
+
+    int open_udp_socket(int port) {
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
+        if (fd < 0 || bind(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+            std::cerr << "Failed to bind UDP port " << port << "\n";
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    int open_listener(int port) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            std::cerr << "Failed to create socket\n";
+            return -1;
+        }
+
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
+
+        if (bind(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+            std::cerr << "Failed to bind to port " << port << "\n";
+            close(fd);
+            return -1;
+        }
+
+        if (listen(fd, SOMAXCONN) < 0) {
+            std::cerr << "Failed to listen\n";
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    void init_payload() {
+        // Incompressible, so compression along the path can't inflate
+        // results; /api/info shares the seed for clients that verify
+        uint64_t seed = std::random_device{}() | uint64_t(std::random_device{}()) << 32;
+        payload_.reset(new speedtest::PayloadPool(seed, speedtest::PayloadPool::kDefaultSize, placement_.numa_node));
+        backend_->register_send_buffer(payload_->data(), payload_->size());
+        payload_->seal();
+    }
+
+    void on_accept(const speedtest::IoCompletion& ev) {
+        if (ev.result < 0) return;
+        // Past a limit, hanging up at once costs less than anything we could say
+        if ((options_.max_connections > 0 && connections_.size() >= static_cast<size_t>(options_.max_connections)) ||
+            over_budget(sizeof(Connection))) {
+            close(ev.result);
+            ++refused_;
+            return;
+        }
+        uint64_t id = next_id_++;
+        Connection& conn = connections_[id];
+        conn.fd = ev.result;
+        conn.last_active = Clock::now();
+        conn.late = draining_;
+        conn.raw = ev.tag == kRawListenTag;
+        if (ev.tag == kTlsListenTag) conn.tls.reset(new speedtest::TlsStream(tls_, conn.fd));
+        backend_->watch_recv(conn.fd, id);
+        account(conn);
+    }
+
+    void on_connection_event(const speedtest::IoCompletion& ev) {
+        handle_connection_event(ev);
+        // Whatever the event did to the connection's buffers
+        auto it = connections_.find(ev.tag);
+        if (it != connections_.end()) account(it->second);
+    }
+
+    void handle_connection_event(const speedtest::IoCompletion& ev) {
+        auto it = connections_.find(ev.tag);
+        if (it == connections_.end()) return;
+        uint64_t id = it->first;
+        Connection& conn = it->second;
+
+        if (ev.type == speedtest::IoCompletion::kSend) {
+            conn.sends_in_flight--;
+            if (conn.closing) {
+                if (conn.sends_in_flight == 0) erase_connection(it);
+                return;
+            }
+            if (ev.result < 0) close_connection(id);
+            else if (conn.tls && conn.tls->has_output()) send_tls_output(id, conn);
+            else if (!conn.pending.empty()) transmit(id, conn, std::move(conn.pending));
+            else if (conn.paused) return;
+            else if (conn.download_left > 0) send_download_chunk(id, conn);
+            else if (!conn.uploading && conn.responded) finish_request(id, conn);
+            return;
+        }
+
+        if (conn.closing) return;
+        if (ev.result <= 0) {
+            close_connection(id);
+            return;
+        }
+
+        conn.last_active = Clock::now();
+        if (!conn.responded && !conn.reading) {
+            conn.reading = true;
+            conn.request_start = conn.last_active;
+        }
+        if (!conn.tls) {
+            on_request_bytes(id, conn, ev.data, ev.result);
+            return;
+        }
+        std::string plain;
+        bool ok = conn.tls->receive(ev.data, ev.result, &plain);
+        // Handshake records go out now unless a send is still in flight
+        if (conn.tls->has_output() && conn.sends_in_flight == 0) send_tls_output(id, conn);
+        if (!ok) close_connection(id);
+        else if (!plain.empty()) on_request_bytes(id, conn, plain.data(), plain.size());
+    }
+
+    void on_request_bytes(uint64_t id, Connection& conn, const char* data, size_t len) {
+        if (conn.queued) {
+            // Body sent without waiting for 100 Continue; count it, don't keep it
+            conn.upload_received += len;
+            conn.keep_alive = false;
+        } else if (conn.uploading) {
+            consume_upload(id, conn, data, len);
+        } else {
+            conn.in.append(data, len);
+            if (!conn.responded) next_request(id, conn);
+            else if (conn.in.size() > kMaxPipelined) close_connection(id);
+        }
+    }
+
+    // Start on the next buffered request once its header is complete
+    void next_request(uint64_t id, Connection& conn) {
+        if (conn.raw) {
+            next_raw_request(id, conn);
+            return;
+        }
+        size_t header_end = conn.in.find("\r\n\r\n");
+        if (header_end != std::string::npos) {
+            start_response(id, conn, header_end + 4);
+        } else if (conn.in.size() > kMaxHeaderSize) {
+            close_connection(id);
+        }
+    }
+
+    // The raw port's "DOWNLOAD <query>\n" and "UPLOAD <query>\n" become
+    // the matching /stream request, so they share its scheduling, tuning
+    // and sampling; only the replies differ (see start_stream, send_busy)
+    void next_raw_request(uint64_t id, Connection& conn) {
+        size_t line_end = conn.in.find('\n');
+        if (line_end == std::string::npos) {
+            if (conn.in.size() > kMaxHeaderSize) close_connection(id);
+            return;
+        }
+        std::string line = conn.in.substr(0, line_end);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        std::string request;
+        if (line.compare(0, 9, "DOWNLOAD ") == 0) {
+            request = "GET /stream/download?" + line.substr(9) + " HTTP/1.1\r\n\r\n";
+        } else if (line.compare(0, 7, "UPLOAD ") == 0) {
+            request = "POST /stream/upload?" + line.substr(7) + " HTTP/1.1\r\nContent-Length: " +
+                      std::to_string(kUnboundedUpload) + "\r\nExpect: 100-continue\r\n\r\n";
+        } else {
+            close_connection(id);
+            return;
+        }
+        conn.in.replace(0, line_end + 1, request);
+        start_response(id, conn, request.size());
+        // One stream per connection
+        conn.keep_alive = false;
+    }
+
+    // The response is out: close, or reset for the next request on this
+    // connection. Socket options a stream applied, such as its congestion
+    // control, stay for the next one; pacing limits are lifted.
+    void finish_request(uint64_t id, Connection& conn) {
+        if (!conn.keep_alive) {
+            close_connection(id);
+            return;
+        }
+        if (conn.scheduled) scheduler_.close_stream(id, Clock::now());
+        if (conn.rate_bps || conn.client_pacing_bps) {
+            speedtest::set_stream_rate(conn.fd, 0, false);
+            speedtest::set_stream_rate(conn.fd, 0, true);
+        }
+        std::string in = std::move(conn.in);
+        Connection next;
+        next.fd = conn.fd;
+        next.in = std::move(in);
+        next.tls = std::move(conn.tls);
+        next.late = conn.late;
+        next.last_active = Clock::now();
+        // Pipelined bytes start the next request's clock
+        next.reading = !next.in.empty();
+        next.request_start = next.last_active;
+        next.buffered = conn.buffered;
+        conn = std::move(next);
+        if (!conn.in.empty()) next_request(id, conn);
+    }
+
+    // Answer idle keep-alive connections, clients that never finish a
+    // request header (however slowly they keep sending it) and readers
+    // that stop reading, by hanging up
+    void close_idle_connections() {
+        auto now = Clock::now();
+        // Draining, a second is enough to send the request a socket was opened for
+        auto cutoff = now - std::chrono::seconds(draining_ ? 1 : options_.idle_timeout_s);
+        auto header_cutoff = now - std::chrono::seconds(options_.header_timeout_s);
+        auto send_cutoff = now - std::chrono::seconds(options_.send_timeout_s);
+        std::vector<uint64_t> idle;
+        for (const auto& entry : connections_) {
+            const Connection& conn = entry.second;
+            if (conn.closing) continue;
+            bool waiting = !conn.responded && conn.sends_in_flight == 0;
+            if (waiting && conn.last_active < cutoff) {
+                idle.push_back(entry.first);
+            } else if ((waiting && conn.reading && conn.request_start < header_cutoff) ||
+                       (conn.sends_in_flight > 0 && conn.send_start < send_cutoff)) {
+                idle.push_back(entry.first);
+                ++timed_out_;
+            }
+        }
+        for (uint64_t id : idle) close_connection(id);
+    }
+
+    void close_connection(uint64_t id) {
+        auto it = connections_.find(id);
+        if (it == connections_.end()) return;
+        Connection& conn = it->second;
+        if (conn.scheduled) scheduler_.close_stream(id, Clock::now());
+        finish_verify(conn);
+        backend_->forget(conn.fd);
+        close(conn.fd);
+        // Sends still in flight report back before their buffers may go
+        if (conn.sends_in_flight > 0) conn.closing = true;
+        else erase_connection(it);
+    }
+
+    void erase_connection(std::unordered_map<uint64_t, Connection>::iterator it) {
+        buffered_ -= it->second.buffered;
+        connections_.erase(it);
+    }
+
+    // What a connection holds of ours: every buffer it has, whatever it
+    // is for at the moment
+    static size_t footprint(const Connection& conn) {
+        size_t bytes = sizeof(Connection) + conn.in.capacity() + conn.out.capacity() + conn.pending.capacity() +
+                       conn.sealed.capacity() + conn.test_id.capacity();
+        if (conn.tls) bytes += kTlsStreamBytes;
+        if (conn.verifier) bytes += sizeof(speedtest::PayloadVerifier);
+        return bytes;
+    }
+
+    // Bring buffered_ up to date with conn, after anything that may have
+    // grown or freed its buffers
+    void account(Connection& conn) {
+        size_t bytes = footprint(conn);
+        buffered_ = buffered_ - conn.buffered + bytes;
+        conn.buffered = bytes;
+    }
+
+    bool over_budget(size_t more) const {
+        return options_.memory_budget > 0 && buffered_ + samples_bytes_ + more > options_.memory_budget;
+    }
+
+    // "256m budget, 4m per connection, up to 10000 connections"
+    std::string describe_budgets() const {
+        auto size = [](uint64_t bytes) {
+            return bytes ? speedtest::format_size(bytes) : std::string("unlimited");
+        };
+        std::string text = size(options_.memory_budget) + " budget, " + size(options_.connection_budget) +
+                           " per connection, ";
+        if (options_.max_connections > 0) text += "up to " + std::to_string(options_.max_connections);
+        else text += "unlimited";
+        return text + " connections";
+    }
+
+    // Every response says whether the connection stays open after it
+    void send_response(uint64_t id, Connection& conn, std::string response) {
+        // While draining, the next request goes to the next process
+        if (draining_) conn.keep_alive = false;
+        // Past a budget, anything but a small answer is a 503 to retry
+        // later; held for a slow reader, it would stay in memory for as long
+        if (response.size() > kSmallResponse &&
+            (over_budget(response.size()) ||
+             (options_.connection_budget > 0 && conn.buffered + response.size() > options_.connection_budget))) {
+            ++over_budget_;
+            response = make_response(kUnavailableHead.view(), "{\"error\":\"over memory budget\"}");
+        }
+        std::string header = conn.keep_alive
+            ? "Connection: keep-alive\r\nKeep-Alive: timeout=" + std::to_string(options_.idle_timeout_s) + "\r\n"
+            : "Connection: close\r\n";
+        response.insert(response.find("\r\n") + 2, header);
+        transmit(id, conn, std::move(response));
+    }
+
+    void transmit(uint64_t id, Connection& conn, std::string response) {
+        // One send at a time per socket; a 100 Continue may still be going out
+        if (conn.sends_in_flight > 0) {
+            conn.pending = std::move(response);
+            return;
+        }
+        conn.out = std::move(response);
+        send_bytes(id, conn, conn.out.data(), conn.out.size());
+    }
+
+    // Responses and payload go out through here, one send in flight per socket. TLS
+    // data is encrypted by the kernel once kTLS is on, so payload slices
+    // still go out zero-copy; without it, it is sealed into conn.sealed.
+    void send_bytes(uint64_t id, Connection& conn, const char* data, size_t len) {
+        if (conn.tls && conn.sends_in_flight == 0) {
+            // The handshake is out by the first response, so this is the
+            // moment to hand the keys over
+            bool ktls = conn.tls->enable_ktls_tx();
+            if (!ktls_reported_) {
+                ktls_reported_ = true;
+                std::cout << "  🔒 kTLS transmit: "
+                          << (ktls ? "on" : conn.tls->error() + ", encrypting in userspace") << "\n";
+            }
+        }
+        conn.sends_in_flight++;
+        conn.send_start = Clock::now();
+        if (conn.tls) {
+            conn.sealed.clear();
+            // Alerts or post-handshake records first, in sequence
+            conn.tls->take_output(&conn.sealed);
+            if (conn.tls->seal(data, len, &conn.sealed)) {
+                backend_->send(conn.fd, conn.sealed.data(), conn.sealed.size(), id);
+                return;
+            }
+        }
+        backend_->send(conn.fd, data, len, id);
+    }
+
+    void send_tls_output(uint64_t id, Connection& conn) {
+        conn.sealed.clear();
+        conn.tls->take_output(&conn.sealed);
+        conn.sends_in_flight++;
+        conn.send_start = Clock::now();
+        backend_->send(conn.fd, conn.sealed.data(), conn.sealed.size(), id);
+    }
+
+    void start_response(uint64_t id, Connection& conn, size_t header_len) {
+        conn.responded = true;
+        conn.keep_alive = wants_keep_alive(conn.in.substr(0, header_len));
+        conn.route = speedtest::kServerRoutes.find(conn.in);
+        uint64_t body_len = 0;
+        if (!header_u64(conn.in.substr(0, header_len), "Content-Length", 0, &body_len)) {
+            // Where this request ends is anyone's guess, so nothing after it is read
+            conn.in.erase(0, header_len);
+            conn.keep_alive = false;
+            send_response(id, conn, make_response(kBadRequestHead.view(), "{\"error\":\"bad content-length\"}"));
+            return;
+        }
+        if (!speedtest::is_stream_route(conn.route)) {
+            std::string request = conn.in.substr(0, header_len);
+            conn.in.erase(0, header_len);
+            // Only stream uploads carry a body; skipping one we don't parse
+            // would misread it as the next request
+            if (body_len > 0) conn.keep_alive = false;
+            // UDP flows are bound to the address asking for them
+            if (conn.route == speedtest::ServerRoute::kUdp) send_response(id, conn, udp_flow_response(conn, request));
+            else send_response(id, conn, handle_request(request, conn.route));
+            return;
+        }
+
+        // Bulk streams go through the scheduler first
+        conn.header_len = header_len;
+        // A request on a connection from before the drain was sent before
+        // the client could know; only tests that show up afterwards are
+        // sent on to the next process
+        if (conn.late && !scheduler_.running(session_key(conn))) {
+            send_busy(id, conn);
+            return;
+        }
+        conn.scheduled = true;
+        switch (scheduler_.open_stream(session_key(conn), id, Clock::now())) {
+            case speedtest::SessionScheduler::Admission::kAdmitted:
+                start_stream(id, conn);
+                break;
+            case speedtest::SessionScheduler::Admission::kQueued:
+                conn.queued = true;
+                break;
+            case speedtest::SessionScheduler::Admission::kRejected:
+                conn.scheduled = false;
+                send_busy(id, conn);
+                break;
+        }
+    }
+
+    // ?session=ID groups a client's streams across phases; without one,
+    // fall back to the test id, then to the client's address
+    std::string session_key(const Connection& conn) {
+        std::string request = conn.in.substr(0, conn.header_len);
+        std::string key = query_string(request, "session");
+        if (key.empty()) key = query_string(request, "test");
+        if (!key.empty()) return key;
+        sockaddr_storage peer{};
+        socklen_t len = sizeof(peer);
+        char host[INET6_ADDRSTRLEN] = "";
+        if (getpeername(conn.fd, reinterpret_cast<sockaddr*>(&peer), &len) == 0) {
+            const void* addr = peer.ss_family == AF_INET6
+                ? static_cast<const void*>(&reinterpret_cast<sockaddr_in6*>(&peer)->sin6_addr)
+                : static_cast<const void*>(&reinterpret_cast<sockaddr_in*>(&peer)->sin_addr);
+            inet_ntop(peer.ss_family, addr, host, sizeof(host));
+        }
+        return std::string("addr:") + host;
+    }
+
+    void send_busy(uint64_t id, Connection& conn) {
+        ++busy_;
+        int retry = scheduler_.retry_after_s();
+        if (conn.raw) {
+            conn.queued = false;
+            conn.uploading = false;
+            conn.download_left = 0;
+            conn.keep_alive = false;
+            transmit(id, conn, "BUSY " + std::to_string(retry) + "\n");
+            return;
+        }
+        std::string json = "{\"error\":\"busy\",\"retry_after\":" + std::to_string(retry) + "}";
+        std::string head(kBusyHead.view());
+        head += std::to_string(retry);
+        head += "\r\nContent-Length: ";
+        conn.queued = false;
+        conn.uploading = false;
+        conn.download_left = 0;
+        // An upload body may already be on its way
+        conn.keep_alive = false;
+        send_response(id, conn, make_response(head, json));
+    }
+
+    void start_stream(uint64_t id, Connection& conn) {
+        std::string request = conn.in.substr(0, conn.header_len);
+        conn.queued = false;
+        conn.test_id = query_string(request, "test");
+        conn.stream = static_cast<int>(query_u64(request, "stream", 0));
+        conn.started = Clock::now();
+        // Streams carry the client's tuning profile so both ends match;
+        // the server's --tuning fills in what the client leaves unset
+        speedtest::TuningProfile tuning = speedtest::tuning_from_query(request_query(request));
+        speedtest::apply_tuning(conn.fd, options_.tuning);
+        speedtest::apply_tuning(conn.fd, tuning);
+        if (!tuning.pacing_bps) tuning.pacing_bps = options_.tuning.pacing_bps;
+        conn.client_pacing_bps = tuning.pacing_bps;
+        conn.rate_bps = tuning.pacing_bps;
+
+        if (conn.route == speedtest::ServerRoute::kStreamDownload) {
+            conn.download_left = query_u64(request, "bytes", 100ull << 20);
+            // Stream N walks the pool from chunk N, which clients that
+            // verify check against
+            conn.payload_offset = conn.stream * kChunkSize % payload_->size();
+            conn.in.erase(0, conn.header_len);
+            if (conn.raw) {
+                transmit(id, conn, "OK\n");
+                return;
+            }
+            send_response(id, conn, make_response(kDownloadHead.view(), conn.download_left, ""));
+        }
+        else {
+            conn.uploading = true;
+            // Checked in start_response
+            header_u64(request, "Content-Length", 0, &conn.upload_expected);
+            conn.upload_start = Clock::now();
+            if (query_u64(request, "verify", 0) && !conn.test_id.empty()) {
+                conn.verifier.reset(new speedtest::PayloadVerifier(*payload_, conn.stream * kChunkSize));
+                samples_[conn.test_id].verified = true;
+            }
+            std::string body = conn.in.substr(conn.header_len);
+            conn.in.clear();
+            // Clients that wait for the go-ahead only start timing once admitted
+            if (conn.raw) {
+                static const char kOk[] = "OK\n";
+                send_bytes(id, conn, kOk, sizeof(kOk) - 1);
+            } else if (expects_continue(request)) {
+                static const char kContinue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                send_bytes(id, conn, kContinue, sizeof(kContinue) - 1);
+            }
+            consume_upload(id, conn, body.data(), body.size());
+        }
+    }
+
+    void schedule_sessions() {
+        std::vector<uint64_t> admitted, expired;
+        scheduler_.poll(Clock::now(), &admitted, &expired);
+        for (uint64_t id : admitted) {
+            auto it = connections_.find(id);
+            if (it == connections_.end() || !it->second.queued) continue;
+            start_stream(id, it->second);
+            account(it->second);
+        }
+        for (uint64_t id : expired) {
+            auto it = connections_.find(id);
+            if (it == connections_.end() || !it->second.queued) continue;
+            it->second.scheduled = false;
+            send_busy(id, it->second);
+            account(it->second);
         }
-        return ip;
+    }
+
+    // Bring every running stream's pacing in line with its fair share
+    void pace_streams(bool refresh_windows) {
+        paced_generation_ = scheduler_.generation();
+        for (auto& entry : connections_) {
+            Connection& conn = entry.second;
+            if (!conn.scheduled || conn.queued || conn.closing) continue;
+            uint64_t rate = scheduler_.stream_rate_bps(entry.first);
+            // A client asking for slower pacing than its share gets what it asked for
+            if (!conn.uploading && conn.client_pacing_bps && (rate == 0 || conn.client_pacing_bps < rate)) {
+                rate = conn.client_pacing_bps;
+            }
+            if (rate == conn.rate_bps && !(conn.uploading && rate && refresh_windows)) continue;
+            conn.rate_bps = rate;
+            speedtest::set_stream_rate(conn.fd, rate, conn.uploading);
+        }
+    }
+
+    std::string describe_limits() const {
+        const speedtest::SchedulerConfig& config = scheduler_.config();
+        std::ostringstream out;
+        if (config.max_sessions > 0) out << config.max_sessions << " at once";
+        else out << "unlimited";
+        out << ", queue " << config.max_queue;
+        if (config.capacity_bps) out << ", " << config.capacity_bps / 1e6 << " Mbit/s shared";
+        return out.str();
+    }
+
+    // {"active":N,"queued":N,"max_sessions":N,"capacity_bps":N,"share_bps":N}
+    std::string scheduler_json() const {
+        speedtest::JsonWriter json;
+        json.begin_object()
+            .field("active", scheduler_.active_sessions())
+            .field("queued", scheduler_.queued_sessions())
+            .field("max_sessions", scheduler_.config().max_sessions)
+            .field("capacity_bps", scheduler_.config().capacity_bps)
+            .field("share_bps", scheduler_.session_share_bps())
+            .end_object();
+        return json.take();
+    }
+
+    void sample_streams() {
+        auto now = Clock::now();
+        for (auto& entry : connections_) {
+            Connection& conn = entry.second;
+            if (conn.test_id.empty() || conn.closing) continue;
+            // Over the memory budget, tests already sampled go on; new ones go without
+            auto found = samples_.find(conn.test_id);
+            if (found == samples_.end() && over_budget(sizeof(TestSamples))) continue;
+            speedtest::TcpInfoSample sample;
+            if (!speedtest::read_tcp_info(conn.fd, &sample)) continue;
+            sample.t_s = std::chrono::duration<double>(now - conn.started).count();
+            sample.stream = conn.stream;
+
+            TestSamples& test = found != samples_.end() ? found->second : samples_[conn.test_id];
+            test.updated = now;
+            if (test.samples.size() < kMaxSamplesPerTest) test.samples.push_back(sample);
+        }
+        for (auto it = samples_.begin(); it != samples_.end();) {
+            if (now - it->second.updated > std::chrono::seconds(kSampleRetentionS)) it = samples_.erase(it);
+            else ++it;
+        }
+        samples_bytes_ = 0;
+        for (const auto& entry : samples_) {
+            samples_bytes_ += sizeof(TestSamples) + entry.first.capacity() +
+                              entry.second.samples.capacity() * sizeof(speedtest::TcpInfoSample);
+            if (entry.second.arrivals) samples_bytes_ += sizeof(speedtest::RateSampler);
+        }
+    }
+
+    // {"connections":N,"buffered_bytes":N,"samples_bytes":N,"budget_bytes":N,...}
+    std::string memory_json() const {
+        size_t paused = 0;
+        for (const auto& entry : connections_) paused += entry.second.paused;
+        speedtest::JsonWriter json;
+        json.begin_object()
+            .field("connections", connections_.size())
+            .field("max_connections", options_.max_connections)
+            .field("buffered_bytes", buffered_)
+            .field("samples_bytes", samples_bytes_)
+            .field("budget_bytes", options_.memory_budget)
+            .field("connection_budget_bytes", options_.connection_budget)
+            .field("paused_downloads", paused)
+            .field("refused", refused_)
+            .field("over_budget", over_budget_)
+            .field("busy", busy_)
+            .field("timed_out", timed_out_)
+            .field("rss_bytes", resident_bytes())
+            .end_object();
+        return json.take();
+    }
+
+    // {"test":ID,"next":N,"samples":[...]}; poll again with since=N for more
+    // What /api/samples reports for ?test=, from ?since= on
+    struct SamplesReply {
+        std::string test;
+        uint64_t next = 0;
+        std::vector<speedtest::TcpInfoSample> samples;
+        bool verified = false;
+        speedtest::IntegrityCounts integrity;
+        bool uploaded = false;
+        speedtest::ReceivedSummary received;
+    };
+
+    SamplesReply collect_samples(const std::string& request) {
+        SamplesReply reply;
+        reply.test = query_string(request, "test");
+        size_t since = query_u64(request, "since", 0);
+        auto it = samples_.find(reply.test);
+        if (it != samples_.end() && since < it->second.samples.size()) {
+            reply.samples.assign(it->second.samples.begin() + since, it->second.samples.end());
+        }
+        reply.next = since + reply.samples.size();
+        if (it != samples_.end() && it->second.verified) {
+            // Finished uploads plus whole blocks of those still arriving
+            reply.verified = true;
+            reply.integrity = it->second.integrity;
+            for (const auto& entry : connections_) {
+                const Connection& conn = entry.second;
+                if (!conn.verifier || conn.test_id != reply.test) continue;
+                reply.integrity.bytes += conn.verifier->counts().bytes;
+                reply.integrity.bad_blocks += conn.verifier->counts().bad_blocks;
+            }
+        }
+        if (it != samples_.end() && it->second.received > 0) {
+            const TestSamples& test = it->second;
+            reply.uploaded = true;
+            reply.received.bytes = test.received;
+            reply.received.seconds = std::chrono::duration<double>(test.last_received - test.first_received).count();
+            // Steady-state rate when there is one, as the client quotes its own
+            speedtest::SampleSummary& rate = reply.received.rate;
+            rate = test.arrivals->stats().summarize();
+            reply.received.mbps = rate.count > 0 ? rate.mean
+                : reply.received.seconds > 0 ? test.received * 8.0 / reply.received.seconds / 1e6 : 0;
+        }
+        return reply;
+    }
+
+    std::string samples_json(const std::string& request) {
+        SamplesReply reply = collect_samples(request);
+        speedtest::JsonWriter json(reply.samples.size() * 256 + 128);
+        json.begin_object().field("test", reply.test).field("next", reply.next).key("samples");
+        speedtest::write_tcp_samples(reply.samples, &json);
+        if (reply.verified) {
+            json.key("integrity").begin_object()
+                .field("bytes", reply.integrity.bytes)
+                .field("bad_blocks", reply.integrity.bad_blocks)
+                .end_object();
+        }
+        if (reply.uploaded) {
+            json.key("received").begin_object()
+                .field("bytes", reply.received.bytes)
+                .field("seconds", reply.received.seconds)
+                .field("mbps", reply.received.mbps);
+            // The spread behind mbps, for the client's error bar
+            const speedtest::SampleSummary& rate = reply.received.rate;
+            json.key("rate").begin_object()
+                .field("count", rate.count)
+                .field("outliers", rate.outliers)
+                .field("mean", rate.mean)
+                .field("stddev", rate.stddev)
+                .field("ci_low", rate.ci_low)
+                .field("ci_high", rate.ci_high)
+                .field("p50", rate.p50)
+                .field("p90", rate.p90)
+                .field("p99", rate.p99)
+                .end_object()
+                .end_object();
+        }
+        json.end_object();
+        return json.take();
+    }
+
+    std::string samples_binary(const std::string& request) {
+        SamplesReply reply = collect_samples(request);
+        return speedtest::encode_samples(reply.test, reply.next, reply.samples,
+                                         reply.verified ? &reply.integrity : nullptr,
+                                         reply.uploaded ? &reply.received : nullptr);
+    }
+
+    void send_download_chunk(uint64_t id, Connection& conn) {
+        // Payload goes out zero-copy unless it is sealed in userspace, into
+        // a copy; over the budget such downloads wait for the reader's
+        // share of memory, and give back the last chunk's meanwhile
+        if (conn.tls && !conn.tls->ktls_tx() && over_budget(kChunkSize)) {
+            conn.paused = true;
+            std::string().swap(conn.sealed);
+            paused_.push_back(id);
+            return;
+        }
+        size_t len = std::min<uint64_t>(conn.download_left, kChunkSize);
+        const char* chunk = payload_->at(conn.payload_offset);
+        conn.download_left -= len;
+        conn.payload_offset = (conn.payload_offset + kChunkSize) % payload_->size();
+        send_bytes(id, conn, chunk, len);
+    }
+
+    // Paused downloads go on, oldest first, as the budget allows
+    void resume_downloads() {
+        size_t done = 0;
+        for (; done < paused_.size() && !over_budget(kChunkSize); ++done) {
+            auto it = connections_.find(paused_[done]);
+            if (it == connections_.end() || !it->second.paused || it->second.closing) continue;
+            Connection& conn = it->second;
+            conn.paused = false;
+            // A TLS record may be going out; its completion sends the chunk
+            if (conn.sends_in_flight == 0) send_download_chunk(it->first, conn);
+            account(conn);
+        }
+        paused_.erase(paused_.begin(), paused_.begin() + done);
+    }
+
+    // Bytes past the body belong to the next pipelined request
+    void consume_upload(uint64_t id, Connection& conn, const char* data, size_t len) {
+        uint64_t body_left = conn.upload_expected > conn.upload_received
+            ? conn.upload_expected - conn.upload_received : 0;
+        size_t body = static_cast<size_t>(std::min<uint64_t>(len, body_left));
+        conn.upload_received += body;
+        note_received(conn, body);
+        if (conn.verifier) conn.verifier->add(data, body);
+        conn.in.append(data + body, len - body);
+        if (conn.upload_received < conn.upload_expected) return;
+        finish_verify(conn);
+
+        double seconds = std::chrono::duration<double>(Clock::now() - conn.upload_start).count();
+        double mbps = seconds > 0 ? conn.upload_received * 8.0 / seconds / 1e6 : 0;
+        speedtest::JsonWriter json;
+        json.begin_object()
+            .field("bytes", conn.upload_received)
+            .field("seconds", seconds)
+            .field("mbps", mbps)
+            .end_object();
+        conn.uploading = false;
+        send_response(id, conn, make_json_response(json.str()));
+    }
+
+    // Upload bytes are timed as each receive completes, so /api/samples
+    // can say what arrived rather than what the client's kernel accepted
+    void note_received(const Connection& conn, size_t len) {
+        if (conn.test_id.empty() || len == 0) return;
+        auto found = samples_.find(conn.test_id);
+        if (found == samples_.end() && over_budget(sizeof(TestSamples))) return;
+        auto now = Clock::now();
+        TestSamples& test = found != samples_.end() ? found->second : samples_[conn.test_id];
+        if (!test.arrivals) {
+            test.arrivals.reset(new speedtest::RateSampler);
+            test.first_received = now;
+        }
+        test.received += len;
+        test.last_received = now;
+        test.updated = now;
+        test.arrivals->update(std::chrono::duration<double>(now - test.first_received).count(), test.received);
+    }
+
+    // A verified upload ended; its counts join its test's
+    void finish_verify(Connection& conn) {
+        if (!conn.verifier) return;
+        speedtest::IntegrityCounts counts = conn.verifier->finish();
+        conn.verifier.reset();
+        TestSamples& test = samples_[conn.test_id];
+        test.updated = Clock::now();
+        test.integrity.bytes += counts.bytes;
+        test.integrity.bad_blocks += counts.bad_blocks;
+    }
+
+    // Everything between '?' and the end of the request target
+    static std::string request_query(const std::string& request) {
+        size_t query = request.find('?');
+        size_t target_end = request.find(' ', request.find(' ') + 1);
+        if (query == std::string::npos || query > target_end) return "";
+        return request.substr(query + 1, target_end - query - 1);
+    }
+
+    // The value of query parameter NAME, matched as a whole key so that
+    // bytes= doesn't find max_bytes=; false if it isn't there
+    static bool query_param(const std::string& request, const std::string& name, std::string* value) {
+        std::string query = request_query(request);
+        for (size_t start = 0; start < query.size();) {
+            size_t end = std::min(query.find('&', start), query.size());
+            size_t eq = query.find('=', start);
+            if (eq < end && query.compare(start, eq - start, name) == 0) {
+                *value = query.substr(eq + 1, end - eq - 1);
+                return true;
+            }
+            start = end + 1;
+        }
+        return false;
+    }
+
+    // Numeric query parameter, e.g. ?bytes=1000
+    static uint64_t query_u64(const std::string& request, const std::string& name, uint64_t fallback) {
+        std::string value;
+        if (!query_param(request, name, &value)) return fallback;
+        return std::strtoull(value.c_str(), nullptr, 10);
+    }
+
+    // Query parameter limited to [A-Za-z0-9_-], e.g. a test id
+    static std::string query_string(const std::string& request, const std::string& name) {
+        std::string value;
+        if (!query_param(request, name, &value)) return "";
+        size_t end = 0;
+        while (end < value.size() && end < 64) {
+            char c = value[end];
+            if (!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_') break;
+            ++end;
+        }
+        value.resize(end);
+        return value;
+    }
+
+    // HTTP/1.1 stays open unless asked to close; 1.0 only when asked not to
+    static bool wants_keep_alive(const std::string& request) {
+        std::string lower(request);
+        std::transform(lower.begin(), lower.end(), lower.begin(),
+                       [](unsigned char c) { return std::tolower(c); });
+        size_t pos = lower.find("\r\nconnection:");
+        std::string value;
+        if (pos != std::string::npos) {
+            size_t start = pos + 13;
+            value = lower.substr(start, lower.find("\r\n", start) - start);
+        }
+        if (value.find("close") != std::string::npos) return false;
+        if (value.find("keep-alive") != std::string::npos) return true;
+        size_t line_end = lower.find("\r\n");
+        return line_end < 8 || lower.compare(line_end - 8, 8, "http/1.0") != 0;
+    }
+
+    // Content negotiation for the /api routes that have a binary form
+    static bool wants_binary(const std::string& request) {
+        size_t header_end = request.find("\r\n\r\n");
+        std::string head = request.substr(0, header_end);
+        std::transform(head.begin(), head.end(), head.begin(), [](unsigned char c) { return std::tolower(c); });
+        size_t pos = head.find("\r\naccept:");
+        if (pos == std::string::npos) return false;
+        std::string accept = head.substr(pos, head.find("\r\n", pos + 2) - pos);
+        return accept.find(speedtest::kBinaryContentType) != std::string::npos;
+    }
+
+    // Expect: 100-continue, which holds the body until we answer
+    static bool expects_continue(const std::string& request) {
+        std::string_view value;
+        return speedtest::find_header(request, "Expect", &value) && speedtest::equals_ignore_case(value, "100-continue");
+    }
+
+    // Numeric header, e.g. Content-Length: FALLBACK if it's missing,
+    // false if it is there but isn't a number that fits
+    static bool header_u64(const std::string& request, std::string_view name, uint64_t fallback, uint64_t* value) {
+        std::string_view text;
+        if (!speedtest::find_header(request, name, &text)) {
+            *value = fallback;
+            return true;
+        }
+        return speedtest::parse_u64(text, value);
+    }
+    
+    // 127.0.0.1 until the background lookup has finished
+    std::string get_ip() {
+        std::lock_guard<std::mutex> lock(public_ip_->mutex);
+        return public_ip_->ip;
+    }
+    
+    // JSON clients get the file as it is; an empty one means the built-in list
+    void set_servers(std::string json) {
+        std::string error;
+        if (json.empty() || !speedtest::parse_servers_json(json, &servers_, &error)) {
+            servers_ = default_servers();
+            json = speedtest::servers_to_json(servers_);
+        }
+        servers_json_ = std::move(json);
     }
     
     std::string get_hostname() {
@@ -94,92 +1681,190 @@ private:
         return "Local Server";
     }
     
-    double random_speed(double base, double variance) {
-        static std::random_device rd;
-        static std::mt19937 gen(rd());
-        std::normal_distribution<> dist(base, variance);
-        return std::max(1.0, dist(gen));
+    // API calls and the page; routed once, in start_response()
+    std::string handle_request(const std::string& request, speedtest::ServerRoute route) {
+        using speedtest::ServerRoute;
+        bool binary = wants_binary(request);
+        switch (route) {
+        case ServerRoute::kServers:
+            return binary ? make_binary_response(speedtest::encode_servers(servers_))
+                          : make_json_response(servers_json_);
+        case ServerRoute::kInfo: {
+            speedtest::ApiInfo info;
+            info.ip = get_ip();
+            info.server = get_hostname();
+            info.location = "Local Network";
+            info.isp = "Development Environment";
+            info.tcp_port = raw_fd_ >= 0 ? options_.tcp_port : 0;
+            info.udp_port = udp_ ? options_.udp_port : 0;
+            info.payload_seed = payload_->seed();
+            info.payload_size = payload_->size();
+            info.placement = placement_.describe(0);
+            if (binary) return make_binary_response(speedtest::encode_info(info));
+            // The seed is hex text: JavaScript numbers can't hold 64 bits
+            char seed[17];
+            char* seed_end = std::to_chars(seed, seed + sizeof(seed), info.payload_seed, 16).ptr;
+            speedtest::JsonWriter json;
+            json.begin_object()
+                .field("ip", info.ip)
+                .field("server", info.server)
+                .field("location", info.location)
+                .field("isp", info.isp)
+                .field("tcp_port", info.tcp_port)
+                .field("udp_port", info.udp_port)
+                .field("payload_seed", std::string_view(seed, seed_end - seed))
+                .field("payload_size", info.payload_size)
+                .field("placement", info.placement)
+                .end_object();
+            return make_json_response(json.str());
+        }
+        case ServerRoute::kPing: {
+            double ping = sim_.ping_ms();
+            double jitter = std::fabs(sim_.ping_ms() - ping);
+            if (binary) return make_binary_response(speedtest::encode_ping(ping, jitter));
+            speedtest::JsonWriter json;
+            json.begin_object().field("ping", ping).field("jitter", jitter).end_object();
+            return make_json_response(json.str());
+        }
+        case ServerRoute::kSamples:
+            return binary ? make_binary_response(samples_binary(request)) : make_json_response(samples_json(request));
+        case ServerRoute::kScheduler:
+            return make_json_response(scheduler_json());
+        case ServerRoute::kMemory:
+            return make_json_response(memory_json());
+        case ServerRoute::kAgentRun:
+        case ServerRoute::kAgentResult:
+            return agent_response(request, route == ServerRoute::kAgentRun);
+        case ServerRoute::kResults:
+            return results_response(request);
+        case ServerRoute::kHistory:
+            return history_response(request);
+        case ServerRoute::kSimulatedDownload:
+        case ServerRoute::kSimulatedUpload: {
+            double speed = sim_.rate_mbps(route == ServerRoute::kSimulatedDownload, kSimulatedSteadyS);
+            speedtest::JsonWriter json;
+            json.begin_object().field("speed", speed).end_object();
+            return make_json_response(json.str());
+        }
+        default:
+            return make_html_response(get_html());
+        }
     }
     
-    void handle_client(int client_fd) {
-        char buffer[4096];
-        ssize_t bytes = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
-        if (bytes <= 0) return;
-        buffer[bytes] = '\0';
-        
-        std::string request(buffer);
-        std::string response;
-        
-        if (request.find("GET /api/servers") != std::string::npos) {
-            std::ostringstream json;
-            json << R"([
-                {"id":1,"name":"New York, US","location":"New York","country":"United States","lat":40.7128,"lng":-74.0060,"distance":0,"ping":12},
-                {"id":2,"name":"London, UK","location":"London","country":"United Kingdom","lat":51.5074,"lng":-0.1278,"distance":5571,"ping":85},
-                {"id":3,"name":"Tokyo, JP","location":"Tokyo","country":"Japan","lat":35.6762,"lng":139.6503,"distance":10838,"ping":165},
-                {"id":4,"name":"Sydney, AU","location":"Sydney","country":"Australia","lat":-33.8688,"lng":151.2093,"distance":15989,"ping":210},
-                {"id":5,"name":"Frankfurt, DE","location":"Frankfurt","country":"Germany","lat":50.1109,"lng":8.6821,"distance":6198,"ping":95},
-                {"id":6,"name":"Singapore, SG","location":"Singapore","country":"Singapore","lat":1.3521,"lng":103.8198,"distance":15322,"ping":180},
-                {"id":7,"name":"Mumbai, IN","location":"Mumbai","country":"India","lat":19.0760,"lng":72.8777,"distance":12568,"ping":145},
-                {"id":8,"name":"São Paulo, BR","location":"São Paulo","country":"Brazil","lat":-23.5505,"lng":-46.6333,"distance":7688,"ping":120}
-            ])";
-            response = make_json_response(json.str());
-        }
-        else if (request.find("GET /api/info") != std::string::npos) {
-            std::ostringstream json;
-            json << "{\"ip\":\"" << get_ip() << "\","
-                 << "\"server\":\"" << get_hostname() << "\","
-                 << "\"location\":\"Local Network\","
-                 << "\"isp\":\"Development Environment\"}";
-            response = make_json_response(json.str());
-        }
-        else if (request.find("GET /api/ping") != std::string::npos) {
-            double ping = random_speed(15.0, 5.0);
-            double jitter = random_speed(3.0, 1.5);
-            std::ostringstream json;
-            json << "{\"ping\":" << ping << ",\"jitter\":" << jitter << "}";
-            response = make_json_response(json.str());
-        }
-        else if (request.find("GET /api/download") != std::string::npos) {
-            double speed = random_speed(95.0, 15.0);
-            std::ostringstream json;
-            json << "{\"speed\":" << speed << "}";
-            response = make_json_response(json.str());
-        }
-        else if (request.find("GET /api/upload") != std::string::npos) {
-            double speed = random_speed(45.0, 10.0);
-            std::ostringstream json;
-            json << "{\"speed\":" << speed << "}";
-            response = make_json_response(json.str());
+    // /api/udp?flow=HEX lets that flow start from the caller's address:
+    // {"port":N,"max_rate_bps":N}
+    std::string udp_flow_response(const Connection& conn, const std::string& request) {
+        sockaddr_storage peer{};
+        socklen_t len = sizeof(peer);
+        uint64_t flow = std::strtoull(query_string(request, "flow").c_str(), nullptr, 16);
+        if (!udp_ || draining_ || getpeername(conn.fd, reinterpret_cast<sockaddr*>(&peer), &len) != 0) {
+            return make_response(kUnavailableHead.view(), udp_ ? "{\"error\":\"draining\"}" : "{\"error\":\"no udp port\"}");
+        }
+        udp_->allow(flow, peer);
+        speedtest::JsonWriter json;
+        json.begin_object().field("port", options_.udp_port).field("max_rate_bps", udp_->max_rate()).end_object();
+        return make_json_response(json.str());
+    }
+
+    // POST /api/agent/run?target=HOST:PORT&... and GET /api/agent/result?run=N,
+    // for a speed_test --mesh controller with our --agent-token; see
+    // speedtest::MeshAgent
+    std::string agent_response(const std::string& request, bool run) {
+        if (!options_.agent) {
+            return make_response(kForbiddenHead.view(), "{\"error\":\"not an agent (--agent=1)\"}");
         }
-        else {
-            response = make_html_response(get_html());
+        if (!has_agent_token(request)) {
+            return make_response(kUnauthorizedHead.view(), "{\"error\":\"expected the --agent-token\"}");
         }
-        
-        send(client_fd, response.c_str(), response.length(), 0);
+        if (run) {
+            if (draining_) return make_response(kAgentHead.view(), "{\"error\":\"draining\"}");
+            return make_response(kAgentHead.view(), agent_.start(request_query(request)));
+        }
+        return make_response(kAgentHead.view(), agent_.result(query_u64(request, "run", 0)));
+    }
+
+    // Authorization: Bearer <--agent-token>, compared in constant time
+    bool has_agent_token(const std::string& request) const {
+        std::string_view value;
+        if (!speedtest::find_header(request, "Authorization", &value) || value.size() < 7 ||
+            !speedtest::equals_ignore_case(value.substr(0, 7), "Bearer ")) {
+            return false;
+        }
+        value.remove_prefix(7);
+        const std::string& token = options_.agent_token;
+        if (token.empty() || value.size() != token.size()) return false;
+        unsigned char diff = 0;
+        for (size_t i = 0; i < token.size(); ++i) diff |= value[i] ^ token[i];
+        return diff == 0;
+    }
+
+    // POST /api/results?download_mbps=..&upload_mbps=..&ping_ms=..&jitter_ms=..
+    // from a client that finished a test: {"stored":N}
+    std::string results_response(const std::string& request) {
+        speedtest::HistoryPoint point;
+        std::string error;
+        speedtest::JsonWriter json;
+        if (!speedtest::history_point_from_query(request_query(request), &point, &error)) {
+            json.begin_object().field("error", error).end_object();
+            return make_response(kBadRequestHead.view(), json.str());
+        }
+        record_result(point);
+        json.begin_object().field("stored", history_.size()).end_object();
+        return make_json_response(json.str());
+    }
+
+    // GET /api/history?from=&to=&limit=, &summary=1 or &step=1m|1h|1d&field=;
+    // see speedtest::history_query_json
+    std::string history_response(const std::string& request) {
+        std::string json;
+        std::string error;
+        if (!speedtest::history_query_json(history_, request_query(request), &json, &error)) {
+            speedtest::JsonWriter body;
+            body.begin_object().field("error", error).end_object();
+            return make_response(kBadRequestHead.view(), body.str());
+        }
+        return make_json_response(json);
+    }
+
+    // Stamped with our clock: clients' clocks can't be trusted to agree
+    void record_result(speedtest::HistoryPoint point) {
+        point.t_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::system_clock::now().time_since_epoch())
+                         .count();
+        history_.add(point);
+    }
+
+    std::string make_json_response(std::string_view json) {
+        return make_response(kJsonHead.view(), json);
     }
     
-    std::string make_json_response(const std::string& json) {
-        std::ostringstream ss;
-        ss << "HTTP/1.1 200 OK\r\n"
-           << "Content-Type: application/json\r\n"
-           << "Access-Control-Allow-Origin: *\r\n"
-           << "Content-Length: " << json.length() << "\r\n"
-           << "\r\n"
-           << json;
-        return ss.str();
+    std::string make_binary_response(std::string_view body) {
+        return make_response(kBinaryHead.view(), body);
     }
     
-    std::string make_html_response(const std::string& html) {
-        std::ostringstream ss;
-        ss << "HTTP/1.1 200 OK\r\n"
-           << "Content-Type: text/html\r\n"
-           << "Content-Length: " << html.length() << "\r\n"
-           << "\r\n"
-           << html;
-        return ss.str();
+    std::string make_html_response(std::string_view html) {
+        return make_response(kHtmlHead.view(), html);
+    }
+
+    std::string make_response(std::string_view head, std::string_view body) {
+        return make_response(head, body.size(), body);
+    }
+
+    // A compiled head, the length and `body`, in one allocation with room
+    // for the Connection header send_response() adds
+    static std::string make_response(std::string_view head, uint64_t content_length, std::string_view body) {
+        char length[20];
+        char* length_end = std::to_chars(length, length + sizeof(length), content_length).ptr;
+        std::string response;
+        response.reserve(head.size() + sizeof(length) + 4 + kConnectionHeaderRoom + body.size());
+        response.append(head);
+        response.append(length, length_end);
+        response.append("\r\n\r\n", 4);
+        response.append(body);
+        return response;
     }
     
-    std::string get_html() {
+    static std::string_view get_html() {
         return R"HTML(
 <!DOCTYPE html>
 <html lang="en">
@@ -538,6 +2223,14 @@ private:
         .result-box.jitter .result-value { color: #f59e0b; }
         
         /* Server Info Bar */
+        .tcp-diag {
+            display: flex;
+            justify-content: center;
+            gap: 30px;
+            margin-top: 20px;
+            flex-wrap: wrap;
+        }
+        
         .server-info-bar {
             display: flex;
             justify-content: center;
@@ -682,6 +2375,44 @@ private:
                     </div>
                 </div>
                 
+                <div class="tcp-diag" id="tcpDiag" style="display: none;">
+                    <div class="info-item">
+                        <div class="info-label">TCP RTT</div>
+                        <div class="info-value" id="diagRtt">--</div>
+                    </div>
+                    <div class="info-item">
+                        <div class="info-label">Cwnd</div>
+                        <div class="info-value" id="diagCwnd">--</div>
+                    </div>
+                    <div class="info-item">
+                        <div class="info-label">Retransmits</div>
+                        <div class="info-value" id="diagRetrans">--</div>
+                    </div>
+                    <div class="info-item">
+                        <div class="info-label">Delivery Rate</div>
+                        <div class="info-value" id="diagDelivery">--</div>
+                    </div>
+                </div>
+                
+                <div class="tcp-diag" id="historyBar" style="display: none;">
+                    <div class="info-item">
+                        <div class="info-label">Tests, Last 24 h</div>
+                        <div class="info-value" id="historyCount">--</div>
+                    </div>
+                    <div class="info-item">
+                        <div class="info-label">Median Download</div>
+                        <div class="info-value" id="historyDownload">--</div>
+                    </div>
+                    <div class="info-item">
+                        <div class="info-label">Median Upload</div>
+                        <div class="info-value" id="historyUpload">--</div>
+                    </div>
+                    <div class="info-item">
+                        <div class="info-label">Median Ping</div>
+                        <div class="info-value" id="historyPing">--</div>
+                    </div>
+                </div>
+                
                 <div class="server-info-bar" id="serverInfoBar">
                     <div class="info-item">
                         <div class="info-label">Server</div>
@@ -707,11 +2438,15 @@ private:
         let selectedServer = null;
         let testing = false;
         
+        const TEST_STREAMS = 4;
+        const TEST_SECONDS = 8;
+        
         // Initialize
         document.addEventListener('DOMContentLoaded', async () => {
             initMap();
             await loadServers();
             await loadInfo();
+            await loadHistory();
         });
         
         function initMap() {
@@ -750,6 +2485,29 @@ private:
             } catch (e) {}
         }
         
+        // What the server has stored over the last day, this result included
+        async function loadHistory() {
+            try {
+                const since = Date.now() - 24 * 3600 * 1000;
+                const history = await fetch('/api/history?summary=1&q=0.5&from=' + since).then(r => r.json());
+                if (!history.download_mbps || !history.download_mbps.count) return;
+                document.getElementById('historyCount').textContent = history.download_mbps.count;
+                document.getElementById('historyDownload').textContent = history.download_mbps.p50.toFixed(1) + ' Mbps';
+                document.getElementById('historyUpload').textContent = history.upload_mbps.p50.toFixed(1) + ' Mbps';
+                document.getElementById('historyPing').textContent = history.ping_ms.p50.toFixed(0) + ' ms';
+                document.getElementById('historyBar').style.display = 'flex';
+            } catch (e) {}
+        }
+        
+        async function submitResult(download, upload, ping, jitter) {
+            const query = 'download_mbps=' + download + '&upload_mbps=' + upload +
+                          '&ping_ms=' + ping + '&jitter_ms=' + jitter;
+            try {
+                await fetch('/api/results?' + query, {method: 'POST'});
+            } catch (e) {}
+            await loadHistory();
+        }
+        
         function renderServers() {
             const list = document.getElementById('serverList');
             list.innerHTML = '<div class="map-title">🖥️ Available Servers</div>';
@@ -826,6 +2584,8 @@ private:
             uploadValue.textContent = '0';
             
             let pingResult, jitterResult, downloadResult, uploadResult;
+            const testId = Math.random().toString(36).slice(2, 10);
+            document.getElementById('tcpDiag').style.display = 'none';
             
             // Ping Test
             status.textContent = 'Testing ping...';
@@ -838,13 +2598,22 @@ private:
             
             // Download Test
             status.textContent = 'Testing download speed...';
-            downloadResult = await runSpeedTest(downloadProgress, downloadValue, '/api/download', 100);
+            try {
+                downloadResult = await runDownload(downloadProgress, downloadValue, testId + '-d', testId);
+            } catch (e) {
+                status.className = 'status';
+                status.textContent = e.message;
+                btn.disabled = false;
+                btn.textContent = 'GO';
+                testing = false;
+                return;
+            }
             
             await sleep(500);
             
             // Upload Test
             status.textContent = 'Testing upload speed...';
-            uploadResult = await runSpeedTest(uploadProgress, uploadValue, '/api/upload', 50);
+            uploadResult = await runUpload(uploadProgress, uploadValue, testId + '-u', testId);
             
             // Show Results
             status.className = 'status';
@@ -857,28 +2626,147 @@ private:
             
             resultsGrid.style.display = 'grid';
             resultsGrid.classList.add('fade-in');
+            submitResult(downloadResult, uploadResult, pingResult, jitterResult);
             
             btn.disabled = false;
             btn.textContent = 'GO';
             testing = false;
         }
         
-        async function runSpeedTest(progressEl, valueEl, endpoint, maxSpeed) {
-            // Animate progress
-            for (let i = 0; i <= 100; i += 2) {
-                const speed = Math.min(maxSpeed, (i / 100) * maxSpeed * (0.8 + Math.random() * 0.4));
-                const offset = 314 - (i / 100) * 314;
-                progressEl.style.strokeDashoffset = offset;
-                valueEl.textContent = speed.toFixed(1);
-                await sleep(40);
+        // Parallel streaming GETs, counted as the bytes arrive. The server
+        // holds them while our session waits for a slot, or answers 503.
+        async function runDownload(progressEl, valueEl, test, session) {
+            const stopWatching = watchSamples(test, false);
+            const controllers = [];
+            let bytes = 0;
+            let admit;
+            const admitted = new Promise(resolve => { admit = resolve; });
+            const status = document.getElementById('status');
+            status.textContent = 'Waiting for the server...';
+            const streams = Array.from({ length: TEST_STREAMS }, (_, i) => {
+                const ctrl = new AbortController();
+                controllers.push(ctrl);
+                return fetch(`/stream/download?bytes=${1e12}&test=${test}&session=${session}&stream=${i}`,
+                             { signal: ctrl.signal, cache: 'no-store' })
+                    .then(async response => {
+                        admit(response);
+                        if (!response.ok) return;
+                        const reader = response.body.getReader();
+                        for (;;) {
+                            const { done, value } = await reader.read();
+                            if (done) break;
+                            bytes += value.length;
+                        }
+                    })
+                    .catch(() => admit(null));
+            });
+            
+            const first = await admitted;
+            if (!first || !first.ok) {
+                controllers.forEach(c => c.abort());
+                await Promise.all(streams);
+                await stopWatching();
+                const retry = first ? first.headers.get('Retry-After') : null;
+                throw new Error(retry ? `Server busy, try again in ${retry} s` : 'Server unreachable');
             }
+            status.textContent = 'Testing download speed...';
+            const speed = await trackSpeed(progressEl, valueEl, () => bytes);
+            controllers.forEach(c => c.abort());
+            await Promise.all(streams);
+            await stopWatching();
+            return speed;
+        }
+        
+        // Parallel POSTs of random data; XHR exposes upload progress. That
+        // counts what the browser handed its socket, so the result is what
+        // the server timed arriving, when it has that.
+        async function runUpload(progressEl, valueEl, test, session) {
+            const stopWatching = watchSamples(test, true);
+            const chunk = new Uint8Array(1 << 20);
+            for (let i = 0; i < chunk.length; i += 65536) {
+                crypto.getRandomValues(chunk.subarray(i, i + 65536));
+            }
+            const body = new Blob(Array(32).fill(chunk));
+            const sent = Array(TEST_STREAMS).fill(0);
+            const xhrs = [];
+            let finished = 0;
+            let running = true;
             
-            // Get final result
-            const result = await fetch(endpoint).then(r => r.json());
-            valueEl.textContent = result.speed.toFixed(1);
-            progressEl.style.strokeDashoffset = 314 - (result.speed / maxSpeed) * 314;
+            const startStream = i => {
+                if (!running) return;
+                const xhr = new XMLHttpRequest();
+                xhrs[i] = xhr;
+                xhr.open('POST', `/stream/upload?test=${test}&session=${session}&stream=${i}`);
+                xhr.upload.onprogress = e => { sent[i] = e.loaded; };
+                xhr.onloadend = () => { finished += sent[i]; sent[i] = 0; startStream(i); };
+                xhr.send(body);
+            };
+            for (let i = 0; i < TEST_STREAMS; i++) startStream(i);
             
-            return result.speed;
+            const speed = await trackSpeed(progressEl, valueEl,
+                                           () => finished + sent.reduce((a, b) => a + b, 0));
+            running = false;
+            xhrs.forEach(x => x.abort());
+            await stopWatching();
+            try {
+                const data = await fetch(`/api/samples?test=${test}&since=${Number.MAX_SAFE_INTEGER}`)
+                    .then(r => r.json());
+                if (data.received && data.received.mbps > 0) return data.received.mbps;
+            } catch (e) {}
+            return speed;
+        }
+        
+        async function trackSpeed(progressEl, valueEl, bytesSoFar) {
+            const start = performance.now();
+            let elapsed = 0;
+            while (elapsed < TEST_SECONDS) {
+                await sleep(200);
+                elapsed = (performance.now() - start) / 1000;
+                setMeter(progressEl, valueEl, bytesSoFar() * 8 / elapsed / 1e6);
+            }
+            return bytesSoFar() * 8 / elapsed / 1e6;
+        }
+        
+        // Meter scale grows by decades: 100, 1000, 10000 Mbps...
+        function setMeter(progressEl, valueEl, speed) {
+            const scale = Math.max(100, Math.pow(10, Math.ceil(Math.log10(Math.max(speed, 1)))));
+            progressEl.style.strokeDashoffset = 314 - (speed / scale) * 314;
+            valueEl.textContent = speed.toFixed(1);
+        }
+        
+        // Polls the server's TCP_INFO samples for this test until stopped
+        function watchSamples(test, serverReceiving) {
+            let since = 0;
+            let stopped = false;
+            const latest = {};
+            const poll = async () => {
+                while (!stopped) {
+                    try {
+                        const data = await fetch(`/api/samples?test=${test}&since=${since}`).then(r => r.json());
+                        since = data.next;
+                        data.samples.forEach(s => { latest[s.stream] = s; });
+                        showDiagnostics(Object.values(latest), serverReceiving);
+                    } catch (e) {}
+                    await sleep(500);
+                }
+            };
+            const done = poll();
+            return async () => { stopped = true; await done; };
+        }
+        
+        function showDiagnostics(samples, serverReceiving) {
+            if (samples.length === 0) return;
+            const sum = f => samples.reduce((total, s) => total + f(s), 0);
+            const segs = sum(s => s.segs_out);
+            document.getElementById('tcpDiag').style.display = 'flex';
+            document.getElementById('diagRtt').textContent = (sum(s => s.rtt_ms) / samples.length).toFixed(2) + ' ms';
+            // On uploads the server only sends ACKs; its cwnd says nothing
+            document.getElementById('diagCwnd').textContent =
+                serverReceiving ? '--' : (sum(s => s.cwnd) / samples.length).toFixed(0);
+            document.getElementById('diagRetrans').textContent =
+                serverReceiving ? '--' : (segs ? (100 * sum(s => s.retrans) / segs).toFixed(2) : '0.00') + '%';
+            document.getElementById('diagDelivery').textContent =
+                serverReceiving ? '--' : (sum(s => s.delivery_bps) / 1e6).toFixed(1) + ' Mbps';
         }
         
         async function animateMeter(progressEl, valueEl, start, end, duration) {
@@ -905,14 +2793,123 @@ private:
     }
 };
 
-int main() {
-    SpeedTestServer server(8080);
-    
+static void print_usage() {
+    std::cerr << "Usage: speed_test_gui [--config=FILE] [--key=value ...]\n"
+              << "  --port=N  --io-backend=auto|epoll|io_uring  --idle-timeout=S\n"
+              << "  --capacity=RATE  --max-sessions=N  --max-queue=N  --tuning=SPEC\n"
+              << "  --simulate=LINK  --seed=N  --servers=JSON_FILE\n"
+              << "  --tls-port=N  --tls-cert=PEM  --tls-key=PEM  --ktls=0|1\n"
+              << "  --tcp-port=N  --udp-port=N  --udp-max-rate=RATE  Raw TCP and UDP test ports\n"
+              << "  --drain-timeout=S  --handoff=SOCKET_PATH\n"
+              << "  --memory-budget=SIZE  --connection-budget=SIZE  --max-connections=N\n"
+              << "  --header-timeout=S  --send-timeout=S\n"
+              << "  --affinity=none|node|node:N|auto|CPU_LIST\n"
+              << "  --agent=0|1  --agent-token=SECRET  Run tests for speed_test --mesh controllers\n"
+              << "                 that send the token (best kept in the config file)\n"
+              << "  --history=FILE  Keep every submitted result in FILE (default: in memory)\n"
+              << "The config file takes the same keys, one key=value per line.\n";
+}
+
+// The config file, then the command line on top, then what they point to
+static bool build_config(const std::string& config_path,
+                         const std::vector<std::pair<std::string, std::string>>& flags, ServerOptions* options,
+                         std::shared_ptr<const speedtest::LinkModel>* link, std::string* servers_json,
+                         std::string* error) {
+    if (!config_path.empty() && !load_config_file(config_path, options, error)) return false;
+    for (const auto& flag : flags) {
+        if (!set_server_option(options, flag.first, flag.second, error)) {
+            *error = "--" + flag.first + ": " + *error;
+            return false;
+        }
+    }
+    // Anyone who can reach an agent could otherwise aim its tests anywhere
+    if (options->agent && options->agent_token.empty()) {
+        *error = "--agent=1 needs --agent-token=SECRET";
+        return false;
+    }
+    *link = speedtest::make_link_model(options->link_spec, error);
+    if (!*link) {
+        *error = "simulate: " + *error;
+        return false;
+    }
+    servers_json->clear();
+    return options->servers_path.empty() || load_servers_json(options->servers_path, servers_json, error);
+}
+
+static void on_signal(int signal) {
+    if (signal == SIGHUP) g_reload_signal = 1;
+    else g_stop_signals = g_stop_signals + 1;
+}
+
+int main(int argc, char** argv) {
+    // Fixed once, so a reload without --seed keeps the same simulation
+    ServerOptions defaults;
+    defaults.seed = std::random_device{}();
+    std::string config_path;
+    std::vector<std::pair<std::string, std::string>> flags;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+            print_usage();
+            return arg == "--help" ? 0 : 1;
+        }
+        std::string key = arg.substr(2, eq - 2);
+        if (key == "config") config_path = arg.substr(eq + 1);
+        else flags.emplace_back(key, arg.substr(eq + 1));
+    }
+
+    ServerOptions options = defaults;
+    std::shared_ptr<const speedtest::LinkModel> link;
+    std::string servers_json;
+    std::string error;
+    if (!build_config(config_path, flags, &options, &link, &servers_json, &error)) {
+        std::cerr << error << "\n";
+        return 1;
+    }
+
+    SpeedTestServer server(options, link, servers_json);
+    if (options.tls_port > 0) {
+        // Without a certificate, browsers will ask to trust a self-signed one
+        std::shared_ptr<speedtest::TlsContext> tls =
+            speedtest::TlsContext::server(options.tls_cert, options.tls_key, &error);
+        if (!tls) {
+            std::cerr << "TLS: " << error << "\n";
+            return 1;
+        }
+        tls->set_ktls(options.ktls);
+        server.enable_tls(tls);
+    } else if (!options.tls_cert.empty() || !options.tls_key.empty()) {
+        std::cerr << "--tls-cert and --tls-key need --tls-port\n";
+        return 1;
+    }
+
+    server.set_reload_handler([&] {
+        ServerOptions fresh = defaults;
+        std::shared_ptr<const speedtest::LinkModel> fresh_link;
+        std::string fresh_servers;
+        std::string reload_error;
+        if (!build_config(config_path, flags, &fresh, &fresh_link, &fresh_servers, &reload_error)) {
+            std::cout << "  ⚠️  Reload failed, keeping the running config: " << reload_error << "\n" << std::flush;
+            return;
+        }
+        server.reconfigure(fresh, fresh_link, fresh_servers);
+    });
+
+    struct sigaction action {};
+    action.sa_handler = on_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, nullptr);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGHUP, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
     if (!server.start()) {
         return 1;
     }
-    
+
     server.run();
-    
+
     return 0;
 }
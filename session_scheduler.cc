@@ -0,0 +1,176 @@
+#include "session_scheduler.h"
+
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cmath>
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+
+namespace speedtest {
+
+namespace {
+
+// Past this the advertised window is no limit at all
+const int kUnclampedWindow = 1 << 30;
+
+double seconds_between(SessionScheduler::Clock::time_point a, SessionScheduler::Clock::time_point b) {
+    return std::chrono::duration<double>(b - a).count();
+}
+
+} // namespace
+
+SessionScheduler::Admission SessionScheduler::open_stream(const std::string& session, uint64_t stream,
+                                                          Clock::time_point now) {
+    auto active = active_.find(session);
+    if (active != active_.end()) {
+        active->second.streams.push_back(stream);
+        stream_session_[stream] = session;
+        ++generation_;
+        return Admission::kAdmitted;
+    }
+
+    auto waiting = waiting_.find(session);
+    if (waiting != waiting_.end()) {
+        waiting->second.streams.push_back(stream);
+        stream_session_[stream] = session;
+        return Admission::kQueued;
+    }
+
+    if (queue_.empty() && has_slot()) {
+        Session& s = active_[session];
+        s.streams.push_back(stream);
+        stream_session_[stream] = session;
+        admit(s, now);
+        return Admission::kAdmitted;
+    }
+
+    if (static_cast<int>(queue_.size()) >= config_.max_queue) return Admission::kRejected;
+    Session& s = waiting_[session];
+    s.queued = now;
+    s.streams.push_back(stream);
+    stream_session_[stream] = session;
+    queue_.push_back(session);
+    return Admission::kQueued;
+}
+
+void SessionScheduler::close_stream(uint64_t stream, Clock::time_point now) {
+    auto it = stream_session_.find(stream);
+    if (it == stream_session_.end()) return;
+    std::string session = it->second;
+    stream_session_.erase(it);
+
+    auto remove = [stream](Session& s) {
+        s.streams.erase(std::remove(s.streams.begin(), s.streams.end(), stream), s.streams.end());
+    };
+    auto active = active_.find(session);
+    if (active != active_.end()) {
+        remove(active->second);
+        if (active->second.streams.empty()) active->second.idle_since = now;
+        ++generation_;
+        return;
+    }
+    auto waiting = waiting_.find(session);
+    if (waiting != waiting_.end()) {
+        remove(waiting->second);
+        // A client that gave up while queued leaves the queue with its last stream
+        if (waiting->second.streams.empty()) {
+            waiting_.erase(waiting);
+            queue_.erase(std::find(queue_.begin(), queue_.end(), session));
+        }
+    }
+}
+
+void SessionScheduler::poll(Clock::time_point now, std::vector<uint64_t>* admitted,
+                            std::vector<uint64_t>* expired) {
+    for (auto it = active_.begin(); it != active_.end();) {
+        Session& s = it->second;
+        if (s.streams.empty() && seconds_between(s.idle_since, now) >= config_.linger_s) {
+            double lasted = seconds_between(s.admitted, s.idle_since);
+            mean_session_s_ = 0.8 * mean_session_s_ + 0.2 * lasted;
+            it = active_.erase(it);
+            ++generation_;
+        } else {
+            ++it;
+        }
+    }
+
+    while (!queue_.empty()) {
+        auto it = waiting_.find(queue_.front());
+        Session& s = it->second;
+        if (seconds_between(s.queued, now) >= config_.queue_timeout_s) {
+            for (uint64_t stream : s.streams) {
+                stream_session_.erase(stream);
+                expired->push_back(stream);
+            }
+        } else if (has_slot()) {
+            Session& promoted = active_[it->first];
+            promoted = s;
+            admit(promoted, now);
+            admitted->insert(admitted->end(), promoted.streams.begin(), promoted.streams.end());
+        } else {
+            break;
+        }
+        waiting_.erase(it);
+        queue_.pop_front();
+    }
+}
+
+uint64_t SessionScheduler::stream_rate_bps(uint64_t stream) const {
+    if (config_.capacity_bps == 0) return 0;
+    auto it = stream_session_.find(stream);
+    if (it == stream_session_.end()) return 0;
+    auto session = active_.find(it->second);
+    if (session == active_.end() || session->second.streams.empty()) return 0;
+    return session_share_bps() / session->second.streams.size();
+}
+
+uint64_t SessionScheduler::session_share_bps() const {
+    if (config_.capacity_bps == 0) return 0;
+    return config_.capacity_bps / std::max<size_t>(1, active_.size());
+}
+
+int SessionScheduler::retry_after_s() const {
+    // Roughly how long until the queue ahead has drained through the slots
+    int slots = config_.max_sessions > 0 ? config_.max_sessions : 1;
+    double wait = mean_session_s_ * (1.0 + static_cast<double>(queue_.size()) / slots);
+    return std::max(1, static_cast<int>(std::ceil(wait)));
+}
+
+void SessionScheduler::admit(Session& session, Clock::time_point now) {
+    session.admitted = now;
+    session.idle_since = now;
+    ++generation_;
+}
+
+bool SessionScheduler::has_slot() const {
+    return config_.max_sessions <= 0 || static_cast<int>(active_.size()) < config_.max_sessions;
+}
+
+void set_stream_rate(int fd, uint64_t rate_bps, bool receiving) {
+    if (!receiving) {
+        // ~0 is the kernel's "unlimited"
+        uint64_t bytes_per_s = rate_bps ? rate_bps / 8 : ~0ull;
+        setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &bytes_per_s, sizeof(bytes_per_s));
+        return;
+    }
+
+    int clamp = kUnclampedWindow;
+    tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (rate_bps && getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        // The receiver's own RTT estimate when it has one, else the handshake's
+        double rtt_us = info.tcpi_rcv_rtt ? info.tcpi_rcv_rtt : info.tcpi_rtt;
+        double window = rate_bps / 8.0 * rtt_us / 1e6;
+        // Below a few segments TCP stalls on delayed ACKs instead of pacing
+        double floor = 4.0 * std::max<uint32_t>(info.tcpi_rcv_mss, 536);
+        clamp = static_cast<int>(std::min<double>(kUnclampedWindow, std::max(window, floor)));
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_WINDOW_CLAMP, &clamp, sizeof(clamp));
+}
+
+} // namespace speedtest
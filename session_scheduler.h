@@ -0,0 +1,103 @@
+#ifndef SESSION_SCHEDULER_H_
+#define SESSION_SCHEDULER_H_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace speedtest {
+
+// Server-side limits shared by all clients
+struct SchedulerConfig {
+    uint64_t capacity_bps = 0;     // Link capacity split between sessions; 0 = don't pace
+    int max_sessions = 16;         // Sessions streaming at once; 0 = unlimited
+    int max_queue = 64;            // Sessions waiting for a slot; beyond that, reject
+    double queue_timeout_s = 30;   // Give up on a queued session after this long
+    double linger_s = 2;           // Keep a slot this long after its last stream ends
+};
+
+// Fair-share admission and pacing for test sessions.
+//
+// A session is one client's test (all of its parallel streams, across the
+// download and upload phases). Up to max_sessions run at once; later ones
+// wait in FIFO order or are turned away when the queue is full. Running
+// sessions split capacity_bps equally, and each session's share is split
+// equally between its open streams, so opening more streams does not buy a
+// client more bandwidth.
+//
+// Streams are identified by the caller's connection ids. The scheduler only
+// does bookkeeping; the server applies the rates to its sockets.
+class SessionScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    enum class Admission { kAdmitted, kQueued, kRejected };
+
+    explicit SessionScheduler(const SchedulerConfig& config) : config_(config) {}
+
+    const SchedulerConfig& config() const { return config_; }
+    // New limits apply to admissions and rates from here on; running
+    // sessions keep their slots even when max_sessions drops
+    void set_config(const SchedulerConfig& config) {
+        config_ = config;
+        ++generation_;
+    }
+
+    // A stream of `session` wants to start
+    Admission open_stream(const std::string& session, uint64_t stream, Clock::time_point now);
+
+    // The stream finished, failed or was never admitted
+    void close_stream(uint64_t stream, Clock::time_point now);
+
+    // Release idle sessions and promote queued ones. Streams whose session
+    // got a slot are appended to *admitted; streams whose session waited
+    // past queue_timeout_s go to *expired (and are forgotten).
+    void poll(Clock::time_point now, std::vector<uint64_t>* admitted, std::vector<uint64_t>* expired);
+
+    // Pacing rate for an admitted stream in bits/s; 0 = unlimited
+    uint64_t stream_rate_bps(uint64_t stream) const;
+
+    // Bumped whenever stream rates may have changed
+    uint64_t generation() const { return generation_; }
+
+    // Suggested wait before a rejected client tries again
+    int retry_after_s() const;
+
+    bool running(const std::string& session) const { return active_.count(session) > 0; }
+    int active_sessions() const { return static_cast<int>(active_.size()); }
+    int queued_sessions() const { return static_cast<int>(queue_.size()); }
+    uint64_t session_share_bps() const;
+
+private:
+    struct Session {
+        std::vector<uint64_t> streams;
+        Clock::time_point admitted;
+        Clock::time_point queued;
+        Clock::time_point idle_since;  // When the last stream closed
+    };
+
+    void admit(Session& session, Clock::time_point now);
+    bool has_slot() const;
+
+    SchedulerConfig config_;
+    std::map<std::string, Session> active_;
+    std::map<std::string, Session> waiting_;
+    std::deque<std::string> queue_;                      // Waiting session ids, oldest first
+    std::unordered_map<uint64_t, std::string> stream_session_;
+    uint64_t generation_ = 0;
+    double mean_session_s_ = 10;                         // Running estimate for Retry-After
+};
+
+// Limit one stream to rate_bps: SO_MAX_PACING_RATE when we send, and a
+// window clamp sized to rate x RTT when we receive (the peer can't be
+// paced directly, but it can't outrun the window we advertise). 0 lifts
+// the limit.
+void set_stream_rate(int fd, uint64_t rate_bps, bool receiving);
+
+} // namespace speedtest
+
+#endif // SESSION_SCHEDULER_H_
@@ -0,0 +1,230 @@
+#include "socket_tuning.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <cctype>
+#include <cmath>
+#include <cerrno>
+#include <cstdlib>
+#include <sstream>
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+
+namespace speedtest {
+
+namespace {
+
+const char* const kKeys[] = {"cc", "sndbuf", "rcvbuf", "nodelay", "notsent_lowat", "pacing", "busy_poll"};
+
+bool parse_scaled(const std::string& text, uint64_t unit, uint64_t* out) {
+    if (text.empty() || !isdigit(static_cast<unsigned char>(text[0]))) return false;
+    char* end = nullptr;
+    errno = 0;
+    double value = std::strtod(text.c_str(), &end);
+    if (errno != 0 || value < 0) return false;
+    std::string suffix(end);
+    if (suffix == "k" || suffix == "K") value *= unit;
+    else if (suffix == "m" || suffix == "M") value *= unit * unit;
+    else if (suffix == "g" || suffix == "G") value *= unit * unit * unit;
+    else if (!suffix.empty()) return false;
+    // Past uint64_t the cast is undefined; 2^64 itself is exact in a double
+    if (!std::isfinite(value) || value >= 18446744073709551616.0) return false;
+    *out = static_cast<uint64_t>(value);
+    return true;
+}
+
+std::string format_scaled(uint64_t value, uint64_t unit) {
+    const char* suffixes[] = {"", "k", "m", "g"};
+    int i = 0;
+    while (i < 3 && value >= unit && value % unit == 0) {
+        value /= unit;
+        ++i;
+    }
+    return std::to_string(value) + suffixes[i];
+}
+
+std::vector<std::string> split(const std::string& text, const std::string& separators) {
+    std::vector<std::string> parts;
+    std::string current;
+    for (char c : text) {
+        if (separators.find(c) != std::string::npos) {
+            if (!current.empty()) parts.push_back(current);
+            current.clear();
+        } else {
+            current += c;
+        }
+    }
+    if (!current.empty()) parts.push_back(current);
+    return parts;
+}
+
+} // namespace
+
+bool TuningProfile::empty() const {
+    return congestion.empty() && sndbuf == 0 && rcvbuf == 0 && nodelay < 0 &&
+           notsent_lowat == 0 && pacing_bps == 0 && busy_poll_us == 0;
+}
+
+std::string TuningProfile::describe() const {
+    if (empty()) return "default";
+    std::ostringstream out;
+    const char* sep = "";
+    auto field = [&](const char* key, const std::string& value) {
+        out << sep << key << "=" << value;
+        sep = ",";
+    };
+    if (!congestion.empty()) field("cc", congestion);
+    if (sndbuf) field("sndbuf", format_scaled(sndbuf, 1024));
+    if (rcvbuf) field("rcvbuf", format_scaled(rcvbuf, 1024));
+    if (nodelay >= 0) field("nodelay", std::to_string(nodelay));
+    if (notsent_lowat) field("notsent_lowat", format_scaled(notsent_lowat, 1024));
+    if (pacing_bps) field("pacing", format_scaled(pacing_bps, 1000));
+    if (busy_poll_us) field("busy_poll", std::to_string(busy_poll_us));
+    return out.str();
+}
+
+std::string TuningProfile::to_query() const {
+    std::ostringstream out;
+    const char* sep = "";
+    auto field = [&](const char* key, const std::string& value) {
+        out << sep << key << "=" << value;
+        sep = "&";
+    };
+    if (!congestion.empty()) field("cc", congestion);
+    if (sndbuf) field("sndbuf", std::to_string(sndbuf));
+    if (rcvbuf) field("rcvbuf", std::to_string(rcvbuf));
+    if (nodelay >= 0) field("nodelay", std::to_string(nodelay));
+    if (notsent_lowat) field("notsent_lowat", std::to_string(notsent_lowat));
+    if (pacing_bps) field("pacing", std::to_string(pacing_bps));
+    if (busy_poll_us) field("busy_poll", std::to_string(busy_poll_us));
+    return out.str();
+}
+
+bool set_tuning_option(TuningProfile* profile, const std::string& key, const std::string& value,
+                       std::string* error) {
+    uint64_t number = 0;
+    bool ok = true;
+    if (key == "cc") {
+        ok = !value.empty() && value.size() < 16;
+        for (char c : value) ok = ok && (isalnum(static_cast<unsigned char>(c)) || c == '_');
+        if (ok) profile->congestion = value;
+    } else if (key == "sndbuf" || key == "rcvbuf" || key == "notsent_lowat") {
+        ok = parse_scaled(value, 1024, &number) && number <= (1u << 30);
+        int bytes = static_cast<int>(number);
+        if (ok && key == "sndbuf") profile->sndbuf = bytes;
+        if (ok && key == "rcvbuf") profile->rcvbuf = bytes;
+        if (ok && key == "notsent_lowat") profile->notsent_lowat = bytes;
+    } else if (key == "nodelay") {
+        ok = value == "0" || value == "1";
+        if (ok) profile->nodelay = value == "1";
+    } else if (key == "pacing") {
+        ok = parse_scaled(value, 1000, &number);
+        if (ok) profile->pacing_bps = number;
+    } else if (key == "busy_poll") {
+        ok = parse_scaled(value, 1000, &number) && number <= 1000000;
+        if (ok) profile->busy_poll_us = static_cast<int>(number);
+    } else {
+        if (error) *error = "unknown tuning option '" + key + "'";
+        return false;
+    }
+    if (!ok && error) *error = "bad value '" + value + "' for " + key;
+    return ok;
+}
+
+bool parse_tuning(const std::string& spec, TuningProfile* profile, std::string* error) {
+    for (const std::string& pair : split(spec, ",&")) {
+        size_t eq = pair.find('=');
+        if (eq == std::string::npos) {
+            if (error) *error = "expected key=value, got '" + pair + "'";
+            return false;
+        }
+        if (!set_tuning_option(profile, pair.substr(0, eq), pair.substr(eq + 1), error)) return false;
+    }
+    return true;
+}
+
+TuningProfile tuning_from_query(const std::string& query) {
+    TuningProfile profile;
+    for (const std::string& pair : split(query, "&")) {
+        size_t eq = pair.find('=');
+        if (eq == std::string::npos) continue;
+        std::string key = pair.substr(0, eq);
+        for (const char* known : kKeys) {
+            // A malformed value from a client just leaves that option unset
+            if (key == known) set_tuning_option(&profile, key, pair.substr(eq + 1), nullptr);
+        }
+    }
+    return profile;
+}
+
+bool parse_rate(const std::string& text, uint64_t* bps) {
+    return parse_scaled(text, 1000, bps);
+}
+
+bool parse_size(const std::string& text, uint64_t* bytes) {
+    return parse_scaled(text, 1024, bytes);
+}
+
+std::string format_size(uint64_t bytes) {
+    return format_scaled(bytes, 1024);
+}
+
+bool parse_sweep(const std::string& spec, const TuningProfile& base,
+                 std::vector<TuningProfile>* profiles, std::string* error) {
+    profiles->assign(1, base);
+    for (const std::string& axis : split(spec, ";")) {
+        size_t eq = axis.find('=');
+        if (eq == std::string::npos) {
+            if (error) *error = "expected key=v1,v2,..., got '" + axis + "'";
+            return false;
+        }
+        std::string key = axis.substr(0, eq);
+        std::vector<std::string> values = split(axis.substr(eq + 1), ",");
+        if (values.empty()) {
+            if (error) *error = "no values for " + key;
+            return false;
+        }
+
+        std::vector<TuningProfile> next;
+        for (const TuningProfile& partial : *profiles) {
+            for (const std::string& value : values) {
+                TuningProfile profile = partial;
+                if (!set_tuning_option(&profile, key, value, error)) return false;
+                next.push_back(profile);
+            }
+        }
+        profiles->swap(next);
+    }
+    return true;
+}
+
+std::vector<std::string> apply_tuning(int fd, const TuningProfile& profile) {
+    std::vector<std::string> rejected;
+    auto set_int = [&](int level, int name, int value, const char* key) {
+        if (setsockopt(fd, level, name, &value, sizeof(value)) != 0) rejected.push_back(key);
+    };
+
+    if (!profile.congestion.empty() &&
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, profile.congestion.data(),
+                   profile.congestion.size()) != 0) {
+        rejected.push_back("cc");
+    }
+    if (profile.sndbuf) set_int(SOL_SOCKET, SO_SNDBUF, profile.sndbuf, "sndbuf");
+    if (profile.rcvbuf) set_int(SOL_SOCKET, SO_RCVBUF, profile.rcvbuf, "rcvbuf");
+    if (profile.nodelay >= 0) set_int(IPPROTO_TCP, TCP_NODELAY, profile.nodelay, "nodelay");
+    if (profile.notsent_lowat) set_int(IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile.notsent_lowat, "notsent_lowat");
+    if (profile.pacing_bps) {
+        uint64_t bytes_per_s = profile.pacing_bps / 8;
+        if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &bytes_per_s, sizeof(bytes_per_s)) != 0) {
+            rejected.push_back("pacing");
+        }
+    }
+    if (profile.busy_poll_us) set_int(SOL_SOCKET, SO_BUSY_POLL, profile.busy_poll_us, "busy_poll");
+    return rejected;
+}
+
+} // namespace speedtest
@@ -0,0 +1,63 @@
+#ifndef SOCKET_TUNING_H_
+#define SOCKET_TUNING_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace speedtest {
+
+// Socket options applied to every test stream. Zero / empty / -1 fields
+// leave the kernel default alone.
+//
+// Text form is comma- or ampersand-separated key=value pairs:
+//   cc=bbr,sndbuf=4m,rcvbuf=4m,nodelay=1,notsent_lowat=128k,pacing=500m,busy_poll=50
+// Sizes take k/m/g suffixes (powers of 1024); pacing is in bits per second
+// with k/m/g meaning 10^3/10^6/10^9.
+struct TuningProfile {
+    std::string congestion;        // TCP_CONGESTION
+    int sndbuf = 0;                // SO_SNDBUF, bytes
+    int rcvbuf = 0;                // SO_RCVBUF, bytes
+    int nodelay = -1;              // TCP_NODELAY
+    int notsent_lowat = 0;         // TCP_NOTSENT_LOWAT, bytes
+    uint64_t pacing_bps = 0;       // SO_MAX_PACING_RATE, bits per second
+    int busy_poll_us = 0;          // SO_BUSY_POLL
+
+    bool empty() const;
+    // "cc=bbr,sndbuf=4m", or "default"
+    std::string describe() const;
+    // "cc=bbr&sndbuf=4194304", for request URLs; empty when nothing is set
+    std::string to_query() const;
+};
+
+// Set one option by key; false with *error filled on a bad key or value
+bool set_tuning_option(TuningProfile* profile, const std::string& key, const std::string& value,
+                       std::string* error);
+
+// Parse a whole profile spec (see above)
+bool parse_tuning(const std::string& spec, TuningProfile* profile, std::string* error);
+
+// Pick the tuning keys out of a URL query string, ignoring everything else
+TuningProfile tuning_from_query(const std::string& query);
+
+// Bits per second with k/m/g meaning 10^3/10^6/10^9, e.g. "10g"
+bool parse_rate(const std::string& text, uint64_t* bps);
+
+// Bytes with k/m/g meaning 2^10/2^20/2^30, e.g. "256m"
+bool parse_size(const std::string& text, uint64_t* bytes);
+// And back, in the largest unit that divides it: 268435456 -> "256m"
+std::string format_size(uint64_t bytes);
+
+// Expand a sweep spec into the cartesian product of its values, each on top
+// of base:
+//   "cc=bbr,cubic;sndbuf=256k,4m" -> 4 profiles
+bool parse_sweep(const std::string& spec, const TuningProfile& base,
+                 std::vector<TuningProfile>* profiles, std::string* error);
+
+// Apply before connect() so buffer sizes shape the window scale. Returns
+// the keys the kernel refused (e.g. an unloaded congestion module).
+std::vector<std::string> apply_tuning(int fd, const TuningProfile& profile);
+
+} // namespace speedtest
+
+#endif // SOCKET_TUNING_H_
@@ -0,0 +1,256 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace speedtest {
+
+namespace {
+
+// Bucket bounds grow by kGamma, so a bucket's midpoint is within kAccuracy
+// of anything in it
+const double kAccuracy = 0.01;
+const double kGamma = (1 + kAccuracy) / (1 - kAccuracy);
+const double kLogGamma = std::log(kGamma);
+const int kBuckets = static_cast<int>(std::ceil(
+    std::log(QuantileSketch::kMaxValue / QuantileSketch::kMinValue) / kLogGamma)) + 1;
+
+// SplitMix64: the bootstrap draws millions of indices and needs speed
+// far more than mt19937's period
+struct FastRng {
+    uint64_t state;
+    uint64_t operator()() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+};
+
+} // namespace
+
+void RunningStats::add(double x) {
+    if (n_ == 0) min_ = max_ = x;
+    min_ = std::min(min_, x);
+    max_ = std::max(max_, x);
+    ++n_;
+    double delta = x - mean_;
+    mean_ += delta / n_;
+    m2_ += delta * (x - mean_);
+}
+
+void RunningStats::merge(const RunningStats& other) {
+    if (other.n_ == 0) return;
+    if (n_ == 0) {
+        *this = other;
+        return;
+    }
+    uint64_t n = n_ + other.n_;
+    double delta = other.mean_ - mean_;
+    mean_ += delta * other.n_ / n;
+    m2_ += other.m2_ + delta * delta * n_ * other.n_ / n;
+    n_ = n;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+}
+
+double RunningStats::variance() const {
+    return n_ > 1 ? m2_ / (n_ - 1) : 0;
+}
+
+double RunningStats::stddev() const {
+    return std::sqrt(variance());
+}
+
+QuantileSketch::QuantileSketch() : buckets_(kBuckets, 0) {}
+
+int QuantileSketch::bucket(double x) {
+    if (!(x > kMinValue)) return 0;
+    int i = static_cast<int>(std::ceil(std::log(x / kMinValue) / kLogGamma));
+    return std::min(i, kBuckets - 1);
+}
+
+double QuantileSketch::value(int bucket) {
+    if (bucket == 0) return kMinValue;
+    // Between the bucket's bounds gamma^(i-1) and gamma^i
+    return kMinValue * 2 * std::pow(kGamma, bucket) / (kGamma + 1);
+}
+
+void QuantileSketch::add(double x) {
+    ++buckets_[bucket(x)];
+    ++count_;
+}
+
+void QuantileSketch::add_bucket(int bucket, uint64_t n) {
+    buckets_[std::clamp(bucket, 0, kBuckets - 1)] += n;
+    count_ += n;
+}
+
+void QuantileSketch::merge(const QuantileSketch& other) {
+    for (int i = 0; i < kBuckets; ++i) buckets_[i] += other.buckets_[i];
+    count_ += other.count_;
+}
+
+double QuantileSketch::quantile(double q) const {
+    if (count_ == 0) return 0;
+    uint64_t rank = static_cast<uint64_t>(std::clamp(q, 0.0, 1.0) * (count_ - 1));
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+        seen += buckets_[i];
+        if (seen > rank) return value(i);
+    }
+    return value(kBuckets - 1);
+}
+
+Reservoir::Reservoir(size_t capacity, uint64_t seed) : capacity_(capacity), rng_(seed) {
+    samples_.reserve(capacity);
+}
+
+void Reservoir::add(double x) {
+    ++seen_;
+    if (samples_.size() < capacity_) {
+        samples_.push_back(x);
+        return;
+    }
+    uint64_t slot = std::uniform_int_distribution<uint64_t>(0, seen_ - 1)(rng_);
+    if (slot < capacity_) samples_[slot] = x;
+}
+
+void Reservoir::merge(const Reservoir& other) {
+    if (other.seen_ == 0) return;
+    if (seen_ + other.samples_.size() <= capacity_ && seen_ == samples_.size() &&
+        other.seen_ == other.samples_.size()) {
+        // Both still hold everything they saw
+        samples_.insert(samples_.end(), other.samples_.begin(), other.samples_.end());
+        seen_ += other.seen_;
+        return;
+    }
+
+    // Each output slot comes from one side with probability proportional
+    // to the values that side has seen
+    std::vector<double> mine = samples_, theirs = other.samples_;
+    std::shuffle(mine.begin(), mine.end(), rng_);
+    std::shuffle(theirs.begin(), theirs.end(), rng_);
+    std::bernoulli_distribution pick_mine(static_cast<double>(seen_) / (seen_ + other.seen_));
+    size_t want = std::min(capacity_, mine.size() + theirs.size());
+    samples_.clear();
+    size_t a = 0, b = 0;
+    while (samples_.size() < want) {
+        bool from_mine = b == theirs.size() || (a < mine.size() && pick_mine(rng_));
+        samples_.push_back(from_mine ? mine[a++] : theirs[b++]);
+    }
+    seen_ += other.seen_;
+}
+
+double median(std::vector<double> values) {
+    if (values.empty()) return 0;
+    size_t mid = values.size() / 2;
+    std::nth_element(values.begin(), values.begin() + mid, values.end());
+    double upper = values[mid];
+    if (values.size() % 2) return upper;
+    double lower = *std::max_element(values.begin(), values.begin() + mid);
+    return (lower + upper) / 2;
+}
+
+size_t reject_outliers(std::vector<double>* values, double threshold) {
+    if (values->size() < 3) return 0;
+    double center = median(*values);
+    std::vector<double> deviations;
+    deviations.reserve(values->size());
+    for (double v : *values) deviations.push_back(std::fabs(v - center));
+
+    // 0.6745 makes the MAD of normal data comparable to a standard
+    // deviation; 0.7979 does the same for the mean absolute deviation
+    double scale = median(deviations) / 0.6745;
+    if (scale == 0) {
+        double sum = 0;
+        for (double d : deviations) sum += d;
+        scale = sum / deviations.size() / 0.7979;
+    }
+    if (scale == 0) return 0;
+
+    size_t before = values->size();
+    values->erase(std::remove_if(values->begin(), values->end(),
+                                 [&](double v) { return std::fabs(v - center) / scale > threshold; }),
+                  values->end());
+    return before - values->size();
+}
+
+Interval bootstrap_mean_ci(const std::vector<double>& values, double confidence, int resamples,
+                           uint64_t seed) {
+    Interval interval;
+    if (values.empty()) return interval;
+    if (values.size() == 1) {
+        interval.low = interval.high = values[0];
+        return interval;
+    }
+
+    FastRng rng{seed};
+    const uint64_t n = values.size();
+    std::vector<double> means(resamples);
+    for (double& mean : means) {
+        double sum = 0;
+        // Multiply-shift maps a 64-bit draw onto [0, n) without a division
+        for (uint64_t i = 0; i < n; ++i) {
+            sum += values[static_cast<uint64_t>((static_cast<unsigned __int128>(rng()) * n) >> 64)];
+        }
+        mean = sum / n;
+    }
+    std::sort(means.begin(), means.end());
+    double tail = (1 - confidence) / 2;
+    interval.low = means[static_cast<size_t>(tail * (resamples - 1))];
+    interval.high = means[static_cast<size_t>((1 - tail) * (resamples - 1))];
+    return interval;
+}
+
+double SampleSummary::relative_error() const {
+    if (count < 2 || mean == 0) return 1;
+    return (ci_high - ci_low) / 2 / std::fabs(mean);
+}
+
+void SampleStats::add(double x) {
+    all_.add(x);
+    sketch_.add(x);
+    reservoir_.add(x);
+}
+
+void SampleStats::merge(const SampleStats& other) {
+    all_.merge(other.all_);
+    sketch_.merge(other.sketch_);
+    reservoir_.merge(other.reservoir_);
+}
+
+SampleSummary SampleStats::summarize() const {
+    return summarize(1000);
+}
+
+SampleSummary SampleStats::summarize(int resamples) const {
+    SampleSummary summary;
+    summary.count = all_.count();
+    if (summary.count == 0) return summary;
+
+    std::vector<double> kept = reservoir_.samples();
+    summary.outliers = reject_outliers(&kept);
+    RunningStats inliers;
+    for (double v : kept) inliers.add(v);
+    summary.mean = inliers.mean();
+    summary.stddev = inliers.stddev();
+    Interval ci = bootstrap_mean_ci(kept, 0.95, resamples);
+    summary.ci_low = ci.low;
+    summary.ci_high = ci.high;
+    summary.p50 = sketch_.quantile(0.5);
+    summary.p90 = sketch_.quantile(0.9);
+    summary.p99 = sketch_.quantile(0.99);
+    return summary;
+}
+
+bool SampleStats::precise_enough(double target, uint64_t min_count) const {
+    if (count() < min_count) return false;
+    // The normal approximation is cheap; only bootstrap when it says we're
+    // close, and then with fewer resamples than a reported interval gets
+    double approx = 1.96 * all_.stddev() / std::sqrt(static_cast<double>(count()));
+    if (approx > 1.25 * target * std::fabs(all_.mean())) return false;
+    return summarize(200).relative_error() <= target;
+}
+
+} // namespace speedtest
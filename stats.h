@@ -0,0 +1,146 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace speedtest {
+
+// Count, mean, variance, min and max in O(1) memory (Welford). Merging
+// two uses Chan's parallel update, so per-thread stats combine exactly.
+class RunningStats {
+public:
+    void add(double x);
+    void merge(const RunningStats& other);
+
+    uint64_t count() const { return n_; }
+    double mean() const { return mean_; }
+    double variance() const;              // Sample variance (n - 1)
+    double stddev() const;
+    double min() const { return min_; }
+    double max() const { return max_; }
+
+private:
+    uint64_t n_ = 0;
+    double mean_ = 0;
+    double m2_ = 0;
+    double min_ = 0;
+    double max_ = 0;
+};
+
+// Quantiles with bounded relative error from log-spaced buckets (as in
+// DDSketch / HDR histograms). Every value v in [kMinValue, kMaxValue) lands
+// in a bucket whose bounds are within 1% of v; smaller values collapse
+// into the first bucket, larger into the last. Fixed memory, and merging
+// is bucket-wise addition.
+class QuantileSketch {
+public:
+    static constexpr double kMinValue = 1e-3;
+    static constexpr double kMaxValue = 1e9;
+
+    QuantileSketch();
+
+    void add(double x);
+    void merge(const QuantileSketch& other);
+    // `n` values already bucketed, e.g. from a sparse copy kept elsewhere
+    void add_bucket(int bucket, uint64_t n);
+
+    uint64_t count() const { return count_; }
+    // q in [0, 1]; 0 when empty
+    double quantile(double q) const;
+
+    // The bucket x lands in, and the value a bucket reports
+    static int bucket(double x);
+    static double value(int bucket);
+
+private:
+    std::vector<uint64_t> buckets_;
+    uint64_t count_ = 0;
+};
+
+// Uniform fixed-size sample of a stream (Algorithm R). Merging draws from
+// both sides in proportion to how many values each has seen.
+class Reservoir {
+public:
+    explicit Reservoir(size_t capacity = 1024, uint64_t seed = 1);
+
+    void add(double x);
+    void merge(const Reservoir& other);
+
+    const std::vector<double>& samples() const { return samples_; }
+    uint64_t seen() const { return seen_; }
+
+private:
+    size_t capacity_;
+    uint64_t seen_ = 0;
+    std::vector<double> samples_;
+    std::mt19937_64 rng_;
+};
+
+// Median of a copy of the values; 0 when empty
+double median(std::vector<double> values);
+
+// Drop values whose modified z-score 0.6745 * |x - median| / MAD exceeds
+// `threshold` (3.5 is the usual cut-off). Returns the number removed. When
+// over half the values are equal (MAD = 0) the mean absolute deviation
+// stands in, so a tight cluster doesn't turn every other value into an
+// outlier.
+size_t reject_outliers(std::vector<double>* values, double threshold = 3.5);
+
+// Percentile bootstrap interval for the mean of `values`
+struct Interval {
+    double low = 0;
+    double high = 0;
+};
+Interval bootstrap_mean_ci(const std::vector<double>& values, double confidence = 0.95,
+                           int resamples = 1000, uint64_t seed = 1);
+
+// What a phase reports: center, spread and a confidence interval
+struct SampleSummary {
+    uint64_t count = 0;
+    size_t outliers = 0;     // Rejected before computing the rest
+    double mean = 0;
+    double stddev = 0;
+    double ci_low = 0;       // 95% bootstrap interval of the mean
+    double ci_high = 0;
+    double p50 = 0;
+    double p90 = 0;
+    double p99 = 0;
+
+    // Half-width of the interval relative to the mean; 1 when undefined
+    double relative_error() const;
+};
+
+// Everything above for one measured quantity: exact moments and quantiles
+// over the whole stream, plus a reservoir for outlier rejection and the
+// bootstrap. Memory is fixed regardless of how many samples arrive.
+class SampleStats {
+public:
+    explicit SampleStats(uint64_t seed = 1) : reservoir_(1024, seed) {}
+
+    void add(double x);
+    void merge(const SampleStats& other);
+
+    uint64_t count() const { return all_.count(); }
+    const RunningStats& moments() const { return all_; }
+
+    // Outliers are rejected from the reservoir; mean and interval come
+    // from what remains, quantiles from the sketch of all values.
+    SampleSummary summarize() const;
+
+    // Stopping rule: at least min_count samples and a 95% interval within
+    // +/- target of the mean (e.g. 0.05 for 5%)
+    bool precise_enough(double target, uint64_t min_count) const;
+
+private:
+    SampleSummary summarize(int resamples) const;
+
+    RunningStats all_;
+    QuantileSketch sketch_;
+    Reservoir reservoir_;
+};
+
+} // namespace speedtest
+
+#endif // STATS_H_
@@ -0,0 +1,150 @@
+#include "tcp_info.h"
+
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+
+namespace speedtest {
+
+bool read_tcp_info(int fd, TcpInfoSample* sample) {
+    tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) return false;
+
+    sample->rtt_ms = info.tcpi_rtt / 1000.0;
+    sample->rttvar_ms = info.tcpi_rttvar / 1000.0;
+    sample->cwnd = info.tcpi_snd_cwnd;
+    sample->mss = info.tcpi_snd_mss;
+    sample->total_retrans = info.tcpi_total_retrans;
+
+    // Older kernels return a shorter struct; leave missing fields at zero
+    auto has = [len](size_t offset, size_t size) { return offset + size <= len; };
+    if (has(offsetof(tcp_info, tcpi_pacing_rate), 8)) sample->pacing_rate_bps = info.tcpi_pacing_rate * 8;
+    if (has(offsetof(tcp_info, tcpi_data_segs_out), 4)) sample->segs_out = info.tcpi_data_segs_out;
+    if (has(offsetof(tcp_info, tcpi_delivery_rate), 8)) sample->delivery_rate_bps = info.tcpi_delivery_rate * 8;
+    if (has(offsetof(tcp_info, tcpi_sndbuf_limited), 8)) {
+        sample->busy_us = info.tcpi_busy_time;
+        sample->rwnd_limited_us = info.tcpi_rwnd_limited;
+        sample->sndbuf_limited_us = info.tcpi_sndbuf_limited;
+    }
+    return true;
+}
+
+TcpInfoSummary summarize_tcp_info(const std::vector<TcpInfoSample>& samples) {
+    TcpInfoSummary summary;
+    if (samples.empty()) return summary;
+
+    // Counters are cumulative, so only the newest sample per stream counts
+    std::map<int, const TcpInfoSample*> latest;
+    for (const TcpInfoSample& s : samples) {
+        summary.rtt_ms += s.rtt_ms;
+        summary.rttvar_ms += s.rttvar_ms;
+        summary.cwnd += s.cwnd;
+        summary.max_rtt_ms = std::max(summary.max_rtt_ms, s.rtt_ms);
+        const TcpInfoSample*& slot = latest[s.stream];
+        if (!slot || s.t_s >= slot->t_s) slot = &s;
+    }
+    summary.samples = static_cast<int>(samples.size());
+    summary.rtt_ms /= samples.size();
+    summary.rttvar_ms /= samples.size();
+    summary.cwnd /= samples.size();
+
+    uint64_t segs_out = 0, busy = 0, rwnd = 0, sndbuf = 0;
+    for (const auto& entry : latest) {
+        const TcpInfoSample& s = *entry.second;
+        summary.retransmits += s.total_retrans;
+        segs_out += s.segs_out;
+        summary.pacing_mbps += s.pacing_rate_bps / 1e6;
+        summary.delivery_mbps += s.delivery_rate_bps / 1e6;
+        busy += s.busy_us;
+        rwnd += s.rwnd_limited_us;
+        sndbuf += s.sndbuf_limited_us;
+    }
+    if (segs_out > 0) summary.retransmit_rate = static_cast<double>(summary.retransmits) / segs_out;
+    if (busy > 0) {
+        summary.rwnd_limited = static_cast<double>(rwnd) / busy;
+        summary.sndbuf_limited = static_cast<double>(sndbuf) / busy;
+        summary.sending = std::max(0.0, 1.0 - summary.rwnd_limited - summary.sndbuf_limited);
+    }
+    return summary;
+}
+
+std::string tcp_samples_to_json(const std::vector<TcpInfoSample>& samples) {
+    JsonWriter json(samples.size() * 256 + 2);
+    write_tcp_samples(samples, &json);
+    return json.take();
+}
+
+void write_tcp_samples(const std::vector<TcpInfoSample>& samples, JsonWriter* json) {
+    json->begin_array();
+    for (const TcpInfoSample& s : samples) {
+        json->begin_object()
+            .field("t", s.t_s)
+            .field("stream", s.stream)
+            .field("rtt_ms", s.rtt_ms)
+            .field("rttvar_ms", s.rttvar_ms)
+            .field("cwnd", s.cwnd)
+            .field("mss", s.mss)
+            .field("retrans", s.total_retrans)
+            .field("segs_out", s.segs_out)
+            .field("pacing_bps", s.pacing_rate_bps)
+            .field("delivery_bps", s.delivery_rate_bps)
+            .field("busy_us", s.busy_us)
+            .field("rwnd_limited_us", s.rwnd_limited_us)
+            .field("sndbuf_limited_us", s.sndbuf_limited_us)
+            .end_object();
+    }
+    json->end_array();
+}
+
+bool tcp_samples_from_json(const std::string& json, std::vector<TcpInfoSample>* samples) {
+    // Flat objects of "key":number pairs, as written above
+    const char* p = json.c_str();
+    const char* end = p + json.size();
+    TcpInfoSample current;
+    bool in_object = false;
+
+    while (p < end) {
+        if (*p == '{') {
+            current = TcpInfoSample();
+            in_object = true;
+            ++p;
+        } else if (*p == '}') {
+            if (in_object) samples->push_back(current);
+            in_object = false;
+            ++p;
+        } else if (*p == '"' && in_object) {
+            const char* key_end = static_cast<const char*>(memchr(p + 1, '"', end - p - 1));
+            if (!key_end || key_end + 1 >= end || key_end[1] != ':') return false;
+            std::string key(p + 1, key_end);
+            char* num_end = nullptr;
+            double value = std::strtod(key_end + 2, &num_end);
+            if (num_end == key_end + 2) return false;
+            p = num_end;
+
+            if (key == "t") current.t_s = value;
+            else if (key == "stream") current.stream = static_cast<int>(value);
+            else if (key == "rtt_ms") current.rtt_ms = value;
+            else if (key == "rttvar_ms") current.rttvar_ms = value;
+            else if (key == "cwnd") current.cwnd = static_cast<uint32_t>(value);
+            else if (key == "mss") current.mss = static_cast<uint32_t>(value);
+            else if (key == "retrans") current.total_retrans = static_cast<uint32_t>(value);
+            else if (key == "segs_out") current.segs_out = static_cast<uint32_t>(value);
+            else if (key == "pacing_bps") current.pacing_rate_bps = static_cast<uint64_t>(value);
+            else if (key == "delivery_bps") current.delivery_rate_bps = static_cast<uint64_t>(value);
+            else if (key == "busy_us") current.busy_us = static_cast<uint64_t>(value);
+            else if (key == "rwnd_limited_us") current.rwnd_limited_us = static_cast<uint64_t>(value);
+            else if (key == "sndbuf_limited_us") current.sndbuf_limited_us = static_cast<uint64_t>(value);
+        } else {
+            ++p;
+        }
+    }
+    return !in_object;
+}
+
+} // namespace speedtest
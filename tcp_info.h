@@ -0,0 +1,61 @@
+#ifndef TCP_INFO_H_
+#define TCP_INFO_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "json_writer.h"
+
+namespace speedtest {
+
+// One getsockopt(TCP_INFO) reading of a test stream
+struct TcpInfoSample {
+    double t_s = 0;                  // Seconds since the phase started
+    int stream = 0;
+    double rtt_ms = 0;
+    double rttvar_ms = 0;
+    uint32_t cwnd = 0;               // Segments
+    uint32_t mss = 0;
+    uint32_t total_retrans = 0;      // Retransmitted segments so far
+    uint32_t segs_out = 0;           // Data segments sent so far
+    uint64_t pacing_rate_bps = 0;
+    uint64_t delivery_rate_bps = 0;
+    uint64_t busy_us = 0;            // Time with data in flight
+    uint64_t rwnd_limited_us = 0;    // ... stalled on the receive window
+    uint64_t sndbuf_limited_us = 0;  // ... stalled on the send buffer
+};
+
+// Per-phase digest of a set of samples
+struct TcpInfoSummary {
+    int samples = 0;
+    double rtt_ms = 0;               // Mean smoothed RTT
+    double rttvar_ms = 0;
+    double max_rtt_ms = 0;
+    double cwnd = 0;                 // Mean congestion window, segments
+    uint32_t retransmits = 0;
+    double retransmit_rate = 0;      // Retransmitted / sent segments
+    double pacing_mbps = 0;          // Sum over streams of the latest rate
+    double delivery_mbps = 0;
+    // Share of busy time stalled on the receive window or the send buffer,
+    // and the rest: sending, as fast as the congestion window, pacing
+    // (fair-share pacing included) or the link allowed. The kernel counts
+    // no time against those separately.
+    double rwnd_limited = 0;
+    double sndbuf_limited = 0;
+    double sending = 0;
+};
+
+// Read TCP_INFO for fd; false if the socket isn't TCP or the call fails
+bool read_tcp_info(int fd, TcpInfoSample* sample);
+
+TcpInfoSummary summarize_tcp_info(const std::vector<TcpInfoSample>& samples);
+
+// JSON array form used by /api/samples, alone or as part of a document
+std::string tcp_samples_to_json(const std::vector<TcpInfoSample>& samples);
+void write_tcp_samples(const std::vector<TcpInfoSample>& samples, JsonWriter* json);
+bool tcp_samples_from_json(const std::string& json, std::vector<TcpInfoSample>* samples);
+
+} // namespace speedtest
+
+#endif // TCP_INFO_H_
@@ -0,0 +1,434 @@
+#include "test_trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+
+namespace speedtest {
+
+namespace {
+
+const char kMagic[8] = {'S', 'P', 'D', 'T', 'R', 'C', '1', '\n'};
+// The writer wakes this often, or sooner when this many events queue up;
+// the queue holds several wake-ups' worth
+const auto kFlushInterval = std::chrono::milliseconds(100);
+const size_t kFlushEvents = 4096;
+const size_t kQueueEvents = 8 * kFlushEvents;
+
+int64_t to_us(double seconds) {
+    return std::llround(seconds * 1e6);
+}
+
+void put_varint(std::string* out, uint64_t v) {
+    while (v >= 0x80) {
+        out->push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    out->push_back(static_cast<char>(v));
+}
+
+void put_signed(std::string* out, int64_t v) {
+    put_varint(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+}
+
+void put_string(std::string* out, const std::string& s) {
+    put_varint(out, s.size());
+    out->append(s);
+}
+
+// TCP_INFO in integers, in wire order
+std::vector<int64_t> tcp_fields(const TcpInfoSample& s) {
+    return {to_us(s.rtt_ms / 1000),
+            to_us(s.rttvar_ms / 1000),
+            s.cwnd,
+            s.mss,
+            s.total_retrans,
+            s.segs_out,
+            static_cast<int64_t>(s.pacing_rate_bps),
+            static_cast<int64_t>(s.delivery_rate_bps),
+            static_cast<int64_t>(s.busy_us),
+            static_cast<int64_t>(s.rwnd_limited_us),
+            static_cast<int64_t>(s.sndbuf_limited_us)};
+}
+
+void set_tcp_fields(const std::vector<int64_t>& f, TcpInfoSample* s) {
+    s->rtt_ms = f[0] / 1000.0;
+    s->rttvar_ms = f[1] / 1000.0;
+    s->cwnd = static_cast<uint32_t>(f[2]);
+    s->mss = static_cast<uint32_t>(f[3]);
+    s->total_retrans = static_cast<uint32_t>(f[4]);
+    s->segs_out = static_cast<uint32_t>(f[5]);
+    s->pacing_rate_bps = static_cast<uint64_t>(f[6]);
+    s->delivery_rate_bps = static_cast<uint64_t>(f[7]);
+    s->busy_us = static_cast<uint64_t>(f[8]);
+    s->rwnd_limited_us = static_cast<uint64_t>(f[9]);
+    s->sndbuf_limited_us = static_cast<uint64_t>(f[10]);
+}
+
+// Bounds-checked reads over the file contents; every getter fails once
+// the data runs out
+class Decoder {
+public:
+    explicit Decoder(const std::string& data) : data_(data) {}
+
+    bool done() const { return pos_ >= data_.size(); }
+    size_t pos() const { return pos_; }
+
+    bool byte(uint8_t* v) {
+        if (pos_ >= data_.size()) return false;
+        *v = static_cast<uint8_t>(data_[pos_++]);
+        return true;
+    }
+
+    bool varint(uint64_t* v) {
+        *v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t b;
+            if (!byte(&b)) return false;
+            *v |= static_cast<uint64_t>(b & 0x7f) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+
+    bool signed_varint(int64_t* v) {
+        uint64_t u;
+        if (!varint(&u)) return false;
+        *v = static_cast<int64_t>(u >> 1) ^ -static_cast<int64_t>(u & 1);
+        return true;
+    }
+
+    bool string(std::string* s) {
+        uint64_t len;
+        if (!varint(&len) || len > data_.size() - pos_) return false;
+        s->assign(data_, pos_, len);
+        pos_ += len;
+        return true;
+    }
+
+private:
+    const std::string& data_;
+    size_t pos_ = 0;
+};
+
+} // namespace
+
+TraceRecorder::TraceRecorder() : pending_(kQueueEvents) {}
+
+TraceRecorder::~TraceRecorder() {
+    close();
+}
+
+bool TraceRecorder::open(const std::string& path, std::string* error) {
+    file_ = fopen(path.c_str(), "wb");
+    if (!file_) {
+        if (error) *error = path + ": " + strerror(errno);
+        return false;
+    }
+    fwrite(kMagic, 1, sizeof(kMagic), file_);
+    bytes_written_ = sizeof(kMagic);
+    epoch_ = std::chrono::steady_clock::now();
+    writer_ = std::thread(&TraceRecorder::writer_loop, this);
+    accepting_ = true;
+    return true;
+}
+
+void TraceRecorder::close() {
+    if (!writer_.joinable()) return;
+    accepting_ = false;
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+    fclose(file_);
+    file_ = nullptr;
+}
+
+int64_t TraceRecorder::now_us() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch_)
+        .count();
+}
+
+void TraceRecorder::push(TraceEvent event) {
+    if (!accepting_.load(std::memory_order_relaxed)) return;
+    if (!pending_.try_push(std::move(event))) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // A wake-up lost to the writer not waiting yet only delays it to the
+    // next interval
+    if (pending_.size() >= kFlushEvents) wake_.notify_one();
+}
+
+void TraceRecorder::meta(const std::string& key, const std::string& value) {
+    TraceEvent e;
+    e.type = TraceEvent::kMeta;
+    e.t_us = now_us();
+    e.key = key;
+    e.text = value;
+    push(std::move(e));
+}
+
+void TraceRecorder::test_begin(const std::string& tuning_query) {
+    TraceEvent e;
+    e.type = TraceEvent::kTestBegin;
+    e.t_us = now_us();
+    e.text = tuning_query;
+    push(std::move(e));
+}
+
+void TraceRecorder::ping(double rtt_ms) {
+    TraceEvent e;
+    e.type = TraceEvent::kPing;
+    e.t_us = now_us();
+    e.value = static_cast<uint64_t>(std::max<int64_t>(0, to_us(rtt_ms / 1000)));
+    push(std::move(e));
+}
+
+void TraceRecorder::phase_begin(bool download, int streams) {
+    TraceEvent e;
+    e.type = TraceEvent::kPhaseBegin;
+    e.t_us = now_us();
+    e.flag = download;
+    e.value = static_cast<uint64_t>(streams);
+    push(std::move(e));
+}
+
+void TraceRecorder::bytes(double t_s, int stream, uint64_t n) {
+    TraceEvent e;
+    e.type = TraceEvent::kBytes;
+    e.t_us = to_us(t_s);
+    e.stream = stream;
+    e.value = n;
+    push(std::move(e));
+}
+
+void TraceRecorder::tcp_info(bool remote, const TcpInfoSample& sample) {
+    TraceEvent e;
+    e.type = TraceEvent::kTcpInfo;
+    e.t_us = to_us(sample.t_s);
+    e.flag = remote;
+    e.stream = sample.stream;
+    e.tcp = sample;
+    push(std::move(e));
+}
+
+void TraceRecorder::phase_end(double t_s, int retry_after_s) {
+    TraceEvent e;
+    e.type = TraceEvent::kPhaseEnd;
+    e.t_us = to_us(t_s);
+    e.value = static_cast<uint64_t>(std::max(0, retry_after_s));
+    push(std::move(e));
+}
+
+void TraceRecorder::received(double t_s, double mbps) {
+    TraceEvent e;
+    e.type = TraceEvent::kReceived;
+    e.t_us = to_us(t_s);
+    e.value = static_cast<uint64_t>(std::llround(std::max(0.0, mbps) * 1e6));
+    push(std::move(e));
+}
+
+void TraceRecorder::writer_loop() {
+    std::string out;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            wake_.wait_for(lock, kFlushInterval, [this] { return stopping_ || pending_.size() >= kFlushEvents; });
+        }
+        // Read before draining, so everything pushed before close() is in
+        // the last batch
+        bool stopping = stopping_;
+
+        out.clear();
+        pending_.drain([&](TraceEvent&& e) { encode(e, &out); });
+        if (!out.empty()) {
+            fwrite(out.data(), 1, out.size(), file_);
+            fflush(file_);
+            bytes_written_ += out.size();
+        }
+        if (stopping) return;
+    }
+}
+
+void TraceRecorder::encode(const TraceEvent& e, std::string* out) {
+    out->push_back(static_cast<char>(e.type));
+    put_signed(out, e.t_us - last_t_us_);
+    last_t_us_ = e.t_us;
+
+    switch (e.type) {
+    case TraceEvent::kMeta:
+        put_string(out, e.key);
+        put_string(out, e.text);
+        break;
+    case TraceEvent::kTestBegin:
+        put_string(out, e.text);
+        break;
+    case TraceEvent::kPing:
+    case TraceEvent::kPhaseEnd:
+    case TraceEvent::kReceived:
+        put_varint(out, e.value);
+        break;
+    case TraceEvent::kPhaseBegin:
+        out->push_back(e.flag ? 1 : 0);
+        put_varint(out, e.value);
+        last_tcp_.clear();
+        break;
+    case TraceEvent::kBytes:
+        put_varint(out, static_cast<uint64_t>(e.stream));
+        put_varint(out, e.value);
+        break;
+    case TraceEvent::kTcpInfo: {
+        out->push_back(e.flag ? 1 : 0);
+        put_varint(out, static_cast<uint64_t>(e.stream));
+        std::vector<int64_t> now = tcp_fields(e.tcp);
+        std::vector<int64_t> before = tcp_fields(last_tcp_[{e.flag, e.stream}]);
+        for (size_t i = 0; i < now.size(); ++i) put_signed(out, now[i] - before[i]);
+        last_tcp_[{e.flag, e.stream}] = e.tcp;
+        break;
+    }
+    }
+}
+
+bool read_trace_events(const std::string& path, std::vector<TraceEvent>* events, std::string* error) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        if (error) *error = path + ": " + strerror(errno);
+        return false;
+    }
+    std::string data;
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) data.append(buffer, n);
+    fclose(file);
+
+    if (data.size() < sizeof(kMagic) || data.compare(0, sizeof(kMagic), kMagic, sizeof(kMagic)) != 0) {
+        if (error) *error = path + ": not a speed test recording";
+        return false;
+    }
+
+    Decoder in(data);
+    uint8_t skip;
+    for (size_t i = 0; i < sizeof(kMagic); ++i) in.byte(&skip);
+
+    int64_t t_us = 0;
+    std::map<std::pair<bool, int>, std::vector<int64_t>> last_tcp;
+    while (!in.done()) {
+        size_t start = in.pos();
+        TraceEvent e;
+        uint8_t type, flag = 0;
+        int64_t dt = 0;
+        uint64_t stream = 0;
+        bool ok = in.byte(&type) && in.signed_varint(&dt);
+        if (ok && (type < TraceEvent::kMeta || type > TraceEvent::kReceived)) {
+            if (error) *error = path + ": bad record type at offset " + std::to_string(start);
+            return false;
+        }
+        e.type = static_cast<TraceEvent::Type>(type);
+
+        switch (e.type) {
+        case TraceEvent::kMeta:
+            ok = ok && in.string(&e.key) && in.string(&e.text);
+            break;
+        case TraceEvent::kTestBegin:
+            ok = ok && in.string(&e.text);
+            break;
+        case TraceEvent::kPing:
+        case TraceEvent::kPhaseEnd:
+        case TraceEvent::kReceived:
+            ok = ok && in.varint(&e.value);
+            break;
+        case TraceEvent::kPhaseBegin:
+            ok = ok && in.byte(&flag) && in.varint(&e.value);
+            break;
+        case TraceEvent::kBytes:
+            ok = ok && in.varint(&stream) && in.varint(&e.value);
+            break;
+        case TraceEvent::kTcpInfo: {
+            ok = ok && in.byte(&flag) && in.varint(&stream);
+            std::vector<int64_t>& fields = last_tcp[{flag != 0, static_cast<int>(stream)}];
+            fields.resize(tcp_fields(TcpInfoSample()).size());
+            std::vector<int64_t> next = fields;
+            for (int64_t& f : next) {
+                int64_t delta = 0;
+                ok = ok && in.signed_varint(&delta);
+                f += delta;
+            }
+            if (ok) {
+                fields = next;
+                set_tcp_fields(fields, &e.tcp);
+            }
+            break;
+        }
+        }
+        // Only the last record can be cut short by a crash
+        if (!ok) break;
+
+        t_us += dt;
+        e.t_us = t_us;
+        e.flag = flag != 0;
+        e.stream = static_cast<int>(stream);
+        if (e.type == TraceEvent::kTcpInfo) {
+            e.tcp.t_s = t_us / 1e6;
+            e.tcp.stream = e.stream;
+        }
+        if (e.type == TraceEvent::kPhaseBegin) last_tcp.clear();
+        events->push_back(std::move(e));
+    }
+    return true;
+}
+
+bool load_test_trace(const std::string& path, TestTrace* trace, std::string* error) {
+    std::vector<TraceEvent> events;
+    if (!read_trace_events(path, &events, error)) return false;
+
+    // Recordings made outside run_full_test still replay as one test
+    auto test = [trace]() -> RecordedTest& {
+        if (trace->tests.empty()) trace->tests.emplace_back();
+        return trace->tests.back();
+    };
+    auto phase = [&]() -> RecordedPhase& {
+        RecordedTest& t = test();
+        if (t.phases.empty()) t.phases.emplace_back();
+        return t.phases.back();
+    };
+
+    for (const TraceEvent& e : events) {
+        switch (e.type) {
+        case TraceEvent::kMeta:
+            trace->meta[e.key] = e.text;
+            break;
+        case TraceEvent::kTestBegin:
+            trace->tests.emplace_back();
+            trace->tests.back().tuning = e.text;
+            break;
+        case TraceEvent::kPing:
+            test().pings_ms.push_back(e.value / 1000.0);
+            break;
+        case TraceEvent::kPhaseBegin:
+            test().phases.emplace_back();
+            phase().download = e.flag;
+            phase().streams = static_cast<int>(e.value);
+            break;
+        case TraceEvent::kBytes:
+            phase().bytes.push_back({e.t_us / 1e6, e.stream, e.value});
+            break;
+        case TraceEvent::kTcpInfo:
+            (e.flag ? phase().remote_tcp : phase().local_tcp).push_back(e.tcp);
+            break;
+        case TraceEvent::kPhaseEnd:
+            phase().seconds = e.t_us / 1e6;
+            phase().retry_after_s = static_cast<int>(e.value);
+            break;
+        case TraceEvent::kReceived:
+            phase().received_mbps = e.value / 1e6;
+            break;
+        }
+    }
+    return true;
+}
+
+} // namespace speedtest
@@ -0,0 +1,143 @@
+#ifndef TEST_TRACE_H_
+#define TEST_TRACE_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "sample_queue.h"
+#include "tcp_info.h"
+
+namespace speedtest {
+
+// Recordings of live tests, for replaying a problematic run offline.
+//
+// The file is an 8-byte magic followed by records that are only ever
+// appended: a type byte, the zigzag varint difference between this
+// record's timestamp and the previous one's in microseconds, then a
+// type-specific payload of varints. TCP_INFO fields are stored as
+// differences from the previous sample of the same stream. A run that
+// dies mid-write loses at most its last record.
+struct TraceEvent {
+    enum Type : uint8_t {
+        kMeta = 1,        // key, text
+        kTestBegin = 2,   // text = tuning query
+        kPing = 3,        // value = RTT in microseconds
+        kPhaseBegin = 4,  // flag = download, value = streams
+        kBytes = 5,       // stream, value = bytes moved since the last one
+        kTcpInfo = 6,     // flag = server side, tcp
+        kPhaseEnd = 7,    // value = Retry-After seconds when refused
+        kReceived = 8,    // value = bits/s the server received, uploads it timed
+    };
+
+    Type type = kMeta;
+    int64_t t_us = 0;   // Phase time for kBytes, kTcpInfo and kPhaseEnd, else recording time
+    bool flag = false;
+    int stream = 0;
+    uint64_t value = 0;
+    std::string key;
+    std::string text;
+    TcpInfoSample tcp;
+};
+
+// Appends events from the test thread; a background thread encodes and
+// writes them so a slow disk never stalls the measurement. Events travel
+// through a lock-free queue: if the disk falls so far behind that it
+// fills, events are dropped and counted rather than the test waiting.
+// All methods are safe to call from any thread.
+class TraceRecorder {
+public:
+    TraceRecorder();
+    ~TraceRecorder();
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+    bool open(const std::string& path, std::string* error);
+    // Writes everything queued so far, then stops the writer
+    void close();
+
+    void meta(const std::string& key, const std::string& value);
+    void test_begin(const std::string& tuning_query);
+    void ping(double rtt_ms);
+    void phase_begin(bool download, int streams);
+    // t_s is the phase clock, as seen by RateSampler
+    void bytes(double t_s, int stream, uint64_t n);
+    void tcp_info(bool remote, const TcpInfoSample& sample);
+    void phase_end(double t_s, int retry_after_s);
+    // What the far end received, when that is the phase's rate
+    void received(double t_s, double mbps);
+
+    uint64_t bytes_written() const { return bytes_written_.load(std::memory_order_relaxed); }
+    // Events lost to a full queue; a replay of such a recording is off
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    void push(TraceEvent event);
+    int64_t now_us() const;
+    void writer_loop();
+    void encode(const TraceEvent& event, std::string* out);
+
+    std::chrono::steady_clock::time_point epoch_;
+    FILE* file_ = nullptr;
+    std::thread writer_;
+
+    MpscQueue<TraceEvent> pending_;
+    std::atomic<bool> accepting_{false};
+    std::atomic<bool> stopping_{false};
+    std::atomic<uint64_t> bytes_written_{0};
+    std::atomic<uint64_t> dropped_{0};
+    // Only for the writer to sleep on; producers notify without it
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+
+    // Encoder state, owned by the writer thread
+    int64_t last_t_us_ = 0;
+    std::map<std::pair<bool, int>, TcpInfoSample> last_tcp_;
+};
+
+// Decode a recording. A truncated final record is dropped silently;
+// anything else malformed is an error.
+bool read_trace_events(const std::string& path, std::vector<TraceEvent>* events, std::string* error);
+
+// A recording regrouped for replay
+struct RecordedPhase {
+    bool download = true;
+    int streams = 0;
+    double seconds = 0;
+    int retry_after_s = 0;
+    double received_mbps = 0;  // The server's count, which replaces ours
+    // (phase time, stream, bytes) in arrival order
+    struct Bytes {
+        double t_s;
+        int stream;
+        uint64_t n;
+    };
+    std::vector<Bytes> bytes;
+    std::vector<TcpInfoSample> local_tcp;
+    std::vector<TcpInfoSample> remote_tcp;
+};
+
+struct RecordedTest {
+    std::string tuning;  // TuningProfile::to_query() form
+    std::vector<double> pings_ms;
+    std::vector<RecordedPhase> phases;
+};
+
+struct TestTrace {
+    std::map<std::string, std::string> meta;
+    std::vector<RecordedTest> tests;
+};
+
+bool load_test_trace(const std::string& path, TestTrace* trace, std::string* error);
+
+} // namespace speedtest
+
+#endif // TEST_TRACE_H_
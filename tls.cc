@@ -0,0 +1,437 @@
+#include "tls.h"
+
+#include <arpa/inet.h>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+namespace speedtest {
+
+namespace {
+
+// TLS 1.3 cipher suite ids, as SSL_CIPHER_get_protocol_id() reports them
+const uint16_t kAes128GcmSha256 = 0x1301;
+const uint16_t kAes256GcmSha384 = 0x1302;
+const uint16_t kChacha20Poly1305Sha256 = 0x1303;
+
+// The library's most recent error, with `what` in front
+std::string ssl_error(const std::string& what) {
+    unsigned long code = ERR_get_error();
+    ERR_clear_error();
+    if (code == 0) return what;
+    char text[256];
+    ERR_error_string_n(code, text, sizeof(text));
+    return what + ": " + text;
+}
+
+EVP_PKEY* generate_key() {
+    EVP_PKEY* key = nullptr;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    if (ctx && EVP_PKEY_keygen_init(ctx) > 0 &&
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) > 0) {
+        EVP_PKEY_keygen(ctx, &key);
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+}
+
+// P-256 key and a certificate for CN=speed_test valid for 30 days
+bool use_self_signed(SSL_CTX* ctx, std::string* error) {
+    EVP_PKEY* key = generate_key();
+    X509* cert = X509_new();
+    bool ok = key && cert;
+    if (ok) {
+        uint32_t serial = 0;
+        RAND_bytes(reinterpret_cast<unsigned char*>(&serial), sizeof(serial));
+        X509_set_version(cert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), serial >> 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 30 * 86400);
+        X509_set_pubkey(cert, key);
+        X509_NAME* name = X509_get_subject_name(cert);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                   reinterpret_cast<const unsigned char*>("speed_test"), -1, -1, 0);
+        X509_set_issuer_name(cert, name);
+        ok = X509_sign(cert, key, EVP_sha256()) > 0 && SSL_CTX_use_certificate(ctx, cert) == 1 &&
+             SSL_CTX_use_PrivateKey(ctx, key) == 1;
+    }
+    if (!ok) *error = ssl_error("self-signed certificate");
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+SSL_CTX* new_context(bool server, std::string* error) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_method());
+    if (!ctx) {
+        *error = ssl_error("SSL_CTX_new");
+        return nullptr;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, TLS1_3_VERSION);
+#ifndef OPENSSL_IS_BORINGSSL
+    // AES-GCM first: every kernel with kTLS has it, and it has AES-NI
+    SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+#endif
+    if (server) {
+        // A ticket sent after the handshake would use up record numbers
+        // behind the kernel's back
+        SSL_CTX_set_num_tickets(ctx, 0);
+    }
+    return ctx;
+}
+
+int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// HKDF-Expand-Label(secret, label, "", length) from RFC 8446 7.1. Keys
+// and IVs are never longer than the hash, so one HMAC block covers them.
+std::string expand_label(const EVP_MD* md, const std::string& secret, const std::string& label, size_t length) {
+    std::string full = "tls13 " + label;
+    std::string info;
+    info += static_cast<char>(length >> 8);
+    info += static_cast<char>(length & 0xff);
+    info += static_cast<char>(full.size());
+    info += full;
+    info += '\0';  // Empty context
+    info += '\1';  // HKDF-Expand block counter
+    unsigned char out[EVP_MAX_MD_SIZE];
+    unsigned int out_len = 0;
+    if (!HMAC(md, secret.data(), static_cast<int>(secret.size()), reinterpret_cast<const unsigned char*>(info.data()),
+              info.size(), out, &out_len) || out_len < length) {
+        return "";
+    }
+    return std::string(reinterpret_cast<const char*>(out), length);
+}
+
+// Record sequence numbers start at zero: the handshake used its own keys
+// and no ticket or key update has gone out under these
+template <typename Info>
+void fill_crypto_info(Info* info, unsigned cipher, const std::string& key, const std::string& iv) {
+    std::memset(info, 0, sizeof(*info));
+    info->info.version = TLS_1_3_VERSION;
+    info->info.cipher_type = cipher;
+    std::memcpy(info->key, key.data(), sizeof(info->key));
+    // The 12-byte TLS 1.3 IV is split into the kernel's salt and iv
+    std::memcpy(info->salt, iv.data(), sizeof(info->salt));
+    std::memcpy(info->iv, iv.data() + sizeof(info->salt), sizeof(info->iv));
+}
+
+bool send_all(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+} // namespace
+
+std::shared_ptr<TlsContext> TlsContext::server(const std::string& cert_path, const std::string& key_path,
+                                               std::string* error) {
+    SSL_CTX* ctx = new_context(true, error);
+    if (!ctx) return nullptr;
+    std::shared_ptr<TlsContext> context(new TlsContext(ctx, true, false));
+    if (cert_path.empty() && key_path.empty()) {
+        if (!use_self_signed(ctx, error)) return nullptr;
+    } else if (SSL_CTX_use_certificate_chain_file(ctx, cert_path.c_str()) != 1) {
+        *error = ssl_error(cert_path);
+        return nullptr;
+    } else if (SSL_CTX_use_PrivateKey_file(ctx, (key_path.empty() ? cert_path : key_path).c_str(),
+                                           SSL_FILETYPE_PEM) != 1 ||
+               SSL_CTX_check_private_key(ctx) != 1) {
+        *error = ssl_error(key_path.empty() ? cert_path : key_path);
+        return nullptr;
+    }
+    SSL_CTX_set_keylog_callback(ctx, &TlsStream::on_keylog);
+    return context;
+}
+
+std::shared_ptr<TlsContext> TlsContext::client(bool verify, std::string* error) {
+    SSL_CTX* ctx = new_context(false, error);
+    if (!ctx) return nullptr;
+    std::shared_ptr<TlsContext> context(new TlsContext(ctx, false, verify));
+    if (verify) {
+        if (SSL_CTX_set_default_verify_paths(ctx) != 1) {
+            *error = ssl_error("system certificates");
+            return nullptr;
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    }
+    SSL_CTX_set_keylog_callback(ctx, &TlsStream::on_keylog);
+    return context;
+}
+
+TlsContext::~TlsContext() {
+    SSL_CTX_free(ctx_);
+}
+
+TlsStream::TlsStream(std::shared_ptr<TlsContext> context, int fd, const std::string& host)
+    : context_(std::move(context)), fd_(fd) {
+    ssl_ = SSL_new(context_->get());
+    in_ = BIO_new(BIO_s_mem());
+    out_ = BIO_new(BIO_s_mem());
+    if (!ssl_ || !in_ || !out_) {
+        failed_ = true;
+        error_ = ssl_error("SSL_new");
+        BIO_free(in_);
+        BIO_free(out_);
+        in_ = out_ = nullptr;
+        return;
+    }
+    // A drained input BIO means "wait for more", not end of stream
+    BIO_set_mem_eof_return(in_, -1);
+    SSL_set_bio(ssl_, in_, out_);
+    SSL_set_app_data(ssl_, this);
+    if (context_->is_server()) {
+        SSL_set_accept_state(ssl_);
+        return;
+    }
+    SSL_set_connect_state(ssl_);
+    in6_addr literal;
+    bool is_address = inet_pton(AF_INET, host.c_str(), &literal) == 1 ||
+                      inet_pton(AF_INET6, host.c_str(), &literal) == 1;
+    if (!host.empty() && !is_address) SSL_set_tlsext_host_name(ssl_, host.c_str());
+    if (context_->verify() && !host.empty()) {
+        X509_VERIFY_PARAM* param = SSL_get0_param(ssl_);
+        if (is_address) X509_VERIFY_PARAM_set1_ip_asc(param, host.c_str());
+        else X509_VERIFY_PARAM_set1_host(param, host.c_str(), host.size());
+    }
+}
+
+TlsStream::~TlsStream() {
+    // Frees both BIOs too
+    SSL_free(ssl_);
+}
+
+void TlsStream::on_keylog(const SSL* ssl, const char* line) {
+    TlsStream* stream = static_cast<TlsStream*>(SSL_get_app_data(ssl));
+    if (!stream) return;
+    // "<LABEL> <client random> <secret>", all hex but the label
+    const char* label = stream->context_->is_server() ? "SERVER_TRAFFIC_SECRET_0 " : "CLIENT_TRAFFIC_SECRET_0 ";
+    size_t label_len = strlen(label);
+    if (strncmp(line, label, label_len) != 0) return;
+    const char* hex = strchr(line + label_len, ' ');
+    if (!hex) return;
+    std::string secret;
+    for (++hex; hex[0] && hex[1]; hex += 2) {
+        int high = hex_digit(hex[0]), low = hex_digit(hex[1]);
+        if (high < 0 || low < 0) return;
+        secret += static_cast<char>(high << 4 | low);
+    }
+    stream->tx_secret_ = secret;
+}
+
+void TlsStream::advance_handshake() {
+    ERR_clear_error();
+    int ret = SSL_do_handshake(ssl_);
+    if (ret == 1) {
+        handshake_done_ = true;
+        return;
+    }
+    int err = SSL_get_error(ssl_, ret);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+        failed_ = true;
+        error_ = ssl_error("TLS handshake");
+    }
+}
+
+bool TlsStream::receive(const char* data, size_t len, std::string* plain) {
+    if (failed_) return false;
+    if (len > 0) BIO_write(in_, data, static_cast<int>(len));
+    if (!handshake_done_) {
+        advance_handshake();
+        if (!handshake_done_) return !failed_;
+    }
+
+    // Decrypt straight into the caller's buffer
+    const size_t kReadSize = 16 << 10;
+    for (;;) {
+        size_t old_size = plain->size();
+        plain->resize(old_size + kReadSize);
+        ERR_clear_error();
+        int n = SSL_read(ssl_, &(*plain)[old_size], static_cast<int>(kReadSize));
+        plain->resize(old_size + std::max(n, 0));
+        if (n > 0) continue;
+        int err = SSL_get_error(ssl_, n);
+        if (err == SSL_ERROR_WANT_READ) break;
+        failed_ = true;
+        error_ = err == SSL_ERROR_ZERO_RETURN ? "closed by peer" : ssl_error("TLS read");
+        break;
+    }
+    // With kTLS transmit on, records the library wants to send (such as
+    // a key update reply) can't go out: the kernel owns the sequence
+    if (ktls_tx_ && BIO_ctrl_pending(out_) > 0) {
+        std::string dropped;
+        take_output(&dropped);
+    }
+    return !failed_;
+}
+
+bool TlsStream::has_output() const {
+    return out_ && BIO_ctrl_pending(out_) > 0;
+}
+
+void TlsStream::take_output(std::string* out) {
+    size_t pending = out_ ? BIO_ctrl_pending(out_) : 0;
+    if (pending == 0) return;
+    size_t old_size = out->size();
+    out->resize(old_size + pending);
+    int n = BIO_read(out_, &(*out)[old_size], static_cast<int>(pending));
+    out->resize(old_size + std::max(n, 0));
+}
+
+bool TlsStream::seal(const char* data, size_t len, std::string* out) {
+    if (ktls_tx_) return false;
+    // Records numbered here can't be continued by the kernel
+    ktls_tried_ = true;
+    while (len > 0 && !failed_) {
+        ERR_clear_error();
+        int n = SSL_write(ssl_, data, static_cast<int>(std::min<size_t>(len, INT_MAX)));
+        if (n <= 0) {
+            failed_ = true;
+            error_ = ssl_error("TLS write");
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+    take_output(out);
+    return true;
+}
+
+bool TlsStream::enable_ktls_tx() {
+    if (ktls_tried_) return ktls_tx_;
+    ktls_tried_ = true;
+    if (!handshake_done_ || failed_) return false;
+    if (!context_->ktls()) {
+        error_ = "turned off";
+        return false;
+    }
+    if (tx_secret_.empty()) {
+        error_ = "traffic secret not available";
+        return false;
+    }
+
+    const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl_);
+    uint16_t suite = cipher ? SSL_CIPHER_get_protocol_id(cipher) : 0;
+    const EVP_MD* md = suite == kAes256GcmSha384 ? EVP_sha384() : EVP_sha256();
+    union {
+        tls12_crypto_info_aes_gcm_128 aes128;
+        tls12_crypto_info_aes_gcm_256 aes256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+        tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+    } info;
+    socklen_t info_len = 0;
+    std::string iv = expand_label(md, tx_secret_, "iv", 12);
+    if (suite == kAes128GcmSha256) {
+        fill_crypto_info(&info.aes128, TLS_CIPHER_AES_GCM_128, expand_label(md, tx_secret_, "key", 16), iv);
+        info_len = sizeof(info.aes128);
+    } else if (suite == kAes256GcmSha384) {
+        fill_crypto_info(&info.aes256, TLS_CIPHER_AES_GCM_256, expand_label(md, tx_secret_, "key", 32), iv);
+        info_len = sizeof(info.aes256);
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    } else if (suite == kChacha20Poly1305Sha256) {
+        // No salt here; the whole IV goes in
+        std::string key = expand_label(md, tx_secret_, "key", 32);
+        std::memset(&info.chacha, 0, sizeof(info.chacha));
+        info.chacha.info.version = TLS_1_3_VERSION;
+        info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        std::memcpy(info.chacha.key, key.data(), sizeof(info.chacha.key));
+        std::memcpy(info.chacha.iv, iv.data(), sizeof(info.chacha.iv));
+        info_len = sizeof(info.chacha);
+#endif
+    }
+    tx_secret_.assign(tx_secret_.size(), '\0');
+    if (info_len == 0 || iv.empty()) {
+        error_ = "cipher suite not supported";
+        return false;
+    }
+
+    // Without the TLS_TX step the ULP passes writes through untouched, so
+    // a failure there still leaves a working userspace connection
+    if (setsockopt(fd_, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+        error_ = std::string("TCP_ULP: ") + strerror(errno);
+    } else if (setsockopt(fd_, SOL_TLS, TLS_TX, &info, info_len) != 0) {
+        error_ = std::string("TLS_TX: ") + strerror(errno);
+    } else {
+        ktls_tx_ = true;
+    }
+    std::memset(&info, 0, sizeof(info));
+    return ktls_tx_;
+}
+
+bool TlsStream::handshake_blocking(int timeout_ms, std::string* error) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    advance_handshake();
+    for (;;) {
+        std::string out;
+        take_output(&out);
+        if (!out.empty() && !send_all(fd_, out)) {
+            *error = std::string("TLS handshake: ") + strerror(errno);
+            return false;
+        }
+        if (failed_) {
+            *error = error_;
+            return false;
+        }
+        if (handshake_done_) return true;
+
+        int left = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count());
+        pollfd p{fd_, POLLIN, 0};
+        if (left <= 0 || poll(&p, 1, left) <= 0) {
+            *error = "TLS handshake timed out";
+            return false;
+        }
+        char buffer[16 << 10];
+        ssize_t n = recv(fd_, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            *error = "TLS handshake: connection closed";
+            return false;
+        }
+        BIO_write(in_, buffer, static_cast<int>(n));
+        advance_handshake();
+    }
+}
+
+std::string TlsStream::describe() const {
+    if (!handshake_done_) return "TLS handshake pending";
+    const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl_);
+    std::string text = std::string(SSL_get_version(ssl_)) + " " + (cipher ? SSL_CIPHER_get_name(cipher) : "?");
+    return text + (ktls_tx_ ? ", kTLS tx" : ", userspace");
+}
+
+} // namespace speedtest
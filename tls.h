@@ -0,0 +1,119 @@
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct bio_st BIO;
+
+namespace speedtest {
+
+// Certificates and settings shared by every TLS connection of one side.
+// Only TLS 1.3 is offered, with session tickets off, so a finished
+// handshake leaves the record sequence numbers at zero and kTLS can take
+// over transmit without help from the library.
+class TlsContext {
+public:
+    // Server side from PEM files; with both paths empty, a throwaway
+    // self-signed certificate is generated
+    static std::shared_ptr<TlsContext> server(const std::string& cert_path, const std::string& key_path,
+                                              std::string* error);
+    // Client side. Test servers usually run self-signed, so peers are only
+    // verified (against the system roots) when asked.
+    static std::shared_ptr<TlsContext> client(bool verify, std::string* error);
+
+    ~TlsContext();
+    TlsContext(const TlsContext&) = delete;
+    TlsContext& operator=(const TlsContext&) = delete;
+
+    SSL_CTX* get() const { return ctx_; }
+    bool is_server() const { return server_; }
+    bool verify() const { return verify_; }
+    // Hand encryption of outgoing records to the kernel where it can (default on)
+    void set_ktls(bool enabled) { ktls_ = enabled; }
+    bool ktls() const { return ktls_; }
+
+private:
+    TlsContext(SSL_CTX* ctx, bool server, bool verify) : ctx_(ctx), server_(server), verify_(verify) {}
+
+    SSL_CTX* ctx_;
+    bool server_;
+    bool verify_;
+    bool ktls_ = true;
+};
+
+// One TLS connection over a socket the caller does the I/O for: ciphertext
+// from recv completions goes in through receive(), and everything to be
+// sent comes back out of take_output() and seal(). That keeps it usable
+// with any IoBackend and with plain blocking sockets alike.
+//
+// Once the handshake is done, enable_ktls_tx() moves record encryption
+// into the kernel (TCP_ULP "tls"). From then on application data is
+// written to the socket as plaintext, so bulk sends keep their zero-copy
+// path; received records are still decrypted here.
+class TlsStream {
+public:
+    // `host` is sent as SNI and verified when the client context asks for it
+    TlsStream(std::shared_ptr<TlsContext> context, int fd, const std::string& host = "");
+    ~TlsStream();
+    TlsStream(const TlsStream&) = delete;
+    TlsStream& operator=(const TlsStream&) = delete;
+
+    bool handshake_done() const { return handshake_done_; }
+
+    // Feed ciphertext from the peer (len 0 just drains what is buffered);
+    // decrypted application data is appended to *plain. False once the
+    // connection is beyond saving: a failed handshake, a bad record, or
+    // the peer's close_notify.
+    bool receive(const char* data, size_t len, std::string* plain);
+
+    // Handshake records and alerts waiting to be sent, appended to *out
+    bool has_output() const;
+    void take_output(std::string* out);
+
+    // Application data to send. Appends the records to *out and returns
+    // true; with kTLS transmit on, returns false and the caller sends
+    // [data, data + len) to the socket as it is.
+    bool seal(const char* data, size_t len, std::string* out);
+
+    // Try kTLS transmit. Call after the handshake, once everything from
+    // take_output() has reached the socket and before any seal(); only the
+    // first call does anything. True when the kernel took the keys.
+    bool enable_ktls_tx();
+    bool ktls_tx() const { return ktls_tx_; }
+
+    // Client handshake on a blocking socket, with everything it sends
+    // written before it returns (so kTLS can be enabled right after)
+    bool handshake_blocking(int timeout_ms, std::string* error);
+
+    // "TLSv1.3 TLS_AES_128_GCM_SHA256, kTLS tx"
+    std::string describe() const;
+    // Why the last failure happened, from the library's error queue
+    const std::string& error() const { return error_; }
+
+private:
+    friend class TlsContext;
+
+    void advance_handshake();
+    // Catches our application traffic secret as the library derives it
+    static void on_keylog(const SSL* ssl, const char* line);
+
+    std::shared_ptr<TlsContext> context_;
+    int fd_;
+    SSL* ssl_ = nullptr;
+    BIO* in_ = nullptr;   // Ciphertext from the peer
+    BIO* out_ = nullptr;  // Ciphertext for the peer
+    bool handshake_done_ = false;
+    bool failed_ = false;
+    bool ktls_tried_ = false;
+    bool ktls_tx_ = false;
+    std::string tx_secret_;  // Our application traffic secret, for kTLS
+    std::string error_;
+};
+
+} // namespace speedtest
+
+#endif // TLS_H_
@@ -0,0 +1,223 @@
+#include "topology.h"
+
+#include <dirent.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+namespace speedtest {
+
+namespace {
+
+const char kSysCpu[] = "/sys/devices/system/cpu/";
+const char kSysNode[] = "/sys/devices/system/node/";
+
+std::string read_line(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+int read_int(const std::string& path, int fallback) {
+    std::ifstream in(path);
+    int value;
+    return in >> value ? value : fallback;
+}
+
+// Names in a directory that are plain numbers, e.g. IRQs under msi_irqs
+std::vector<int> numbered_entries(const std::string& path) {
+    std::vector<int> numbers;
+    DIR* dir = opendir(path.c_str());
+    if (!dir) return numbers;
+    while (dirent* entry = readdir(dir)) {
+        char* end;
+        long n = std::strtol(entry->d_name, &end, 10);
+        if (end != entry->d_name && *end == '\0') numbers.push_back(static_cast<int>(n));
+    }
+    closedir(dir);
+    std::sort(numbers.begin(), numbers.end());
+    return numbers;
+}
+
+} // namespace
+
+Topology Topology::read() {
+    Topology topology;
+    std::vector<int> online;
+    if (!parse_cpu_list(read_line(std::string(kSysCpu) + "online"), &online)) online.push_back(0);
+    for (int cpu : online) {
+        CpuInfo info;
+        info.cpu = cpu;
+        std::string dir = std::string(kSysCpu) + "cpu" + std::to_string(cpu) + "/topology/";
+        info.core = read_int(dir + "core_id", -1);
+        info.package = read_int(dir + "physical_package_id", -1);
+        topology.cpus_.push_back(info);
+    }
+    // Kernels without NUMA have no node directories; everything stays node 0
+    DIR* dir = opendir(kSysNode);
+    if (!dir) return topology;
+    while (dirent* entry = readdir(dir)) {
+        int node;
+        if (std::sscanf(entry->d_name, "node%d", &node) != 1) continue;
+        std::vector<int> cpus;
+        parse_cpu_list(read_line(std::string(kSysNode) + entry->d_name + "/cpulist"), &cpus);
+        for (CpuInfo& info : topology.cpus_) {
+            if (std::find(cpus.begin(), cpus.end(), info.cpu) != cpus.end()) info.node = node;
+        }
+    }
+    closedir(dir);
+    return topology;
+}
+
+std::vector<int> Topology::node_cpus(int node) const {
+    std::vector<int> cpus;
+    for (const CpuInfo& info : cpus_) {
+        if (info.node == node) cpus.push_back(info.cpu);
+    }
+    return cpus;
+}
+
+int Topology::cpu_node(int cpu) const {
+    for (const CpuInfo& info : cpus_) {
+        if (info.cpu == cpu) return info.node;
+    }
+    return -1;
+}
+
+bool parse_cpu_list(const std::string& text, std::vector<int>* cpus) {
+    cpus->clear();
+    std::istringstream ranges(text);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        int first, last;
+        char extra;
+        int fields = std::sscanf(range.c_str(), "%d-%d%c", &first, &last, &extra);
+        if (fields == 1) last = first;
+        if (fields < 1 || fields > 2 || first < 0 || last < first || last >= CPU_SETSIZE) return false;
+        for (int cpu = first; cpu <= last; ++cpu) cpus->push_back(cpu);
+    }
+    std::sort(cpus->begin(), cpus->end());
+    cpus->erase(std::unique(cpus->begin(), cpus->end()), cpus->end());
+    return !cpus->empty();
+}
+
+std::string format_cpu_list(std::vector<int> cpus) {
+    std::sort(cpus.begin(), cpus.end());
+    std::ostringstream out;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) ++j;
+        if (i > 0) out << ",";
+        out << cpus[i];
+        if (j > i) out << "-" << cpus[j];
+        i = j + 1;
+    }
+    return out.str();
+}
+
+int nic_numa_node(const std::string& device) {
+    return read_int("/sys/class/net/" + device + "/device/numa_node", -1);
+}
+
+std::vector<int> nic_irq_cpus(const std::string& device) {
+    // PCI NICs list their vectors under the device, virtio ones under its parent
+    std::string dir = "/sys/class/net/" + device + "/device/";
+    std::vector<int> irqs = numbered_entries(dir + "msi_irqs");
+    if (irqs.empty()) irqs = numbered_entries(dir + "../msi_irqs");
+    std::vector<int> cpus;
+    for (int irq : irqs) {
+        std::string base = "/proc/irq/" + std::to_string(irq) + "/";
+        std::string list = read_line(base + "effective_affinity_list");
+        if (list.empty()) list = read_line(base + "smp_affinity_list");
+        std::vector<int> some;
+        if (parse_cpu_list(list, &some)) cpus.insert(cpus.end(), some.begin(), some.end());
+    }
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return cpus;
+}
+
+std::vector<int> Placement::thread_cpus(size_t thread) const {
+    if (cpus.empty() || !one_per_thread) return cpus;
+    return {cpus[thread % cpus.size()]};
+}
+
+std::string Placement::describe(size_t thread) const {
+    if (cpus.empty()) return "";
+    std::vector<int> mine = thread_cpus(thread);
+    std::ostringstream out;
+    out << (mine.size() == 1 ? "cpu " : "cpus ") << format_cpu_list(mine);
+    if (numa_node >= 0) out << ", node " << numa_node;
+    if (!device.empty() && !irq_cpus.empty()) out << ", " << device << " irqs " << format_cpu_list(irq_cpus);
+    return out.str();
+}
+
+bool parse_placement(const std::string& spec, const std::string& device, Placement* placement,
+                     std::string* error) {
+    *placement = Placement();
+    if (spec.empty() || spec == "none") return true;
+    Topology topology = Topology::read();
+    placement->device = device;
+    if (!device.empty()) placement->irq_cpus = nic_irq_cpus(device);
+    // Without NUMA (or a NIC that reports it) everything is node 0
+    int nic_node = device.empty() ? -1 : nic_numa_node(device);
+    int node = std::max(0, nic_node);
+
+    if (spec == "node" || spec == "auto") {
+        placement->cpus = topology.node_cpus(node);
+        placement->numa_node = node;
+        if (spec == "auto") {
+            placement->one_per_thread = true;
+            // Sharing a core with the NIC's interrupts costs more than the
+            // cache lines it would save
+            std::vector<int> quiet;
+            for (int cpu : placement->cpus) {
+                if (std::find(placement->irq_cpus.begin(), placement->irq_cpus.end(), cpu) ==
+                    placement->irq_cpus.end()) {
+                    quiet.push_back(cpu);
+                }
+            }
+            if (!quiet.empty()) placement->cpus = quiet;
+        }
+    } else if (spec.compare(0, 5, "node:") == 0) {
+        placement->numa_node = std::atoi(spec.c_str() + 5);
+        placement->cpus = topology.node_cpus(placement->numa_node);
+        if (placement->cpus.empty()) {
+            *error = "no CPUs on NUMA node " + spec.substr(5);
+            return false;
+        }
+    } else {
+        if (!parse_cpu_list(spec, &placement->cpus)) {
+            *error = "expected none, auto, node, node:N or a CPU list, not " + spec;
+            return false;
+        }
+        placement->one_per_thread = true;
+        for (int cpu : placement->cpus) {
+            if (topology.cpu_node(cpu) < 0) {
+                *error = "cpu " + std::to_string(cpu) + " isn't online";
+                return false;
+            }
+        }
+        placement->numa_node = topology.cpu_node(placement->cpus.front());
+    }
+    if (placement->cpus.empty()) {
+        *error = "no CPUs to place threads on";
+        return false;
+    }
+    return true;
+}
+
+bool pin_to_cpus(const std::vector<int>& cpus) {
+    if (cpus.empty()) return true;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+} // namespace speedtest
@@ -0,0 +1,66 @@
+#ifndef TOPOLOGY_H_
+#define TOPOLOGY_H_
+
+#include <string>
+#include <vector>
+
+namespace speedtest {
+
+// An online CPU, as /sys/devices/system describes it
+struct CpuInfo {
+    int cpu = 0;
+    int node = 0;      // NUMA node; 0 on machines without NUMA
+    int core = -1;     // core_id within the package
+    int package = -1;
+};
+
+// CPUs and NUMA nodes of this machine, read once
+class Topology {
+public:
+    static Topology read();
+
+    const std::vector<CpuInfo>& cpus() const { return cpus_; }
+    std::vector<int> node_cpus(int node) const;
+    int cpu_node(int cpu) const;  // -1 if the CPU isn't online
+
+private:
+    std::vector<CpuInfo> cpus_;
+};
+
+// "0-3,8,10-11" to CPU numbers and back
+bool parse_cpu_list(const std::string& text, std::vector<int>* cpus);
+std::string format_cpu_list(std::vector<int> cpus);
+
+// NUMA node of a NIC, and the CPUs its interrupts are steered to (from
+// its MSI vectors' effective affinity); -1 and empty for virtual devices
+int nic_numa_node(const std::string& device);
+std::vector<int> nic_irq_cpus(const std::string& device);
+
+// Where a set of threads runs and where their buffers live
+struct Placement {
+    std::vector<int> cpus;      // Empty: wherever the scheduler likes
+    bool one_per_thread = false;  // Thread k gets cpus[k % n] alone, else all of them
+    int numa_node = -1;         // For buffers; -1 = first touch decides
+    std::string device;         // The NIC it was chosen for, if any
+    std::vector<int> irq_cpus;  // ... and where its interrupts go
+
+    bool empty() const { return cpus.empty(); }
+    std::vector<int> thread_cpus(size_t thread) const;
+    // "cpu 3, node 0, eth0 irqs 0-1" for thread k
+    std::string describe(size_t thread) const;
+};
+
+// "none"; "node" for all CPUs of the NIC's node, or "node:N" for node N;
+// "auto" for one CPU each on the NIC's node, avoiding the CPUs that take
+// its interrupts while others are left; or a CPU list, one each. False
+// with *error for a bad spec or CPUs that aren't online.
+bool parse_placement(const std::string& spec, const std::string& device, Placement* placement,
+                     std::string* error);
+
+// Keeps the calling thread on these CPUs (threads it starts inherit them);
+// an empty list leaves it alone
+bool pin_to_cpus(const std::vector<int>& cpus);
+
+} // namespace speedtest
+
+#endif // TOPOLOGY_H_
@@ -0,0 +1,146 @@
+// Replays a `speed_test --record` file through the CLI's statistics and
+// display, or as the /api/samples stream the web GUI polls, faster than
+// real time.
+
+#include "benchmark.h"
+
+#include <cstdlib>
+#include <cstring>
+
+using namespace speedtest;
+
+static void print_usage() {
+    std::cout << "Usage: trace_replay FILE [options]\n"
+              << "  --speed=X    Replay at X times real time (default 10; 0 = no waiting)\n"
+              << "  --samples    Print the server-side TCP_INFO samples as the GUI would\n"
+              << "               receive them from /api/samples, one JSON poll per line\n"
+              << "  --events     Print every decoded record\n";
+}
+
+// Returns the value of --name=value, or nullptr
+static const char* flag_value(const char* arg, const char* name) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) == 0 && arg[len] == '=') return arg + len + 1;
+    return nullptr;
+}
+
+// One line per 500 ms of phase time, like the GUI's watchSamples() polls
+static void print_sample_stream(const TestTrace& trace) {
+    const double kPollS = 0.5;
+    int phase_number = 0;
+    for (const RecordedTest& test : trace.tests) {
+        for (const RecordedPhase& phase : test.phases) {
+            std::string id = std::to_string(++phase_number) + (phase.download ? "d" : "u");
+            size_t next = 0;
+            double end = std::max(phase.seconds, phase.remote_tcp.empty() ? 0 : phase.remote_tcp.back().t_s);
+            for (double poll = kPollS; next < phase.remote_tcp.size() || poll <= end; poll += kPollS) {
+                std::vector<TcpInfoSample> batch;
+                while (next < phase.remote_tcp.size() && phase.remote_tcp[next].t_s < poll) {
+                    batch.push_back(phase.remote_tcp[next++]);
+                }
+                JsonWriter json(batch.size() * 256 + 64);
+                json.begin_object().field("test", id).field("t", poll).field("next", next).key("samples");
+                write_tcp_samples(batch, &json);
+                json.end_object();
+                std::cout << json.str() << "\n";
+            }
+        }
+    }
+}
+
+static void print_events(const std::vector<TraceEvent>& events) {
+    static const char* names[] = {"", "meta", "test", "ping", "phase", "bytes", "tcp_info", "end", "received"};
+    for (const TraceEvent& e : events) {
+        std::cout << std::setw(12) << e.t_us << "  " << std::left << std::setw(9) << names[e.type] << std::right;
+        switch (e.type) {
+        case TraceEvent::kMeta:
+            std::cout << e.key << "=" << e.text;
+            break;
+        case TraceEvent::kTestBegin:
+            std::cout << (e.text.empty() ? "(default tuning)" : e.text);
+            break;
+        case TraceEvent::kPing:
+            std::cout << e.value / 1000.0 << " ms";
+            break;
+        case TraceEvent::kPhaseBegin:
+            std::cout << (e.flag ? "download" : "upload") << " streams=" << e.value;
+            break;
+        case TraceEvent::kBytes:
+            std::cout << "stream " << e.stream << " +" << e.value;
+            break;
+        case TraceEvent::kTcpInfo:
+            std::cout << (e.flag ? "server" : "client") << " stream " << e.stream << " rtt " << e.tcp.rtt_ms
+                      << " ms cwnd " << e.tcp.cwnd << " retrans " << e.tcp.total_retrans;
+            break;
+        case TraceEvent::kPhaseEnd:
+            if (e.value) std::cout << "refused, retry after " << e.value << " s";
+            break;
+        case TraceEvent::kReceived:
+            std::cout << e.value / 1e6 << " Mbps";
+            break;
+        }
+        std::cout << "\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string path;
+    double speed = 10;
+    bool samples = false;
+    bool events = false;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value;
+        if ((value = flag_value(arg, "--speed"))) {
+            speed = std::max(0.0, atof(value));
+        } else if (strcmp(arg, "--samples") == 0) {
+            samples = true;
+        } else if (strcmp(arg, "--events") == 0) {
+            events = true;
+        } else if (arg[0] != '-' && path.empty()) {
+            path = arg;
+        } else {
+            print_usage();
+            return strcmp(arg, "--help") == 0 ? 0 : 1;
+        }
+    }
+    if (path.empty()) {
+        print_usage();
+        return 1;
+    }
+
+    std::string error;
+    if (events) {
+        std::vector<TraceEvent> decoded;
+        if (!read_trace_events(path, &decoded, &error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+        print_events(decoded);
+        return 0;
+    }
+
+    std::shared_ptr<TestTrace> trace(new TestTrace);
+    if (!load_test_trace(path, trace.get(), &error)) {
+        std::cerr << error << "\n";
+        return 1;
+    }
+    if (samples) {
+        print_sample_stream(*trace);
+        return 0;
+    }
+
+    SpeedTest::print_header();
+    std::cout << "  Replaying " << path << " (" << trace->tests.size() << " test"
+              << (trace->tests.size() == 1 ? "" : "s") << ")\n";
+
+    SpeedTest test(trace, speed);
+    std::vector<SpeedResult> results;
+    while (test.replays_left() > 0) results.push_back(test.run_full_test());
+    if (results.size() > 1) {
+        SpeedTest::print_sweep(results);
+    } else if (!results.empty()) {
+        SpeedTest::print_result(results[0]);
+    }
+    return 0;
+}
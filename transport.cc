@@ -0,0 +1,576 @@
+#include "transport.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+
+#include "binary_api.h"
+#include "http_routes.h"
+
+namespace speedtest {
+
+namespace {
+
+// Large enough that the server keeps streaming until we hang up
+const uint64_t kUnboundedBytes = 1ull << 40;
+const size_t kChunkSize = 256 << 10;
+const uint64_t kHeaderTag = 1ull << 32;
+// A response header that hasn't ended by now isn't one
+const size_t kMaxHeaderSize = 16 << 10;
+// How long to sit in the server's session queue before giving up
+const double kMaxQueueWaitS = 60;
+// A UDP flow nobody answers is most likely firewalled
+const double kUdpAnswerS = 5;
+const auto kUdpResend = std::chrono::milliseconds(200);
+const int kStopAttempts = 5;
+
+// /api/samples from a server that only speaks JSON
+void samples_from_json(const std::string& json, PhaseResult* result) {
+    size_t array = json.find("\"samples\":");
+    if (array != std::string::npos) tcp_samples_from_json(json.substr(array), &result->remote_tcp);
+    static const char kBytes[] = "\"integrity\":{\"bytes\":";
+    static const char kBad[] = ",\"bad_blocks\":";
+    size_t integrity = json.find(kBytes);
+    if (integrity != std::string::npos) {
+        result->integrity.bytes = std::strtoull(json.c_str() + integrity + sizeof(kBytes) - 1, nullptr, 10);
+        size_t bad = json.find(kBad, integrity);
+        if (bad != std::string::npos) {
+            result->integrity.bad_blocks = std::strtoull(json.c_str() + bad + sizeof(kBad) - 1, nullptr, 10);
+        }
+    }
+    static const char kReceived[] = "\"received\":{\"bytes\":";
+    static const char kSeconds[] = ",\"seconds\":";
+    static const char kMbps[] = ",\"mbps\":";
+    size_t received = json.find(kReceived);
+    if (received != std::string::npos) {
+        result->received.bytes = std::strtoull(json.c_str() + received + sizeof(kReceived) - 1, nullptr, 10);
+        size_t seconds = json.find(kSeconds, received);
+        size_t mbps = json.find(kMbps, received);
+        if (seconds != std::string::npos) {
+            result->received.seconds = std::strtod(json.c_str() + seconds + sizeof(kSeconds) - 1, nullptr);
+        }
+        if (mbps != std::string::npos) {
+            result->received.mbps = std::strtod(json.c_str() + mbps + sizeof(kMbps) - 1, nullptr);
+        }
+        // The spread behind mbps, from servers that send it
+        size_t rate = json.find("\"rate\":{", received);
+        size_t rate_end = json.find('}', rate);
+        auto number = [&](const char* key) {
+            std::string field = std::string("\"") + key + "\":";
+            size_t pos = json.find(field, rate);
+            return pos < rate_end ? std::strtod(json.c_str() + pos + field.size(), nullptr) : 0.0;
+        };
+        if (rate != std::string::npos) {
+            SampleSummary& s = result->received.rate;
+            s.count = static_cast<uint64_t>(number("count"));
+            s.outliers = static_cast<size_t>(number("outliers"));
+            s.mean = number("mean");
+            s.stddev = number("stddev");
+            s.ci_low = number("ci_low");
+            s.ci_high = number("ci_high");
+            s.p50 = number("p50");
+            s.p90 = number("p90");
+            s.p99 = number("p99");
+        }
+    }
+}
+
+} // namespace
+
+std::string HttpFraming::request(const PhaseSetup& setup, const std::string& query, uint64_t bytes) {
+    const std::string& host = setup.config->host;
+    if (setup.download) {
+        return "GET /stream/download?bytes=" + std::to_string(bytes) + "&" + query + " HTTP/1.1\r\nHost: " + host +
+               "\r\n\r\n";
+    }
+    // The server answers 100 Continue once our session is admitted
+    return "POST /stream/upload?" + query + " HTTP/1.1\r\nHost: " + host +
+           "\r\nContent-Type: application/octet-stream\r\nContent-Length: " + std::to_string(bytes) +
+           "\r\nExpect: 100-continue\r\n\r\n";
+}
+
+bool HttpFraming::accepted(const std::string& header, bool download) {
+    return header.compare(0, 12, download ? "HTTP/1.1 200" : "HTTP/1.1 100") == 0;
+}
+
+int HttpFraming::retry_after_s(const std::string& header) {
+    std::string_view retry;
+    return find_header(header, "Retry-After", &retry) ? std::max(1, atoi(std::string(retry).c_str())) : 1;
+}
+
+std::string RawFraming::request(const PhaseSetup& setup, const std::string& query, uint64_t bytes) {
+    if (setup.download) return "DOWNLOAD bytes=" + std::to_string(bytes) + "&" + query + "\n";
+    return "UPLOAD " + query + "\n";
+}
+
+bool RawFraming::accepted(const std::string& header, bool) {
+    return header == "OK";
+}
+
+int RawFraming::retry_after_s(const std::string& header) {
+    return header.compare(0, 5, "BUSY ") == 0 ? std::max(1, atoi(header.c_str() + 5)) : 1;
+}
+
+template <typename Framing>
+TcpTransport<Framing>::TcpTransport(const PhaseSetup& setup, int port) : setup_(setup), port_(port) {}
+
+template <typename Framing>
+bool TcpTransport<Framing>::open(PhaseResult* result) {
+    const EngineConfig& config = *setup_.config;
+    std::string tuning = config.tuning.to_query();
+    if (!tuning.empty()) tuning = "&" + tuning;
+    streams_.resize(config.streams);
+    for (size_t i = 0; i < streams_.size(); ++i) {
+        Stream& s = streams_[i];
+        std::vector<std::string> rejected;
+        s.fd = connect_tcp(config.host, port_, &config.tuning, &rejected, &config.source);
+        if (s.fd < 0) continue;
+        if (i == 0) result->tuning_rejected = rejected;
+        if (config.tuning.nodelay < 0) {
+            int one = 1;
+            setsockopt(s.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (config.tls && !(s.tls = start_tls(s.fd, config.tls, config.host))) {
+            ::close(s.fd);
+            s.fd = -1;
+            continue;
+        }
+
+        // The session id keeps both phases in one server-side scheduler slot
+        std::string query = "test=" + setup_.test + "&session=" + setup_.session + "&stream=" + std::to_string(i) +
+                            tuning;
+        // Stream i walks the pool from chunk i, in either direction, so the
+        // receiving end knows where to check from
+        uint64_t start = i * kChunkSize % setup_.payload->size();
+        if (setup_.verify && !setup_.download) query += "&verify=1";
+        if (setup_.verify && setup_.download) s.verifier.reset(new PayloadVerifier(*setup_.payload, start));
+        s.request = Framing::request(setup_, query, kUnboundedBytes);
+        if (!setup_.download) s.payload_offset = start;
+        std::string sealed;
+        if (s.tls && s.tls->seal(s.request.data(), s.request.size(), &sealed)) s.request = std::move(sealed);
+        setup_.backend->watch_recv(s.fd, i);
+        setup_.backend->send(s.fd, s.request.data(), s.request.size(), kHeaderTag | i);
+        ++in_flight_;
+        ++open_streams_;
+    }
+    if (open_streams_ == 0) result->error = "can't connect to " + config.host + ":" + std::to_string(port_);
+    return open_streams_ > 0;
+}
+
+template <typename Framing>
+double TcpTransport<Framing>::give_up_s() const {
+    return kMaxQueueWaitS;
+}
+
+template <typename Framing>
+void TcpTransport<Framing>::send_chunk(size_t i) {
+    Stream& s = streams_[i];
+    const char* chunk = setup_.payload->at(s.payload_offset);
+    s.sealed.clear();
+    if (s.tls && s.tls->seal(chunk, kChunkSize, &s.sealed)) {
+        setup_.backend->send(s.fd, s.sealed.data(), s.sealed.size(), i);
+    } else {
+        setup_.backend->send(s.fd, chunk, kChunkSize, i);
+    }
+    ++in_flight_;
+    s.payload_offset = (s.payload_offset + kChunkSize) % setup_.payload->size();
+}
+
+template <typename Framing>
+void TcpTransport<Framing>::hang_up(Stream& s) {
+    setup_.backend->forget(s.fd);
+    ::close(s.fd);
+    s.fd = -1;
+    --open_streams_;
+}
+
+template <typename Framing>
+void TcpTransport<Framing>::pump(int timeout_ms) {
+    const bool download = setup_.download;
+    setup_.backend->wait(&events_, timeout_ms);
+    for (const IoCompletion& ev : events_) {
+        in_flight_ -= ev.type == IoCompletion::kSend;
+        size_t i = ev.tag & ~kHeaderTag;
+        if (i >= streams_.size() || streams_[i].fd != ev.fd) continue;
+        Stream& s = streams_[i];
+
+        // From here on, data and len are what the server sent, in plaintext
+        const char* data = ev.data;
+        int len = ev.result;
+        if (s.tls && ev.type == IoCompletion::kRecv && ev.result > 0) {
+            plain_.clear();
+            if (!s.tls->receive(ev.data, ev.result, &plain_)) {
+                len = -EPROTO;
+            } else if (plain_.empty()) {
+                continue;
+            } else {
+                data = plain_.data();
+                len = static_cast<int>(plain_.size());
+            }
+        }
+
+        if (ev.type == IoCompletion::kRecv && len > 0 && !s.header_done) {
+            // The header may come over several receives; the terminator
+            // may straddle two
+            const size_t terminator = sizeof(Framing::kHeaderEnd) - 1;
+            size_t from = s.header.size() < terminator ? 0 : s.header.size() - (terminator - 1);
+            s.header.append(data, len);
+            size_t end = s.header.find(Framing::kHeaderEnd, from);
+            if (end == std::string::npos) {
+                if (s.header.size() > kMaxHeaderSize) hang_up(s);
+                continue;
+            }
+            s.header_done = true;
+            std::string header = s.header.substr(0, end);
+            if (Framing::accepted(header, download)) {
+                started_ = true;
+                if (download) received(s, s.header.data() + end + terminator, s.header.size() - (end + terminator));
+                else send_chunk(i);
+                s.header.clear();
+                continue;
+            }
+            // The server has no room for another session
+            retry_after_s_ = Framing::retry_after_s(header);
+            hang_up(s);
+            continue;
+        }
+        if (len < 0 || (ev.type == IoCompletion::kRecv && len == 0)) {
+            hang_up(s);
+            continue;
+        }
+        if (ev.type == IoCompletion::kRecv) {
+            if (download) received(s, data, len);
+        } else if (ev.type == IoCompletion::kSend) {
+            if (ev.tag & kHeaderTag) continue;
+            // Payload bytes, not TLS record overhead
+            s.bytes += s.sealed.empty() ? len : kChunkSize;
+            send_chunk(i);
+        }
+    }
+}
+
+template <typename Framing>
+void TcpTransport<Framing>::poll_fds(std::vector<pollfd>* fds, std::chrono::steady_clock::time_point* wake) {
+    int fd = setup_.backend->poll_fd();
+    if (fd >= 0) fds->push_back({fd, POLLIN, 0});
+    else *wake = std::chrono::steady_clock::now();
+}
+
+template <typename Framing>
+void TcpTransport<Framing>::received(Stream& s, const char* data, size_t len) {
+    s.bytes += len;
+    if (s.verifier) s.verifier->add(data, len);
+}
+
+template <typename Framing>
+void TcpTransport<Framing>::close() {
+    // Hang up, then let cancelled sends drain before their buffers go away
+    for (Stream& s : streams_) {
+        if (s.fd >= 0) hang_up(s);
+    }
+    auto drain_start = std::chrono::steady_clock::now();
+    while (in_flight_ > 0 && std::chrono::steady_clock::now() - drain_start < std::chrono::seconds(1)) {
+        setup_.backend->wait(&events_, 50);
+        for (const IoCompletion& ev : events_) in_flight_ -= ev.type == IoCompletion::kSend;
+    }
+}
+
+template <typename Framing>
+void TcpTransport<Framing>::finish(PhaseResult* result) {
+    result->retry_after_s = retry_after_s_;
+    // The server samples its end too; for downloads that is the sending side
+    const EngineConfig& config = *setup_.config;
+    std::string reply;
+    std::string path = "/api/samples?test=" + setup_.test;
+    if (http_get(config.host, config.port, path, &reply, config.tls, &config.source, kBinaryContentType)) {
+        // Servers from before the binary API answer in JSON
+        BinaryMessage message;
+        std::string error;
+        if (message.parse(reply.data(), reply.size(), &error) && message.type() == BinaryType::kSamples) {
+            for (size_t i = 0; i < message.records(); ++i) {
+                result->remote_tcp.push_back(read_tcp_sample(message.record(i)));
+            }
+            // What the server checked of our uploads, by the time it answered
+            BinaryFields body = message.body();
+            result->integrity.bytes = body.u64(samples_field::kIntegrityBytes);
+            result->integrity.bad_blocks = body.u64(samples_field::kBadBlocks);
+            result->received = read_received(body);
+        } else {
+            samples_from_json(reply, result);
+        }
+    }
+    for (Stream& s : streams_) {
+        if (!s.verifier) continue;
+        IntegrityCounts counts = s.verifier->finish();
+        result->integrity.bytes += counts.bytes;
+        result->integrity.bad_blocks += counts.bad_blocks;
+    }
+    // Our upload count is what the kernel took, which a deep send buffer
+    // inflates; what the server timed arriving is what the link carried,
+    // and its samples give the spread
+    if (!setup_.download && result->received.mbps > 0) {
+        result->sent_mbps = result->mbps;
+        result->sent_rate = result->rate;
+        result->mbps = result->received.mbps;
+        result->rate = result->received.rate;
+    }
+}
+
+template class TcpTransport<HttpFraming>;
+template class TcpTransport<RawFraming>;
+
+UdpTransport::~UdpTransport() {
+    for (Flow& flow : flows_) {
+        if (flow.fd >= 0) ::close(flow.fd);
+    }
+}
+
+bool UdpTransport::open(PhaseResult* result) {
+    const EngineConfig& config = *setup_.config;
+    size_t size = std::min(std::max(config.udp_datagram_size, kMinDatagramSize), kMaxDatagramSize);
+    flows_.resize(config.streams);
+    std::mt19937_64 gen(std::random_device{}());
+    opened_ = Clock::now();
+    for (size_t i = 0; i < flows_.size(); ++i) {
+        Flow& flow = flows_[i];
+        flow.id = gen();
+        flow.size = static_cast<uint32_t>(size);
+        std::ostringstream path;
+        path << "/api/udp?flow=" << std::hex << flow.id << "&test=" << setup_.test << "&session=" << setup_.session;
+        std::string json;
+        if (!http_get(config.host, config.port, path.str(), &json, config.tls, &config.source)) {
+            result->error = "server doesn't offer UDP flows (--udp-port)";
+            break;
+        }
+        size_t pos = json.find("\"port\":");
+        int port = pos == std::string::npos ? 0 : atoi(json.c_str() + pos + 7);
+        sockaddr_storage addr{};
+        socklen_t addr_len = 0;
+        if (port <= 0 || !resolve_tcp(config.host, port, &addr, &addr_len)) {
+            result->error = "can't resolve " + config.host;
+            break;
+        }
+        flow.fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (flow.fd < 0) continue;
+        int buffer = 4 << 20;
+        setsockopt(flow.fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+        setsockopt(flow.fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+        DatagramReceiver::enable_gro(flow.fd);
+        std::string error;
+        if (!apply_binding(flow.fd, config.source, &error)) {
+            result->error = error;
+            ::close(flow.fd);
+            flow.fd = -1;
+            continue;
+        }
+        if (connect(flow.fd, reinterpret_cast<sockaddr*>(&addr), addr_len) != 0) {
+            ::close(flow.fd);
+            flow.fd = -1;
+            continue;
+        }
+        send_start(flow);
+        ++open_streams_;
+    }
+    return open_streams_ > 0;
+}
+
+double UdpTransport::give_up_s() const {
+    return kUdpAnswerS;
+}
+
+void UdpTransport::send_start(Flow& flow) {
+    const EngineConfig& config = *setup_.config;
+    Datagram start;
+    start.type = DatagramType::kStart;
+    start.download = setup_.download;
+    start.flow = flow.id;
+    start.rate_bps = config.udp_rate_bps / std::max<size_t>(1, flows_.size());
+    start.size = flow.size;
+    // A little past the phase, so the server doesn't stop first
+    start.duration_ms = static_cast<uint32_t>(config.duration_s * 1000) + 1000;
+    char out[kControlSize];
+    send(flow.fd, out, encode_datagram(start, out), 0);
+    flow.last_start = Clock::now();
+}
+
+void UdpTransport::send_data(Flow& flow, Clock::time_point now) {
+    size_t due = flow.pacer.due(now);
+    Datagram data;
+    data.type = DatagramType::kData;
+    data.flow = flow.id;
+    data.seq = flow.sent;
+    // A full socket buffer drops here, before the datagrams count as sent
+    size_t sent = sender_.send(flow.fd, nullptr, 0, data, flow.size, due);
+    flow.sent += sent;
+    flow.sent_bytes += sent * flow.size;
+    flow.pacer.sent(due);
+}
+
+void UdpTransport::receive(Flow& flow) {
+    for (;;) {
+        const std::vector<ReceivedDatagram>& batch = receiver_.receive(flow.fd);
+        if (batch.empty()) return;
+        uint64_t now_ns = steady_ns();
+        for (const ReceivedDatagram& received : batch) on_datagram(flow, received, now_ns);
+    }
+}
+
+void UdpTransport::on_datagram(Flow& flow, const ReceivedDatagram& received, uint64_t now_ns) {
+    Datagram datagram;
+    if (!decode_datagram(received.data, received.len, &datagram) || datagram.flow != flow.id) return;
+    switch (datagram.type) {
+        case DatagramType::kStart:
+            // The ack carries the rate the server granted
+            flow.rate_bps = datagram.rate_bps;
+            if (!flow.acked && !setup_.download) {
+                flow.pacer = DatagramPacer(datagram.rate_bps, flow.size, Clock::now());
+                started_ = true;
+            }
+            flow.acked = true;
+            break;
+        case DatagramType::kData:
+            flow.acked = started_ = true;
+            flow.rx.add(datagram.seq, received.len, datagram.sent_ns, now_ns);
+            break;
+        case DatagramType::kReport:
+            flow.reported = true;
+            flow.report = datagram.counts;
+            break;
+        default:
+            break;
+    }
+}
+
+void UdpTransport::pump(int timeout_ms) {
+    auto now = Clock::now();
+    auto wake = now + std::chrono::milliseconds(timeout_ms);
+    bool sending = !setup_.download;
+    for (Flow& flow : flows_) {
+        if (flow.fd < 0) continue;
+        if (!flow.acked) {
+            if (now - flow.last_start >= kUdpResend) send_start(flow);
+            wake = std::min(wake, flow.last_start + kUdpResend);
+        } else if (sending) {
+            send_data(flow, now);
+            wake = std::min(wake, flow.pacer.next());
+        }
+    }
+    if (!started_ && now - opened_ > std::chrono::duration<double>(kUdpAnswerS)) {
+        // Nothing came back; the driver gives up on the phase
+        for (Flow& flow : flows_) {
+            if (flow.fd < 0) continue;
+            ::close(flow.fd);
+            flow.fd = -1;
+            --open_streams_;
+        }
+        return;
+    }
+
+    std::vector<pollfd> fds;
+    for (const Flow& flow : flows_) {
+        if (flow.fd >= 0) fds.push_back({flow.fd, POLLIN, 0});
+    }
+    auto wait_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wake - Clock::now()).count();
+    wait_ns = std::max<int64_t>(0, wait_ns);
+    timespec timeout{static_cast<time_t>(wait_ns / 1000000000), static_cast<long>(wait_ns % 1000000000)};
+    if (ppoll(fds.data(), fds.size(), &timeout, nullptr) <= 0) return;
+    for (Flow& flow : flows_) {
+        if (flow.fd >= 0) receive(flow);
+    }
+}
+
+void UdpTransport::poll_fds(std::vector<pollfd>* fds, Clock::time_point* wake) {
+    // The same deadlines pump() keeps
+    bool sending = !setup_.download;
+    for (const Flow& flow : flows_) {
+        if (flow.fd < 0) continue;
+        fds->push_back({flow.fd, POLLIN, 0});
+        if (!flow.acked) *wake = std::min(*wake, flow.last_start + kUdpResend);
+        else if (sending) *wake = std::min(*wake, flow.pacer.next());
+    }
+    if (!started_) {
+        auto give_up = opened_ + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(kUdpAnswerS));
+        *wake = std::min(*wake, give_up);
+    }
+}
+
+uint64_t UdpTransport::stream_bytes(size_t i) const {
+    const Flow& flow = flows_[i];
+    return setup_.download ? flow.rx.counts().bytes : flow.sent_bytes;
+}
+
+void UdpTransport::close() {
+    // Ask each flow's server end for its counts, resending lost requests
+    Datagram stop;
+    stop.type = DatagramType::kStop;
+    char out[kControlSize];
+    for (int attempt = 0; attempt < kStopAttempts; ++attempt) {
+        std::vector<pollfd> fds;
+        for (Flow& flow : flows_) {
+            if (flow.fd < 0 || !flow.acked || flow.reported) continue;
+            stop.flow = flow.id;
+            send(flow.fd, out, encode_datagram(stop, out), 0);
+            fds.push_back({flow.fd, POLLIN, 0});
+        }
+        if (fds.empty()) break;
+        timespec timeout{0, std::chrono::duration_cast<std::chrono::nanoseconds>(kUdpResend).count()};
+        auto deadline = Clock::now() + kUdpResend;
+        while (Clock::now() < deadline && ppoll(fds.data(), fds.size(), &timeout, nullptr) > 0) {
+            bool waiting = false;
+            for (Flow& flow : flows_) {
+                if (flow.fd < 0 || flow.reported) continue;
+                receive(flow);
+                waiting |= flow.acked && !flow.reported;
+            }
+            if (!waiting) break;
+        }
+    }
+    for (Flow& flow : flows_) {
+        if (flow.fd < 0) continue;
+        ::close(flow.fd);
+        flow.fd = -1;
+        --open_streams_;
+    }
+}
+
+void UdpTransport::finish(PhaseResult* result) {
+    // Counts from both ends, per direction: the sender's total against what
+    // the receiver saw
+    uint64_t sent = 0;
+    uint64_t target_bps = 0;
+    DatagramCounts received;
+    for (const Flow& flow : flows_) {
+        if (!flow.reported) continue;
+        const DatagramCounts& rx = setup_.download ? flow.rx.counts() : flow.report;
+        sent += setup_.download ? flow.report.sent : flow.sent;
+        received.received += rx.received;
+        received.bytes += rx.bytes;
+        received.duplicates += rx.duplicates;
+        received.reordered += rx.reordered;
+        received.max_reorder_depth = std::max(received.max_reorder_depth, rx.max_reorder_depth);
+        received.jitter_ns = std::max(received.jitter_ns, rx.jitter_ns);
+        received.delay_var_ns = std::max(received.delay_var_ns, rx.delay_var_ns);
+        target_bps += flow.rate_bps;
+    }
+    result->datagrams = summarize_datagrams(sent, received);
+    result->datagrams.target_mbps = target_bps / 1e6;
+    if (!setup_.download && result->seconds > 0) {
+        // The server only counts, so the received rate has no samples
+        // behind it; our spread goes with what we sent
+        result->sent_mbps = result->mbps;
+        result->sent_rate = result->rate;
+        result->rate = SampleSummary();
+        result->mbps = received.bytes * 8.0 / result->seconds / 1e6;
+    }
+}
+
+} // namespace speedtest
@@ -0,0 +1,178 @@
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+
+#include "client_engine.h"
+#include "payload.h"
+#include "udp_flow.h"
+
+namespace speedtest {
+
+// How one download or upload phase moves its bytes. ClientEngine's phase
+// loop is a template over the transport, so every call below resolves at
+// compile time and completions are handled without indirection. A
+// transport provides:
+//
+//   bool open(PhaseResult* result)   Connect every stream and ask the server
+//                                    to start; false (with result->error)
+//                                    if the phase can't run at all
+//   void pump(int timeout_ms)        Wait up to timeout_ms for I/O and
+//                                    handle whatever completed
+//   void poll_fds(fds, wake)         What pump(0) is waiting for: sockets
+//                                    to poll readable, and a time to pump
+//                                    by regardless (only ever moved earlier)
+//   bool started() const             The server let the first stream go
+//   double give_up_s() const         How long to wait for that
+//   int open_streams() const
+//   size_t streams() const
+//   uint64_t stream_bytes(size_t i) const  Payload moved so far
+//   int stream_fd(size_t i) const    TCP socket to sample, or -1
+//   void close()                     Hang up, letting sends drain
+//   void finish(PhaseResult* result) Add what the transport or the server
+//                                    counted beyond bytes and time
+struct PhaseSetup {
+    const EngineConfig* config = nullptr;
+    IoBackend* backend = nullptr;
+    const PayloadPool* payload = nullptr;
+    bool verify = false;  // payload is the server's: check what arrives, ask it to check what we send
+    bool download = true;
+    std::string test;     // ?test= for this phase's streams
+    std::string session;  // ?session= shared by the phases of a test
+};
+
+// Bulk streams over TCP, framed by the server's HTTP /stream endpoints or
+// by its raw port's one-line requests. Uploads count what our kernel took;
+// the server times what arrives, and the rate it reports becomes the
+// phase's mbps.
+struct HttpFraming {
+    static constexpr char kHeaderEnd[] = "\r\n\r\n";
+    static std::string request(const PhaseSetup& setup, const std::string& query, uint64_t bytes);
+    // The 200 (download) or 100 Continue (upload) that lets a stream go
+    static bool accepted(const std::string& header, bool download);
+    static int retry_after_s(const std::string& header);
+};
+
+// "DOWNLOAD <query>\n" or "UPLOAD <query>\n", answered by "OK\n" or
+// "BUSY <retry after s>\n", then payload in one direction until hangup
+struct RawFraming {
+    static constexpr char kHeaderEnd[] = "\n";
+    static std::string request(const PhaseSetup& setup, const std::string& query, uint64_t bytes);
+    static bool accepted(const std::string& header, bool download);
+    static int retry_after_s(const std::string& header);
+};
+
+template <typename Framing>
+class TcpTransport {
+public:
+    TcpTransport(const PhaseSetup& setup, int port);
+
+    bool open(PhaseResult* result);
+    void pump(int timeout_ms);
+    void poll_fds(std::vector<pollfd>* fds, std::chrono::steady_clock::time_point* wake);
+    bool started() const { return started_; }
+    double give_up_s() const;
+    int open_streams() const { return open_streams_; }
+    size_t streams() const { return streams_.size(); }
+    uint64_t stream_bytes(size_t i) const { return streams_[i].bytes; }
+    int stream_fd(size_t i) const { return streams_[i].fd; }
+    void close();
+    void finish(PhaseResult* result);
+
+private:
+    struct Stream {
+        int fd = -1;
+        bool header_done = false;  // Response header (or go-ahead) consumed
+        std::string header;        // What has arrived of it so far
+        uint64_t payload_offset = 0;
+        uint64_t bytes = 0;
+        std::string request;
+        std::unique_ptr<TlsStream> tls;
+        std::string sealed;        // Encrypted chunk in flight, without kTLS
+        std::unique_ptr<PayloadVerifier> verifier;  // Downloads with setup.verify
+    };
+
+    void received(Stream& s, const char* data, size_t len);
+
+    void send_chunk(size_t i);
+    void hang_up(Stream& s);
+
+    PhaseSetup setup_;
+    int port_;
+    std::vector<Stream> streams_;
+    std::vector<IoCompletion> events_;
+    std::string plain_;  // Decrypted bytes of one TLS completion
+    int in_flight_ = 0;  // Sends the kernel may still be reading from
+    int open_streams_ = 0;
+    bool started_ = false;
+    int retry_after_s_ = 0;
+};
+
+using HttpTransport = TcpTransport<HttpFraming>;
+using RawTcpTransport = TcpTransport<RawFraming>;
+
+// Paced datagrams with sequence numbers, one flow per stream, each at its
+// share of EngineConfig::udp_rate_bps. Flows are registered over HTTP
+// (/api/udp), which also names the server's UDP port. Downloads count
+// bytes as they arrive; uploads count what was sent, and the phase's
+// mbps becomes what the server reports it received. Both ends batch
+// datagrams with GSO/GRO where the kernel has them.
+class UdpTransport {
+public:
+    explicit UdpTransport(const PhaseSetup& setup)
+        : setup_(setup), sender_(setup.payload->data(), setup.payload->size()) {}
+    ~UdpTransport();
+
+    bool open(PhaseResult* result);
+    void pump(int timeout_ms);
+    void poll_fds(std::vector<pollfd>* fds, std::chrono::steady_clock::time_point* wake);
+    bool started() const { return started_; }
+    double give_up_s() const;
+    int open_streams() const { return open_streams_; }
+    size_t streams() const { return flows_.size(); }
+    uint64_t stream_bytes(size_t i) const;
+    int stream_fd(size_t) const { return -1; }
+    void close();
+    void finish(PhaseResult* result);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Flow {
+        int fd = -1;
+        uint64_t id = 0;
+        bool acked = false;
+        uint64_t rate_bps = 0;         // Granted by the server
+        Clock::time_point last_start;  // kStart is resent until acked
+        DatagramPacer pacer;
+        uint32_t size = 0;
+        uint64_t sent = 0;
+        uint64_t sent_bytes = 0;
+        SequenceTracker rx;
+        bool reported = false;
+        DatagramCounts report;         // The server's side, from kReport
+    };
+
+    void send_start(Flow& flow);
+    void send_data(Flow& flow, Clock::time_point now);
+    void receive(Flow& flow);
+    void on_datagram(Flow& flow, const ReceivedDatagram& received, uint64_t now_ns);
+
+    PhaseSetup setup_;
+    std::vector<Flow> flows_;
+    DatagramSender sender_;
+    DatagramReceiver receiver_;
+    Clock::time_point opened_;
+    int open_streams_ = 0;
+    bool started_ = false;
+};
+
+} // namespace speedtest
+
+#endif // TRANSPORT_H_
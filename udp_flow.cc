@@ -0,0 +1,450 @@
+#include "udp_flow.h"
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+#include "topology.h"
+
+namespace speedtest {
+
+namespace {
+
+const uint32_t kMagic = 0x53545531;  // "STU1"
+const uint8_t kDownloadFlag = 1;
+// Most datagrams a pacer lets out at once after falling behind
+const size_t kMaxBurst = 64;
+// Registered flows must start within this, and go once silent this long
+const auto kAllowFor = std::chrono::seconds(10);
+const auto kIdleFlow = std::chrono::seconds(10);
+const uint32_t kMaxDurationMs = 60000;
+// For flows that ask for no particular rate on a server with no cap
+const uint64_t kDefaultRateBps = 1000000000;
+const auto kMaxPollWait = std::chrono::milliseconds(100);
+// Largest GSO send: the IPv4 length limit less headers, rounded down
+const size_t kMaxGsoBytes = 65000;
+const size_t kGroBufferSize = 65536;
+// Receive batches per wakeup before the server goes back to sending
+const int kReceiveBatches = 16;
+
+void put_u64(char* out, uint64_t v) {
+    for (int i = 7; i >= 0; --i, v >>= 8) out[i] = static_cast<char>(v & 0xff);
+}
+
+void put_u32(char* out, uint32_t v) {
+    for (int i = 3; i >= 0; --i, v >>= 8) out[i] = static_cast<char>(v & 0xff);
+}
+
+uint64_t get_u64(const char* in) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v = v << 8 | static_cast<uint8_t>(in[i]);
+    return v;
+}
+
+uint32_t get_u32(const char* in) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) v = v << 8 | static_cast<uint8_t>(in[i]);
+    return v;
+}
+
+bool same_host(const sockaddr_storage& a, const sockaddr_storage& b) {
+    if (a.ss_family != b.ss_family) return false;
+    if (a.ss_family == AF_INET6) {
+        return std::memcmp(&reinterpret_cast<const sockaddr_in6&>(a).sin6_addr,
+                           &reinterpret_cast<const sockaddr_in6&>(b).sin6_addr, sizeof(in6_addr)) == 0;
+    }
+    return reinterpret_cast<const sockaddr_in&>(a).sin_addr.s_addr ==
+           reinterpret_cast<const sockaddr_in&>(b).sin_addr.s_addr;
+}
+
+bool same_port(const sockaddr_storage& a, const sockaddr_storage& b) {
+    if (a.ss_family == AF_INET6) {
+        return reinterpret_cast<const sockaddr_in6&>(a).sin6_port == reinterpret_cast<const sockaddr_in6&>(b).sin6_port;
+    }
+    return reinterpret_cast<const sockaddr_in&>(a).sin_port == reinterpret_cast<const sockaddr_in&>(b).sin_port;
+}
+
+} // namespace
+
+size_t encode_datagram(const Datagram& datagram, char* out) {
+    put_u32(out, kMagic);
+    out[4] = static_cast<char>(datagram.type);
+    out[5] = datagram.download ? kDownloadFlag : 0;
+    out[6] = out[7] = 0;
+    put_u64(out + 8, datagram.flow);
+    put_u64(out + 16, datagram.seq);
+    put_u64(out + 24, datagram.sent_ns);
+    if (datagram.type == DatagramType::kData) return kDataHeaderSize;
+
+    const DatagramCounts& c = datagram.counts;
+    put_u64(out + 32, datagram.rate_bps);
+    put_u32(out + 40, datagram.size);
+    put_u32(out + 44, datagram.duration_ms);
+    put_u64(out + 48, c.sent);
+    put_u64(out + 56, c.received);
+    put_u64(out + 64, c.bytes);
+    put_u64(out + 72, c.duplicates);
+    put_u64(out + 80, c.reordered);
+    put_u64(out + 88, c.max_reorder_depth);
+    put_u64(out + 96, c.jitter_ns);
+    put_u64(out + 104, c.delay_var_ns);
+    return kControlSize;
+}
+
+bool decode_datagram(const char* data, size_t len, Datagram* datagram) {
+    if (len < kDataHeaderSize || get_u32(data) != kMagic) return false;
+    uint8_t type = static_cast<uint8_t>(data[4]);
+    if (type < 1 || type > 4) return false;
+    datagram->type = static_cast<DatagramType>(type);
+    datagram->download = data[5] & kDownloadFlag;
+    datagram->flow = get_u64(data + 8);
+    datagram->seq = get_u64(data + 16);
+    datagram->sent_ns = get_u64(data + 24);
+    if (datagram->type == DatagramType::kData) return true;
+    if (len < kControlSize) return false;
+
+    DatagramCounts& c = datagram->counts;
+    datagram->rate_bps = get_u64(data + 32);
+    datagram->size = get_u32(data + 40);
+    datagram->duration_ms = get_u32(data + 44);
+    c.sent = get_u64(data + 48);
+    c.received = get_u64(data + 56);
+    c.bytes = get_u64(data + 64);
+    c.duplicates = get_u64(data + 72);
+    c.reordered = get_u64(data + 80);
+    c.max_reorder_depth = get_u64(data + 88);
+    c.jitter_ns = get_u64(data + 96);
+    c.delay_var_ns = get_u64(data + 104);
+    return true;
+}
+
+uint64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void SequenceTracker::add(uint64_t seq, size_t bytes, uint64_t sent_ns, uint64_t received_ns) {
+    // Transit differences are what matter, so the wrap of a negative
+    // offset between the clocks is harmless
+    int64_t transit = static_cast<int64_t>(received_ns - sent_ns);
+    if (!timed_) {
+        timed_ = true;
+        min_transit_ = max_transit_ = last_transit_ = transit;
+    } else {
+        int64_t d = transit - last_transit_;
+        jitter_ += (std::abs(static_cast<double>(d)) - jitter_) / 16;
+        last_transit_ = transit;
+        min_transit_ = std::min(min_transit_, transit);
+        max_transit_ = std::max(max_transit_, transit);
+    }
+    counts_.jitter_ns = static_cast<uint64_t>(jitter_);
+    counts_.delay_var_ns = static_cast<uint64_t>(max_transit_ - min_transit_);
+
+    uint64_t& word = seen_[(seq % kWindow) / 64];
+    uint64_t bit = 1ull << (seq % 64);
+    if (seq >= next_) {
+        // Numbers skipped over are unseen so far; their slots may still
+        // hold bits from a window ago
+        if (seq - next_ >= kWindow) {
+            std::fill(seen_.begin(), seen_.end(), 0);
+        } else {
+            for (uint64_t s = next_; s < seq; ++s) seen_[(s % kWindow) / 64] &= ~(1ull << (s % 64));
+        }
+        word |= bit;
+        next_ = seq + 1;
+    } else {
+        uint64_t depth = next_ - 1 - seq;
+        if (depth < kWindow) {
+            if (word & bit) {
+                counts_.duplicates++;
+                return;
+            }
+            word |= bit;
+        }
+        counts_.reordered++;
+        counts_.max_reorder_depth = std::max(counts_.max_reorder_depth, depth);
+    }
+    counts_.received++;
+    counts_.bytes += bytes;
+}
+
+DatagramSummary summarize_datagrams(uint64_t sent, const DatagramCounts& received) {
+    DatagramSummary summary;
+    summary.sent = sent;
+    summary.received = received.received;
+    summary.lost = sent > received.received ? sent - received.received : 0;
+    summary.reordered = received.reordered;
+    summary.max_reorder_depth = received.max_reorder_depth;
+    summary.loss_rate = sent > 0 ? static_cast<double>(summary.lost) / sent : 0;
+    summary.jitter_ms = received.jitter_ns / 1e6;
+    summary.delay_var_ms = received.delay_var_ns / 1e6;
+    return summary;
+}
+
+DatagramSender::DatagramSender(const char* payload, size_t len) : buffer_(kMaxBatch * kMaxDatagramSize) {
+    for (size_t i = 0; i < buffer_.size(); i += len) {
+        std::memcpy(&buffer_[i], payload, std::min(len, buffer_.size() - i));
+    }
+}
+
+size_t DatagramSender::send(int fd, const sockaddr* to, socklen_t to_len, Datagram header, size_t size,
+                            size_t count) {
+    // sendmmsg takes the datagrams at kMaxDatagramSize strides; GSO wants
+    // them back to back, so there they start every `size` bytes, over
+    // whichever part of the payload lands there
+    size_t sent = 0;
+    while (sent < count) {
+        size_t batch = std::min(count - sent, kMaxBatch);
+        if (gso_) batch = std::min(batch, kMaxGsoBytes / size);
+        header.sent_ns = steady_ns();
+        size_t stride = gso_ ? size : kMaxDatagramSize;
+        for (size_t i = 0; i < batch; ++i, ++header.seq) encode_datagram(header, &buffer_[i * stride]);
+
+        int took = 0;
+        if (gso_) {
+            iovec iov{buffer_.data(), batch * size};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(uint16_t))] = {};
+            msghdr msg{};
+            msg.msg_name = const_cast<sockaddr*>(to);
+            msg.msg_namelen = to ? to_len : 0;
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            if (batch > 1) {
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+                cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t segment = static_cast<uint16_t>(size);
+                std::memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+            }
+            if (sendmsg(fd, &msg, MSG_DONTWAIT) >= 0) {
+                took = static_cast<int>(batch);
+            } else if (batch > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+                // No GSO here (or not on this device); redo the batch the other way
+                gso_ = false;
+                header.seq -= batch;
+                continue;
+            }
+        } else {
+            mmsghdr msgs[kMaxBatch] = {};
+            iovec iovs[kMaxBatch];
+            for (size_t i = 0; i < batch; ++i) {
+                iovs[i] = {&buffer_[i * kMaxDatagramSize], size};
+                msgs[i].msg_hdr.msg_name = const_cast<sockaddr*>(to);
+                msgs[i].msg_hdr.msg_namelen = to ? to_len : 0;
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            took = std::max(0, sendmmsg(fd, msgs, static_cast<unsigned>(batch), MSG_DONTWAIT));
+        }
+        sent += took;
+        if (static_cast<size_t>(took) < batch) break;
+    }
+    return sent;
+}
+
+DatagramReceiver::DatagramReceiver()
+    : buffers_(kBatch * kGroBufferSize), from_(kBatch), control_(kBatch * CMSG_SPACE(sizeof(int))) {}
+
+bool DatagramReceiver::enable_gro(int fd) {
+    int on = 1;
+    return setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+}
+
+const std::vector<ReceivedDatagram>& DatagramReceiver::receive(int fd) {
+    received_.clear();
+    mmsghdr msgs[kBatch] = {};
+    iovec iovs[kBatch];
+    for (size_t i = 0; i < kBatch; ++i) {
+        iovs[i] = {&buffers_[i * kGroBufferSize], kGroBufferSize};
+        msgs[i].msg_hdr.msg_name = &from_[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = &control_[i * CMSG_SPACE(sizeof(int))];
+        msgs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(int));
+    }
+    int n = recvmmsg(fd, msgs, kBatch, MSG_DONTWAIT, nullptr);
+    for (int i = 0; i < n; ++i) {
+        const msghdr& hdr = msgs[i].msg_hdr;
+        size_t len = msgs[i].msg_len;
+        // Coalesced by GRO: equal segments, but the last may be short
+        size_t segment = len;
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(const_cast<msghdr*>(&hdr), cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int size;
+                std::memcpy(&size, CMSG_DATA(cm), sizeof(size));
+                if (size > 0) segment = size;
+            }
+        }
+        const char* data = static_cast<const char*>(iovs[i].iov_base);
+        for (size_t offset = 0; offset < len; offset += segment) {
+            received_.push_back({data + offset, std::min(segment, len - offset), &from_[i], hdr.msg_namelen});
+        }
+    }
+    return received_;
+}
+
+DatagramPacer::DatagramPacer(uint64_t rate_bps, size_t size, Clock::time_point start)
+    : gap_(rate_bps > 0 ? static_cast<int64_t>(size * 8 * 1e9 / rate_bps) : 0), next_(start) {}
+
+size_t DatagramPacer::due(Clock::time_point now) {
+    if (now < next_) return 0;
+    if (gap_.count() == 0) return kMaxBurst;
+    if (now - next_ > gap_ * kMaxBurst) next_ = now - gap_ * (kMaxBurst - 1);
+    return 1 + (now - next_) / gap_;
+}
+
+void DatagramPacer::sent(size_t count) {
+    next_ += gap_ * count;
+}
+
+UdpFlowServer::UdpFlowServer(int fd, uint64_t max_rate_bps, std::vector<int> cpus)
+    : fd_(fd), max_rate_bps_(max_rate_bps), payload_(std::random_device{}(), PayloadPool::kBlockSize),
+      sender_(payload_.data(), payload_.size()) {
+    DatagramReceiver::enable_gro(fd_);
+    int buffer = 4 << 20;
+    setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+    setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    thread_ = std::thread([this, cpus] {
+        pin_to_cpus(cpus);
+        run();
+    });
+}
+
+UdpFlowServer::~UdpFlowServer() {
+    stop();
+    close(fd_);
+}
+
+void UdpFlowServer::stop() {
+    stop_ = true;
+    if (thread_.joinable()) thread_.join();
+}
+
+void UdpFlowServer::allow(uint64_t flow, const sockaddr_storage& peer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = Clock::now();
+    for (auto it = allowed_.begin(); it != allowed_.end();) {
+        if (it->second.second < now) it = allowed_.erase(it);
+        else ++it;
+    }
+    allowed_[flow] = {peer, now + kAllowFor};
+}
+
+void UdpFlowServer::run() {
+    while (!stop_) {
+        auto now = Clock::now();
+        auto wake = std::min(send_due(now), now + kMaxPollWait);
+        auto wait_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wake - Clock::now()).count();
+        timespec timeout{0, std::max<int64_t>(0, wait_ns)};
+        pollfd p{fd_, POLLIN, 0};
+        if (ppoll(&p, 1, &timeout, nullptr) > 0 && (p.revents & POLLIN)) {
+            for (int i = 0; i < kReceiveBatches; ++i) {
+                const std::vector<ReceivedDatagram>& batch = receiver_.receive(fd_);
+                if (batch.empty()) break;
+                uint64_t now_ns = steady_ns();
+                for (const ReceivedDatagram& received : batch) on_datagram(received, now_ns);
+            }
+        }
+        now = Clock::now();
+        for (auto it = flows_.begin(); it != flows_.end();) {
+            if (now - it->second.last_heard > kIdleFlow && now > it->second.end) it = flows_.erase(it);
+            else ++it;
+        }
+    }
+}
+
+void UdpFlowServer::on_datagram(const ReceivedDatagram& received, uint64_t now_ns) {
+    const sockaddr_storage& from = *received.from;
+    Datagram datagram;
+    if (!decode_datagram(received.data, received.len, &datagram)) return;
+    auto now = Clock::now();
+    auto it = flows_.find(datagram.flow);
+    if (it != flows_.end() && !(same_host(it->second.peer, from) && same_port(it->second.peer, from))) return;
+
+    if (datagram.type == DatagramType::kStart) {
+        if (it == flows_.end()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto allowed = allowed_.find(datagram.flow);
+                if (allowed == allowed_.end() || allowed->second.second < now ||
+                    !same_host(allowed->second.first, from)) {
+                    return;
+                }
+                allowed_.erase(allowed);
+            }
+            Flow& flow = flows_[datagram.flow];
+            flow.peer = from;
+            flow.peer_len = received.from_len;
+            flow.download = datagram.download;
+            flow.size = static_cast<uint32_t>(
+                std::min<size_t>(std::max<size_t>(datagram.size, kMinDatagramSize), kMaxDatagramSize));
+            uint64_t max_rate = max_rate_bps_;
+            flow.rate_bps = datagram.rate_bps;
+            if (max_rate && (flow.rate_bps == 0 || flow.rate_bps > max_rate)) flow.rate_bps = max_rate;
+            if (flow.rate_bps == 0) flow.rate_bps = kDefaultRateBps;
+            flow.end = now + std::chrono::milliseconds(std::min(datagram.duration_ms, kMaxDurationMs));
+            flow.pacer = DatagramPacer(flow.rate_bps, flow.size, now);
+            it = flows_.find(datagram.flow);
+        }
+        // The ack says what was granted; resent starts get it again
+        it->second.last_heard = now;
+        datagram.size = it->second.size;
+        datagram.rate_bps = it->second.rate_bps;
+        send_control(it->second, datagram);
+        return;
+    }
+    if (it == flows_.end()) return;
+    Flow& flow = it->second;
+    flow.last_heard = now;
+    if (datagram.type == DatagramType::kData && !flow.download) {
+        flow.rx.add(datagram.seq, received.len, datagram.sent_ns, now_ns);
+    } else if (datagram.type == DatagramType::kStop) {
+        flow.end = std::min(flow.end, now);
+        Datagram report;
+        report.type = DatagramType::kReport;
+        report.flow = datagram.flow;
+        report.download = flow.download;
+        report.counts = flow.rx.counts();
+        report.counts.sent = flow.seq;
+        send_control(flow, report);
+    }
+}
+
+void UdpFlowServer::send_control(const Flow& flow, const Datagram& datagram) {
+    char out[kControlSize];
+    size_t len = encode_datagram(datagram, out);
+    sendto(fd_, out, len, MSG_DONTWAIT, reinterpret_cast<const sockaddr*>(&flow.peer), flow.peer_len);
+}
+
+UdpFlowServer::Clock::time_point UdpFlowServer::send_due(Clock::time_point now) {
+    auto wake = now + kMaxPollWait;
+    Datagram datagram;
+    datagram.type = DatagramType::kData;
+    for (auto& entry : flows_) {
+        Flow& flow = entry.second;
+        if (!flow.download || now >= flow.end) continue;
+        datagram.flow = entry.first;
+        datagram.seq = flow.seq;
+        size_t due = flow.pacer.due(now);
+        // A full socket buffer drops here, before the datagrams count as sent
+        flow.seq += sender_.send(fd_, reinterpret_cast<const sockaddr*>(&flow.peer), flow.peer_len, datagram,
+                                 flow.size, due);
+        flow.pacer.sent(due);
+        wake = std::min(wake, flow.pacer.next());
+    }
+    return wake;
+}
+
+} // namespace speedtest
@@ -0,0 +1,232 @@
+#ifndef UDP_FLOW_H_
+#define UDP_FLOW_H_
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "payload.h"
+
+namespace speedtest {
+
+// UDP throughput flows: the sender paces numbered datagrams at a target
+// rate and the receiver counts what arrived, how late and in what order.
+// A flow is opened with a kStart datagram from the client; the server
+// echoes it as an ack, then sends (downloads) or counts (uploads) until
+// kStop, which it answers with a kReport of its side's counts.
+enum class DatagramType : uint8_t { kStart = 1, kData = 2, kStop = 3, kReport = 4 };
+
+// What one end of a flow counted
+struct DatagramCounts {
+    uint64_t sent = 0;
+    uint64_t received = 0;           // Distinct sequence numbers
+    uint64_t bytes = 0;              // Datagram payload bytes received
+    uint64_t duplicates = 0;
+    uint64_t reordered = 0;          // Arrived after a later one
+    uint64_t max_reorder_depth = 0;  // Furthest behind the newest seen
+    // One-way delay variation. Transit is arrival on the receiver's clock
+    // minus the sender's timestamp; the clocks' offset is unknown but
+    // cancels out of both.
+    uint64_t jitter_ns = 0;          // RFC 3550 interarrival jitter
+    uint64_t delay_var_ns = 0;       // Highest transit above the lowest
+};
+
+struct Datagram {
+    DatagramType type = DatagramType::kData;
+    bool download = false;      // kStart: server sends
+    uint64_t flow = 0;          // Picked by the client, registered over HTTP first
+    uint64_t seq = 0;           // kData: 0, 1, 2, ... per flow
+    uint64_t sent_ns = 0;       // kData: sender's steady clock
+    // kStart
+    uint64_t rate_bps = 0;
+    uint32_t size = 0;          // Bytes per data datagram
+    uint32_t duration_ms = 0;
+    // kReport
+    DatagramCounts counts;
+};
+
+// Data datagrams carry the short header, control ones all fields; the
+// rest of a data datagram is payload
+const size_t kDataHeaderSize = 32;
+const size_t kControlSize = 112;
+const size_t kMinDatagramSize = 64;
+const size_t kMaxDatagramSize = 1472;  // One Ethernet frame over IPv4
+
+// Writes the header (big-endian) to `out`, which has room for
+// kControlSize bytes; returns the bytes written
+size_t encode_datagram(const Datagram& datagram, char* out);
+bool decode_datagram(const char* data, size_t len, Datagram* datagram);
+
+uint64_t steady_ns();
+
+// Loss and reordering from the sequence numbers of one flow, and delay
+// variation from its timestamps. Duplicates are caught within the last
+// kWindow numbers.
+class SequenceTracker {
+public:
+    static constexpr uint64_t kWindow = 4096;
+
+    // `received_ns` is steady_ns() when the datagram was read
+    void add(uint64_t seq, size_t bytes, uint64_t sent_ns, uint64_t received_ns);
+    const DatagramCounts& counts() const { return counts_; }
+
+private:
+    DatagramCounts counts_;
+    uint64_t next_ = 0;  // One past the highest seen
+    bool timed_ = false;
+    int64_t last_transit_ = 0;
+    int64_t min_transit_ = 0;
+    int64_t max_transit_ = 0;
+    double jitter_ = 0;
+    std::vector<uint64_t> seen_ = std::vector<uint64_t>(kWindow / 64);
+};
+
+// Loss and reordering of one direction, from the sender's and receiver's counts
+struct DatagramSummary {
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t lost = 0;
+    uint64_t reordered = 0;
+    uint64_t max_reorder_depth = 0;
+    double loss_rate = 0;
+    double jitter_ms = 0;     // Of the worst flow
+    double delay_var_ms = 0;
+    double target_mbps = 0;   // The rate the flows were granted
+};
+
+DatagramSummary summarize_datagrams(uint64_t sent, const DatagramCounts& received);
+
+// Sends runs of equal-sized datagrams in one syscall: as one UDP_SEGMENT
+// (GSO) buffer the kernel splits late, or with sendmmsg where GSO isn't
+// available. Each datagram gets its own header over a copy of `payload`.
+class DatagramSender {
+public:
+    static constexpr size_t kMaxBatch = 64;  // UDP_MAX_SEGMENTS
+
+    // Datagram bodies are cut from `payload`, repeated if it's short
+    DatagramSender(const char* payload, size_t len);
+
+    // Sends `count` datagrams of `size` bytes numbered from header.seq, to
+    // `to` (nullptr on a connected socket). Returns how many the socket
+    // took; fewer than asked means its buffer is full.
+    size_t send(int fd, const sockaddr* to, socklen_t to_len, Datagram header, size_t size, size_t count);
+    bool gso() const { return gso_; }
+
+private:
+    std::vector<char> buffer_;  // kMaxBatch datagrams' worth of payload
+    bool gso_ = true;           // Until the kernel refuses it
+};
+
+// One datagram out of a DatagramReceiver batch, valid until the next receive()
+struct ReceivedDatagram {
+    const char* data;
+    size_t len;
+    const sockaddr_storage* from;
+    socklen_t from_len;
+};
+
+// Reads many datagrams per syscall with recvmmsg. UDP_GRO is turned on
+// where the kernel has it, so a run from one sender arrives as one
+// buffer, split here by the segment size the kernel reports.
+class DatagramReceiver {
+public:
+    static constexpr size_t kBatch = 16;
+
+    DatagramReceiver();
+
+    // Turns on GRO for `fd`; false if the kernel doesn't do it
+    static bool enable_gro(int fd);
+    // Whatever is queued, up to kBatch buffers; empty when nothing was
+    const std::vector<ReceivedDatagram>& receive(int fd);
+
+private:
+    std::vector<char> buffers_;
+    std::vector<sockaddr_storage> from_;
+    std::vector<char> control_;
+    std::vector<ReceivedDatagram> received_;
+};
+
+// Spaces datagrams evenly at a rate. due() says how many may go now; a
+// sender that fell behind by more than a burst doesn't try to catch up.
+class DatagramPacer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    DatagramPacer() = default;
+    DatagramPacer(uint64_t rate_bps, size_t size, Clock::time_point start);
+
+    size_t due(Clock::time_point now);
+    void sent(size_t count);
+    Clock::time_point next() const { return next_; }
+
+private:
+    std::chrono::nanoseconds gap_{0};
+    Clock::time_point next_;
+};
+
+// The server end of UDP flows, on its own thread so pacing doesn't wait
+// on the HTTP event loop. Only flows registered by allow() from an HTTP
+// request are served, and only to the address that request came from, so
+// a spoofed kStart can't point a blast at someone else.
+class UdpFlowServer {
+public:
+    // Takes ownership of a bound UDP socket; its thread runs on `cpus`
+    // when given
+    UdpFlowServer(int fd, uint64_t max_rate_bps, std::vector<int> cpus = {});
+    ~UdpFlowServer();
+    UdpFlowServer(const UdpFlowServer&) = delete;
+    UdpFlowServer& operator=(const UdpFlowServer&) = delete;
+
+    int fd() const { return fd_; }
+    // Let `flow` start from `peer` (its address; the port is not checked) for a while
+    void allow(uint64_t flow, const sockaddr_storage& peer);
+    void set_max_rate(uint64_t bps) { max_rate_bps_ = bps; }
+    uint64_t max_rate() const { return max_rate_bps_; }
+    // Stop serving; the socket is closed on destruction
+    void stop();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Flow {
+        sockaddr_storage peer{};
+        socklen_t peer_len = 0;
+        bool download = false;
+        uint64_t rate_bps = 0;
+        uint32_t size = 0;
+        Clock::time_point end;
+        Clock::time_point last_heard;
+        DatagramPacer pacer;
+        uint64_t seq = 0;
+        SequenceTracker rx;
+    };
+
+    void run();
+    void on_datagram(const ReceivedDatagram& received, uint64_t now_ns);
+    void send_control(const Flow& flow, const Datagram& datagram);
+    // Sends what is due on every download flow; returns when to come back
+    Clock::time_point send_due(Clock::time_point now);
+
+    int fd_;
+    std::atomic<uint64_t> max_rate_bps_;
+    std::atomic<bool> stop_{false};
+    std::mutex mutex_;  // Guards allowed_
+    std::unordered_map<uint64_t, std::pair<sockaddr_storage, Clock::time_point>> allowed_;
+    std::unordered_map<uint64_t, Flow> flows_;
+    PayloadPool payload_;
+    DatagramSender sender_;
+    DatagramReceiver receiver_;
+    std::thread thread_;
+};
+
+} // namespace speedtest
+
+#endif // UDP_FLOW_H_